@@ -4,6 +4,7 @@
 #include <iostream>
 #include <vector>
 #include <string>
+#include <DepthSource.h>
 
 /// \file depthimage.cpp
 /// \brief Program that streams thermal images and saves it to thermal_images directory.
@@ -18,6 +19,8 @@ void printUsage(char *cmd)
 		   " -r x		number of rows in the patterns (default 4).\n"
 		   " -c x		number of columns in the patterns (default 5).\n"
            " -n x		number of image pairs (NEEDED).\n"
+		   " -bag x		read the color intrinsics from the RealSense recording x\n"
+		   "                instead of a camera.\n"
 		   " Output:	Camera extrinsics between the thermal and rgb\n"
 		   "                camera saved to an extrinsic.xml file.\n"
 		   "", cmdname);
@@ -30,12 +33,14 @@ void printUsage(char *cmd)
 /// \param r Number of rows in the patterns.
 /// \param c Number of columns in the patterns.
 /// \param n Number of images pairs.
+/// \param bag RealSense recording the color intrinsics are read from.
 /// \return 0 if successful, -1 if failure.
 int main(int argc, char **argv)
 {
     int row = 4;
     int column = 5;
     int n = -1;
+    depth_source_options depthOptions;
     for(int i=1; i < argc; i++)
 	{
 		if (std::strcmp(argv[i], "-h") == 0)
@@ -94,6 +99,19 @@ int main(int argc, char **argv)
 				exit(1);
 			}
 		}
+		else if (std::strcmp(argv[i], "-bag") == 0)
+		{
+			if (i + 1 != argc)
+			{
+				depthOptions.type = DEPTH_SOURCE_BAG;
+				depthOptions.file = argv[++i];
+			}
+            else
+            {
+				std::cerr << "Error: Enter a bag file." << std::endl;
+				exit(1);
+			}
+		}
 	}
 
     if (n == -1)
@@ -110,10 +128,9 @@ int main(int argc, char **argv)
     fs["distCoeffs"] >> distCoeffsThermal;
     fs.release();
 
-    rs2::pipeline pipe;
-    pipe.start();
-    auto color_stream = pipe.get_active_profile().get_stream(RS2_STREAM_COLOR).as<rs2::video_stream_profile>();
-    rs2_intrinsics intrinsicsColor = color_stream.get_intrinsics();
+    std::unique_ptr<depth_source> source = open_depth_source(depthOptions);
+    rs2_intrinsics intrinsicsColor = source->color_intrinsics();
+    source->stop();
     cv::Mat cameraMatrixRealSense = (cv::Mat_<double>(3, 3) <<
         intrinsicsColor.fx, 0, intrinsicsColor.ppx,
         0, intrinsicsColor.fy, intrinsicsColor.ppy,
@@ -0,0 +1,389 @@
+#include <CloudLoader.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <pcl/io/pcd_io.h>
+
+/// \file CloudLoader.cpp
+/// \brief Progressive loading of large PCD files. The file is mapped and its points are
+/// converted in blocks on all cores, every finished block can be rendered while the rest of
+/// the file is still loading.
+
+#define PCD_MAX_LINE 1024
+
+bool parse_pcd_header(const char* data, size_t size, pcd_header& header)
+{
+    header = pcd_header();
+    std::vector<std::string> fields;
+    std::vector<int> sizes, counts;
+    std::vector<char> types;
+    uint64_t width = 0, height = 1;
+    bool hasPoints = false;
+    size_t pos = 0;
+    while (pos < size)
+    {
+        const char* end = static_cast<const char*>(memchr(data + pos, '\n', size - pos));
+        if (!end)
+        {
+            return false;
+        }
+        std::istringstream line(std::string(data + pos, end));
+        pos = end - data + 1;
+        std::string key;
+        if (!(line >> key) || key[0] == '#')
+        {
+            continue;
+        }
+        if (key == "FIELDS")
+        {
+            std::string field;
+            while (line >> field)
+            {
+                fields.push_back(field);
+            }
+        }
+        else if (key == "SIZE" || key == "COUNT")
+        {
+            std::vector<int>& values = key == "SIZE" ? sizes : counts;
+            int value;
+            while (line >> value)
+            {
+                values.push_back(value);
+            }
+        }
+        else if (key == "TYPE")
+        {
+            std::string type;
+            while (line >> type)
+            {
+                types.push_back(type[0]);
+            }
+        }
+        else if (key == "WIDTH")
+        {
+            line >> width;
+        }
+        else if (key == "HEIGHT")
+        {
+            line >> height;
+        }
+        else if (key == "POINTS")
+        {
+            hasPoints = static_cast<bool>(line >> header.points);
+        }
+        else if (key == "DATA")
+        {
+            line >> header.data;
+            header.data_offset = pos;
+            break;
+        }
+    }
+    if (header.data.empty() || fields.empty() || sizes.size() != fields.size() || types.size() != fields.size())
+    {
+        return false;
+    }
+    if (counts.empty())
+    {
+        counts.assign(fields.size(), 1);
+    }
+    if (counts.size() != fields.size())
+    {
+        return false;
+    }
+    if (!hasPoints)
+    {
+        header.points = width * height;
+    }
+
+    bool xyzFloat = true;
+    for (size_t i = 0; i < fields.size(); i++)
+    {
+        int offset = header.data == "ascii" ? header.columns : static_cast<int>(header.point_size);
+        if (fields[i] == "x" || fields[i] == "y" || fields[i] == "z")
+        {
+            int& field = fields[i] == "x" ? header.x : fields[i] == "y" ? header.y : header.z;
+            field = offset;
+            xyzFloat = xyzFloat && types[i] == 'F' && sizes[i] == 4;
+        }
+        else if ((fields[i] == "rgb" || fields[i] == "rgba") && sizes[i] == 4)
+        {
+            header.rgb = offset;
+            header.rgb_float = types[i] == 'F';
+        }
+        header.point_size += static_cast<size_t>(sizes[i]) * counts[i];
+        header.columns += counts[i];
+    }
+    header.xyz_float = xyzFloat;
+    return header.x >= 0 && header.y >= 0 && header.z >= 0;
+}
+
+cloud_loader::cloud_loader()
+    : _data(nullptr), _size(0), _blocks(0), _nextBlock(0), _running(0), _points(0), _stop(false)
+{
+}
+
+cloud_loader::~cloud_loader()
+{
+    close();
+}
+
+/// \brief Opens a PCD file and starts loading it.
+/// \param filename Path of the file.
+/// \param threads Loading threads, all cores if 0.
+/// \return False if the file cannot be opened.
+bool cloud_loader::start(const std::string& filename, unsigned int threads)
+{
+    close();
+    _filename = filename;
+    _stop = false;
+    _points = 0;
+    _nextBlock = 0;
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        std::cerr << "Failed to open " << filename << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+    struct stat st;
+    void* data = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+    {
+        data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    ::close(fd);
+    if (data == MAP_FAILED)
+    {
+        std::cerr << "Failed to map " << filename << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+    _data = static_cast<const char*>(data);
+    _size = st.st_size;
+
+    bool mapped = parse_pcd_header(_data, _size, _header) &&
+                  ((_header.data == "binary" && _header.xyz_float) || _header.data == "ascii");
+    if (!mapped)
+    {
+        // Compressed and unusual files are left to PCL
+        _running = 1;
+        _threads.emplace_back(&cloud_loader::run_pcl, this);
+        return true;
+    }
+    if (_header.data == "binary")
+    {
+        // A file cut short loads up to its last complete point
+        uint64_t available = (_size - _header.data_offset) / _header.point_size;
+        _header.points = std::min(_header.points, available);
+        _blocks = (_header.points + CLOUD_LOAD_BLOCK_POINTS - 1) / CLOUD_LOAD_BLOCK_POINTS;
+    }
+    else
+    {
+        _blocks = (_size - _header.data_offset + CLOUD_LOAD_BLOCK_BYTES - 1) / CLOUD_LOAD_BLOCK_BYTES;
+    }
+    madvise(const_cast<char*>(_data), _size, MADV_SEQUENTIAL);
+    if (threads == 0)
+    {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    threads = static_cast<unsigned int>(std::min<uint64_t>(threads, std::max<uint64_t>(_blocks, 1)));
+    _running = threads;
+    for (unsigned int i = 0; i < threads; i++)
+    {
+        _threads.emplace_back(&cloud_loader::run, this);
+    }
+    return true;
+}
+
+/// \brief Moves the blocks loaded since the last call to the caller.
+/// \param blocks Loaded blocks are appended.
+/// \return True if blocks were appended.
+bool cloud_loader::take(std::vector<cloud_ptr>& blocks)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (_ready.empty())
+    {
+        return false;
+    }
+    blocks.insert(blocks.end(), _ready.begin(), _ready.end());
+    _ready.clear();
+    return true;
+}
+
+/// \brief Hands a finished block to the renderer.
+/// \param block Loaded points.
+/// \return None.
+void cloud_loader::publish(const cloud_ptr& block)
+{
+    block->width = static_cast<uint32_t>(block->points.size());
+    block->height = 1;
+    block->is_dense = true;
+    _points += block->points.size();
+    std::lock_guard<std::mutex> lock(_mutex);
+    _ready.push_back(block);
+}
+
+/// \brief Copies the packed color of a point.
+static void set_color(pcl::PointXYZRGB& p, uint32_t rgb)
+{
+    p.r = static_cast<uint8_t>(rgb >> 16);
+    p.g = static_cast<uint8_t>(rgb >> 8);
+    p.b = static_cast<uint8_t>(rgb);
+    p.a = 255;
+}
+
+/// \brief Parses the packed color of an ASCII point, written as an integer or as the float
+/// with the same bits.
+static uint32_t parse_color(const char* value, bool isFloat)
+{
+    if (isFloat && strpbrk(value, ".eE"))
+    {
+        float f = strtof(value, nullptr);
+        uint32_t rgb;
+        memcpy(&rgb, &f, sizeof(rgb));
+        return rgb;
+    }
+    return static_cast<uint32_t>(strtoul(value, nullptr, 10));
+}
+
+/// \brief Loading thread: claims blocks until the file is converted. Binary blocks are ranges
+/// of points, ASCII blocks are byte ranges holding the lines that start in them.
+/// \return None.
+void cloud_loader::run()
+{
+    const uint32_t white = 0xFFFFFF;
+    uint64_t block;
+    while (!_stop && (block = _nextBlock++) < _blocks)
+    {
+        cloud_ptr cloud(new pcl::PointCloud<pcl::PointXYZRGB>);
+        if (_header.data == "binary")
+        {
+            uint64_t first = block * CLOUD_LOAD_BLOCK_POINTS;
+            uint64_t last = std::min<uint64_t>(first + CLOUD_LOAD_BLOCK_POINTS, _header.points);
+            cloud->points.reserve(last - first);
+            const char* point = _data + _header.data_offset + first * _header.point_size;
+            for (uint64_t i = first; i < last; i++, point += _header.point_size)
+            {
+                pcl::PointXYZRGB p;
+                memcpy(&p.x, point + _header.x, sizeof(float));
+                memcpy(&p.y, point + _header.y, sizeof(float));
+                memcpy(&p.z, point + _header.z, sizeof(float));
+                if (!std::isfinite(p.x) || !std::isfinite(p.y) || !std::isfinite(p.z))
+                {
+                    continue;
+                }
+                uint32_t rgb = white;
+                if (_header.rgb >= 0)
+                {
+                    memcpy(&rgb, point + _header.rgb, sizeof(rgb));
+                }
+                set_color(p, rgb);
+                cloud->points.push_back(p);
+            }
+            // The converted pages are not needed again
+            size_t begin = (_header.data_offset + first * _header.point_size) & ~static_cast<size_t>(4095);
+            madvise(const_cast<char*>(_data) + begin, point - (_data + begin), MADV_DONTNEED);
+        }
+        else
+        {
+            size_t start = _header.data_offset + block * CLOUD_LOAD_BLOCK_BYTES;
+            size_t end = std::min<size_t>(start + CLOUD_LOAD_BLOCK_BYTES, _size);
+            size_t pos = start;
+            if (block > 0)
+            {
+                // A line that starts in the previous block belongs to it
+                while (pos < _size && _data[pos - 1] != '\n')
+                {
+                    pos++;
+                }
+            }
+            char line[PCD_MAX_LINE];
+            const char* values[64];
+            int columns = std::min(_header.columns, 64);
+            while (pos < end)
+            {
+                const char* eol = static_cast<const char*>(memchr(_data + pos, '\n', _size - pos));
+                size_t length = (eol ? eol - _data : _size) - pos;
+                size_t copied = std::min<size_t>(length, PCD_MAX_LINE - 1);
+                memcpy(line, _data + pos, copied);
+                line[copied] = '\0';
+                pos += length + 1;
+
+                int n = 0;
+                char* save = nullptr;
+                for (char* token = strtok_r(line, " \t\r", &save); token && n < columns; token = strtok_r(nullptr, " \t\r", &save))
+                {
+                    values[n++] = token;
+                }
+                if (n <= _header.x || n <= _header.y || n <= _header.z)
+                {
+                    continue;
+                }
+                pcl::PointXYZRGB p;
+                p.x = strtof(values[_header.x], nullptr);
+                p.y = strtof(values[_header.y], nullptr);
+                p.z = strtof(values[_header.z], nullptr);
+                if (!std::isfinite(p.x) || !std::isfinite(p.y) || !std::isfinite(p.z))
+                {
+                    continue;
+                }
+                set_color(p, _header.rgb >= 0 && n > _header.rgb ? parse_color(values[_header.rgb], _header.rgb_float) : white);
+                cloud->points.push_back(p);
+            }
+        }
+        if (!cloud->points.empty())
+        {
+            publish(cloud);
+        }
+    }
+    _running--;
+}
+
+/// \brief Loading thread for files that are not mapped: PCL loads the whole file.
+/// \return None.
+void cloud_loader::run_pcl()
+{
+    cloud_ptr cloud(new pcl::PointCloud<pcl::PointXYZRGB>);
+    try
+    {
+        if (pcl::io::loadPCDFile(_filename, *cloud) >= 0)
+        {
+            cloud->points.erase(std::remove_if(cloud->points.begin(), cloud->points.end(), [](const pcl::PointXYZRGB& p)
+                                {
+                                    return !std::isfinite(p.x) || !std::isfinite(p.y) || !std::isfinite(p.z);
+                                }), cloud->points.end());
+            publish(cloud);
+        }
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << "Failed to load " << _filename << ": " << e.what() << std::endl;
+    }
+    _running--;
+}
+
+/// \brief Stops loading and unmaps the file.
+/// \return None.
+void cloud_loader::close()
+{
+    _stop = true;
+    for (auto& thread : _threads)
+    {
+        thread.join();
+    }
+    _threads.clear();
+    if (_data)
+    {
+        munmap(const_cast<char*>(_data), _size);
+    }
+    _data = nullptr;
+    _size = 0;
+    _ready.clear();
+}
@@ -0,0 +1,410 @@
+#include <CloudOctree.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <thread>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/// \file CloudOctree.cpp
+/// \brief Level of detail octree of a large point cloud, cached in a file next to the cloud.
+/// The points are sorted by their Morton code, which makes every node and every cell of its
+/// sample grid a contiguous range of points, so the tree is built in one pass per level.
+
+/// \brief Size and modification time of a file, to tell whether a cache is older than its cloud.
+static bool file_stamp(const std::string& filename, uint64_t& size, int64_t& mtime)
+{
+    struct stat st;
+    if (stat(filename.c_str(), &st) != 0)
+    {
+        return false;
+    }
+    size = static_cast<uint64_t>(st.st_size);
+    mtime = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+    return true;
+}
+
+/// \brief Spreads the low 21 bits of a value to every third bit.
+static uint64_t spread_bits(uint64_t v)
+{
+    v &= 0x1FFFFF;
+    v = (v | v << 32) & 0x1F00000000FFFFull;
+    v = (v | v << 16) & 0x1F0000FF0000FFull;
+    v = (v | v << 8) & 0x100F00F00F00F00Full;
+    v = (v | v << 4) & 0x10C30C30C30C30C3ull;
+    v = (v | v << 2) & 0x1249249249249249ull;
+    return v;
+}
+
+/// \brief Sorts on all cores: ranges are sorted by one thread each and merged pairwise.
+/// \param v Values to sort.
+/// \param less Strict order.
+/// \return None.
+template <class T, class Less>
+static void parallel_sort(std::vector<T>& v, Less less)
+{
+    size_t threads = std::max(1u, std::thread::hardware_concurrency());
+    size_t chunk = (v.size() + threads - 1) / threads;
+    if (threads == 1 || chunk < 65536)
+    {
+        std::sort(v.begin(), v.end(), less);
+        return;
+    }
+    std::vector<size_t> bounds;
+    for (size_t begin = 0; begin < v.size(); begin += chunk)
+    {
+        bounds.push_back(begin);
+    }
+    bounds.push_back(v.size());
+
+    std::vector<std::thread> workers;
+    for (size_t i = 0; i + 1 < bounds.size(); i++)
+    {
+        workers.emplace_back([&v, &bounds, &less, i]()
+                             {
+                                 std::sort(v.begin() + bounds[i], v.begin() + bounds[i + 1], less);
+                             });
+    }
+    for (auto& w : workers)
+    {
+        w.join();
+    }
+    while (bounds.size() > 2)
+    {
+        workers.clear();
+        std::vector<size_t> merged;
+        for (size_t i = 0; i + 1 < bounds.size(); i += 2)
+        {
+            merged.push_back(bounds[i]);
+            if (i + 2 < bounds.size())
+            {
+                workers.emplace_back([&v, &bounds, &less, i]()
+                                     {
+                                         std::inplace_merge(v.begin() + bounds[i], v.begin() + bounds[i + 1],
+                                                            v.begin() + bounds[i + 2], less);
+                                     });
+            }
+        }
+        merged.push_back(v.size());
+        for (auto& w : workers)
+        {
+            w.join();
+        }
+        bounds.swap(merged);
+    }
+}
+
+octree_builder::octree_builder()
+    : _written(0), _file(nullptr)
+{
+}
+
+/// \brief Allocates the points of the whole cloud at once, so adding the blocks does not
+/// reallocate and copy the points added before.
+/// \param points Points of the cloud.
+/// \return None.
+void octree_builder::reserve(uint64_t points)
+{
+    _points.reserve(static_cast<size_t>(points));
+}
+
+/// \brief Adds the points of a cloud, points without finite coordinates are skipped.
+/// \param cloud Block of the cloud.
+/// \return None.
+void octree_builder::add(const pcl::PointCloud<pcl::PointXYZRGB>& cloud)
+{
+    for (const auto& p : cloud.points)
+    {
+        if (std::isfinite(p.x) && std::isfinite(p.y) && std::isfinite(p.z))
+        {
+            build_point b = {0, p.x, p.y, p.z, p.r, p.g, p.b, 255};
+            _points.push_back(b);
+        }
+    }
+}
+
+/// \brief Builds the octree of the added points and writes it. The file is written under a
+/// temporary name and renamed when complete. The points are released afterwards.
+/// \param filename Cache file.
+/// \param source Cloud file the points were loaded from, whose size and time are stored.
+/// \return False if there are no points or the file cannot be written.
+bool octree_builder::write(const std::string& filename, const std::string& source)
+{
+    if (_points.empty())
+    {
+        std::cerr << "No points to build " << filename << " from" << std::endl;
+        return false;
+    }
+    lod_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, LOD_MAGIC, sizeof(header.magic));
+    header.version = LOD_VERSION;
+    file_stamp(source, header.source_size, header.source_mtime_ns);
+
+    float lo[3] = {INFINITY, INFINITY, INFINITY};
+    float hi[3] = {-INFINITY, -INFINITY, -INFINITY};
+    for (const auto& p : _points)
+    {
+        lo[0] = std::min(lo[0], p.x); hi[0] = std::max(hi[0], p.x);
+        lo[1] = std::min(lo[1], p.y); hi[1] = std::max(hi[1], p.y);
+        lo[2] = std::min(lo[2], p.z); hi[2] = std::max(hi[2], p.z);
+    }
+    float half = std::max(std::max(hi[0] - lo[0], hi[1] - lo[1]), hi[2] - lo[2]) * 0.5f;
+    // Keeps the points on the upper faces inside the cube
+    half = std::max(half * 1.001f, 1e-3f);
+    for (int i = 0; i < 3; i++)
+    {
+        header.center[i] = (lo[i] + hi[i]) * 0.5f;
+    }
+    header.half = half;
+
+    const float cells = static_cast<float>(1 << LOD_KEY_BITS);
+    const float scale = cells / (2.0f * half);
+    for (auto& p : _points)
+    {
+        uint64_t q[3];
+        const float v[3] = {p.x, p.y, p.z};
+        for (int i = 0; i < 3; i++)
+        {
+            float c = (v[i] - (header.center[i] - half)) * scale;
+            q[i] = static_cast<uint64_t>(std::min(std::max(c, 0.0f), cells - 1.0f));
+        }
+        p.key = spread_bits(q[0]) | spread_bits(q[1]) << 1 | spread_bits(q[2]) << 2;
+    }
+    parallel_sort(_points, [](const build_point& a, const build_point& b)
+                  {
+                      return a.key < b.key;
+                  });
+
+    std::string temporary = filename + ".tmp";
+    _file = fopen(temporary.c_str(), "wb");
+    if (!_file)
+    {
+        std::cerr << "Failed to create " << temporary << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+    bool ok = fwrite(&header, sizeof(header), 1, _file) == 1;
+    _nodes.clear();
+    _written = 0;
+    if (ok)
+    {
+        build_node(0, _points.size(), 0, header.center, half);
+        ok = !ferror(_file);
+    }
+    std::vector<build_point>().swap(_points);
+    std::vector<build_point>().swap(_sample);
+
+    // The node table starts on a 64 byte boundary, so it can be used in place when mapped
+    uint64_t end = sizeof(header) + _written * sizeof(lod_point);
+    header.node_offset = (end + 63) & ~static_cast<uint64_t>(63);
+    header.nodes = static_cast<uint32_t>(_nodes.size());
+    header.points = _written;
+    static const char padding[64] = {};
+    ok = ok && fwrite(padding, 1, header.node_offset - end, _file) == header.node_offset - end;
+    ok = ok && fwrite(_nodes.data(), sizeof(lod_node), _nodes.size(), _file) == _nodes.size();
+    ok = ok && fseek(_file, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, _file) == 1;
+    ok = fclose(_file) == 0 && ok;
+    _file = nullptr;
+    if (!ok || rename(temporary.c_str(), filename.c_str()) != 0)
+    {
+        std::cerr << "Failed to write " << filename << ": " << strerror(errno) << std::endl;
+        unlink(temporary.c_str());
+        return false;
+    }
+    return true;
+}
+
+/// \brief Builds a node and its children from a range of sorted points. A node that is small
+/// enough or at LOD_MAX_DEPTH keeps all points, others keep the middle point of every occupied
+/// cell of their sample grid and pass the rest on, still sorted, to the children.
+/// \param begin First point of the node.
+/// \param end End of the points of the node.
+/// \param depth Depth of the node, 0 for the root.
+/// \param center Center of the node cube.
+/// \param half Half the edge of the node cube.
+/// \return Index of the node.
+uint32_t octree_builder::build_node(size_t begin, size_t end, uint32_t depth, const float center[3], float half)
+{
+    uint32_t index = static_cast<uint32_t>(_nodes.size());
+    lod_node node;
+    memset(&node, 0, sizeof(node));
+    memcpy(node.center, center, sizeof(node.center));
+    node.half = half;
+    node.first = _written;
+    node.depth = depth;
+
+    build_point* p = _points.data();
+    size_t rest = begin;
+    if (end - begin <= LOD_LEAF_POINTS || depth >= LOD_MAX_DEPTH)
+    {
+        node.count = static_cast<uint32_t>(end - begin);
+        write_points(p + begin, end - begin, center, half);
+    }
+    else
+    {
+        // Cells of the sample grid share the key bits above the cell size
+        unsigned int shift = 3 * (LOD_KEY_BITS - depth - LOD_GRID_BITS);
+        _sample.clear();
+        size_t run = begin;
+        while (run < end)
+        {
+            uint64_t cell = p[run].key >> shift;
+            size_t runEnd = run + 1;
+            while (runEnd < end && (p[runEnd].key >> shift) == cell)
+            {
+                runEnd++;
+            }
+            size_t middle = run + (runEnd - run) / 2;
+            _sample.push_back(p[middle]);
+            for (size_t i = run; i < runEnd; i++)
+            {
+                if (i != middle)
+                {
+                    p[rest++] = p[i];
+                }
+            }
+            run = runEnd;
+        }
+        node.count = static_cast<uint32_t>(_sample.size());
+        write_points(_sample.data(), _sample.size(), center, half);
+    }
+    _nodes.push_back(node);
+
+    unsigned int shift = 3 * (LOD_KEY_BITS - 1 - depth);
+    size_t child = begin;
+    while (child < rest)
+    {
+        unsigned int octant = (p[child].key >> shift) & 7;
+        size_t childEnd = child + 1;
+        while (childEnd < rest && ((p[childEnd].key >> shift) & 7) == octant)
+        {
+            childEnd++;
+        }
+        float quarter = half * 0.5f;
+        float childCenter[3] = {center[0] + ((octant & 1) ? quarter : -quarter),
+                                center[1] + ((octant & 2) ? quarter : -quarter),
+                                center[2] + ((octant & 4) ? quarter : -quarter)};
+        uint32_t childIndex = build_node(child, childEnd, depth + 1, childCenter, quarter);
+        _nodes[index].children[octant] = childIndex;
+        child = childEnd;
+    }
+    return index;
+}
+
+/// \brief Quantizes the points of a node to its cube and appends them to the file.
+/// \param points Points of the node.
+/// \param count Number of points.
+/// \param center Center of the node cube.
+/// \param half Half the edge of the node cube.
+/// \return False if writing failed.
+bool octree_builder::write_points(const build_point* points, size_t count, const float center[3], float half)
+{
+    const float scale = LOD_QUANT / half;
+    _buffer.resize(count);
+    for (size_t i = 0; i < count; i++)
+    {
+        const build_point& p = points[i];
+        lod_point& q = _buffer[i];
+        q.x = static_cast<int16_t>(std::lrint(std::min(std::max((p.x - center[0]) * scale, -LOD_QUANT), LOD_QUANT)));
+        q.y = static_cast<int16_t>(std::lrint(std::min(std::max((p.y - center[1]) * scale, -LOD_QUANT), LOD_QUANT)));
+        q.z = static_cast<int16_t>(std::lrint(std::min(std::max((p.z - center[2]) * scale, -LOD_QUANT), LOD_QUANT)));
+        q.reserved = 0;
+        q.r = p.r;
+        q.g = p.g;
+        q.b = p.b;
+        q.a = p.a;
+    }
+    _written += count;
+    return fwrite(_buffer.data(), sizeof(lod_point), count, _file) == count;
+}
+
+cloud_octree::cloud_octree()
+    : _data(nullptr), _size(0), _nodes(nullptr), _points(nullptr)
+{
+    memset(&_header, 0, sizeof(_header));
+}
+
+cloud_octree::~cloud_octree()
+{
+    close();
+}
+
+/// \brief Maps a cache file.
+/// \param filename Cache file.
+/// \param source Cloud the cache was built from, the cache is rejected if the cloud changed.
+/// \return False if the file is missing, damaged or out of date.
+bool cloud_octree::open(const std::string& filename, const std::string& source)
+{
+    close();
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        return false;
+    }
+    struct stat st;
+    void* data = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && static_cast<size_t>(st.st_size) >= sizeof(lod_header))
+    {
+        data = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    ::close(fd);
+    if (data == MAP_FAILED)
+    {
+        return false;
+    }
+    _data = static_cast<const char*>(data);
+    _size = st.st_size;
+    memcpy(&_header, _data, sizeof(_header));
+
+    uint64_t size = 0;
+    int64_t mtime = 0;
+    bool valid = memcmp(_header.magic, LOD_MAGIC, sizeof(_header.magic)) == 0 && _header.version == LOD_VERSION &&
+                 _header.nodes > 0 && _header.node_offset % 64 == 0 &&
+                 sizeof(lod_header) + _header.points * sizeof(lod_point) <= _header.node_offset &&
+                 _header.node_offset + static_cast<uint64_t>(_header.nodes) * sizeof(lod_node) <= _size;
+    if (!valid)
+    {
+        std::cerr << filename << " is not a level of detail cache" << std::endl;
+        close();
+        return false;
+    }
+    if (!file_stamp(source, size, mtime) || size != _header.source_size || mtime != _header.source_mtime_ns)
+    {
+        std::cerr << filename << " is out of date" << std::endl;
+        close();
+        return false;
+    }
+    _nodes = reinterpret_cast<const lod_node*>(_data + _header.node_offset);
+    _points = reinterpret_cast<const lod_point*>(_data + sizeof(lod_header));
+    return true;
+}
+
+/// \brief Unmaps the file.
+/// \return None.
+void cloud_octree::close()
+{
+    if (_data)
+    {
+        munmap(const_cast<char*>(_data), _size);
+    }
+    _data = nullptr;
+    _size = 0;
+    _nodes = nullptr;
+    _points = nullptr;
+    memset(&_header, 0, sizeof(_header));
+}
+
+/// \brief Asks the kernel to read the points of a node ahead of their use.
+/// \param node Node about to be drawn.
+/// \return None.
+void cloud_octree::prefetch(const lod_node& node) const
+{
+    const char* begin = reinterpret_cast<const char*>(node_points(node));
+    size_t offset = (begin - _data) & ~static_cast<size_t>(4095);
+    madvise(const_cast<char*>(_data) + offset, (begin - _data) - offset + node.count * sizeof(lod_point), MADV_WILLNEED);
+}
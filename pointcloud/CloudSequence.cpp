@@ -0,0 +1,447 @@
+#include <CloudSequence.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/// \file CloudSequence.cpp
+/// \brief Recording of timestamped point clouds in a chunked file with a seek index, and its
+/// playback with a prefetching reader thread.
+
+#define CLOUD_RECORD_ALIGNMENT 64
+#define CLOUD_PAGE_SIZE 4096
+
+static uint64_t align_up(uint64_t size, uint64_t alignment)
+{
+    return (size + alignment - 1) / alignment * alignment;
+}
+
+cloud_recorder::cloud_recorder()
+    : _fd(-1), _header(), _chunk(), _chunkOffset(0), _nextOffset(0), _chunkOpen(false)
+{
+}
+
+cloud_recorder::~cloud_recorder()
+{
+    close();
+}
+
+/// \brief Creates a sequence, an existing file is overwritten.
+/// \param filename Path of the sequence.
+/// \param format Encoding of the points, compact by default.
+/// \return True if the file was created.
+bool cloud_recorder::open(const std::string& filename, cloud_point_format format)
+{
+    close();
+    _fd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (_fd < 0)
+    {
+        std::cerr << "Failed to create " << filename << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+    _header = cloud_file_header();
+    memcpy(_header.magic, CLOUD_SEQUENCE_MAGIC, sizeof(_header.magic));
+    _header.version = CLOUD_SEQUENCE_VERSION;
+    _header.chunk_frames = CLOUD_CHUNK_FRAMES;
+    _header.point_format = format;
+    _header.point_size = format == CLOUD_POINT_COMPACT ? sizeof(compact_point) : sizeof(cloud_point);
+    _header.created_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    _nextOffset = CLOUD_HEADER_SIZE;
+    _chunkOpen = false;
+    if (!write_at(&_header, sizeof(_header), 0))
+    {
+        close();
+        return false;
+    }
+    return true;
+}
+
+/// \brief Appends a frame, a new chunk is started when the current one is full. The points
+/// are written first, the chunk and file headers that index them afterwards.
+/// \param prefix Written in front of the points, the origin of compact points.
+/// \param prefixBytes Size of the prefix.
+/// \param points Points of the frame in the format of the sequence.
+/// \param count Number of points.
+/// \param timestamp_ns Time of the frame.
+/// \return False if the recording is not open or the disk is full, the recording is closed then.
+bool cloud_recorder::write_record(const void* prefix, size_t prefixBytes, const void* points, size_t count, int64_t timestamp_ns)
+{
+    if (_fd < 0)
+    {
+        return false;
+    }
+    if (_chunkOpen && _chunk.frames == CLOUD_CHUNK_FRAMES)
+    {
+        finish_chunk();
+    }
+    if (!_chunkOpen)
+    {
+        _chunkOffset = _nextOffset;
+        _chunk = cloud_chunk_header();
+        _chunk.magic = CLOUD_CHUNK_MAGIC;
+        _chunk.chunk = _header.chunks;
+        _chunk.first_frame = _header.frames;
+        _chunk.bytes = CLOUD_CHUNK_HEADER_SIZE;
+        _chunkOpen = true;
+        _header.chunks++;
+    }
+
+    uint32_t n = _chunk.frames;
+    uint64_t offset = _chunk.bytes;
+    cloud_record_header record = {};
+    record.frame = _header.frames;
+    record.timestamp_ns = timestamp_ns;
+    record.points = static_cast<uint32_t>(count);
+    record.point_format = _header.point_format;
+    record.bytes = prefixBytes + count * _header.point_size;
+    uint64_t data = _chunkOffset + offset + CLOUD_RECORD_HEADER_SIZE;
+    if (!write_at(&record, sizeof(record), _chunkOffset + offset) || !write_at(prefix, prefixBytes, data) ||
+        !write_at(points, count * _header.point_size, data + prefixBytes))
+    {
+        close();
+        return false;
+    }
+    _chunk.timestamps[n] = timestamp_ns;
+    _chunk.offsets[n] = offset;
+    _chunk.points[n] = record.points;
+    _chunk.bytes = align_up(offset + CLOUD_RECORD_HEADER_SIZE + record.bytes, CLOUD_RECORD_ALIGNMENT);
+    _chunk.frames = n + 1;
+    _header.frames++;
+    if (!write_at(&_chunk, sizeof(_chunk), _chunkOffset) || !write_at(&_header, sizeof(_header), 0))
+    {
+        close();
+        return false;
+    }
+    return true;
+}
+
+/// \brief Writes a whole buffer at an offset.
+/// \param data Bytes to write.
+/// \param size Number of bytes.
+/// \param offset Position in the file.
+/// \return False on a write error, like a full disk.
+bool cloud_recorder::write_at(const void* data, size_t size, uint64_t offset)
+{
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    while (size > 0)
+    {
+        ssize_t written = pwrite(_fd, bytes, size, offset);
+        if (written < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (written <= 0)
+        {
+            std::cerr << "Failed to write pointcloud sequence: " << strerror(written < 0 ? errno : ENOSPC) << std::endl;
+            return false;
+        }
+        bytes += written;
+        size -= written;
+        offset += written;
+    }
+    return true;
+}
+
+/// \brief Starts writing the full chunk back without waiting for the disk, so dirty pages do
+/// not pile up, and moves on to the next page.
+/// \return None.
+void cloud_recorder::finish_chunk()
+{
+    sync_file_range(_fd, _chunkOffset, _chunk.bytes, SYNC_FILE_RANGE_WRITE);
+    _nextOffset = _chunkOffset + align_up(_chunk.bytes, CLOUD_PAGE_SIZE);
+    _chunkOpen = false;
+}
+
+/// \brief Closes the file, it ends after the last frame.
+/// \return None.
+void cloud_recorder::close()
+{
+    if (_fd < 0)
+    {
+        return;
+    }
+    if (_chunkOpen)
+    {
+        finish_chunk();
+    }
+    ::close(_fd);
+    _fd = -1;
+}
+
+cloud_sequence::cloud_sequence()
+    : _fd(-1), _format(CLOUD_POINT_FLOAT)
+{
+}
+
+cloud_sequence::~cloud_sequence()
+{
+    close();
+}
+
+/// \brief Reads a whole buffer at an offset.
+/// \param fd File.
+/// \param data Destination.
+/// \param size Number of bytes.
+/// \param offset Position in the file.
+/// \return False on a read error or at the end of the file.
+static bool read_at(int fd, void* data, size_t size, uint64_t offset)
+{
+    uint8_t* bytes = static_cast<uint8_t*>(data);
+    while (size > 0)
+    {
+        ssize_t got = pread(fd, bytes, size, offset);
+        if (got < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (got <= 0)
+        {
+            return false;
+        }
+        bytes += got;
+        size -= got;
+        offset += got;
+    }
+    return true;
+}
+
+/// \brief Opens a sequence and reads the chunk headers into the seek index.
+/// \param filename Path of the sequence.
+/// \return False if the file is not a pointcloud sequence.
+bool cloud_sequence::open(const std::string& filename)
+{
+    close();
+    _fd = ::open(filename.c_str(), O_RDONLY);
+    if (_fd < 0)
+    {
+        std::cerr << "Failed to open " << filename << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+    struct stat st;
+    cloud_file_header header;
+    if (fstat(_fd, &st) != 0 || !read_at(_fd, &header, sizeof(header), 0) ||
+        memcmp(header.magic, CLOUD_SEQUENCE_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != CLOUD_SEQUENCE_VERSION || header.chunk_frames != CLOUD_CHUNK_FRAMES ||
+        !((header.point_format == CLOUD_POINT_FLOAT && header.point_size == sizeof(cloud_point)) ||
+          (header.point_format == CLOUD_POINT_COMPACT && header.point_size == sizeof(compact_point))))
+    {
+        std::cerr << filename << " is not a pointcloud sequence" << std::endl;
+        close();
+        return false;
+    }
+    uint64_t size = st.st_size;
+    _format = header.point_format;
+    // The sequential scan of the chunk headers is the whole index, a long recording has few chunks
+    posix_fadvise(_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    // Only complete frames of chunks that made it to disk are indexed
+    cloud_chunk_header chunk;
+    uint64_t offset = CLOUD_HEADER_SIZE;
+    while (offset + sizeof(chunk) <= size && read_at(_fd, &chunk, sizeof(chunk), offset))
+    {
+        if (chunk.magic != CLOUD_CHUNK_MAGIC || chunk.bytes < CLOUD_CHUNK_HEADER_SIZE ||
+            chunk.first_frame != _index.size())
+        {
+            break;
+        }
+        uint32_t frames = std::min<uint32_t>(chunk.frames, CLOUD_CHUNK_FRAMES);
+        uint32_t complete = 0;
+        while (complete < frames)
+        {
+            uint64_t record = offset + chunk.offsets[complete];
+            if (chunk.offsets[complete] < CLOUD_CHUNK_HEADER_SIZE ||
+                record + CLOUD_RECORD_HEADER_SIZE + record_bytes(chunk.points[complete]) > size)
+            {
+                break;
+            }
+            _index.push_back(frame_entry{record, chunk.timestamps[complete], chunk.points[complete]});
+            complete++;
+        }
+        if (complete < frames || complete == 0)
+        {
+            break;
+        }
+        offset += align_up(chunk.bytes, CLOUD_PAGE_SIZE);
+    }
+    posix_fadvise(_fd, 0, 0, POSIX_FADV_NORMAL);
+    return true;
+}
+
+/// \brief Closes the file.
+/// \return None.
+void cloud_sequence::close()
+{
+    if (_fd >= 0)
+    {
+        ::close(_fd);
+    }
+    _fd = -1;
+    _index.clear();
+}
+
+/// \brief First frame at or after a time, from the index.
+/// \param timestamp_ns Frame time in ns.
+/// \return Frame number, frames() if all frames are older.
+uint64_t cloud_sequence::seek(int64_t timestamp_ns) const
+{
+    auto found = std::lower_bound(_index.begin(), _index.end(), timestamp_ns,
+                                  [](const frame_entry& e, int64_t t) { return e.timestamp_ns < t; });
+    return found - _index.begin();
+}
+
+/// \brief Bytes following the record header of a frame.
+/// \param points Number of points of the frame.
+/// \return Size of the origin and the points.
+size_t cloud_sequence::record_bytes(uint32_t points) const
+{
+    if (_format == CLOUD_POINT_COMPACT)
+    {
+        return sizeof(compact_origin) + static_cast<size_t>(points) * sizeof(compact_point);
+    }
+    return static_cast<size_t>(points) * sizeof(cloud_point);
+}
+
+/// \brief Reads the data of a frame as stored, safe to call from several threads.
+/// \param index Frame number, less than frames().
+/// \param data Bytes following the record header, replaced.
+/// \return False if the index is out of range or the record does not match the index.
+bool cloud_sequence::read_record(uint64_t index, std::vector<uint8_t>& data) const
+{
+    if (index >= _index.size())
+    {
+        return false;
+    }
+    const frame_entry& entry = _index[index];
+    cloud_record_header record;
+    if (!read_at(_fd, &record, sizeof(record), entry.offset) || record.frame != index ||
+        record.points != entry.points || record.point_format != _format || record.bytes != record_bytes(entry.points))
+    {
+        return false;
+    }
+    data.resize(record.bytes);
+    return read_at(_fd, data.data(), data.size(), entry.offset + CLOUD_RECORD_HEADER_SIZE);
+}
+
+bool is_cloud_sequence(const std::string& filename)
+{
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        return false;
+    }
+    char magic[8];
+    bool sequence = read_at(fd, magic, sizeof(magic), 0) && memcmp(magic, CLOUD_SEQUENCE_MAGIC, sizeof(magic)) == 0;
+    ::close(fd);
+    return sequence;
+}
+
+/// \brief Starts the reader thread at the first frame.
+/// \param sequence Open sequence, must outlive the prefetcher.
+/// \param depth Frames read ahead.
+cloud_prefetcher::cloud_prefetcher(const cloud_sequence& sequence, size_t depth)
+    : _sequence(sequence), _depth(std::max<size_t>(depth, 1)), _next(0), _generation(0), _stop(false),
+      _thread(&cloud_prefetcher::run, this)
+{
+}
+
+cloud_prefetcher::~cloud_prefetcher()
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stop = true;
+    }
+    _cv.notify_all();
+    _thread.join();
+}
+
+/// \brief Cloud to show for a frame. Frames before it are released, the reader thread goes on
+/// with the frames after it. A frame before the read ahead frames, or further ahead than the
+/// reader can catch up with, restarts reading there.
+/// \param index Frame to show.
+/// \param wait Wait until exactly this frame is read, used when paused or stepping. Otherwise
+/// the newest read frame up to index is returned, so playback skips frames instead of stalling
+/// when the disk is slower than the recording.
+/// \param cloud The cloud, null if reading the frame failed.
+/// \param loaded Frame number of the returned cloud.
+/// \return False if no frame up to index is read yet.
+bool cloud_prefetcher::get(uint64_t index, bool wait, cloud_ptr& cloud, uint64_t& loaded)
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    uint64_t first = _cache.empty() ? _next : _cache.front().index;
+    if (index < first || index > _next + _depth)
+    {
+        _cache.clear();
+        _next = index;
+        _generation++;
+        _cv.notify_all();
+    }
+    while (_cache.size() > 1 && _cache[1].index <= index)
+    {
+        _cache.pop_front();
+    }
+    // Releasing read frames lets the reader continue
+    _cv.notify_all();
+    if (wait)
+    {
+        // Frames before index are released as they arrive, otherwise they fill the cache and
+        // the reader never gets to index
+        while (true)
+        {
+            while (!_cache.empty() && _cache.front().index < index)
+            {
+                _cache.pop_front();
+                _cv.notify_all();
+            }
+            if (!_cache.empty() || index >= _sequence.frames())
+            {
+                break;
+            }
+            _cv.wait(lock);
+        }
+    }
+    if (_cache.empty() || _cache.front().index > index || (wait && _cache.front().index != index))
+    {
+        return false;
+    }
+    cloud = _cache.front().cloud;
+    loaded = _cache.front().index;
+    return true;
+}
+
+/// \brief Reader thread: keeps the frames after the played one decoded.
+/// \return None.
+void cloud_prefetcher::run()
+{
+    std::vector<uint8_t> buffer;
+    std::unique_lock<std::mutex> lock(_mutex);
+    while (true)
+    {
+        _cv.wait(lock, [&] { return _stop || (_next < _sequence.frames() && _cache.size() < _depth); });
+        if (_stop)
+        {
+            return;
+        }
+        uint64_t index = _next;
+        uint64_t generation = _generation;
+        lock.unlock();
+        cloud_ptr cloud(new pcl::PointCloud<pcl::PointXYZRGB>);
+        if (!_sequence.read(index, *cloud, buffer))
+        {
+            std::cerr << "Failed to read pointcloud " << index << std::endl;
+            cloud.reset();
+        }
+        lock.lock();
+        // Playback jumped while reading, the frame is not needed
+        if (generation == _generation)
+        {
+            _cache.push_back(entry{index, cloud});
+            _next = index + 1;
+            _cv.notify_all();
+        }
+    }
+}
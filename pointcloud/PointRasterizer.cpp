@@ -0,0 +1,244 @@
+#include <PointRasterizer.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstring>
+#include <Eigen/Geometry>
+
+/// \file PointRasterizer.cpp
+/// \brief Renders point clouds to images on the CPU, for snapshots on machines without a GPU.
+/// A splat is placed on the same pixels as a GL point of the same size, so a snapshot matches
+/// the window pixel for pixel apart from the depth test.
+
+/// \brief floor() without the library call, for values well inside the int range.
+static inline int fast_floor(float v)
+{
+    int i = static_cast<int>(v);
+    return i - (static_cast<float>(i) > v);
+}
+
+/// \brief ceil() without the library call, for values well inside the int range.
+static inline int fast_ceil(float v)
+{
+    int i = static_cast<int>(v);
+    return i + (static_cast<float>(i) < v);
+}
+
+/// \brief Calls f(tile) for every tile a splat lies on. A splat is at most a tile wide, so
+/// these are the tile of its top left pixel and the ones right of and below it if it reaches
+/// into them.
+template <class F>
+static inline void for_splat_tiles(int x, int y, int size, int width, int height, int tilesX, F f)
+{
+    int tx0 = std::max(x, 0) >> RASTER_TILE_BITS;
+    int tx1 = std::min(x + size - 1, width - 1) >> RASTER_TILE_BITS;
+    int ty0 = std::max(y, 0) >> RASTER_TILE_BITS;
+    int ty1 = std::min(y + size - 1, height - 1) >> RASTER_TILE_BITS;
+    f(ty0 * tilesX + tx0);
+    if (tx1 != tx0)
+    {
+        f(ty0 * tilesX + tx1);
+    }
+    if (ty1 != ty0)
+    {
+        f(ty1 * tilesX + tx0);
+        if (tx1 != tx0)
+        {
+            f(ty1 * tilesX + tx1);
+        }
+    }
+}
+
+Eigen::Matrix4f raster_view_matrix(double yaw, double pitch, float offsetY)
+{
+    const float degrees = static_cast<float>(M_PI / 180.0);
+    Eigen::Affine3f view = Eigen::Affine3f::Identity();
+    // gluLookAt(0, 0, 0, 0, 0, 1, 0, -1, 0) turns y and z around
+    view.linear() = Eigen::Vector3f(1.0f, -1.0f, -1.0f).asDiagonal();
+    view.translate(Eigen::Vector3f(0.0f, 0.0f, 0.5f + offsetY * 0.05f));
+    view.rotate(Eigen::AngleAxisf(static_cast<float>(pitch) * degrees, Eigen::Vector3f::UnitX()));
+    view.rotate(Eigen::AngleAxisf(static_cast<float>(yaw) * degrees, Eigen::Vector3f::UnitY()));
+    view.translate(Eigen::Vector3f(0.0f, 0.0f, -0.5f));
+    return view.matrix();
+}
+
+/// \brief Creates the renderer.
+/// \param threads Rendering threads, all cores if 0.
+point_rasterizer::point_rasterizer(unsigned int threads)
+    : _pool(threads), _threads(_pool.size())
+{
+}
+
+/// \brief Runs f(thread) on every rendering thread of the pool, the calling thread being thread 0.
+template <class F>
+void point_rasterizer::parallel(F f)
+{
+    _pool.run(f);
+}
+
+/// \brief Renders points given by their memory layout.
+/// \param points First point, x, y and z are its first three floats.
+/// \param count Number of points.
+/// \param stride Bytes from one point to the next.
+/// \param color Byte offset of b, g and r in a point.
+/// \param view Model view matrix.
+/// \param width Image width.
+/// \param height Image height.
+/// \param image BGR image.
+/// \param maxZ Far limit of the drawn points.
+/// \return None.
+void point_rasterizer::render_points(const void* points, size_t count, size_t stride, size_t color,
+                                     const Eigen::Matrix4f& view, int width, int height, cv::Mat& image, float maxZ)
+{
+    image.create(height, width, CV_8UC3);
+    _splats.resize(count);
+    const int tilesX = (width + RASTER_TILE - 1) / RASTER_TILE;
+    const int tilesY = (height + RASTER_TILE - 1) / RASTER_TILE;
+    const size_t tiles = static_cast<size_t>(tilesX) * tilesY;
+    _counts.assign(_threads * tiles, 0);
+    _offsets.resize(_threads * tiles);
+    _starts.resize(tiles + 1);
+
+    // Same size as glPointSize(width / 640) in the window
+    const int size = std::min(std::max(1, static_cast<int>(std::lrint(width / 640.0f))), RASTER_TILE);
+    const float focal = 0.5f * height / std::tan(RASTER_FOV_Y * 0.5f * static_cast<float>(M_PI / 180.0));
+    const float cx = 0.5f * width, cy = 0.5f * height;
+    const char* base = static_cast<const char*>(points);
+    // Copied so the compiler keeps them in registers while splats are written
+    const float m00 = view(0, 0), m01 = view(0, 1), m02 = view(0, 2), m03 = view(0, 3);
+    const float m10 = view(1, 0), m11 = view(1, 1), m12 = view(1, 2), m13 = view(1, 3);
+    const float m20 = view(2, 0), m21 = view(2, 1), m22 = view(2, 2), m23 = view(2, 3);
+    auto chunk = [this, count](unsigned int k, size_t& begin, size_t& end)
+    {
+        begin = count * k / _threads;
+        end = count * (k + 1) / _threads;
+    };
+
+    // Projects the points and counts them per tile, a splat on a tile border goes to each tile
+    parallel([&](unsigned int k)
+             {
+                 size_t begin, end;
+                 chunk(k, begin, end);
+                 uint32_t* counts = &_counts[k * tiles];
+                 for (size_t i = begin; i < end; i++)
+                 {
+                     const char* p = base + i * stride;
+                     const float* xyz = reinterpret_cast<const float*>(p);
+                     splat& s = _splats[i];
+                     s.depth = 0.0f;
+                     // Also drops NaN coordinates, every comparison with them fails
+                     if (!(xyz[2] != 0 && xyz[2] < maxZ))
+                     {
+                         continue;
+                     }
+                     float xe = m00 * xyz[0] + m01 * xyz[1] + m02 * xyz[2] + m03;
+                     float ye = m10 * xyz[0] + m11 * xyz[1] + m12 * xyz[2] + m13;
+                     float depth = -(m20 * xyz[0] + m21 * xyz[1] + m22 * xyz[2] + m23);
+                     if (!(depth >= RASTER_NEAR && depth <= RASTER_FAR))
+                     {
+                         continue;
+                     }
+                     float scale = focal / depth;
+                     float xw = cx + xe * scale;
+                     float yw = cy - ye * scale;
+                     // Like GL, a point whose center is outside the view is dropped entirely
+                     // and a center on the right or bottom edge would start a splat past the last tile
+                     if (!(xw >= 0 && xw < width && yw >= 0 && yw < height))
+                     {
+                         continue;
+                     }
+                     // The pixels a GL point of this size covers: floor(xw - size / 2 + 0.5) and, with
+                     // rows counted from the top, ceil(yw + size / 2 - 0.5) - size
+                     s.x = static_cast<int16_t>(fast_floor(xw - size * 0.5f + 0.5f));
+                     s.y = static_cast<int16_t>(fast_ceil(yw + size * 0.5f - 0.5f) - size);
+                     s.depth = depth;
+                     memcpy(&s.color, p + color, sizeof(s.color));
+                     for_splat_tiles(s.x, s.y, size, width, height, tilesX, [counts](int t)
+                                     {
+                                         counts[t]++;
+                                     });
+                 }
+             });
+
+    // Every thread writes its points of a tile after those of the threads before it, so the
+    // points of a tile stay in cloud order
+    uint32_t total = 0;
+    for (size_t t = 0; t < tiles; t++)
+    {
+        _starts[t] = total;
+        for (unsigned int k = 0; k < _threads; k++)
+        {
+            _offsets[k * tiles + t] = total;
+            total += _counts[k * tiles + t];
+        }
+    }
+    _starts[tiles] = total;
+    _binned.resize(total);
+
+    parallel([&](unsigned int k)
+             {
+                 size_t begin, end;
+                 chunk(k, begin, end);
+                 uint32_t* offsets = &_offsets[k * tiles];
+                 for (size_t i = begin; i < end; i++)
+                 {
+                     const splat& s = _splats[i];
+                     if (s.depth == 0.0f)
+                     {
+                         continue;
+                     }
+                     for_splat_tiles(s.x, s.y, size, width, height, tilesX, [this, offsets, &s](int t)
+                                     {
+                                         _binned[offsets[t]++] = s;
+                                     });
+                 }
+             });
+
+    // Tiles are handed out one at a time, the nearest point of a pixel wins and of equally near
+    // points the first. Depth and color of a tile stay in the cache of its thread and the
+    // depth test is a select instead of a branch, depths of neighboring points are random.
+    std::atomic<size_t> nextTile(0);
+    parallel([&](unsigned int)
+             {
+                 std::vector<float> tileDepth(RASTER_TILE * RASTER_TILE);
+                 std::vector<uint32_t> tileColor(RASTER_TILE * RASTER_TILE);
+                 const uint32_t background = RASTER_BACKGROUND * 0x010101u;
+                 size_t t;
+                 while ((t = nextTile++) < tiles)
+                 {
+                     int x0 = static_cast<int>(t % tilesX) * RASTER_TILE, y0 = static_cast<int>(t / tilesX) * RASTER_TILE;
+                     int x1 = std::min(x0 + RASTER_TILE, width), y1 = std::min(y0 + RASTER_TILE, height);
+                     std::fill(tileDepth.begin(), tileDepth.end(), INFINITY);
+                     std::fill(tileColor.begin(), tileColor.end(), background);
+                     for (uint32_t j = _starts[t]; j < _starts[t + 1]; j++)
+                     {
+                         const splat& s = _binned[j];
+                         int sx0 = std::max<int>(s.x, x0) - x0, sx1 = std::min<int>(s.x + size, x1) - x0;
+                         int sy0 = std::max<int>(s.y, y0) - y0, sy1 = std::min<int>(s.y + size, y1) - y0;
+                         for (int y = sy0; y < sy1; y++)
+                         {
+                             float* depth = &tileDepth[y * RASTER_TILE];
+                             uint32_t* pixel = &tileColor[y * RASTER_TILE];
+                             for (int x = sx0; x < sx1; x++)
+                             {
+                                 bool nearer = s.depth < depth[x];
+                                 depth[x] = nearer ? s.depth : depth[x];
+                                 pixel[x] = nearer ? s.color : pixel[x];
+                             }
+                         }
+                     }
+                     for (int y = y0; y < y1; y++)
+                     {
+                         const uint32_t* color = &tileColor[(y - y0) * RASTER_TILE];
+                         uint8_t* pixel = image.ptr<uint8_t>(y) + x0 * 3;
+                         for (int x = 0; x < x1 - x0; x++)
+                         {
+                             pixel[x * 3] = static_cast<uint8_t>(color[x]);
+                             pixel[x * 3 + 1] = static_cast<uint8_t>(color[x] >> 8);
+                             pixel[x * 3 + 2] = static_cast<uint8_t>(color[x] >> 16);
+                         }
+                     }
+                 }
+             });
+}
@@ -0,0 +1,316 @@
+// Buffer objects are GL 1.5, their prototypes are only declared on request
+#define GL_GLEXT_PROTOTYPES
+#include <GL/gl.h>
+#include <GL/glext.h>
+
+#include <PointRenderer.h>
+
+#include <algorithm>
+#include <cmath>
+#include <queue>
+#include <utility>
+
+/// \file PointRenderer.cpp
+/// \brief Draws point clouds from vertex buffers. A cloud is filtered and uploaded once when it
+/// is new and then drawn with a single call per frame, instead of one glColor and one glVertex
+/// call per point. Octrees of large clouds are drawn node by node from buffers that are
+/// uploaded as the nodes come into view.
+
+point_renderer::point_renderer()
+    : _staged(false)
+{
+}
+
+point_renderer::~point_renderer()
+{
+    resize(0);
+}
+
+/// \brief Creates or deletes buffers to have one per layer.
+/// \param layers Number of layers.
+/// \return None.
+void point_renderer::resize(size_t layers)
+{
+    while (_layers.size() > layers)
+    {
+        glDeleteBuffers(1, &_layers.back().buffer);
+        _layers.pop_back();
+    }
+    while (_layers.size() < layers)
+    {
+        layer l;
+        glGenBuffers(1, &l.buffer);
+        l.count = 0;
+        l.max_z = 0.0f;
+        _layers.push_back(l);
+    }
+}
+
+/// \brief Orphans the buffer of a layer, so the driver can hand out new memory while the old
+/// contents may still be drawn, and maps it for writing.
+/// \param index Layer.
+/// \param capacity Most vertices that will be written.
+/// \return Vertices to fill, in a staging copy if the buffer cannot be mapped.
+point_renderer::vertex* point_renderer::map(size_t index, size_t capacity)
+{
+    glBindBuffer(GL_ARRAY_BUFFER, _layers[index].buffer);
+    glBufferData(GL_ARRAY_BUFFER, capacity * sizeof(vertex), nullptr, GL_STREAM_DRAW);
+    void* mapped = capacity ? glMapBuffer(GL_ARRAY_BUFFER, GL_WRITE_ONLY) : nullptr;
+    _staged = mapped == nullptr;
+    if (_staged)
+    {
+        _staging.resize(capacity);
+        return _staging.data();
+    }
+    return static_cast<vertex*>(mapped);
+}
+
+/// \brief Finishes writing the buffer mapped by map().
+/// \param index Layer.
+/// \param count Vertices written.
+/// \return None.
+void point_renderer::unmap(size_t index, size_t count)
+{
+    layer& l = _layers[index];
+    l.count = count;
+    // A buffer whose contents were lost while mapped, e.g. on a mode switch, is uploaded next time
+    if (_staged)
+    {
+        glBufferSubData(GL_ARRAY_BUFFER, 0, count * sizeof(vertex), _staging.data());
+    }
+    else if (glUnmapBuffer(GL_ARRAY_BUFFER) != GL_TRUE)
+    {
+        l.count = 0;
+        l.source.reset();
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+/// \brief Draws every layer with one call.
+/// \return None.
+void point_renderer::draw_layers()
+{
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glEnableClientState(GL_COLOR_ARRAY);
+    for (const auto& l : _layers)
+    {
+        if (l.count == 0)
+        {
+            continue;
+        }
+        glBindBuffer(GL_ARRAY_BUFFER, l.buffer);
+        glVertexPointer(3, GL_FLOAT, sizeof(vertex), reinterpret_cast<const void*>(offsetof(vertex, x)));
+        glColorPointer(3, GL_UNSIGNED_BYTE, sizeof(vertex), reinterpret_cast<const void*>(offsetof(vertex, r)));
+        glDrawArrays(GL_POINTS, 0, static_cast<GLsizei>(l.count));
+    }
+    // Client side arrays, like the text of example.hpp, need the buffer unbound
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glDisableClientState(GL_COLOR_ARRAY);
+    glDisableClientState(GL_VERTEX_ARRAY);
+}
+
+size_t point_renderer::points() const
+{
+    size_t total = 0;
+    for (const auto& l : _layers)
+    {
+        total += l.count;
+    }
+    return total;
+}
+
+octree_renderer::octree_renderer()
+    : _residentPoints(0), _drawn(0), _frame(0), _complete(true)
+{
+}
+
+octree_renderer::~octree_renderer()
+{
+    clear();
+}
+
+/// \brief Draws a tree with the current transforms. Nodes are selected by the size of their cube
+/// on screen, a child only when the sample grid of its parent is coarser than a pixel. At most
+/// LOD_UPLOAD_POINTS points of nodes that are not on the GPU yet are uploaded, the others are
+/// read ahead from disk and left out until a later frame.
+/// \param tree The tree.
+/// \param budget Most points drawn.
+/// \return None.
+void octree_renderer::draw(const cloud_octree& tree, size_t budget)
+{
+    _frame++;
+    _drawn = 0;
+    _complete = true;
+    _selected.clear();
+    if (tree.nodes() == 0)
+    {
+        return;
+    }
+
+    GLfloat modelview[16], projection[16], clip[16];
+    GLint viewport[4];
+    glGetFloatv(GL_MODELVIEW_MATRIX, modelview);
+    glGetFloatv(GL_PROJECTION_MATRIX, projection);
+    glGetIntegerv(GL_VIEWPORT, viewport);
+    for (int column = 0; column < 4; column++)
+    {
+        for (int row = 0; row < 4; row++)
+        {
+            float sum = 0.0f;
+            for (int k = 0; k < 4; k++)
+            {
+                sum += projection[k * 4 + row] * modelview[column * 4 + k];
+            }
+            clip[column * 4 + row] = sum;
+        }
+    }
+    // Frustum planes from the rows of the clip matrix, in model coordinates
+    float planes[6][4];
+    for (int i = 0; i < 6; i++)
+    {
+        int row = i / 2;
+        float sign = (i % 2) ? -1.0f : 1.0f;
+        for (int k = 0; k < 4; k++)
+        {
+            planes[i][k] = clip[k * 4 + 3] + sign * clip[k * 4 + row];
+        }
+    }
+    auto visible = [&planes](const lod_node& n)
+    {
+        for (const auto& p : planes)
+        {
+            float distance = p[0] * n.center[0] + p[1] * n.center[1] + p[2] * n.center[2] + p[3];
+            float radius = n.half * (std::fabs(p[0]) + std::fabs(p[1]) + std::fabs(p[2]));
+            if (distance < -radius)
+            {
+                return false;
+            }
+        }
+        return true;
+    };
+    // Edge of the cube in pixels, from the distance of its nearest possible point
+    float focal = projection[5] * viewport[3] * 0.5f;
+    auto screen_size = [&modelview, focal](const lod_node& n)
+    {
+        float eye[3];
+        for (int row = 0; row < 3; row++)
+        {
+            eye[row] = modelview[row] * n.center[0] + modelview[4 + row] * n.center[1] +
+                       modelview[8 + row] * n.center[2] + modelview[12 + row];
+        }
+        float distance = std::sqrt(eye[0] * eye[0] + eye[1] * eye[1] + eye[2] * eye[2]) - n.half * 1.7321f;
+        return distance > 1e-3f ? 2.0f * n.half * focal / distance : INFINITY;
+    };
+
+    std::priority_queue<std::pair<float, uint32_t>> queue;
+    if (visible(tree.node(0)))
+    {
+        queue.push(std::make_pair(screen_size(tree.node(0)), 0u));
+    }
+    while (!queue.empty())
+    {
+        std::pair<float, uint32_t> top = queue.top();
+        queue.pop();
+        const lod_node& n = tree.node(top.second);
+        if (_drawn + n.count > budget)
+        {
+            break;
+        }
+        _selected.push_back(top.second);
+        _drawn += n.count;
+        if (top.first < LOD_GRID_CELLS)
+        {
+            continue;
+        }
+        for (uint32_t child : n.children)
+        {
+            if (child != 0 && visible(tree.node(child)))
+            {
+                queue.push(std::make_pair(screen_size(tree.node(child)), child));
+            }
+        }
+    }
+
+    size_t uploaded = 0;
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glEnableClientState(GL_COLOR_ARRAY);
+    for (uint32_t index : _selected)
+    {
+        const lod_node& n = tree.node(index);
+        auto it = _resident.find(index);
+        if (it == _resident.end())
+        {
+            if (uploaded >= LOD_UPLOAD_POINTS)
+            {
+                tree.prefetch(n);
+                _drawn -= n.count;
+                _complete = false;
+                continue;
+            }
+            // The stored points are the vertices, they go to the GPU straight from the mapping
+            resident r;
+            glGenBuffers(1, &r.buffer);
+            glBindBuffer(GL_ARRAY_BUFFER, r.buffer);
+            glBufferData(GL_ARRAY_BUFFER, n.count * sizeof(lod_point), tree.node_points(n), GL_STATIC_DRAW);
+            r.count = n.count;
+            uploaded += n.count;
+            _residentPoints += n.count;
+            it = _resident.insert(std::make_pair(index, r)).first;
+        }
+        it->second.frame = _frame;
+        glBindBuffer(GL_ARRAY_BUFFER, it->second.buffer);
+        glVertexPointer(3, GL_SHORT, sizeof(lod_point), reinterpret_cast<const void*>(offsetof(lod_point, x)));
+        glColorPointer(3, GL_UNSIGNED_BYTE, sizeof(lod_point), reinterpret_cast<const void*>(offsetof(lod_point, r)));
+        glPushMatrix();
+        glTranslatef(n.center[0], n.center[1], n.center[2]);
+        float scale = n.half / LOD_QUANT;
+        glScalef(scale, scale, scale);
+        glDrawArrays(GL_POINTS, 0, static_cast<GLsizei>(n.count));
+        glPopMatrix();
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glDisableClientState(GL_COLOR_ARRAY);
+    glDisableClientState(GL_VERTEX_ARRAY);
+
+    evict(budget * LOD_RESIDENT_FACTOR);
+}
+
+/// \brief Deletes the buffers of the nodes drawn longest ago, until the resident points are
+/// within a limit. Nodes drawn in the current frame are kept.
+/// \param limit Most resident points.
+/// \return None.
+void octree_renderer::evict(size_t limit)
+{
+    if (_residentPoints <= limit)
+    {
+        return;
+    }
+    std::vector<std::pair<uint64_t, uint32_t>> unused;
+    for (const auto& r : _resident)
+    {
+        if (r.second.frame != _frame)
+        {
+            unused.push_back(std::make_pair(r.second.frame, r.first));
+        }
+    }
+    std::sort(unused.begin(), unused.end());
+    for (size_t i = 0; i < unused.size() && _residentPoints > limit; i++)
+    {
+        auto it = _resident.find(unused[i].second);
+        glDeleteBuffers(1, &it->second.buffer);
+        _residentPoints -= it->second.count;
+        _resident.erase(it);
+    }
+}
+
+/// \brief Deletes all node buffers.
+/// \return None.
+void octree_renderer::clear()
+{
+    for (auto& r : _resident)
+    {
+        glDeleteBuffers(1, &r.second.buffer);
+    }
+    _resident.clear();
+    _residentPoints = 0;
+}
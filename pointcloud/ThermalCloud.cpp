@@ -0,0 +1,87 @@
+#include <ThermalCloud.h>
+#include <Palettes.h>
+
+/// \file ThermalCloud.cpp
+/// \brief Colorizing of raw thermal frames and their projection onto RealSense depth points.
+
+void process_thermaldata(const cv::Mat& raw,
+                        cv::Mat& gray,
+                        cv::Mat& color,
+                        uint16_t& rangeMin,
+                        uint16_t& rangeMax)
+{
+    float diff = rangeMax - rangeMin;
+    float scale = 255 / diff;
+    const int *selectedColormap = colormap_ironblack;
+	int selectedColormapSize = get_size_colormap_ironblack();
+
+    uint16_t value;
+    uint16_t valueFrameBuffer;
+    for (int row = 0; row < raw.rows; row++)
+    {
+        const uint16_t *rawRow = raw.ptr<uint16_t>(row);
+        for (int column = 0; column < raw.cols; column++)
+        {
+            valueFrameBuffer = rawRow[column];
+            if (valueFrameBuffer <= rangeMin)
+            {
+                value = 0;
+            }
+            else if (valueFrameBuffer > rangeMax)
+            {
+                value = 255;
+            }
+            else
+            {
+                value = ((valueFrameBuffer - rangeMin) * scale);
+            }
+            int ofs_r = 3 * value + 0; if (selectedColormapSize <= ofs_r) ofs_r = selectedColormapSize - 1;
+            int ofs_g = 3 * value + 1; if (selectedColormapSize <= ofs_g) ofs_g = selectedColormapSize - 1;
+            int ofs_b = 3 * value + 2; if (selectedColormapSize <= ofs_b) ofs_b = selectedColormapSize - 1;
+            cv::Vec3b rgbcolor(selectedColormap[ofs_b], selectedColormap[ofs_g], selectedColormap[ofs_r]);
+            color.at<cv::Vec3b>(row, column) = rgbcolor;
+            gray.at<uint8_t>(row, column) = value;
+        }
+    }
+}
+
+pcl_ptr points_to_pcl(const rs2::points& points, const thermal_projection& projection, const cv::Mat& thermalimage)
+{
+    pcl_ptr cloud(new pcl::PointCloud<pcl::PointXYZRGB>);
+
+    auto sp = points.get_profile().as<rs2::video_stream_profile>();
+    cloud->width = sp.width();
+    cloud->height = sp.height();
+    cloud->is_dense = false;
+    cloud->points.resize(points.size());
+    // One thermal pixel per point, found by the projection for the same depth pixels
+    const int32_t* index = projection.index();
+    const cv::Vec3b* colors = thermalimage.ptr<cv::Vec3b>();
+    auto ptr = points.get_vertices();
+    for (auto& p : cloud->points)
+    {
+        p.x = ptr->x;
+        p.y = ptr->y;
+        p.z = ptr->z;
+        ptr++;
+
+        if (p.z > 0)
+        {
+            if (*index >= 0)
+            {
+                cv::Vec3b color = colors[*index];
+                p.r = color[2];
+                p.g = color[1];
+                p.b = color[0];
+            }
+            else
+            {
+                p.r = 153;
+                p.g = 153;
+                p.b = 153;
+            }
+        }
+        index++;
+    }
+    return cloud;
+}
@@ -0,0 +1,560 @@
+#include <librealsense2/rs.hpp>
+#include <pcl/point_types.h>
+#include <pcl/io/pcd_io.h>
+#include <opencv2/opencv.hpp>
+#include <iostream>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <libgen.h>
+#include <sys/stat.h>
+#include <DepthSource.h>
+#include <ThermalCloud.h>
+#include <CloudWriter.h>
+#include <CloudSequence.h>
+#include <ThermalRecording.h>
+
+#define BATCH_JOBS_PER_THREAD 2 // Frames in flight per worker, bounds the memory held
+#define BATCH_REPORT_FRAMES 100
+
+/// \file batch_pc.cpp
+/// \brief Regenerates the thermal point clouds of a recorded session, a RealSense bag and a raw
+/// thermal recording, with new calibration or range settings on all cores.
+
+/// \brief Function to describe how to use the command line arguments
+/// \param cmd Argument of the command line, here it is the program
+void printUsage(char *cmd)
+{
+	char *cmdname = basename(cmd);
+	printf(" Usage: %s -bag x -thermal x [OPTION]...\n"
+		   " -h			display this help and exit.\n"
+		   " -bag x		RealSense recording with the depth and color streams (NEEDED).\n"
+		   " -thermal x		raw thermal recording made with -record (NEEDED).\n"
+		   " -out x		directory the clouds are written to (default: clouds).\n"
+		   " -calibration x	thermal intrinsics (default: ../calibration.xml).\n"
+		   " -extrinsic x		thermal to rgb extrinsics (default: ../extrinsic.xml).\n"
+		   " -mintemp x		sets a minimum value for scaling (suggestion: 27300).\n"
+		   " -maxtemp x		sets a maximum value for scaling (suggestion: 30800).\n"
+		   "			Temperature values for min and max are in hectoKelvin.\n"
+		   " -sync x		max time difference in ms between a depth and a thermal frame (default: 50).\n"
+		   " -offset x		ms added to the thermal timestamps before matching (default: 0).\n"
+		   " -threads x		worker threads (default: all cores).\n"
+		   " -distortion x		thermal lens distortion: remap, model or table (default: remap),\n"
+		   "			see ThermalProjection.h.\n"
+		   " -pcd x		format of the clouds: ascii, binary or compressed (default: binary).\n"
+		   " -dense		only write points with depth.\n"
+		   " -sequence		write all clouds to one sequence file clouds.pcs instead of PCD files.\n"
+		   " Output:		cloud_<frame>.pcd for every depth frame with a thermal match, in order,\n"
+		   "			and frames.csv with the timestamps and thermal frame of every cloud.\n"
+		   "", cmdname);
+	return;
+}
+
+/// \brief A depth frame and its matched thermal frame, waiting for a worker.
+struct batch_job
+{
+	uint64_t index;          // Output order
+	rs2::frameset frames;
+	cv::Mat raw;
+	uint64_t thermal_frame;
+	int64_t thermal_ns;
+	uint32_t frame_counter;
+};
+
+/// \brief A projected cloud waiting for its turn to be written.
+struct batch_result
+{
+	pcl_ptr cloud;
+	double depth_ms;
+	uint64_t thermal_frame;
+	int64_t thermal_ns;
+	uint32_t frame_counter;
+};
+
+/// \brief Jobs for the workers and results for the writer. Results are written in job order,
+/// the reader stops submitting while too many frames are in flight.
+struct batch_queue
+{
+	std::mutex mutex;
+	std::condition_variable cv;
+	std::deque<batch_job> jobs;
+	std::map<uint64_t, batch_result> results;
+	uint64_t submitted = 0;
+	uint64_t written = 0;
+	bool done = false;   // No more jobs
+	bool failed = false; // The writer gave up
+};
+
+/// \brief Worker: aligns depth to color, colorizes the thermal frame and projects it onto the points.
+/// Every worker owns its processing blocks, frames are shared read-only.
+/// \param queue Shared queue.
+/// \param calibration Thermal calibration.
+/// \param rangeMin Minimum temperature to be scaled between 0 and 255.
+/// \param rangeMax Maximum temperature to be scaled between 0 and 255.
+/// \param distortion Handling of the thermal lens distortion.
+/// \return None.
+void run_worker(batch_queue& queue, const thermal_calibration& calibration, uint16_t rangeMin, uint16_t rangeMax,
+				thermal_distortion distortion)
+{
+	rs2::align align_to_color(RS2_STREAM_COLOR);
+	rs2::pointcloud pc;
+	// The workers already use all cores, each projects on its own thread
+	thermal_projection projection(1);
+	cv::Mat gray, color, undistortedColor;
+	while (true)
+	{
+		batch_job job;
+		{
+			std::unique_lock<std::mutex> lock(queue.mutex);
+			queue.cv.wait(lock, [&] { return !queue.jobs.empty() || queue.done || queue.failed; });
+			if (queue.jobs.empty() || queue.failed)
+			{
+				return;
+			}
+			job = std::move(queue.jobs.front());
+			queue.jobs.pop_front();
+		}
+		gray.create(job.raw.rows, job.raw.cols, CV_8UC1);
+		color.create(job.raw.rows, job.raw.cols, CV_8UC3);
+		process_thermaldata(job.raw, gray, color, rangeMin, rangeMax);
+		rs2::frameset aligned = align_to_color.process(job.frames);
+		rs2::depth_frame depth = aligned.get_depth_frame();
+		if (!projection.ready())
+		{
+			projection.init(calibration, depth.get_profile().as<rs2::video_stream_profile>().get_intrinsics(),
+							job.raw.cols, job.raw.rows, distortion);
+		}
+		projection.project(static_cast<const uint16_t*>(depth.get_data()), depth.get_units());
+		projection.undistort(color, undistortedColor);
+		rs2::points points = pc.calculate(depth);
+
+		batch_result result;
+		result.cloud = points_to_pcl(points, projection, undistortedColor);
+		result.cloud->header.stamp = static_cast<uint64_t>(job.thermal_ns / 1000);
+		result.depth_ms = job.frames.get_timestamp();
+		result.thermal_frame = job.thermal_frame;
+		result.thermal_ns = job.thermal_ns;
+		result.frame_counter = job.frame_counter;
+		{
+			std::lock_guard<std::mutex> lock(queue.mutex);
+			queue.results.emplace(job.index, std::move(result));
+		}
+		queue.cv.notify_all();
+	}
+}
+
+/// \brief Writer: writes the results in job order as PCD files or into a sequence and indexes
+/// them in frames.csv.
+/// \param queue Shared queue.
+/// \param directory Output directory.
+/// \param format Encoding of the PCD files.
+/// \param skipInvalid Only write points with depth.
+/// \param sequence Write the clouds to clouds.pcs, the cloud column is the frame in the sequence.
+/// \return None.
+void run_writer(batch_queue& queue, const std::string& directory, pcd_format format, bool skipInvalid, bool sequence)
+{
+	std::string indexFile = directory + "/frames.csv";
+	FILE* index = fopen(indexFile.c_str(), "w");
+	cloud_recorder recorder;
+	if (!index)
+	{
+		std::cerr << "Failed to open " << indexFile << std::endl;
+	}
+	else if (sequence && !recorder.open(directory + "/clouds.pcs"))
+	{
+		fclose(index);
+		index = nullptr;
+	}
+	else
+	{
+		fprintf(index, "cloud,depth_ms,thermal_frame,thermal_ns,frame_counter,points\n");
+	}
+	auto start = std::chrono::steady_clock::now();
+	uint64_t skipped = 0;
+	while (index)
+	{
+		batch_result result;
+		uint64_t next;
+		{
+			std::unique_lock<std::mutex> lock(queue.mutex);
+			next = queue.written;
+			queue.cv.wait(lock, [&] { return queue.results.count(next) || (queue.done && next == queue.submitted); });
+			auto it = queue.results.find(next);
+			if (it == queue.results.end())
+			{
+				break;
+			}
+			result = std::move(it->second);
+			queue.results.erase(it);
+		}
+
+		char name[32];
+		if (sequence)
+		{
+			snprintf(name, sizeof(name), "%llu", static_cast<unsigned long long>(recorder.frames()));
+			if (!recorder.write(*result.cloud))
+			{
+				break;
+			}
+		}
+		else
+		{
+			snprintf(name, sizeof(name), "cloud_%06llu.pcd", static_cast<unsigned long long>(next));
+		}
+		bool written = true;
+		try
+		{
+			if (!sequence && !write_pcd(directory + "/" + name, *result.cloud, format, skipInvalid))
+			{
+				// Also the case of a frame without any point with depth, the run goes on without it
+				std::cerr << "Failed to write " << directory << "/" << name << std::endl;
+				written = false;
+			}
+		}
+		catch (const std::exception& e)
+		{
+			std::cerr << "Failed to write " << directory << "/" << name << ": " << e.what() << std::endl;
+			break;
+		}
+		// The index only lists files that exist
+		if (written)
+		{
+			fprintf(index, "%s,%.3f,%llu,%lld,%u,%zu\n", name, result.depth_ms,
+					static_cast<unsigned long long>(result.thermal_frame), static_cast<long long>(result.thermal_ns),
+					result.frame_counter, result.cloud->points.size());
+		}
+		else
+		{
+			skipped++;
+		}
+		{
+			std::lock_guard<std::mutex> lock(queue.mutex);
+			queue.written++;
+		}
+		queue.cv.notify_all();
+		if ((next + 1) % BATCH_REPORT_FRAMES == 0)
+		{
+			double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+			printf("%llu clouds, %.1f clouds/s\n", static_cast<unsigned long long>(next + 1), (next + 1) / elapsed);
+		}
+	}
+	if (index)
+	{
+		fclose(index);
+	}
+	if (skipped)
+	{
+		printf("%llu clouds not written and left out of frames.csv\n", static_cast<unsigned long long>(skipped));
+	}
+	std::lock_guard<std::mutex> lock(queue.mutex);
+	if (!queue.done || queue.written != queue.submitted)
+	{
+		queue.failed = true;
+		queue.cv.notify_all();
+	}
+}
+
+/// \brief Finds the thermal frame received closest to a depth frame.
+/// \param recording Thermal recording.
+/// \param timestamp_ns Depth frame time on the host clock.
+/// \param offset_ns Added to the thermal timestamps.
+/// \param tolerance_ns Largest accepted difference.
+/// \param match Index of the thermal frame.
+/// \return True if a frame is within the tolerance.
+bool match_thermal_frame(const thermal_recording& recording, int64_t timestamp_ns, int64_t offset_ns,
+						 int64_t tolerance_ns, uint64_t& match)
+{
+	uint64_t after = recording.seek(timestamp_ns - offset_ns);
+	int64_t best = tolerance_ns + 1;
+	for (uint64_t i = after == 0 ? 0 : after - 1; i <= after && i < recording.frames(); i++)
+	{
+		int64_t difference = std::llabs(recording.frame(i).header->frame_ns + offset_ns - timestamp_ns);
+		if (difference < best)
+		{
+			best = difference;
+			match = i;
+		}
+	}
+	return best <= tolerance_ns;
+}
+
+/// \brief Reprocesses a recorded session into thermal point clouds.
+/// \param argc Number of command-line arguments.
+/// \param argv Array of command-line arguments.
+/// \param bag RealSense recording.
+/// \param thermal Raw thermal recording.
+/// \param out Output directory.
+/// \param calibration Thermal intrinsics file.
+/// \param extrinsic Thermal to rgb extrinsics file.
+/// \param mintemp Minimum temperature to be scaled between 0 and 255.
+/// \param maxtemp Maximum temperature to be scaled between 0 and 255.
+/// \param sync Tolerance in ms for matching depth and thermal frames.
+/// \param offset Shift of the thermal timestamps in ms.
+/// \param threads Number of worker threads.
+/// \param distortion Handling of the thermal lens distortion.
+/// \param pcd Format of the clouds.
+/// \param dense Skip points without depth.
+/// \param sequence Write one sequence file instead of PCD files.
+/// \return 0 if successful, -1 if failure.
+int main(int argc, char * argv[])
+try
+{
+	std::string bagFile;
+	std::string thermalFile;
+	std::string outDirectory = "clouds";
+	std::string calibrationFile = "../calibration.xml";
+	std::string extrinsicFile = "../extrinsic.xml";
+	uint16_t rangeMin = 27300;
+	uint16_t rangeMax = 30800;
+	double syncTolerance = 50.0;
+	double offset = 0.0;
+	int threads = static_cast<int>(std::thread::hardware_concurrency());
+	thermal_distortion distortion = DISTORTION_REMAP;
+	pcd_format format = PCD_BINARY;
+	bool dense = false;
+	bool sequence = false;
+
+	for(int i=1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "-h") == 0)
+		{
+			printUsage(argv[0]);
+			exit(0);
+		}
+		else if (strcmp(argv[i], "-bag") == 0 || strcmp(argv[i], "-thermal") == 0 || strcmp(argv[i], "-out") == 0 ||
+				 strcmp(argv[i], "-calibration") == 0 || strcmp(argv[i], "-extrinsic") == 0)
+		{
+			std::string& file = strcmp(argv[i], "-bag") == 0 ? bagFile :
+								strcmp(argv[i], "-thermal") == 0 ? thermalFile :
+								strcmp(argv[i], "-out") == 0 ? outDirectory :
+								strcmp(argv[i], "-calibration") == 0 ? calibrationFile : extrinsicFile;
+			if (i + 1 != argc)
+			{
+				file = argv[++i];
+			}
+			else
+			{
+				std::cerr << "Error: Enter a path after " << argv[i] << "." << std::endl;
+				exit(1);
+			}
+		}
+		else if (strcmp(argv[i], "-mintemp") == 0 || strcmp(argv[i], "-maxtemp") == 0)
+		{
+			uint16_t& range = strcmp(argv[i], "-mintemp") == 0 ? rangeMin : rangeMax;
+			if (i + 1 != argc)
+			{
+				long int temp = std::strtol(argv[++i], nullptr, 10);
+				if (temp < 0 || temp > 65535){
+					std::cerr << "Error: Enter a temp between 0 and 65535." << std::endl;
+					exit(1);
+				}
+				range = static_cast<uint16_t>(temp);
+			}
+			else
+			{
+				std::cerr << "Error: Enter a temp (0 to 65535)." << std::endl;
+				exit(1);
+			}
+		}
+		else if (strcmp(argv[i], "-sync") == 0)
+		{
+			if (i + 1 != argc && (syncTolerance = std::strtod(argv[i + 1], nullptr)) > 0.0)
+			{
+				i++;
+			}
+			else
+			{
+				std::cerr << "Error: Enter a sync tolerance above 0 ms." << std::endl;
+				exit(1);
+			}
+		}
+		else if (strcmp(argv[i], "-offset") == 0)
+		{
+			if (i + 1 != argc)
+			{
+				offset = std::strtod(argv[++i], nullptr);
+			}
+			else
+			{
+				std::cerr << "Error: Enter an offset in ms." << std::endl;
+				exit(1);
+			}
+		}
+		else if (strcmp(argv[i], "-threads") == 0)
+		{
+			if (i + 1 != argc && (threads = std::strtol(argv[i + 1], nullptr, 10)) > 0)
+			{
+				i++;
+			}
+			else
+			{
+				std::cerr << "Error: Enter a number of threads above 0." << std::endl;
+				exit(1);
+			}
+		}
+		else if (strcmp(argv[i], "-distortion") == 0)
+		{
+			if (i + 1 != argc && parse_thermal_distortion(argv[i + 1], distortion))
+			{
+				i++;
+			}
+			else
+			{
+				std::cerr << "Error: Enter a distortion mode: remap, model or table." << std::endl;
+				exit(1);
+			}
+		}
+		else if (strcmp(argv[i], "-pcd") == 0)
+		{
+			if (i + 1 != argc && parse_pcd_format(argv[i + 1], format))
+			{
+				i++;
+			}
+			else
+			{
+				std::cerr << "Error: Enter a cloud format: ascii, binary or compressed." << std::endl;
+				exit(1);
+			}
+		}
+		else if (strcmp(argv[i], "-dense") == 0)
+		{
+			dense = true;
+		}
+		else if (strcmp(argv[i], "-sequence") == 0)
+		{
+			sequence = true;
+		}
+		else
+		{
+			printUsage(argv[0]);
+			exit(1);
+		}
+	}
+	if (bagFile.empty() || thermalFile.empty())
+	{
+		printUsage(argv[0]);
+		exit(1);
+	}
+	threads = threads > 0 ? threads : 1;
+
+	thermal_calibration calibration;
+	if (!load_thermal_calibration(calibration, calibrationFile, extrinsicFile))
+	{
+		return -1;
+	}
+	thermal_recording recording;
+	if (!recording.open(thermalFile))
+	{
+		return -1;
+	}
+	if (mkdir(outDirectory.c_str(), 0755) != 0 && errno != EEXIST)
+	{
+		perror(outDirectory.c_str());
+		return -1;
+	}
+
+	// The bag is read as fast as the workers take the frames, none are dropped
+	depth_source_options depthOptions;
+	depthOptions.type = DEPTH_SOURCE_BAG;
+	depthOptions.file = bagFile;
+	depthOptions.real_time = false;
+	std::unique_ptr<depth_source> source = open_depth_source(depthOptions);
+
+	batch_queue queue;
+	std::vector<std::thread> workers;
+	for (int i = 0; i < threads; i++)
+	{
+		workers.emplace_back(run_worker, std::ref(queue), std::cref(calibration), rangeMin, rangeMax, distortion);
+	}
+	std::thread writer(run_writer, std::ref(queue), outDirectory, format, dense, sequence);
+
+	auto start = std::chrono::steady_clock::now();
+	uint64_t depthFrames = 0;
+	uint64_t unmatched = 0;
+	uint64_t maxInFlight = static_cast<uint64_t>(threads) * BATCH_JOBS_PER_THREAD;
+	int64_t toleranceNs = static_cast<int64_t>(syncTolerance * 1e6);
+	int64_t offsetNs = static_cast<int64_t>(offset * 1e6);
+	while (!source->finished())
+	{
+		rs2::frameset frames;
+		if (!source->wait_for_frames(frames, 1000))
+		{
+			continue;
+		}
+		depthFrames++;
+		uint64_t match;
+		int64_t timestampNs = static_cast<int64_t>(std::llround(frames.get_timestamp() * 1e6));
+		if (!match_thermal_frame(recording, timestampNs, offsetNs, toleranceNs, match))
+		{
+			unmatched++;
+			continue;
+		}
+
+		batch_job job;
+		job.raw.create(recording.height(), recording.width(), CV_16UC1);
+		if (!recording.decode(match, job.raw.ptr<uint16_t>()))
+		{
+			std::cerr << "Thermal frame " << match << " is corrupt" << std::endl;
+			unmatched++;
+			continue;
+		}
+		const thermal_record_header* header = recording.frame(match).header;
+		// Frames must not go back to the playback pool while they wait for a worker
+		frames.keep();
+		job.frames = frames;
+		job.thermal_frame = match;
+		job.thermal_ns = header->frame_ns;
+		job.frame_counter = header->frame_counter;
+		{
+			std::unique_lock<std::mutex> lock(queue.mutex);
+			queue.cv.wait(lock, [&] { return queue.submitted - queue.written < maxInFlight || queue.failed; });
+			if (queue.failed)
+			{
+				break;
+			}
+			job.index = queue.submitted++;
+			queue.jobs.push_back(std::move(job));
+		}
+		queue.cv.notify_all();
+	}
+	{
+		std::lock_guard<std::mutex> lock(queue.mutex);
+		queue.done = true;
+	}
+	queue.cv.notify_all();
+	for (auto& worker : workers)
+	{
+		worker.join();
+	}
+	writer.join();
+	source->stop();
+
+	double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	printf("%llu depth frames, %llu clouds written to %s, %llu without a thermal frame within %.0f ms, %.1f s (%.1f clouds/s)\n",
+		   static_cast<unsigned long long>(depthFrames), static_cast<unsigned long long>(queue.written),
+		   outDirectory.c_str(), static_cast<unsigned long long>(unmatched), syncTolerance, elapsed,
+		   elapsed > 0 ? queue.written / elapsed : 0.0);
+	return queue.failed ? -1 : 0;
+}
+catch (const rs2::error & e)
+{
+	std::cerr << "RealSense error calling " << e.get_failed_function() << "(" << e.get_failed_args() << "):\n    " << e.what() << std::endl;
+	return EXIT_FAILURE;
+}
+catch (const std::exception & e)
+{
+	std::cerr << e.what() << std::endl;
+	return EXIT_FAILURE;
+}
@@ -0,0 +1,80 @@
+#ifndef CLOUDLOADER_H
+#define CLOUDLOADER_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <pcl/point_types.h>
+#include <pcl/point_cloud.h>
+
+/// \file CloudLoader.h
+/// \brief Progressive loading of large PCD files. The file is mapped and its points are
+/// converted in blocks on all cores, every finished block can be rendered while the rest of
+/// the file is still loading.
+
+#define CLOUD_LOAD_BLOCK_POINTS 262144       // Points per block of a binary file
+#define CLOUD_LOAD_BLOCK_BYTES (8 << 20)     // Bytes per block of an ASCII file
+
+/// \brief Layout of the points of a PCD file, from its header.
+struct pcd_header
+{
+    std::string data;       // ascii, binary or binary_compressed
+    uint64_t points = 0;
+    size_t data_offset = 0; // First byte after the header
+    size_t point_size = 0;  // Bytes per point in a binary file
+    int columns = 0;        // Values per line in an ASCII file
+    // Byte offset in a binary point, column in an ASCII line, -1 if the field is missing
+    int x = -1, y = -1, z = -1, rgb = -1;
+    bool xyz_float = false; // x, y and z are 4 byte floats
+    bool rgb_float = false; // rgb is a float holding the packed color bits
+};
+
+/// \brief Parses the header of a PCD file.
+/// \param data Start of the file.
+/// \param size Bytes of the file.
+/// \param header The layout.
+/// \return False if the header is incomplete or not a PCD header.
+bool parse_pcd_header(const char* data, size_t size, pcd_header& header);
+
+/// \brief Loads a PCD file in the background. Binary and ASCII files are mapped and converted
+/// in blocks by a pool of threads, compressed files are loaded by PCL in one piece. Only points
+/// with finite coordinates are kept.
+class cloud_loader
+{
+public:
+    using cloud_ptr = pcl::PointCloud<pcl::PointXYZRGB>::Ptr;
+
+    cloud_loader();
+    ~cloud_loader();
+    bool start(const std::string& filename, unsigned int threads = 0);
+    bool take(std::vector<cloud_ptr>& blocks);
+    bool done() const { return _running == 0; }
+    uint64_t points() const { return _points; }
+    /// \brief Points announced by the header of the file, 0 if it has none.
+    uint64_t expected_points() const { return _header.points; }
+
+private:
+    void run();
+    void run_pcl();
+    void publish(const cloud_ptr& block);
+    void close();
+
+    std::string _filename;
+    const char* _data;
+    size_t _size;
+    pcd_header _header;
+    uint64_t _blocks;
+    std::atomic<uint64_t> _nextBlock;
+    std::atomic<unsigned int> _running;
+    std::atomic<uint64_t> _points;
+    std::atomic<bool> _stop;
+    std::mutex _mutex;
+    std::vector<cloud_ptr> _ready;
+    std::vector<std::thread> _threads;
+};
+
+#endif
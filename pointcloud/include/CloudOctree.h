@@ -0,0 +1,138 @@
+#ifndef CLOUDOCTREE_H
+#define CLOUDOCTREE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <pcl/point_types.h>
+#include <pcl/point_cloud.h>
+
+/// \file CloudOctree.h
+/// \brief Level of detail octree of a large point cloud, cached in a file next to the cloud.
+///
+/// Every node holds a spatially even sample of the points in its cube: one point of each cell
+/// of a grid of LOD_GRID_CELLS^3 cells, and the points it did not take are passed on to its
+/// children. Drawing a node and any set of its ancestors shows every point once, coarse nodes
+/// cover the whole cloud with few points and deeper nodes only add detail. A node that holds
+/// at most LOD_LEAF_POINTS points keeps all of them and has no children.
+///
+/// The file is a 64 byte header, the points of all nodes, each node a contiguous run, and the
+/// node table. Points are 12 bytes, 16-bit coordinates relative to the cube of their node, and
+/// are handed to the GPU as they are stored. The viewer maps the file, only the nodes that are
+/// drawn are read from disk.
+
+#define LOD_MAGIC "THPCLOD1"
+#define LOD_VERSION 1
+#define LOD_GRID_BITS 5                    // Sample grid of a node, 32 cells per edge
+#define LOD_GRID_CELLS (1 << LOD_GRID_BITS)
+#define LOD_KEY_BITS 21                    // Morton key bits per axis
+#define LOD_MAX_DEPTH (LOD_KEY_BITS - LOD_GRID_BITS) // Nodes this deep keep all their points
+#define LOD_LEAF_POINTS 8192
+#define LOD_QUANT 32767.0f                 // Stored coordinate of the faces of a node cube
+#define LOD_BUILD_POINT_BYTES 36           // Build memory per point, 24 held and 12 for sort merges
+
+/// \brief Stored point, 12 bytes. The position is center + (x, y, z) * half / LOD_QUANT of the
+/// node cube.
+struct lod_point
+{
+    int16_t x, y, z;
+    int16_t reserved;
+    uint8_t r, g, b, a;
+};
+
+/// \brief Cube of a node, its points and its children.
+struct lod_node
+{
+    float center[3];
+    float half;             // Half the edge of the cube
+    uint64_t first;         // Index of the first point of the node
+    uint32_t count;
+    uint32_t depth;
+    uint32_t children[8];   // Node index per octant, 0 for none
+};
+
+/// \brief First bytes of the cache file.
+struct lod_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t nodes;
+    uint64_t points;
+    uint64_t node_offset;   // File offset of the node table
+    uint64_t source_size;   // Size and modification time of the cloud the cache was built from
+    int64_t source_mtime_ns;
+    float center[3];        // Cube of the root
+    float half;
+};
+
+static_assert(sizeof(lod_point) == 12, "LOD point size changed");
+static_assert(sizeof(lod_node) == 64, "LOD node size changed");
+static_assert(sizeof(lod_header) == 64, "LOD header size changed");
+
+/// \brief Name of the cache file of a cloud.
+inline std::string octree_cache_name(const std::string& source)
+{
+    return source + ".lod";
+}
+
+/// \brief Builds the octree of a cloud that is added block by block. All points are held in
+/// memory: 24 bytes per point while building and up to 12 more for the merge buffers of the
+/// parallel sort, LOD_BUILD_POINT_BYTES in all. Callers check the size of a cloud against the
+/// memory they allow before adding it.
+class octree_builder
+{
+public:
+    octree_builder();
+    void reserve(uint64_t points);
+    void add(const pcl::PointCloud<pcl::PointXYZRGB>& cloud);
+    bool write(const std::string& filename, const std::string& source);
+    uint64_t points() const { return _points.size(); }
+
+private:
+    /// \brief Point with the Morton code of its position in the root cube.
+    struct build_point
+    {
+        uint64_t key;
+        float x, y, z;
+        uint8_t r, g, b, a;
+    };
+
+    uint32_t build_node(size_t begin, size_t end, uint32_t depth, const float center[3], float half);
+    bool write_points(const build_point* points, size_t count, const float center[3], float half);
+
+    std::vector<build_point> _points;
+    std::vector<lod_node> _nodes;
+    std::vector<build_point> _sample;
+    std::vector<lod_point> _buffer;
+    uint64_t _written;
+    FILE* _file;
+};
+
+/// \brief Octree cache file mapped for drawing.
+class cloud_octree
+{
+public:
+    cloud_octree();
+    ~cloud_octree();
+    cloud_octree(const cloud_octree&) = delete;
+    cloud_octree& operator=(const cloud_octree&) = delete;
+
+    bool open(const std::string& filename, const std::string& source);
+    void close();
+    uint32_t nodes() const { return _header.nodes; }
+    uint64_t points() const { return _header.points; }
+    const lod_node& node(uint32_t index) const { return _nodes[index]; }
+    const lod_point* node_points(const lod_node& node) const { return _points + node.first; }
+    void prefetch(const lod_node& node) const;
+
+private:
+    const char* _data;
+    size_t _size;
+    lod_header _header;
+    const lod_node* _nodes;
+    const lod_point* _points;
+};
+
+#endif
@@ -0,0 +1,373 @@
+#ifndef CLOUDSEQUENCE_H
+#define CLOUDSEQUENCE_H
+
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <pcl/point_types.h>
+#include <pcl/point_cloud.h>
+#include <BackgroundWriter.h>
+#include <CompactCloud.h>
+
+/// \file CloudSequence.h
+/// \brief Recording of timestamped point clouds in a chunked file with a seek index, and its
+/// playback with a prefetching reader thread.
+///
+/// The file starts with a 4096 byte header followed by chunks of up to CLOUD_CHUNK_FRAMES
+/// frames. A chunk starts with a 4096 byte chunk header holding the time, offset and number of
+/// points of each frame written to it, which is the seek index. Every frame is a 32 byte record
+/// header followed by the points with depth, no invalid points are stored. Points are compact
+/// 8 byte points behind the origin of the frame (see CompactCloud.h) or, with
+/// CLOUD_POINT_FLOAT, 16 byte points with float coordinates and the rig label. Chunks start on a
+/// page boundary, records on a 64 byte boundary. The counters in the headers are only updated
+/// after a frame is written, so a recording cut short by a crash is readable up to its last
+/// complete frame.
+
+#define CLOUD_SEQUENCE_MAGIC "THPCLSEQ"
+#define CLOUD_SEQUENCE_VERSION 1
+#define CLOUD_CHUNK_MAGIC 0x4B4E4843 // "CHNK"
+#define CLOUD_CHUNK_FRAMES 64
+#define CLOUD_HEADER_SIZE 4096
+#define CLOUD_CHUNK_HEADER_SIZE 4096
+#define CLOUD_RECORD_HEADER_SIZE 32
+#define CLOUD_SEQUENCE_QUEUE 8   // Clouds waiting for the disk before new ones are dropped
+#define CLOUD_PREFETCH_FRAMES 8  // Clouds decoded ahead of playback
+
+/// \brief Encoding of the stored points.
+enum cloud_point_format
+{
+    CLOUD_POINT_FLOAT = 0,  // cloud_point, float xyz in meters and rgb plus label
+    CLOUD_POINT_COMPACT = 1 // compact_origin followed by compact_point
+};
+
+/// \brief Stored point, 16 bytes.
+struct cloud_point
+{
+    float x, y, z;
+    uint8_t r, g, b;
+    uint8_t label; // Rig id of a fused cloud
+};
+
+/// \brief First page of a sequence.
+struct cloud_file_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t chunk_frames;
+    uint32_t point_format;  // cloud_point_format
+    uint32_t point_size;    // Bytes per stored point
+    uint64_t frames;        // Complete frames in the file
+    uint64_t chunks;
+    int64_t created_ns;
+};
+
+/// \brief First page of a chunk, timestamps is the index used to seek by time.
+struct cloud_chunk_header
+{
+    uint32_t magic;
+    uint32_t frames;        // Complete frames in the chunk
+    uint64_t chunk;
+    uint64_t first_frame;   // Frame number of the first record
+    uint64_t bytes;         // Used bytes including this header
+    int64_t timestamps[CLOUD_CHUNK_FRAMES]; // Cloud time in ns
+    uint64_t offsets[CLOUD_CHUNK_FRAMES];   // Record offset from the chunk start
+    uint32_t points[CLOUD_CHUNK_FRAMES];
+};
+
+/// \brief Stored in front of the points of every frame.
+struct cloud_record_header
+{
+    uint64_t frame;         // Frame number in the sequence
+    int64_t timestamp_ns;
+    uint32_t points;
+    uint32_t point_format;
+    uint64_t bytes;         // Bytes following the record header, origin and points
+};
+
+static_assert(sizeof(cloud_point) == 16, "Stored point size changed");
+static_assert(sizeof(cloud_file_header) <= CLOUD_HEADER_SIZE, "File header larger than its page");
+static_assert(sizeof(cloud_chunk_header) <= CLOUD_CHUNK_HEADER_SIZE, "Chunk header larger than its page");
+static_assert(sizeof(cloud_record_header) == CLOUD_RECORD_HEADER_SIZE, "Record header size changed");
+
+inline uint8_t get_cloud_point_label(const pcl::PointXYZRGB&) { return 0; }
+inline uint8_t get_cloud_point_label(const pcl::PointXYZRGBL& p) { return static_cast<uint8_t>(p.label); }
+inline void set_cloud_point_label(pcl::PointXYZRGB&, uint8_t) {}
+inline void set_cloud_point_label(pcl::PointXYZRGBL& p, uint8_t label) { p.label = label; }
+
+/// \brief Copies the valid points of a cloud into the float format, see stored_point_valid.
+/// \tparam PointT pcl::PointXYZRGB or pcl::PointXYZRGBL.
+/// \param cloud Cloud to store.
+/// \param points Stored points, replaced.
+/// \return None.
+template <class PointT>
+void pack_cloud_points(const pcl::PointCloud<PointT>& cloud, std::vector<cloud_point>& points)
+{
+    points.clear();
+    points.reserve(cloud.points.size());
+    for (const auto& p : cloud.points)
+    {
+        if (stored_point_valid(p, cloud.is_dense))
+        {
+            cloud_point s;
+            s.x = p.x;
+            s.y = p.y;
+            s.z = p.z;
+            s.r = p.r;
+            s.g = p.g;
+            s.b = p.b;
+            s.label = get_cloud_point_label(p);
+            points.push_back(s);
+        }
+    }
+}
+
+/// \brief Converts float format points to an unorganized, dense cloud.
+/// \tparam PointT pcl::PointXYZRGB or pcl::PointXYZRGBL.
+/// \param points Stored points.
+/// \param count Number of points.
+/// \param cloud Cloud to fill, its points are replaced.
+/// \return None.
+template <class PointT>
+void unpack_cloud_points(const cloud_point* points, size_t count, pcl::PointCloud<PointT>& cloud)
+{
+    cloud.points.resize(count);
+    for (size_t i = 0; i < count; i++)
+    {
+        const cloud_point& s = points[i];
+        PointT& p = cloud.points[i];
+        p.x = s.x;
+        p.y = s.y;
+        p.z = s.z;
+        p.r = s.r;
+        p.g = s.g;
+        p.b = s.b;
+        p.a = 255;
+        set_cloud_point_label(p, s.label);
+    }
+    cloud.width = static_cast<uint32_t>(count);
+    cloud.height = 1;
+    cloud.is_dense = true;
+}
+
+/// \brief Appends clouds to a sequence file.
+class cloud_recorder
+{
+public:
+    cloud_recorder();
+    ~cloud_recorder();
+    bool open(const std::string& filename, cloud_point_format format = CLOUD_POINT_COMPACT);
+    void close();
+    bool is_open() const { return _fd >= 0; }
+    uint64_t frames() const { return _header.frames; }
+
+    /// \brief Appends the valid points of a cloud in the format of the sequence.
+    /// \tparam PointT pcl::PointXYZRGB or pcl::PointXYZRGBL.
+    /// \param cloud Cloud to store, its stamp in microseconds is the frame time.
+    /// \return False if the recording is not open or the disk is full, the recording is closed then.
+    template <class PointT>
+    bool write(const pcl::PointCloud<PointT>& cloud)
+    {
+        int64_t timestamp_ns = static_cast<int64_t>(cloud.header.stamp) * 1000;
+        if (_header.point_format == CLOUD_POINT_FLOAT)
+        {
+            pack_cloud_points(cloud, _packed);
+            return write_record(nullptr, 0, _packed.data(), _packed.size(), timestamp_ns);
+        }
+        compact_origin origin = compact_cloud_origin(cloud);
+        pack_compact_points(cloud, origin, _compact);
+        return write_record(&origin, sizeof(origin), _compact.data(), _compact.size(), timestamp_ns);
+    }
+
+private:
+    bool write_record(const void* prefix, size_t prefixBytes, const void* points, size_t count, int64_t timestamp_ns);
+    bool write_at(const void* data, size_t size, uint64_t offset);
+    void finish_chunk();
+
+    int _fd;
+    cloud_file_header _header;
+    cloud_chunk_header _chunk;
+    uint64_t _chunkOffset;
+    uint64_t _nextOffset;
+    bool _chunkOpen;
+    std::vector<cloud_point> _packed;
+    std::vector<compact_point> _compact;
+};
+
+/// \brief Read access to a sequence. The chunk headers are read into an index when opening,
+/// frames are read with pread, so read_points can be called from several threads.
+class cloud_sequence
+{
+public:
+    cloud_sequence();
+    ~cloud_sequence();
+    bool open(const std::string& filename);
+    void close();
+    uint64_t frames() const { return _index.size(); }
+    int64_t timestamp(uint64_t index) const { return _index[index].timestamp_ns; }
+    uint32_t points(uint64_t index) const { return _index[index].points; }
+    uint64_t seek(int64_t timestamp_ns) const;
+    bool read_record(uint64_t index, std::vector<uint8_t>& data) const;
+
+    /// \brief Reads a frame, safe to call from several threads.
+    /// \tparam PointT pcl::PointXYZRGB or pcl::PointXYZRGBL.
+    /// \param index Frame number, less than frames().
+    /// \param cloud Unorganized, dense cloud of the frame, its stamp is the frame time.
+    /// \param buffer Scratch memory for the record, kept to avoid allocating for every frame.
+    /// \return False if the index is out of range or the record does not match the index.
+    template <class PointT>
+    bool read(uint64_t index, pcl::PointCloud<PointT>& cloud, std::vector<uint8_t>& buffer) const
+    {
+        if (!read_record(index, buffer))
+        {
+            return false;
+        }
+        size_t count = _index[index].points;
+        if (_format == CLOUD_POINT_COMPACT)
+        {
+            compact_origin origin;
+            memcpy(&origin, buffer.data(), sizeof(origin));
+            unpack_compact_points(reinterpret_cast<const compact_point*>(buffer.data() + sizeof(origin)), count, origin, cloud);
+        }
+        else
+        {
+            unpack_cloud_points(reinterpret_cast<const cloud_point*>(buffer.data()), count, cloud);
+        }
+        cloud.header.stamp = static_cast<uint64_t>(_index[index].timestamp_ns / 1000);
+        return true;
+    }
+
+private:
+    /// \brief Location of a frame in the file.
+    struct frame_entry
+    {
+        uint64_t offset;
+        int64_t timestamp_ns;
+        uint32_t points;
+    };
+
+    size_t record_bytes(uint32_t points) const;
+
+    int _fd;
+    uint32_t _format;
+    std::vector<frame_entry> _index;
+};
+
+/// \brief True if a file starts with the sequence magic.
+/// \param filename Path of the file.
+/// \return False for other files, like PCD, and files that cannot be read.
+bool is_cloud_sequence(const std::string& filename);
+
+/// \brief Reads the frames following the played one on a background thread, so playback only
+/// waits for the disk when it jumps.
+class cloud_prefetcher
+{
+public:
+    using cloud_ptr = pcl::PointCloud<pcl::PointXYZRGB>::Ptr;
+
+    cloud_prefetcher(const cloud_sequence& sequence, size_t depth = CLOUD_PREFETCH_FRAMES);
+    ~cloud_prefetcher();
+    bool get(uint64_t index, bool wait, cloud_ptr& cloud, uint64_t& loaded);
+
+private:
+    /// \brief Frame read ahead, a null cloud if reading it failed.
+    struct entry
+    {
+        uint64_t index;
+        cloud_ptr cloud;
+    };
+
+    void run();
+
+    const cloud_sequence& _sequence;
+    size_t _depth;
+    std::mutex _mutex;
+    std::condition_variable _cv;
+    std::deque<entry> _cache;   // Consecutive frames ending before _next
+    uint64_t _next;             // Next frame the thread reads
+    uint64_t _generation;       // Changed when playback jumps, a read in flight is discarded
+    bool _stop;
+    std::thread _thread;
+};
+
+/// \brief Records clouds on a background thread, so writing a sequence never blocks the
+/// render loop. write() only queues a reference to the cloud, the caller must not modify the
+/// cloud afterwards.
+/// \tparam PointT pcl::PointXYZRGB or pcl::PointXYZRGBL.
+template <class PointT>
+class sequence_writer
+{
+public:
+    using cloud_ptr = typename pcl::PointCloud<PointT>::ConstPtr;
+
+    sequence_writer() : _writer(CLOUD_SEQUENCE_QUEUE) {}
+
+    /// \brief Closes the sequence after writing the queued clouds.
+    ~sequence_writer()
+    {
+        stop();
+    }
+
+    /// \brief Creates the sequence and starts the writer thread.
+    /// \param filename Path of the sequence, an existing file is overwritten.
+    /// \return False if the file could not be created.
+    bool start(const std::string& filename)
+    {
+        stop();
+        if (!_recorder.open(filename))
+        {
+            return false;
+        }
+        _filename = filename;
+        // The recorder closes itself when a write fails, the remaining clouds are discarded
+        _writer.start([this](cloud_ptr& cloud) { return _recorder.write(*cloud); }, true);
+        std::cout << "Recording pointclouds to " << filename << std::endl;
+        return true;
+    }
+
+    /// \brief Writes the queued clouds and closes the sequence.
+    /// \return None.
+    void stop()
+    {
+        if (!_writer.running())
+        {
+            return;
+        }
+        _writer.stop();
+        _recorder.close();
+        std::cout << "Recorded " << _recorder.frames() << " pointclouds to " << _filename;
+        if (_writer.dropped())
+        {
+            std::cout << ", " << _writer.dropped() << " dropped while the disk was busy";
+        }
+        std::cout << std::endl;
+    }
+
+    /// \brief True between start() and stop().
+    bool recording()
+    {
+        return _writer.running();
+    }
+
+    /// \brief Queues a cloud, never waits for the disk.
+    /// \param cloud Snapshot of the cloud, its stamp in microseconds is the frame time.
+    /// \return False if not recording, writing failed or the cloud was dropped because the queue is full.
+    bool write(cloud_ptr cloud)
+    {
+        return _writer.push(std::move(cloud));
+    }
+
+private:
+    cloud_recorder _recorder;
+    std::string _filename;
+    // Last member, its thread is stopped before the recorder is destroyed
+    background_writer<cloud_ptr> _writer;
+};
+
+#endif
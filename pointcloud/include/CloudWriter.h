@@ -0,0 +1,155 @@
+#ifndef CLOUDWRITER_H
+#define CLOUDWRITER_H
+
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <utility>
+#include <pcl/point_types.h>
+#include <pcl/point_cloud.h>
+#include <pcl/io/pcd_io.h>
+#include <BackgroundWriter.h>
+
+/// \file CloudWriter.h
+/// \brief PCD writing on a background thread, so saving a cloud never blocks the render loop.
+
+#define CLOUD_WRITER_QUEUE 4 // Saves waiting for the disk before new ones are refused
+
+/// \brief Encoding of a written PCD file.
+enum pcd_format
+{
+    PCD_ASCII,
+    PCD_BINARY,             // Raw points, fastest to write and to load
+    PCD_BINARY_COMPRESSED   // LZF compressed binary
+};
+
+/// \brief Parses a PCD format name.
+/// \param name ascii, binary or compressed.
+/// \param format The format.
+/// \return True if the name is known.
+inline bool parse_pcd_format(const char* name, pcd_format& format)
+{
+    if (strcmp(name, "ascii") == 0)
+    {
+        format = PCD_ASCII;
+    }
+    else if (strcmp(name, "binary") == 0)
+    {
+        format = PCD_BINARY;
+    }
+    else if (strcmp(name, "compressed") == 0)
+    {
+        format = PCD_BINARY_COMPRESSED;
+    }
+    else
+    {
+        return false;
+    }
+    return true;
+}
+
+/// \brief Writes a cloud as a PCD file.
+/// \tparam PointT PCL point type with x, y and z.
+/// \param file Path of the file.
+/// \param cloud Cloud to write.
+/// \param format Encoding of the file.
+/// \param skipInvalid Only write points with a positive, finite depth. The cloud is no longer organized.
+/// \return True if the file was written, false also for a cloud without points.
+template <class PointT>
+bool write_pcd(const std::string& file, const pcl::PointCloud<PointT>& cloud, pcd_format format, bool skipInvalid)
+{
+    pcl::PointCloud<PointT> valid;
+    const pcl::PointCloud<PointT>* out = &cloud;
+    if (skipInvalid && !cloud.is_dense)
+    {
+        valid.header = cloud.header;
+        valid.points.reserve(cloud.points.size());
+        for (const auto& p : cloud.points)
+        {
+            if (p.z > 0 && std::isfinite(p.x) && std::isfinite(p.y) && std::isfinite(p.z))
+            {
+                valid.points.push_back(p);
+            }
+        }
+        valid.width = static_cast<uint32_t>(valid.points.size());
+        valid.height = 1;
+        valid.is_dense = true;
+        out = &valid;
+    }
+    // PCL throws instead of writing an empty cloud
+    if (out->points.empty())
+    {
+        return false;
+    }
+    int result;
+    switch (format)
+    {
+    case PCD_ASCII: result = pcl::io::savePCDFileASCII(file, *out); break;
+    case PCD_BINARY_COMPRESSED: result = pcl::io::savePCDFileBinaryCompressed(file, *out); break;
+    default: result = pcl::io::savePCDFileBinary(file, *out); break;
+    }
+    return result >= 0;
+}
+
+/// \brief Background PCD writer. save() only queues a reference to the cloud, the caller must
+/// not modify the cloud afterwards (hand over a cloud that is replaced, not updated in place).
+/// \tparam PointT PCL point type with x, y and z.
+template <class PointT>
+class cloud_writer
+{
+public:
+    using cloud_ptr = typename pcl::PointCloud<PointT>::ConstPtr;
+
+    /// \brief Starts the writer thread.
+    /// \param format Encoding of the written files.
+    /// \param skipInvalid Drop points without depth when writing.
+    cloud_writer(pcd_format format, bool skipInvalid)
+        : _format(format), _skipInvalid(skipInvalid), _writer(CLOUD_WRITER_QUEUE)
+    {
+        _writer.start([this](job& j) { return write(j); });
+    }
+
+    /// \brief Queues a cloud for writing, never waits for the disk.
+    /// \param file Path of the file.
+    /// \param cloud Snapshot of the cloud, shared until it is written.
+    /// \return False if too many saves are already waiting.
+    bool save(const std::string& file, cloud_ptr cloud)
+    {
+        return _writer.push(job(file, std::move(cloud)));
+    }
+
+    /// \brief Saves queued or being written.
+    size_t pending()
+    {
+        return _writer.pending();
+    }
+
+private:
+    using job = std::pair<std::string, cloud_ptr>;
+
+    bool write(const job& j)
+    {
+        try
+        {
+            if (write_pcd(j.first, *j.second, _format, _skipInvalid))
+            {
+                std::cout << "Saved pointcloud " << j.first << std::endl;
+                return true;
+            }
+            std::cerr << "Failed to save " << j.first << std::endl;
+        }
+        catch (const std::exception& e)
+        {
+            std::cerr << "Failed to save " << j.first << ": " << e.what() << std::endl;
+        }
+        return false;
+    }
+
+    pcd_format _format;
+    bool _skipInvalid;
+    // Last member, its thread is stopped before the members it uses are destroyed
+    background_writer<job> _writer;
+};
+
+#endif
@@ -0,0 +1,196 @@
+#ifndef COMPACTCLOUD_H
+#define COMPACTCLOUD_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <pcl/point_types.h>
+#include <pcl/point_cloud.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/// \file CompactCloud.h
+/// \brief Quantized 8 byte points for storing and moving clouds: millimeter positions relative
+/// to an origin per cloud and the colormapped thermal color as RGB565.
+///
+/// A pcl::PointXYZRGB takes 32 bytes with its padding, a compact point 8. Positions cover
+/// +-32.767 m around the origin, which is the center of the bounding box of the cloud. The
+/// clouds carry the palette color of the thermal pixel, not the temperature, and 5-6-5 bits
+/// are enough to tell the 256 palette entries of a colormap apart on screen.
+
+#define COMPACT_SCALE 1000.0f     // Units per meter
+#define COMPACT_RANGE 32767.0f    // Largest distance from the origin in units
+
+/// \brief Stored point, 8 bytes.
+struct compact_point
+{
+    int16_t x, y, z;  // Millimeters from the origin
+    uint16_t color;   // RGB565
+};
+
+/// \brief Position all points of a cloud are stored relative to, 16 bytes.
+struct compact_origin
+{
+    float x, y, z;
+    uint32_t reserved;
+};
+
+static_assert(sizeof(compact_point) == 8, "Compact point size changed");
+static_assert(sizeof(compact_origin) == 16, "Compact origin size changed");
+
+/// \brief Converts 8-bit rgb to RGB565.
+inline uint16_t pack_rgb565(uint8_t r, uint8_t g, uint8_t b)
+{
+    return static_cast<uint16_t>(((r >> 3) << 11) | ((g >> 2) << 5) | (b >> 3));
+}
+
+/// \brief Converts RGB565 to 8-bit rgb, the high bits are repeated in the low ones so white stays white.
+inline void unpack_rgb565(uint16_t color, uint8_t& r, uint8_t& g, uint8_t& b)
+{
+    uint8_t r5 = color >> 11, g6 = (color >> 5) & 0x3F, b5 = color & 0x1F;
+    r = static_cast<uint8_t>((r5 << 3) | (r5 >> 2));
+    g = static_cast<uint8_t>((g6 << 2) | (g6 >> 4));
+    b = static_cast<uint8_t>((b5 << 3) | (b5 >> 2));
+}
+
+/// \brief True for a point that is stored: finite, and in a cloud that is not dense also in front
+/// of the camera, organized clouds mark points without depth with z = 0.
+template <class PointT>
+inline bool stored_point_valid(const PointT& p, bool dense)
+{
+    return std::isfinite(p.x) && std::isfinite(p.y) && std::isfinite(p.z) && (dense || p.z > 0);
+}
+
+/// \brief Center of the bounding box of the stored points, rounded to the unit.
+/// \tparam PointT pcl::PointXYZRGB or pcl::PointXYZRGBL.
+/// \param cloud The cloud.
+/// \return The origin, zero for a cloud without valid points.
+template <class PointT>
+compact_origin compact_cloud_origin(const pcl::PointCloud<PointT>& cloud)
+{
+    float lo[3] = {INFINITY, INFINITY, INFINITY};
+    float hi[3] = {-INFINITY, -INFINITY, -INFINITY};
+    for (const auto& p : cloud.points)
+    {
+        if (stored_point_valid(p, cloud.is_dense))
+        {
+            lo[0] = std::min(lo[0], p.x); hi[0] = std::max(hi[0], p.x);
+            lo[1] = std::min(lo[1], p.y); hi[1] = std::max(hi[1], p.y);
+            lo[2] = std::min(lo[2], p.z); hi[2] = std::max(hi[2], p.z);
+        }
+    }
+    compact_origin origin = {0.0f, 0.0f, 0.0f, 0};
+    if (lo[0] <= hi[0])
+    {
+        origin.x = std::round((lo[0] + hi[0]) * 0.5f * COMPACT_SCALE) / COMPACT_SCALE;
+        origin.y = std::round((lo[1] + hi[1]) * 0.5f * COMPACT_SCALE) / COMPACT_SCALE;
+        origin.z = std::round((lo[2] + hi[2]) * 0.5f * COMPACT_SCALE) / COMPACT_SCALE;
+    }
+    return origin;
+}
+
+/// \brief Quantizes the valid points of a cloud. Points further than COMPACT_RANGE from the
+/// origin, only possible in a cloud spanning more than 65 m, are dropped.
+/// \tparam PointT pcl::PointXYZRGB or pcl::PointXYZRGBL, x, y and z are the first floats of the
+/// 16 byte aligned point.
+/// \param cloud Cloud to store.
+/// \param origin Origin of the stored positions, see compact_cloud_origin.
+/// \param points Stored points, replaced.
+/// \return None.
+template <class PointT>
+void pack_compact_points(const pcl::PointCloud<PointT>& cloud, const compact_origin& origin, std::vector<compact_point>& points)
+{
+    // One spare point for the 8 byte store of the last one
+    points.resize(cloud.points.size() + 1);
+    compact_point* out = points.data();
+    size_t n = 0;
+    bool dense = cloud.is_dense;
+#if defined(__SSE2__)
+    const __m128 offset = _mm_setr_ps(origin.x, origin.y, origin.z, 0.0f);
+    const __m128 scale = _mm_set1_ps(COMPACT_SCALE);
+    const __m128 range = _mm_set1_ps(COMPACT_RANGE);
+    const __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF));
+    // The fourth float is padding, which may hold a denormal that would slow the arithmetic down
+    const __m128 xyzMask = _mm_castsi128_ps(_mm_setr_epi32(-1, -1, -1, 0));
+    for (const auto& p : cloud.points)
+    {
+        __m128 v = _mm_mul_ps(_mm_sub_ps(_mm_and_ps(_mm_loadu_ps(&p.x), xyzMask), offset), scale);
+        // NaN and infinity fail the comparison as well
+        int inRange = _mm_movemask_ps(_mm_cmple_ps(_mm_and_ps(v, absMask), range)) & 7;
+        __m128i q = _mm_cvtps_epi32(v);
+        q = _mm_packs_epi32(q, q);
+        q = _mm_insert_epi16(q, pack_rgb565(p.r, p.g, p.b), 3);
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(out + n), q);
+        // Always stored, only kept by advancing past it
+        n += (inRange == 7 && (dense || p.z > 0)) ? 1 : 0;
+    }
+#else
+    for (const auto& p : cloud.points)
+    {
+        float x = (p.x - origin.x) * COMPACT_SCALE;
+        float y = (p.y - origin.y) * COMPACT_SCALE;
+        float z = (p.z - origin.z) * COMPACT_SCALE;
+        if (stored_point_valid(p, dense) && std::fabs(x) <= COMPACT_RANGE && std::fabs(y) <= COMPACT_RANGE &&
+            std::fabs(z) <= COMPACT_RANGE)
+        {
+            out[n].x = static_cast<int16_t>(std::lrint(x));
+            out[n].y = static_cast<int16_t>(std::lrint(y));
+            out[n].z = static_cast<int16_t>(std::lrint(z));
+            out[n].color = pack_rgb565(p.r, p.g, p.b);
+            n++;
+        }
+    }
+#endif
+    points.resize(n);
+}
+
+inline void set_compact_label(pcl::PointXYZRGB&) {}
+inline void set_compact_label(pcl::PointXYZRGBL& p) { p.label = 0; }
+
+/// \brief Converts quantized points to an unorganized, dense cloud.
+/// \tparam PointT pcl::PointXYZRGB or pcl::PointXYZRGBL, the label is not stored and set to 0.
+/// \param points Stored points.
+/// \param count Number of points.
+/// \param origin Origin of the stored positions.
+/// \param cloud Cloud to fill, its points are replaced.
+/// \return None.
+template <class PointT>
+void unpack_compact_points(const compact_point* points, size_t count, const compact_origin& origin, pcl::PointCloud<PointT>& cloud)
+{
+    cloud.points.resize(count);
+#if defined(__SSE2__)
+    const __m128 offset = _mm_setr_ps(origin.x, origin.y, origin.z, 1.0f);
+    const __m128 scale = _mm_setr_ps(1.0f / COMPACT_SCALE, 1.0f / COMPACT_SCALE, 1.0f / COMPACT_SCALE, 0.0f);
+    for (size_t i = 0; i < count; i++)
+    {
+        // Sign extends x, y, z and color to 32 bits, the color lane is zeroed by the scale
+        __m128i q = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(points + i));
+        q = _mm_srai_epi32(_mm_unpacklo_epi16(q, q), 16);
+        __m128 v = _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(q), scale), offset);
+        PointT& p = cloud.points[i];
+        _mm_storeu_ps(&p.x, v);
+        unpack_rgb565(points[i].color, p.r, p.g, p.b);
+        p.a = 255;
+        set_compact_label(p);
+    }
+#else
+    for (size_t i = 0; i < count; i++)
+    {
+        PointT& p = cloud.points[i];
+        p.x = points[i].x / COMPACT_SCALE + origin.x;
+        p.y = points[i].y / COMPACT_SCALE + origin.y;
+        p.z = points[i].z / COMPACT_SCALE + origin.z;
+        unpack_rgb565(points[i].color, p.r, p.g, p.b);
+        p.a = 255;
+        set_compact_label(p);
+    }
+#endif
+    cloud.width = static_cast<uint32_t>(count);
+    cloud.height = 1;
+    cloud.is_dense = true;
+}
+
+#endif
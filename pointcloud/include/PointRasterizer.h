@@ -0,0 +1,93 @@
+#ifndef POINTRASTERIZER_H
+#define POINTRASTERIZER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <Eigen/Core>
+#include <pcl/point_types.h>
+#include <pcl/point_cloud.h>
+#include <opencv2/core.hpp>
+#include <WorkerPool.h>
+
+/// \file PointRasterizer.h
+/// \brief Renders point clouds to images on the CPU, for snapshots on machines without a GPU.
+/// Points are drawn as square splats with a depth test, seen through the same camera as the
+/// point cloud window, so a snapshot looks like the window would.
+///
+/// Rendering runs on all cores in three passes: the points are projected and counted per
+/// screen tile, the projected points are sorted into the tiles, and every tile is rasterized
+/// by one thread, so the depth and color buffers are written without locks. The passes run on a
+/// worker pool whose threads are started once with the renderer.
+
+#define RASTER_TILE_BITS 6
+#define RASTER_TILE (1 << RASTER_TILE_BITS) // Tile edge in pixels
+#define RASTER_FOV_Y 60.0f        // Vertical field of view in degrees, as in draw_pointcloud
+#define RASTER_NEAR 0.01f
+#define RASTER_FAR 10.0f
+#define RASTER_MAX_Z 2.0f         // Points further from their camera are not drawn
+#define RASTER_BACKGROUND 153     // Gray of the window background
+
+/// \brief View transform of the point cloud window: the camera looks along z with y down and
+/// the cloud is rotated about a point 0.5 m in front of it.
+/// \param yaw Rotation about y in degrees, from dragging sideways.
+/// \param pitch Rotation about x in degrees, from dragging up and down.
+/// \param offsetY Scroll steps, 0.05 m towards the cloud each.
+/// \return Model view matrix.
+Eigen::Matrix4f raster_view_matrix(double yaw, double pitch, float offsetY);
+
+/// \brief Multithreaded point splatting renderer.
+class point_rasterizer
+{
+public:
+    explicit point_rasterizer(unsigned int threads = 0);
+
+    /// \brief Renders a cloud. Points with z == 0 or z >= maxZ in the cloud are skipped like in
+    /// the window, the splat size follows the window as well, width / 640 pixels up to a tile.
+    /// \tparam PointT pcl::PointXYZRGB or pcl::PointXYZRGBL.
+    /// \param cloud Cloud to draw.
+    /// \param view Model view matrix, see raster_view_matrix.
+    /// \param width Image width.
+    /// \param height Image height.
+    /// \param image BGR image, reallocated if its size differs.
+    /// \param maxZ Far limit of the drawn points.
+    /// \return None.
+    template <class PointT>
+    void render(const pcl::PointCloud<PointT>& cloud, const Eigen::Matrix4f& view, int width, int height,
+                cv::Mat& image, float maxZ = RASTER_MAX_Z)
+    {
+        if (cloud.points.empty())
+        {
+            render_points(nullptr, 0, sizeof(PointT), 0, view, width, height, image, maxZ);
+            return;
+        }
+        // x, y and z lead every PCL point, b, g and r follow each other
+        const PointT& first = cloud.points[0];
+        size_t color = reinterpret_cast<const char*>(&first.b) - reinterpret_cast<const char*>(&first);
+        render_points(&first, cloud.points.size(), sizeof(PointT), color, view, width, height, image, maxZ);
+    }
+
+private:
+    /// \brief Projected point, 12 bytes.
+    struct splat
+    {
+        int16_t x, y;      // Top left pixel of the splat
+        float depth;       // Distance along the view direction, 0 for a point that is not drawn
+        uint32_t color;    // b, g and r from the low byte up
+    };
+
+    void render_points(const void* points, size_t count, size_t stride, size_t color, const Eigen::Matrix4f& view,
+                       int width, int height, cv::Mat& image, float maxZ);
+    template <class F>
+    void parallel(F f);
+
+    worker_pool _pool;
+    unsigned int _threads;
+    std::vector<splat> _splats;
+    std::vector<uint32_t> _counts;     // Per thread and tile
+    std::vector<uint32_t> _offsets;    // Per thread and tile, next binned index
+    std::vector<uint32_t> _starts;     // First binned index of each tile
+    std::vector<splat> _binned;        // Splats sorted by tile
+};
+
+#endif
@@ -0,0 +1,154 @@
+#ifndef POINTRENDERER_H
+#define POINTRENDERER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+#include <pcl/point_types.h>
+#include <pcl/point_cloud.h>
+#include <CloudOctree.h>
+
+/// \file PointRenderer.h
+/// \brief Draws point clouds from vertex buffers. A cloud is filtered and uploaded once when it
+/// is new and then drawn with a single call per frame, instead of one glColor and one glVertex
+/// call per point.
+
+#define POINT_RENDER_MAX_Z 2.0f // Points further away are not drawn
+#define LOD_POINT_BUDGET 5000000     // Octree points drawn per frame
+#define LOD_UPLOAD_POINTS 1000000    // Octree points uploaded per frame, more wait for the next
+#define LOD_RESIDENT_FACTOR 4        // Octree points kept on the GPU, times the budget
+
+/// \brief Vertex buffers of the drawn clouds, one per layer. Needs the GL context that draws
+/// them to be current in every call, including the destructor.
+class point_renderer
+{
+public:
+    point_renderer();
+    ~point_renderer();
+    point_renderer(const point_renderer&) = delete;
+    point_renderer& operator=(const point_renderer&) = delete;
+
+    /// \brief Draws clouds with the current transforms. A cloud that was not drawn before, is
+    /// uploaded; only points with z != 0 and z < maxZ are uploaded.
+    /// \tparam PointT pcl::PointXYZRGB or pcl::PointXYZRGBL.
+    /// \param clouds Layers to draw. The renderer keeps a reference to each, so a layer is
+    /// recognized as unchanged as long as the same cloud is passed, clouds must be replaced
+    /// instead of modified in place.
+    /// \param maxZ Far limit of the drawn points.
+    /// \return None.
+    template <class PointT>
+    void draw(const std::vector<std::shared_ptr<pcl::PointCloud<PointT>>>& clouds, float maxZ = POINT_RENDER_MAX_Z)
+    {
+        resize(clouds.size());
+        for (size_t i = 0; i < clouds.size(); i++)
+        {
+            layer& l = _layers[i];
+            if (l.source != clouds[i] || l.max_z != maxZ)
+            {
+                l.source = clouds[i];
+                l.max_z = maxZ;
+                upload(i, *clouds[i], maxZ);
+            }
+        }
+        draw_layers();
+    }
+
+    /// \brief Points drawn by the last draw().
+    size_t points() const;
+
+private:
+    /// \brief Interleaved vertex, 16 bytes.
+    struct vertex
+    {
+        float x, y, z;
+        uint8_t r, g, b, a;
+    };
+
+    /// \brief Buffer of one layer and the cloud it holds.
+    struct layer
+    {
+        unsigned int buffer;
+        size_t count;
+        float max_z;
+        std::shared_ptr<const void> source;
+    };
+
+    template <class PointT>
+    void upload(size_t index, const pcl::PointCloud<PointT>& cloud, float maxZ)
+    {
+        vertex* v = map(index, cloud.points.size());
+        size_t n = 0;
+        for (const auto& p : cloud.points)
+        {
+            // Also drops NaN coordinates
+            if (p.z != 0 && p.z < maxZ)
+            {
+                v[n].x = p.x;
+                v[n].y = p.y;
+                v[n].z = p.z;
+                v[n].r = p.r;
+                v[n].g = p.g;
+                v[n].b = p.b;
+                v[n].a = 255;
+                n++;
+            }
+        }
+        unmap(index, n);
+    }
+
+    void resize(size_t layers);
+    vertex* map(size_t index, size_t capacity);
+    void unmap(size_t index, size_t count);
+    void draw_layers();
+
+    std::vector<layer> _layers;
+    std::vector<vertex> _staging; // Used when the driver cannot map a buffer
+    bool _staged;
+};
+
+/// \brief Draws a level of detail octree within a point budget. Nodes outside the view are
+/// skipped, the others are drawn from large on screen to small until the budget is spent, and
+/// nodes whose sample spacing is below a pixel are not refined. Node buffers stay on the GPU
+/// until they have not been drawn for a while and the resident points exceed their limit.
+/// Needs the GL context that draws the tree to be current in every call, including the
+/// destructor.
+class octree_renderer
+{
+public:
+    octree_renderer();
+    ~octree_renderer();
+    octree_renderer(const octree_renderer&) = delete;
+    octree_renderer& operator=(const octree_renderer&) = delete;
+
+    void draw(const cloud_octree& tree, size_t budget = LOD_POINT_BUDGET);
+    void clear();
+
+    /// \brief Points drawn by the last draw().
+    size_t points() const { return _drawn; }
+
+    /// \brief False if the last draw() left nodes out that were not uploaded yet, drawing
+    /// again refines the view.
+    bool complete() const { return _complete; }
+
+private:
+    /// \brief Buffer of a node on the GPU.
+    struct resident
+    {
+        unsigned int buffer;
+        uint32_t count;
+        uint64_t frame;    // Last frame the node was drawn in
+    };
+
+    void evict(size_t limit);
+
+    std::unordered_map<uint32_t, resident> _resident;
+    std::vector<uint32_t> _selected;
+    size_t _residentPoints;
+    size_t _drawn;
+    uint64_t _frame;
+    bool _complete;
+};
+
+#endif
@@ -0,0 +1,35 @@
+#ifndef THERMALCLOUD_H
+#define THERMALCLOUD_H
+
+#include <cstdint>
+#include <string>
+#include <librealsense2/rs.hpp>
+#include <pcl/point_types.h>
+#include <pcl/point_cloud.h>
+#include <opencv2/opencv.hpp>
+#include <ThermalCalibration.h>
+#include <ThermalProjection.h>
+
+/// \file ThermalCloud.h
+/// \brief Colorizing of raw thermal frames and their projection onto RealSense depth points.
+
+using pcl_ptr = pcl::PointCloud<pcl::PointXYZRGB>::Ptr;
+
+/// \brief Processes decoded thermal data to thermal image.
+/// \param raw Raw 14-bit temperature values, see lepton_decoder.
+/// \param gray Thermal image that is generated.
+/// \param color Colorized thermal image that is generated.
+/// \param rangeMin Minimum temperature to be scaled between 0 and 255.
+/// \param rangeMax Maximum temperature to be scaled between 0 and 255.
+/// \return None.
+void process_thermaldata(const cv::Mat& raw, cv::Mat& gray, cv::Mat& color, uint16_t& rangeMin,  uint16_t& rangeMax);
+
+/// \brief Converts depth points to pointcloud with rgb values based on thermal colormap.
+/// \param points Depth points from the realsense depth frame, aligned to the color stream.
+/// \param projection Projection, project() has been called with the same depth frame. It gives
+/// the thermal pixel of every point, so the image is not undistorted here.
+/// \param thermalimage Colorized thermal image after thermal_projection::undistort.
+/// \return PCL XZYRGB pointcloud.
+pcl_ptr points_to_pcl(const rs2::points& points, const thermal_projection& projection, const cv::Mat& thermalimage);
+
+#endif
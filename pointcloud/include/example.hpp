@@ -458,8 +458,40 @@ public:
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP);
         glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
         glBindTexture(GL_TEXTURE_2D, 0);
+        _width = width;
+        _height = height;
     }
 
+    // Uploads a packed 8-bit image, e.g. a BGR cv::Mat. While the size stays the same the
+    // texture storage is reused and only its contents are replaced.
+    void upload(const void* data, int width, int height, GLenum format)
+    {
+        if (!_gl_handle)
+            glGenTextures(1, &_gl_handle);
+
+        glBindTexture(GL_TEXTURE_2D, _gl_handle);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        if (width == _width && height == _height)
+        {
+            glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, format, GL_UNSIGNED_BYTE, data);
+        }
+        else
+        {
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, format, GL_UNSIGNED_BYTE, data);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP);
+            _width = width;
+            _height = height;
+        }
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+        glBindTexture(GL_TEXTURE_2D, 0);
+    }
+
+    int width() const { return _width; }
+    int height() const { return _height; }
+
     void show(const rect& r, float alpha = 1.f) const
     {
         if (!_gl_handle)
@@ -504,6 +536,8 @@ public:
 
 private:
     GLuint          _gl_handle = 0;
+    int             _width = 0;
+    int             _height = 0;
     rs2_stream      _stream_type = RS2_STREAM_ANY;
     int             _stream_index{};
     imu_renderer    _imu_render;
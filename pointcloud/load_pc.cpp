@@ -1,5 +1,6 @@
 #include <librealsense2/rs.hpp> // Include RealSense Cross Platform API
 #include "example.hpp" // Include short list of convenience functions for rendering
+#include <PointRenderer.h>
 
 #include <pcl/point_types.h>
 #include <pcl/filters/passthrough.h>
@@ -7,49 +8,309 @@
 #include <opencv2/opencv.hpp>
 #include <opencv2/calib3d.hpp>
 #include <iostream>
+#include <chrono>
 #include <ctime>
 #include <cstdint>
+#include <cstdlib>
 #include <cstring>
+#include <memory>
+#include <string>
 #include <arpa/inet.h>
+#include <libgen.h>
+#include <unistd.h>
+#include <CloudSequence.h>
+#include <CloudLoader.h>
+#include <CloudOctree.h>
+#include <thread>
+
+#define SEEK_STEP_S 10.0
+#define GIB (1024.0 * 1024.0 * 1024.0)
+#define ACTIVE_POLL_S 0.005 // Wait between checks for loaded blocks and due frames
 
 /// \file load_pc.cpp
-/// \brief Program that loads a saved point cloud in the form of thermal.pcd and renders it.
+/// \brief Program that loads a saved point cloud, thermal.pcd by default, or plays a recorded
+/// pointcloud sequence and renders it.
 
 /// \brief 3D position state for displaying pointcloud
 struct state
 {
     state() : yaw(0.0), pitch(0.0), last_x(0.0), last_y(0.0),
-        ml(false), offset_x(0.0f), offset_y(0.0f) {}
+        ml(false), offset_x(0.0f), offset_y(0.0f), dirty(true), far_z(10.0f), zoom_step(0.05f),
+        tree(nullptr), budget(LOD_POINT_BUDGET) {}
     double yaw, pitch, last_x, last_y;
     bool ml;
     float offset_x, offset_y;
+    bool dirty;              // The view changed since it was last drawn
+    float far_z;             // Far plane, meters
+    float zoom_step;         // Meters per scroll step
+    point_renderer renderer;
+    const cloud_octree* tree; // Drawn instead of the clouds if set
+    size_t budget;           // Most octree points per frame
+    octree_renderer lod;
+};
+
+/// \brief Playback position in a pointcloud sequence, changed by the keys.
+struct playback
+{
+    playback(const cloud_sequence& sequence, double rate, bool loop)
+        : sequence(sequence), rate(rate), loop(loop), playing(false), position(0), start_ns(0) {}
+    uint64_t due();
+    void key(int key);
+    void seek_frame(uint64_t frame);
+    void print() const;
+
+    const cloud_sequence& sequence;
+    double rate;             // Playback speed, 1 is real time
+    bool loop;
+    bool playing;
+    uint64_t position;       // Frame shown
+    int64_t start_ns;        // Sequence time when playing started
+    std::chrono::steady_clock::time_point started;
 };
 
 using pcl_ptr = pcl::PointCloud<pcl::PointXYZRGB>::Ptr;
 
+/// \brief Set by GLFW when the window was exposed or resized and its contents have to be drawn
+/// again. The callbacks cannot take a state, the user pointer of the window is the window.
+static bool window_damaged = false;
+
+uint64_t physical_memory();
+bool open_octree(cloud_octree& tree, const std::string& file, uint64_t memoryLimit);
 void register_glfw_callbacks(window& app, state& app_state);
 void draw_pointcloud(window& app, state& app_state, const std::vector<pcl_ptr>& points);
 
-/// \brief Loads and renders a point cloud file 'thermal.pcd'.
-/// \param argc Number of command-line arguments. No arguments.
-/// \param argv Array of command-line arguments. No arguments.
+/// \brief Function to describe how to use the command line arguments
+/// \param cmd Argument of the command line, here it is the program
+void printUsage(char *cmd)
+{
+	char *cmdname = basename(cmd);
+	printf(" Usage: %s [OPTION]... [FILE]\n"
+		   " -h			display this help and exit.\n"
+		   " -rate x		playback speed of a sequence, 1 is real time (default: 1).\n"
+		   " -loop		restart a sequence when it ends.\n"
+		   " -lod		draw a PCD file through a level of detail octree, cached in FILE.lod\n"
+		   "			and built on first use.\n"
+		   " -budget x		most points drawn per frame with -lod (default: 5000000).\n"
+		   " -lodmem x		GiB the octree build may use (default: installed memory). The\n"
+		   "			build holds all points, 36 bytes each, and refuses a cloud that\n"
+		   "			does not fit.\n"
+		   " FILE			PCD file or pointcloud sequence recorded with thermalPC -record\n"
+		   "			(default: thermal.pcd).\n"
+		   " Keys:		space resets the view. For a sequence p plays and pauses,\n"
+		   "			left and right step a frame, up and down seek 10 s,\n"
+		   "			home and end go to the first and last frame.\n"
+		   "", cmdname);
+	return;
+}
+
+/// \brief Loads and renders a point cloud file or plays a pointcloud sequence.
+/// \param argc Number of command-line arguments.
+/// \param argv Array of command-line arguments.
+/// \param rate Playback speed of a sequence.
+/// \param loop Restart a sequence at its end.
+/// \param lod Draw through a level of detail octree.
+/// \param budget Most octree points drawn per frame.
+/// \param memoryLimit Most bytes the octree build may use.
 /// \return 0 if successful, -1 if failure.
 int main(int argc, char * argv[])
 try
 {
+	std::string file = "thermal.pcd";
+	double rate = 1.0;
+	bool loop = false;
+	bool lod = false;
+	size_t budget = LOD_POINT_BUDGET;
+	uint64_t memoryLimit = physical_memory();
+
+	for(int i=1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "-h") == 0)
+		{
+			printUsage(argv[0]);
+			exit(0);
+		}
+		else if (strcmp(argv[i], "-rate") == 0)
+		{
+			if (i + 1 != argc && (rate = std::strtod(argv[i + 1], nullptr)) > 0.0)
+			{
+				i++;
+			}
+			else
+			{
+				std::cerr << "Error: Enter a playback rate above 0." << std::endl;
+				exit(1);
+			}
+		}
+		else if (strcmp(argv[i], "-loop") == 0)
+		{
+			loop = true;
+		}
+		else if (strcmp(argv[i], "-lod") == 0)
+		{
+			lod = true;
+		}
+		else if (strcmp(argv[i], "-budget") == 0)
+		{
+			if (i + 1 != argc && (budget = std::strtoull(argv[i + 1], nullptr, 10)) > 0)
+			{
+				i++;
+			}
+			else
+			{
+				std::cerr << "Error: Enter a point budget above 0." << std::endl;
+				exit(1);
+			}
+		}
+		else if (strcmp(argv[i], "-lodmem") == 0)
+		{
+			double gib;
+			if (i + 1 != argc && (gib = std::strtod(argv[i + 1], nullptr)) > 0.0)
+			{
+				memoryLimit = static_cast<uint64_t>(gib * GIB);
+				i++;
+			}
+			else
+			{
+				std::cerr << "Error: Enter a build memory above 0 GiB." << std::endl;
+				exit(1);
+			}
+		}
+		else if (argv[i][0] != '-')
+		{
+			file = argv[i];
+		}
+		else
+		{
+			printUsage(argv[0]);
+			exit(1);
+		}
+	}
+
+    // The octree is built before the window opens, a window would not respond meanwhile
+    cloud_octree tree;
+    bool sequenceFile = is_cloud_sequence(file);
+    if (lod && sequenceFile)
+    {
+        std::cerr << "Error: -lod needs a PCD file." << std::endl;
+        exit(1);
+    }
+    if (lod && !open_octree(tree, file, memoryLimit))
+    {
+        return -1;
+    }
+
     window app(1280, 720, "RealSense PCL Pointcloud Example");
     state app_state;
     register_glfw_callbacks(app, app_state);
+    if (lod)
+    {
+        // The view reaches the far corner of the tree and zooms in steps that suit its size
+        const lod_node& root = tree.node(0);
+        float distance = std::sqrt(root.center[0] * root.center[0] + root.center[1] * root.center[1] +
+                                   root.center[2] * root.center[2]) + root.half * 1.7321f;
+        app_state.far_z = std::max(app_state.far_z, distance * 2.0f);
+        app_state.zoom_step = std::max(app_state.zoom_step, root.half * 0.02f);
+        app_state.tree = &tree;
+        app_state.budget = budget;
+    }
 
     pcl_ptr cloud(new pcl::PointCloud<pcl::PointXYZRGB>);
-    
-    pcl::io::loadPCDFile ("thermal.pcd", *cloud);
     std::vector<pcl_ptr> layers;
     layers.push_back(cloud);
 
+    // A PCD file is rendered block by block while it loads
+    cloud_loader loader;
+    bool loading = false;
+    auto loadStart = std::chrono::steady_clock::now();
+    cloud_sequence sequence;
+    std::unique_ptr<playback> player;
+    std::unique_ptr<cloud_prefetcher> prefetcher;
+    if (sequenceFile)
+    {
+        if (!sequence.open(file))
+        {
+            return -1;
+        }
+        if (sequence.frames() == 0)
+        {
+            std::cerr << file << " holds no pointclouds" << std::endl;
+            return -1;
+        }
+        player.reset(new playback(sequence, rate, loop));
+        prefetcher.reset(new cloud_prefetcher(sequence));
+        auto view_keys = app.on_key_release;
+        playback& p = *player;
+        app.on_key_release = [view_keys, &p](int key)
+        {
+            view_keys(key);
+            p.key(key);
+        };
+        player->print();
+    }
+    else if (!lod)
+    {
+        if (!loader.start(file))
+        {
+            return -1;
+        }
+        loading = true;
+    }
+
+    uint64_t shown = sequence.frames();
     while (app)
     {
+        // Nothing is drawn until the view changes, the window is exposed or a new block or frame
+        // arrives, an idle window sleeps in glfwWaitEvents
+        for (;;)
+        {
+            if (loading)
+            {
+                // Blocks published before the last thread finished are all taken
+                bool finished = loader.done();
+                app_state.dirty |= loader.take(layers);
+                if (finished)
+                {
+                    loading = false;
+                    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - loadStart).count();
+                    printf("Loaded %llu points from %s in %.2f s\n", static_cast<unsigned long long>(loader.points()), file.c_str(), elapsed);
+                }
+            }
+            if (player)
+            {
+                // While playing, the newest prefetched frame that is due is shown and late frames
+                // are skipped; when paused the requested frame is waited for
+                uint64_t due = player->due();
+                pcl_ptr next;
+                uint64_t loaded;
+                if (due != shown && prefetcher->get(due, !player->playing, next, loaded) && loaded != shown)
+                {
+                    shown = loaded;
+                    if (next)
+                    {
+                        layers[0] = next;
+                        app_state.dirty = true;
+                    }
+                }
+            }
+            app_state.dirty |= window_damaged;
+            window_damaged = false;
+            if (app_state.dirty || glfwWindowShouldClose(app))
+            {
+                break;
+            }
+            if (loading || (player && player->playing))
+            {
+                glfwWaitEventsTimeout(ACTIVE_POLL_S);
+            }
+            else
+            {
+                glfwWaitEvents();
+            }
+        }
+        app_state.dirty = false;
         draw_pointcloud(app, app_state, layers);
+        // Octree nodes left out for the upload limit are drawn in the next frames
+        app_state.dirty = app_state.tree && !app_state.lod.complete();
     }
     return EXIT_SUCCESS;
 }
@@ -64,12 +325,105 @@ catch (const std::exception & e)
     return EXIT_FAILURE;
 }
 
+/// \brief Opens the octree cache of a PCD file, building it if it is missing or older than the
+/// file.
+/// \param tree The octree.
+/// \param file PCD file.
+/// \param memoryLimit Most bytes the build may use.
+/// \return False if the file cannot be loaded, does not fit in memoryLimit or the cache cannot
+/// be written.
+bool open_octree(cloud_octree& tree, const std::string& file, uint64_t memoryLimit)
+{
+    std::string cache = octree_cache_name(file);
+    if (tree.open(cache, file))
+    {
+        printf("Opened %s, %llu points in %u nodes\n", cache.c_str(), static_cast<unsigned long long>(tree.points()), tree.nodes());
+        return true;
+    }
+    printf("Building %s\n", cache.c_str());
+    auto start = std::chrono::steady_clock::now();
+    cloud_loader loader;
+    if (!loader.start(file))
+    {
+        return false;
+    }
+    // The builder holds every point, a cloud that does not fit is refused before it is allocated
+    uint64_t maxPoints = memoryLimit / LOD_BUILD_POINT_BYTES;
+    if (loader.expected_points() > maxPoints)
+    {
+        std::cerr << "Error: Building the octree of " << loader.expected_points() << " points needs "
+                  << loader.expected_points() * LOD_BUILD_POINT_BYTES / GIB << " GiB, more than the "
+                  << memoryLimit / GIB << " GiB allowed by -lodmem." << std::endl;
+        return false;
+    }
+    // Blocks are released as soon as they are added, the builder keeps a compact copy
+    octree_builder builder;
+    builder.reserve(loader.expected_points());
+    std::vector<pcl_ptr> blocks;
+    for (;;)
+    {
+        bool finished = loader.done();
+        blocks.clear();
+        loader.take(blocks);
+        for (const auto& block : blocks)
+        {
+            builder.add(*block);
+        }
+        // A header that understates the points is caught while they are added
+        if (builder.points() > maxPoints)
+        {
+            std::cerr << "Error: " << file << " has more points than its header announces, they need more than the "
+                      << memoryLimit / GIB << " GiB allowed by -lodmem." << std::endl;
+            return false;
+        }
+        if (finished)
+        {
+            break;
+        }
+        if (blocks.empty())
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+    }
+    blocks.clear();
+    if (!builder.write(cache, file) || !tree.open(cache, file))
+    {
+        return false;
+    }
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    printf("Built %s, %llu points in %u nodes in %.2f s\n", cache.c_str(), static_cast<unsigned long long>(tree.points()), tree.nodes(), elapsed);
+    return true;
+}
+
+/// \brief Installed memory, the default limit of an octree build.
+/// \return Bytes of physical memory.
+uint64_t physical_memory()
+{
+    long pages = sysconf(_SC_PHYS_PAGES);
+    long pageSize = sysconf(_SC_PAGESIZE);
+    if (pages <= 0 || pageSize <= 0)
+    {
+        return UINT64_MAX;
+    }
+    return static_cast<uint64_t>(pages) * static_cast<uint64_t>(pageSize);
+}
+
 /// \brief Function to create callbacks to interact with the point cloud.
 /// \param app Window that renders the point cloud. Interactions happen due to the callbacks here.
 /// \param app_state State of the app's current transform.
 /// \return None.
 void register_glfw_callbacks(window& app, state& app_state)
 {
+    glfwSetWindowRefreshCallback(app, [](GLFWwindow*)
+    {
+        window_damaged = true;
+    });
+
+    glfwSetFramebufferSizeCallback(app, [](GLFWwindow*, int, int)
+    {
+        window_damaged = true;
+    });
+
     app.on_left_mouse = [&](bool pressed)
     {
         app_state.ml = pressed;
@@ -79,6 +433,7 @@ void register_glfw_callbacks(window& app, state& app_state)
     {
         app_state.offset_x += static_cast<float>(xoffset);
         app_state.offset_y += static_cast<float>(yoffset);
+        app_state.dirty = true;
     };
 
     app.on_mouse_move = [&](double x, double y)
@@ -91,6 +446,7 @@ void register_glfw_callbacks(window& app, state& app_state)
             app_state.pitch += (y - app_state.last_y);
             app_state.pitch = std::max(app_state.pitch, -80.0);
             app_state.pitch = std::min(app_state.pitch, +80.0);
+            app_state.dirty = true;
         }
         app_state.last_x = x;
         app_state.last_y = y;
@@ -102,6 +458,7 @@ void register_glfw_callbacks(window& app, state& app_state)
         { // Escape
             app_state.yaw = app_state.pitch = 0;
             app_state.offset_x = app_state.offset_y = 0.0;
+            app_state.dirty = true;
         }
     };
 }
@@ -116,40 +473,38 @@ void draw_pointcloud(window& app, state& app_state, const std::vector<pcl_ptr>&
     glPopMatrix();
     glPushAttrib(GL_ALL_ATTRIB_BITS);
 
-    float width = app.width(), height = app.height();
+    // The window may have been resized while waiting for events, after the viewport was set
+    int fbWidth, fbHeight;
+    glfwGetFramebufferSize(app, &fbWidth, &fbHeight);
+    glViewport(0, 0, fbWidth, fbHeight);
+    float width = static_cast<float>(fbWidth), height = static_cast<float>(std::max(fbHeight, 1));
 
     glClearColor(153.f / 255, 153.f / 255, 153.f / 255, 1);
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
     glMatrixMode(GL_PROJECTION);
     glPushMatrix();
-    gluPerspective(60, width / height, 0.01f, 10.0f);
+    gluPerspective(60, width / height, 0.01f, app_state.far_z);
 
     glMatrixMode(GL_MODELVIEW);
     glPushMatrix();
     gluLookAt(0, 0, 0, 0, 0, 1, 0, -1, 0);
 
-    glTranslatef(0, 0, +0.5f + app_state.offset_y * 0.05f);
+    glTranslatef(0, 0, +0.5f + app_state.offset_y * app_state.zoom_step);
     glRotated(app_state.pitch, 1, 0, 0);
     glRotated(app_state.yaw, 0, 1, 0);
     glTranslatef(0, 0, -0.5f);
 
     glPointSize(width / 640);
-    glEnable(GL_TEXTURE_2D);
 
-    for (auto&& pc : points)
+    // Uploads a new cloud once, unchanged ones are drawn from their buffers
+    if (app_state.tree)
     {
-        glBegin(GL_POINTS);
-        for (int i = 0; i < pc->points.size(); i++)
-        {
-            auto&& p = pc->points[i];
-            if (p.z && p.z < 2.0)
-            {
-                glColor3ub(p.r, p.g, p.b);
-                glVertex3f(p.x, p.y, p.z);
-            }
-        }
-        glEnd();
+        app_state.lod.draw(*app_state.tree, app_state.budget);
+    }
+    else
+    {
+        app_state.renderer.draw(points);
     }
 
     glPopMatrix();
@@ -159,3 +514,102 @@ void draw_pointcloud(window& app, state& app_state, const std::vector<pcl_ptr>&
     glPushMatrix();
 }
 
+
+/// \brief Frame to show now. While playing it follows the recorded timestamps at the playback
+/// rate, at the end playback restarts or pauses.
+/// \return Frame number.
+uint64_t playback::due()
+{
+    if (!playing)
+    {
+        return position;
+    }
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count() * rate;
+    int64_t now_ns = start_ns + static_cast<int64_t>(elapsed * 1e9);
+    uint64_t frame = sequence.seek(now_ns);
+    if (frame == sequence.frames())
+    {
+        if (loop)
+        {
+            seek_frame(0);
+            return position;
+        }
+        playing = false;
+        position = sequence.frames() - 1;
+        print();
+        return position;
+    }
+    // The latest frame whose time has come
+    if (sequence.timestamp(frame) > now_ns && frame > 0)
+    {
+        frame--;
+    }
+    position = std::max(position, frame);
+    return position;
+}
+
+/// \brief Playback keys: p plays and pauses, left and right step a frame and pause, up and
+/// down seek SEEK_STEP_S, home and end go to the first and last frame.
+/// \param key GLFW key code.
+/// \return None.
+void playback::key(int key)
+{
+    uint64_t last = sequence.frames() - 1;
+    switch (key)
+    {
+    case GLFW_KEY_P:
+        playing = !playing;
+        if (playing && position == last && !loop)
+        {
+            position = 0;
+        }
+        seek_frame(position);
+        break;
+    case GLFW_KEY_RIGHT:
+        playing = false;
+        seek_frame(std::min(position + 1, last));
+        break;
+    case GLFW_KEY_LEFT:
+        playing = false;
+        seek_frame(position > 0 ? position - 1 : 0);
+        break;
+    case GLFW_KEY_UP:
+    case GLFW_KEY_DOWN:
+    {
+        int64_t step = static_cast<int64_t>(SEEK_STEP_S * 1e9);
+        int64_t target = sequence.timestamp(position) + (key == GLFW_KEY_UP ? step : -step);
+        seek_frame(std::min(sequence.seek(target), last));
+        break;
+    }
+    case GLFW_KEY_HOME:
+        seek_frame(0);
+        break;
+    case GLFW_KEY_END:
+        seek_frame(last);
+        break;
+    default:
+        return;
+    }
+    print();
+}
+
+/// \brief Moves playback to a frame, playing continues from there.
+/// \param frame Frame number, less than the number of frames.
+/// \return None.
+void playback::seek_frame(uint64_t frame)
+{
+    position = frame;
+    start_ns = sequence.timestamp(frame);
+    started = std::chrono::steady_clock::now();
+}
+
+/// \brief Prints the playback position.
+/// \return None.
+void playback::print() const
+{
+    double time = (sequence.timestamp(position) - sequence.timestamp(0)) * 1e-9;
+    double length = (sequence.timestamp(sequence.frames() - 1) - sequence.timestamp(0)) * 1e-9;
+    printf("%s frame %llu/%llu, %.2f/%.2f s, %u points\n", playing ? "Playing" : "Paused",
+           static_cast<unsigned long long>(position + 1), static_cast<unsigned long long>(sequence.frames()),
+           time, length, sequence.points(position));
+}
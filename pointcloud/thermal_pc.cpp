@@ -1,5 +1,7 @@
 #include <librealsense2/rs.hpp> // Include RealSense Cross Platform API
 #include "example.hpp" // Include short list of convenience functions for rendering
+#include <PointRenderer.h>
+#include <PointRasterizer.h>
 
 #include <pcl/point_types.h>
 #include <pcl/filters/passthrough.h>
@@ -10,85 +12,553 @@
 #include <ctime>
 #include <cstdint>
 #include <cstring>
+#include <cerrno>
+#include <cmath>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
 #include <arpa/inet.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <unistd.h>
 #include <Palettes.h>
+#include <DepthSource.h>
+#include <LeptonDecoder.h>
+#include <LeptonTelemetry.h>
+#include <ThermalSocket.h>
+#include <ThermalCloud.h>
+#include <CloudWriter.h>
+#include <CloudSequence.h>
+#include <ThermalProjection.h>
+#include <ThermalDepth.h>
+#include <ThermalUpsample.h>
 
-#define PACKET_SIZE 164
-#define PACKET_SIZE_UINT16 (PACKET_SIZE/2)
-#define PACKETS_PER_FRAME 60
-#define FRAME_SIZE_UINT16 (PACKET_SIZE_UINT16*PACKETS_PER_FRAME)
 #define FPS 27
+#define RIG_HISTORY 4
+#define RIG_STALL_MS 1000.0
+#define SNAPSHOT_WIDTH 1280
+#define SNAPSHOT_HEIGHT 720
+#define INSET_FRACTION 0.25f    // Width of a thermal inset relative to the window
+#define INSET_MARGIN 10.0f
 
 /// \file thermal_pc.cpp
 /// \brief Program that streams a pointcloud combining depth points with thermal data. Can save a point cloud.
+/// \brief Several rigs can be fused into one cloud in a common world frame.
+/// \brief With -headless no window is opened and the program is controlled by signals.
+/// \brief With -snapshot images of the fused cloud are rendered on the CPU from fixed viewpoints.
+/// \brief With -tdimage organized temperature and depth images are written instead of building clouds.
 
 /// \brief 3D position state for displaying pointcloud
 struct state
 {
     state() : yaw(0.0), pitch(0.0), last_x(0.0), last_y(0.0),
-        ml(false), offset_x(0.0f), offset_y(0.0f) {}
+        ml(false), offset_x(0.0f), offset_y(0.0f), key(0) {}
     double yaw, pitch, last_x, last_y;
     bool ml;
     float offset_x, offset_y;
+    int key;                        // Released key not handled yet, lower case for letters, 0 for none
+    point_renderer renderer;
+    std::vector<texture> thermal;   // Latest thermal image of every rig
 };
 
-using pcl_ptr = pcl::PointCloud<pcl::PointXYZRGB>::Ptr;
+using pcl_rig_ptr = pcl::PointCloud<pcl::PointXYZRGBL>::Ptr;
+
+/// \brief Frame published by a rig, its points are in the world frame and labelled with the rig id.
+struct rig_frame
+{
+    int rig_id;
+    double timestamp;
+    thermal_timestamps thermal_time;
+    lepton_telemetry telemetry;
+    pcl_rig_ptr cloud;          // Empty with -tdimage
+    cv::Mat thermal;
+};
+
+/// \brief Calibration, world pose and latest frames of one Lepton and RealSense pair.
+struct rig
+{
+    int id;
+    uint16_t port;
+    receive_options receive;
+    depth_source_options depth;
+    thermal_calibration calibration;
+    Eigen::Affine3f world;
+
+    std::mutex mutex;
+    std::deque<rig_frame> history;
+
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+};
+
+/// \brief Shared between the rig threads and the main loop to signal new frames and shutdown.
+struct rig_sync
+{
+    std::mutex mutex;
+    std::condition_variable cv;
+    uint64_t generation = 0;
+    std::atomic<bool> running{true};
+    bool print_timing = false;
+    bool check_crc = true;
+    bool keep_thermal = true;               // Frames keep their thermal image for display
+    // With -tdimage every frame is written as a temperature and depth image instead of a cloud
+    thermal_depth_writer* thermal_depth = nullptr;
+    bool upsample = false;                  // Temperatures of the image upsampled with the depth as guide
+    thermal_distortion distortion = DISTORTION_REMAP;   // Lens distortion handling of the clouds and images
+    const lepton_decoder* decoder = nullptr;
+    // Set by signals in headless mode, under the mutex so the main loop is woken
+    bool save_requested = false;
+    bool record_requested = false;
+};
+
+/// \brief Fixed viewpoint of the snapshots, with the transforms of the window's state.
+struct snapshot_view
+{
+    double yaw, pitch;
+    float offset_y;
+};
 
 void register_glfw_callbacks(window& app, state& app_state);
-void draw_pointcloud(window& app, state& app_state, const std::vector<pcl_ptr>& points);
-void process_thermaldata(uint8_t (*shelf)[PACKET_SIZE * PACKETS_PER_FRAME], cv::Mat& gray, cv::Mat& color, int& myImageWidth, int& myImageHeight, uint16_t& rangeMin,  uint16_t& rangeMax);
-
-/// \brief Converts depth points to pointcloud with rgb values based on thermal colormap.
-/// \param points Depth points from the realsense depth frame.
-/// \param thermalimage Thermal image that contains the temperature data.
-/// \param cameraMatrixThermal Thermal camera intrinsics.
-/// \param R Rotation matrix to convert depth camera frame to thermal camera frame.
-/// \param T Translation matrix to convert depth camera frame to thermal camera frame.
-/// \return PCL XZYRGB pointcloud.
-pcl_ptr points_to_pcl(const rs2::points& points, cv::Mat& thermalimage, const cv::Mat& cameraMatrixThermal, const cv::Mat& R, const cv::Mat& T)
+void draw_pointcloud(window& app, state& app_state, const std::vector<pcl_rig_ptr>& points);
+void draw_thermal_insets(window& app, state& app_state);
+/// \brief Moves the valid points of a rig's cloud into the world frame and labels them with the rig id.
+/// \param cloud Organized point cloud in the rig's depth camera frame.
+/// \param r Rig that produced the cloud.
+/// \return Unorganized cloud of the valid points in the world frame.
+pcl_rig_ptr rig_to_world(const pcl_ptr& cloud, const rig& r)
+{
+    pcl_rig_ptr world(new pcl::PointCloud<pcl::PointXYZRGBL>);
+    world->points.reserve(cloud->points.size());
+    for (const auto& p : cloud->points)
+    {
+        if (p.z <= 0)
+        {
+            continue;
+        }
+        Eigen::Vector3f q = r.world * Eigen::Vector3f(p.x, p.y, p.z);
+        pcl::PointXYZRGBL w;
+        w.x = q.x();
+        w.y = q.y();
+        w.z = q.z();
+        w.r = p.r;
+        w.g = p.g;
+        w.b = p.b;
+        w.label = static_cast<uint32_t>(r.id);
+        world->points.push_back(w);
+    }
+    world->width = static_cast<uint32_t>(world->points.size());
+    world->height = 1;
+    world->is_dense = true;
+    return world;
+}
+
+/// \brief Reads the rig list from an OpenCV xml file (see rigs.xml).
+/// \param file Path to the rigs file.
+/// \param receive Receive options of rigs that do not set their own.
+/// \param depth Depth source of rigs that do not set their own serial or bag.
+/// \param rigs Rigs that are read, ids follow the order in the file.
+/// \return True if every rig in the file was loaded.
+bool load_rigs(const std::string& file, const receive_options& receive, const depth_source_options& depth,
+               std::vector<std::unique_ptr<rig>>& rigs)
+{
+    cv::FileStorage fs(file, cv::FileStorage::READ);
+    if (!fs.isOpened())
+    {
+        std::cerr << "Failed to open " << file << std::endl;
+        return false;
+    }
+    cv::FileNode nodes = fs["rigs"];
+    if (!nodes.isSeq() || nodes.size() == 0)
+    {
+        std::cerr << "No rigs listed in " << file << std::endl;
+        return false;
+    }
+    for (cv::FileNodeIterator it = nodes.begin(); it != nodes.end(); ++it)
+    {
+        cv::FileNode node = *it;
+        std::unique_ptr<rig> r(new rig);
+        r->id = static_cast<int>(rigs.size());
+        r->port = static_cast<uint16_t>(static_cast<int>(node["port"]));
+        r->depth = depth;
+        if (!node["serial"].empty())
+        {
+            r->depth.serial = static_cast<std::string>(node["serial"]);
+        }
+        if (!node["bag"].empty())
+        {
+            r->depth.type = DEPTH_SOURCE_BAG;
+            r->depth.file = static_cast<std::string>(node["bag"]);
+        }
+        r->receive = receive;
+        if (!node["rcvbuf"].empty())
+        {
+            r->receive.rcvbuf = static_cast<int>(node["rcvbuf"]);
+        }
+        if (!node["cpu"].empty())
+        {
+            r->receive.cpu = static_cast<int>(node["cpu"]);
+        }
+        if (!node["rtprio"].empty())
+        {
+            r->receive.priority = static_cast<int>(node["rtprio"]);
+        }
+        if (!load_thermal_calibration(r->calibration, static_cast<std::string>(node["calibration"]), static_cast<std::string>(node["extrinsic"])))
+        {
+            return false;
+        }
+        cv::Mat world;
+        node["world"] >> world;
+        r->world = Eigen::Affine3f::Identity();
+        if (!world.empty())
+        {
+            if (world.rows != 4 || world.cols != 4)
+            {
+                std::cerr << "Rig " << r->id << ": world must be a 4x4 matrix" << std::endl;
+                return false;
+            }
+            world.convertTo(world, CV_32F);
+            for (int row = 0; row < 3; row++)
+            {
+                for (int col = 0; col < 4; col++)
+                {
+                    r->world.matrix()(row, col) = world.at<float>(row, col);
+                }
+            }
+        }
+        rigs.push_back(std::move(r));
+    }
+    return true;
+}
+
+/// \brief Stops every rig and wakes the main loop.
+/// \param sync Shared rig state.
+/// \return None.
+void stop_rigs(rig_sync& sync)
+{
+    sync.running = false;
+    sync.cv.notify_all();
+}
+
+/// \brief Rig thread: receives thermal data, grabs depth and publishes world frame clouds until stopped.
+/// \param r Rig to run.
+/// \param sync Shared rig state.
+/// \param rangeMin Minimum temperature to be scaled between 0 and 255.
+/// \param rangeMax Maximum temperature to be scaled between 0 and 255.
+/// \return None.
+void run_rig(rig& r, rig_sync& sync, uint16_t rangeMin, uint16_t rangeMax)
 {
-    pcl_ptr cloud(new pcl::PointCloud<pcl::PointXYZRGB>);
-
-    auto sp = points.get_profile().as<rs2::video_stream_profile>();
-    cloud->width = sp.width();
-    cloud->height = sp.height();
-    cloud->is_dense = false;
-    cloud->points.resize(points.size());
-    auto ptr = points.get_vertices();
-    for (auto& p : cloud->points)
-    {
-        p.x = ptr->x;
-        p.y = ptr->y;
-        p.z = ptr->z;
-        ptr++;
-
-        if (p.z > 0)
+    int sockfd = open_thermal_socket(r.port, 1000, r.receive);
+    if (sockfd < 0)
+    {
+        stop_rigs(sync);
+        return;
+    }
+    const lepton_decoder* decoder = sync.decoder;
+    while (!decoder && sync.running)
+    {
+        if ((decoder = detect_lepton_stream(sockfd)) == nullptr && errno != EAGAIN && errno != EWOULDBLOCK)
         {
-            cv::Mat realSensePoint(3, 1, CV_64F);
-            realSensePoint.at<double>(0, 0) = p.x;
-            realSensePoint.at<double>(1, 0) = p.y;
-            realSensePoint.at<double>(2, 0) = p.z;
-            cv::Mat thermalPoint = R * realSensePoint + T;
-            cv::Mat projectedThermalPoint = cameraMatrixThermal * thermalPoint;
-            int thermalX = static_cast<int>(projectedThermalPoint.at<double>(0, 0) / projectedThermalPoint.at<double>(2, 0));
-            int thermalY = static_cast<int>(projectedThermalPoint.at<double>(1, 0) / projectedThermalPoint.at<double>(2, 0));
-
-            if (thermalX >= 0 && thermalX < thermalimage.cols && thermalY >= 0 && thermalY < thermalimage.rows)
+            std::cerr << "Rig " << r.id << ": Receive failed" << std::endl;
+            stop_rigs(sync);
+        }
+    }
+    if (!decoder)
+    {
+        close(sockfd);
+        return;
+    }
+    try
+    {
+        uint32_t kernelDrops = 0;
+        ssize_t receivedBytes[MAX_SEGMENTS_PER_FRAME] = {};
+        drop_stats drops;
+        thermal_timestamps timestamps = {};
+        frame_timing timing;
+        std::vector<uint8_t> thermalFrame(decoder->frame_size());
+        std::vector<uint16_t> telemetryWords(decoder->telemetry_words());
+        lepton_telemetry telemetry;
+        frame_sequence sequence;
+        cv::Mat raw(decoder->height, decoder->width, CV_16UC1);
+        cv::Mat color(decoder->height, decoder->width, CV_8UC3);
+        cv::Mat gray(decoder->height, decoder->width, CV_8UC1);
+        cv::Mat undistortedColor;
+        cv::Mat undistortedRaw;
+        thermal_projection projection;
+        guided_upsampler upsampler;
+        // Only the receive thread is pinned and prioritized, not the processing and its threads
+        lepton_receiver receiver(sockfd, *decoder, r.receive);
+
+        rs2::pointcloud pc;
+        rs2::points points;
+        std::unique_ptr<depth_source> source = open_depth_source(r.depth);
+        std::cout << "Rig " << r.id << ": depth from " << source->name() << std::endl;
+        rs2::align align_to_color(RS2_STREAM_COLOR);
+
+        while (sync.running)
+        {
+            rs2::frameset frames;
+            if (!source->wait_for_frames(frames, 1000))
+            {
+                if (source->finished())
+                {
+                    std::cout << "Rig " << r.id << ": end of " << source->name() << std::endl;
+                    stop_rigs(sync);
+                }
+                continue;
+            }
+            frames = align_to_color.process(frames);
+            auto depth = frames.get_depth_frame();
+            // The newest thermal frame for this depth frame, older ones would misregister motion
+            if (receiver.receive_latest(thermalFrame.data(), receivedBytes, timestamps, &kernelDrops) < 0)
             {
-                cv::Vec3b color = thermalimage.at<cv::Vec3b>(thermalY, thermalX);
-                p.r = color[2];
-                p.g = color[1];
-                p.b = color[0];
+                if (errno != EAGAIN && errno != EWOULDBLOCK)
+                {
+                    std::cerr << "Rig " << r.id << ": Receive failed" << std::endl;
+                    stop_rigs(sync);
+                }
+                continue;
+            }
+
+            // Reject corrupted frames before decoding and projecting them
+            drop_reason reason = decoder->validate(thermalFrame.data(), receivedBytes, sync.check_crc);
+            if (reason == DROP_NONE)
+            {
+                // Telemetry first, repeated frames and frames frozen by the shutter are not projected
+                decoder->decode(thermalFrame.data(), nullptr, telemetryWords.data());
+                parse_lepton_telemetry(telemetryWords.data(), decoder->telemetry_words(), telemetry);
+                reason = sequence.check(telemetry, drops);
+            }
+            drops.add(reason);
+            if (reason != DROP_NONE)
+            {
+                continue;
+            }
+            decoder->decode(thermalFrame.data(), raw.ptr<uint16_t>(), nullptr);
+            // Clouds and temperature images both look their thermal pixels up in the projection
+            const uint16_t* depthData = static_cast<const uint16_t*>(depth.get_data());
+            if (!projection.ready())
+            {
+                projection.init(r.calibration, depth.get_profile().as<rs2::video_stream_profile>().get_intrinsics(),
+                                decoder->width, decoder->height, sync.distortion);
+            }
+            projection.project(depthData, depth.get_units());
+            if (!sync.thermal_depth || sync.keep_thermal)
+            {
+                process_thermaldata(raw, gray, color, rangeMin, rangeMax);
+                projection.undistort(color, undistortedColor);
+            }
+
+            rig_frame frame;
+            frame.rig_id = r.id;
+            frame.timestamp = frames.get_timestamp();
+            frame.thermal_time = timestamps;
+            frame.telemetry = telemetry;
+            if (sync.thermal_depth)
+            {
+                // Straight from the depth image to the frame, no points and no cloud
+                projection.undistort(raw, undistortedRaw, true);
+                // A new image every frame, the writer holds it until it is on disk
+                cv::Mat thermalDepth;
+                if (sync.upsample)
+                {
+                    upsampler.upsample(projection, depthData, depth.get_units(), undistortedRaw, thermalDepth);
+                }
+                else
+                {
+                    build_thermal_depth(projection, depthData, depth.get_units(), undistortedRaw, thermalDepth);
+                }
+                // Written here rather than by the alignment, so no frame is skipped between ticks
+                sync.thermal_depth->write(r.id, timestamps.frame_ns, thermalDepth);
+                frame.cloud.reset(new pcl::PointCloud<pcl::PointXYZRGBL>);
             }
             else
             {
-                p.r = 153;
-                p.g = 153;
-                p.b = 153;
+                points = pc.calculate(depth);
+                frame.cloud = rig_to_world(points_to_pcl(points, projection, undistortedColor), r);
+            }
+            frame.cloud->header.stamp = static_cast<uint64_t>(timestamps.frame_ns / 1000);
+            if (sync.keep_thermal)
+            {
+                frame.thermal = undistortedColor.clone();
+            }
+            timing.add(timestamps, realtime_ns());
+            if (sync.print_timing && timing.frames() >= TIMING_REPORT_FRAMES)
+            {
+                std::cout << "Rig " << r.id << std::endl;
+                timing.print();
+                print_socket_drops(r.port, kernelDrops);
+                drops.print();
+                timing.clear();
+                drops.clear();
             }
+            {
+                std::lock_guard<std::mutex> lock(r.mutex);
+                r.history.push_back(std::move(frame));
+                if (r.history.size() > RIG_HISTORY)
+                {
+                    r.history.pop_front();
+                }
+            }
+            {
+                std::lock_guard<std::mutex> lock(sync.mutex);
+                sync.generation++;
+            }
+            sync.cv.notify_all();
+        }
+        source->stop();
+    }
+    catch (const rs2::error & e)
+    {
+        std::cerr << "Rig " << r.id << ": RealSense error calling " << e.get_failed_function() << "(" << e.get_failed_args() << "):\n    " << e.what() << std::endl;
+        stop_rigs(sync);
+    }
+    catch (const std::exception & e)
+    {
+        std::cerr << "Rig " << r.id << ": " << e.what() << std::endl;
+        stop_rigs(sync);
+    }
+    close(sockfd);
+}
+
+/// \brief Signal thread of the headless mode. The signals are blocked in every other thread, so
+/// they are only taken here: SIGINT and SIGTERM stop the program, SIGUSR1 saves the current
+/// cloud and SIGUSR2 starts and stops recording.
+/// \param signals Signals that are handled.
+/// \param sync Shared rig state.
+/// \return None.
+void handle_signals(sigset_t signals, rig_sync& sync)
+{
+    while (sync.running)
+    {
+        int signal = 0;
+        if (sigwait(&signals, &signal) != 0)
+        {
+            continue;
+        }
+        if (signal == SIGUSR1 || signal == SIGUSR2)
+        {
+            std::lock_guard<std::mutex> lock(sync.mutex);
+            (signal == SIGUSR1 ? sync.save_requested : sync.record_requested) = true;
+        }
+        else
+        {
+            sync.running = false;
+        }
+        sync.cv.notify_all();
+    }
+}
+
+/// \brief Picks one frame per rig close in time to the newest frame of the slowest running rig.
+/// \param rigs Rigs to align.
+/// \param tolerance Maximum time difference in ms for a frame to be part of the tick.
+/// \param lastReference Reference time of the previous tick, updated when a new tick is produced.
+/// \param aligned Frames of the new tick, one per rig that is in sync.
+/// \return True if a new tick was produced.
+bool align_rig_frames(std::vector<std::unique_ptr<rig>>& rigs, double tolerance, double& lastReference, std::vector<rig_frame>& aligned)
+{
+    std::vector<std::deque<rig_frame>> snapshot(rigs.size());
+    double newest = -std::numeric_limits<double>::infinity();
+    for (size_t i = 0; i < rigs.size(); i++)
+    {
+        std::lock_guard<std::mutex> lock(rigs[i]->mutex);
+        snapshot[i] = rigs[i]->history;
+        if (!snapshot[i].empty())
+        {
+            newest = std::max(newest, snapshot[i].back().timestamp);
+        }
+    }
+
+    // Rigs that stopped publishing must not hold back the others
+    double reference = std::numeric_limits<double>::infinity();
+    for (const auto& history : snapshot)
+    {
+        if (!history.empty() && history.back().timestamp >= newest - RIG_STALL_MS)
+        {
+            reference = std::min(reference, history.back().timestamp);
+        }
+    }
+    if (reference == std::numeric_limits<double>::infinity() || reference <= lastReference)
+    {
+        return false;
+    }
+
+    aligned.clear();
+    for (const auto& history : snapshot)
+    {
+        const rig_frame* best = nullptr;
+        for (const auto& frame : history)
+        {
+            if (!best || std::abs(frame.timestamp - reference) < std::abs(best->timestamp - reference))
+            {
+                best = &frame;
+            }
+        }
+        if (best && std::abs(best->timestamp - reference) <= tolerance)
+        {
+            aligned.push_back(*best);
+        }
+    }
+    lastReference = reference;
+    return true;
+}
+
+/// \brief Concatenates the aligned rig clouds into one cloud.
+/// \param frames Frames of one tick.
+/// \return Merged cloud, each point keeps the label of its rig.
+pcl_rig_ptr merge_rig_frames(const std::vector<rig_frame>& frames)
+{
+    pcl_rig_ptr merged(new pcl::PointCloud<pcl::PointXYZRGBL>);
+    size_t total = 0;
+    for (const auto& frame : frames)
+    {
+        total += frame.cloud->points.size();
+    }
+    merged->points.reserve(total);
+    for (const auto& frame : frames)
+    {
+        merged->points.insert(merged->points.end(), frame.cloud->points.begin(), frame.cloud->points.end());
+    }
+    merged->width = static_cast<uint32_t>(merged->points.size());
+    merged->height = 1;
+    merged->is_dense = true;
+    if (!frames.empty())
+    {
+        // Thermal arrival time of the earliest rig, in microseconds like every PCL stamp
+        merged->header.stamp = frames.front().cloud->header.stamp;
+        for (const auto& frame : frames)
+        {
+            merged->header.stamp = std::min(merged->header.stamp, frame.cloud->header.stamp);
+        }
+    }
+    return merged;
+}
+
+/// \brief Renders a cloud from every viewpoint and writes snapshot_<view>.png. An image is
+/// written under a temporary name and renamed, so a reader never sees half of it.
+/// \param rasterizer Renderer.
+/// \param views Viewpoints.
+/// \param cloud Cloud to render.
+/// \param image Image buffer, reused between calls.
+/// \return None.
+void save_snapshots(point_rasterizer& rasterizer, const std::vector<snapshot_view>& views,
+                    const pcl_rig_ptr& cloud, cv::Mat& image)
+{
+    for (size_t i = 0; i < views.size(); i++)
+    {
+        const snapshot_view& v = views[i];
+        rasterizer.render(*cloud, raster_view_matrix(v.yaw, v.pitch, v.offset_y), SNAPSHOT_WIDTH, SNAPSHOT_HEIGHT, image);
+        std::string name = "snapshot_" + std::to_string(i) + ".png";
+        std::string temporary = "snapshot_" + std::to_string(i) + ".tmp.png";
+        if (!cv::imwrite(temporary, image) || rename(temporary.c_str(), name.c_str()) != 0)
+        {
+            std::cerr << "Could not write " << name << std::endl;
         }
     }
-    return cloud;
 }
 
 /// \brief Function to describe how to use the command line arguments
@@ -102,6 +572,35 @@ void printUsage(char *cmd)
 		   " -mintemp x		sets a minimum value for scaling (suggestion: 27300).\n"
 		   " -maxtemp x		sets a maximum value for scaling (suggestion: 30800).\n"
 		   "			Temperature values for min and max are in hectoKelvin.\n"
+		   " -rigs x		xml file listing several rigs to fuse (see rigs.xml).\n"
+		   "			Overrides -port and the default calibration files.\n"
+		   " -sync x		max time difference in ms between fused rig frames (default: 50).\n"
+		   " -rcvbuf x		socket receive buffer in bytes (suggestion: 4194304).\n"
+		   " -cpu x		pin the thermal receive thread to cpu x.\n"
+		   " -rtprio x		run the thermal receive thread under SCHED_FIFO with priority x (1 to 99).\n"
+		   " -lepton x		thermal stream layout, detected when not given.\n"
+		   "			lepton3, lepton2 and their -telemetry-header/-footer variants.\n"
+		   " -nocrc		skip the CRC check of the thermal packets.\n"
+		   " -timing		print thermal frame jitter, latency and drop statistics every 10 s.\n"
+		   " -bag x		play depth and color from the RealSense recording x instead of a camera.\n"
+		   " -syndepth		use a synthetic depth and color scene instead of a camera.\n"
+		   " -fast		play the bag or the synthetic scene as fast as possible\n"
+		   "			instead of at its frame rate.\n"
+		   " -pcd x		format of saved clouds: ascii, binary or compressed (default: binary).\n"
+		   " -record x		record the fused pointclouds to the sequence file x from the start.\n"
+		   "			Key r starts and stops recording to thermal_<date>_<time>.pcs.\n"
+		   " -headless		run without windows, as fast as the rigs deliver. SIGINT and SIGTERM\n"
+		   "			stop, SIGUSR1 saves thermal.pcd and SIGUSR2 starts and stops recording.\n"
+		   " -tdimage x		write depth aligned temperature images to the directory x instead\n"
+		   "			of building pointclouds, see ThermalDepth.h.\n"
+		   " -upsample		with -tdimage, upsample the temperatures to the depth resolution\n"
+		   "			with the depth as guide instead of repeating each thermal pixel.\n"
+		   " -distortion x		thermal lens distortion of the clouds and images: remap, model or\n"
+		   "			table (default: remap), see ThermalProjection.h.\n"
+		   " -snapshot x		render the fused cloud on the CPU every x seconds to snapshot_<n>.png,\n"
+		   "			one image per -view. Works with and without -headless.\n"
+		   " -view y,p,z		viewpoint of the snapshots as yaw and pitch in degrees and scroll steps\n"
+		   "			like in the window, can be repeated (default: 0,0,0).\n"
 		   " Output:		Pointcloud stream where the rgb values are a temperature map.\n"
 		   "", cmdname);
 	return;
@@ -113,17 +612,47 @@ void printUsage(char *cmd)
 /// \param port Port of the IP address.
 /// \param mintemp Minimum temperature to be scaled between 0 and 255.
 /// \param maxtemp Maximum temperature to be scaled between 0 and 255.
+/// \param rigs Xml file with the rigs to fuse.
+/// \param sync Tolerance in ms for aligning rig frames.
+/// \param lepton Layout of the thermal stream.
+/// \param nocrc Skip the CRC check of the thermal packets.
+/// \param timing Print the timing histograms and drop counters periodically.
+/// \param rcvbuf Socket receive buffer size.
+/// \param cpu Cpu the thermal receive thread is pinned to.
+/// \param rtprio SCHED_FIFO priority of the thermal receive thread.
+/// \param bag RealSense recording to play instead of a camera.
+/// \param syndepth Synthetic depth scene instead of a camera.
+/// \param fast Play the bag or the synthetic scene as fast as possible.
+/// \param pcd Format of the saved clouds.
+/// \param record Sequence file the fused clouds are recorded to.
+/// \param headless Run without windows, controlled by signals.
+/// \param tdimage Directory of the temperature and depth images written instead of clouds.
+/// \param upsample Depth guided upsampling of the temperatures of the images.
+/// \param distortion Handling of the thermal lens distortion in the clouds and images.
+/// \param snapshot Interval in seconds of the CPU rendered snapshots.
+/// \param view Viewpoint of the snapshots, one image each.
 /// \return 0 if successful, -1 if failure.
 int main(int argc, char * argv[])
 try
 {
-    window app(1280, 720, "RealSense PCL Pointcloud Example");
-    state app_state;
-    register_glfw_callbacks(app, app_state);
-
     uint16_t rangeMin = 27300;
 	uint16_t rangeMax = 30800;
 	uint16_t port = 8080;
+	std::string rigsFile;
+	double syncTolerance = 50.0;
+	bool printTiming = false;
+	bool checkCrc = true;
+	const lepton_decoder *decoder = nullptr;
+	receive_options receiveOptions;
+	depth_source_options depthOptions;
+	pcd_format saveFormat = PCD_BINARY;
+	std::string recordFile;
+	std::string thermalDepthDirectory;
+	bool upsample = false;
+	thermal_distortion distortion = DISTORTION_REMAP;
+	bool headless = false;
+	double snapshotInterval = 0.0;
+	std::vector<snapshot_view> snapshotViews;
 
     for(int i=1; i < argc; i++)
 	{
@@ -183,125 +712,410 @@ try
 				exit(1);
 			}
 		}
+		else if (strcmp(argv[i], "-rigs") == 0)
+		{
+			if (i + 1 != argc)
+			{
+				rigsFile = argv[++i];
+			}
+			else
+			{
+				std::cerr << "Error: Enter a rigs file." << std::endl;
+				exit(1);
+			}
+		}
+		else if (strcmp(argv[i], "-sync") == 0)
+		{
+			if (i + 1 != argc)
+			{
+				double temp = std::strtod(argv[++i], nullptr);
+				if (temp <= 0){
+					std::cerr << "Error: Enter a positive sync tolerance in ms." << std::endl;
+					exit(1);
+				}
+				syncTolerance = temp;
+			}
+			else
+			{
+				std::cerr << "Error: Enter a sync tolerance in ms." << std::endl;
+				exit(1);
+			}
+		}
+		else if (strcmp(argv[i], "-timing") == 0)
+		{
+			printTiming = true;
+		}
+		else if (strcmp(argv[i], "-rcvbuf") == 0)
+		{
+			if (i + 1 != argc)
+			{
+				long int temp = std::strtol(argv[++i], nullptr, 10);
+				if (temp <= 0 || temp > 1073741824){
+					std::cerr << "Error: Enter a receive buffer size in bytes." << std::endl;
+					exit(1);
+				}
+				receiveOptions.rcvbuf = static_cast<int>(temp);
+			}
+			else
+			{
+				std::cerr << "Error: Enter a receive buffer size in bytes." << std::endl;
+				exit(1);
+			}
+		}
+		else if (strcmp(argv[i], "-cpu") == 0)
+		{
+			if (i + 1 != argc)
+			{
+				long int temp = std::strtol(argv[++i], nullptr, 10);
+				if (temp < 0 || temp >= CPU_SETSIZE){
+					std::cerr << "Error: Enter a valid cpu." << std::endl;
+					exit(1);
+				}
+				receiveOptions.cpu = static_cast<int>(temp);
+			}
+			else
+			{
+				std::cerr << "Error: Enter a valid cpu." << std::endl;
+				exit(1);
+			}
+		}
+		else if (strcmp(argv[i], "-rtprio") == 0)
+		{
+			if (i + 1 != argc)
+			{
+				long int temp = std::strtol(argv[++i], nullptr, 10);
+				if (temp < 1 || temp > 99){
+					std::cerr << "Error: Enter a priority between 1 and 99." << std::endl;
+					exit(1);
+				}
+				receiveOptions.priority = static_cast<int>(temp);
+			}
+			else
+			{
+				std::cerr << "Error: Enter a priority between 1 and 99." << std::endl;
+				exit(1);
+			}
+		}
+		else if (strcmp(argv[i], "-nocrc") == 0)
+		{
+			checkCrc = false;
+		}
+		else if (strcmp(argv[i], "-lepton") == 0)
+		{
+			if (i + 1 != argc && (decoder = find_lepton_decoder(argv[i + 1])) != nullptr)
+			{
+				i++;
+			}
+			else
+			{
+				std::cerr << "Error: Enter one of the thermal decoders:" << std::endl;
+				print_lepton_decoders();
+				exit(1);
+			}
+		}
+		else if (strcmp(argv[i], "-bag") == 0)
+		{
+			if (i + 1 != argc)
+			{
+				depthOptions.type = DEPTH_SOURCE_BAG;
+				depthOptions.file = argv[++i];
+			}
+			else
+			{
+				std::cerr << "Error: Enter a bag file." << std::endl;
+				exit(1);
+			}
+		}
+		else if (strcmp(argv[i], "-syndepth") == 0)
+		{
+			depthOptions.type = DEPTH_SOURCE_SYNTHETIC;
+		}
+		else if (strcmp(argv[i], "-fast") == 0)
+		{
+			depthOptions.real_time = false;
+		}
+		else if (strcmp(argv[i], "-pcd") == 0)
+		{
+			if (i + 1 != argc && parse_pcd_format(argv[i + 1], saveFormat))
+			{
+				i++;
+			}
+			else
+			{
+				std::cerr << "Error: Enter a cloud format: ascii, binary or compressed." << std::endl;
+				exit(1);
+			}
+		}
+		else if (strcmp(argv[i], "-record") == 0)
+		{
+			if (i + 1 != argc)
+			{
+				recordFile = argv[i + 1];
+				i++;
+			}
+			else
+			{
+				std::cerr << "Error: Enter a sequence file." << std::endl;
+				exit(1);
+			}
+		}
+		else if (strcmp(argv[i], "-headless") == 0)
+		{
+			headless = true;
+		}
+		else if (strcmp(argv[i], "-tdimage") == 0)
+		{
+			if (i + 1 != argc)
+			{
+				thermalDepthDirectory = argv[++i];
+			}
+			else
+			{
+				std::cerr << "Error: Enter a directory for the temperature images." << std::endl;
+				exit(1);
+			}
+		}
+		else if (strcmp(argv[i], "-upsample") == 0)
+		{
+			upsample = true;
+		}
+		else if (strcmp(argv[i], "-distortion") == 0)
+		{
+			if (i + 1 != argc && parse_thermal_distortion(argv[i + 1], distortion))
+			{
+				i++;
+			}
+			else
+			{
+				std::cerr << "Error: Enter a distortion mode: remap, model or table." << std::endl;
+				exit(1);
+			}
+		}
+		else if (strcmp(argv[i], "-snapshot") == 0)
+		{
+			if (i + 1 != argc)
+			{
+				double temp = std::strtod(argv[++i], nullptr);
+				if (temp <= 0){
+					std::cerr << "Error: Enter a positive snapshot interval in seconds." << std::endl;
+					exit(1);
+				}
+				snapshotInterval = temp;
+			}
+			else
+			{
+				std::cerr << "Error: Enter a snapshot interval in seconds." << std::endl;
+				exit(1);
+			}
+		}
+		else if (strcmp(argv[i], "-view") == 0)
+		{
+			snapshot_view v;
+			if (i + 1 != argc && sscanf(argv[i + 1], "%lf,%lf,%f", &v.yaw, &v.pitch, &v.offset_y) == 3)
+			{
+				snapshotViews.push_back(v);
+				i++;
+			}
+			else
+			{
+				std::cerr << "Error: Enter a view as yaw,pitch,zoom." << std::endl;
+				exit(1);
+			}
+		}
 	}
+    if (upsample && thermalDepthDirectory.empty())
+    {
+        std::cerr << "Error: -upsample needs -tdimage." << std::endl;
+        exit(1);
+    }
 
-    int sockfd;
-    struct sockaddr_in servaddr, cliaddr;
-
-    uint8_t shelf[4][PACKET_SIZE * PACKETS_PER_FRAME];
-    bool first = true;
-    int myImageWidth = 160;
-    int myImageHeight = 120;
-    cv::Mat color(myImageHeight, myImageWidth, CV_8UC3);
-    cv::Mat gray(myImageHeight, myImageWidth, CV_8UC1);
-    cv::Mat undistortedColor(myImageHeight, myImageWidth, CV_8UC3);
-    cv::Mat undistortedImage(myImageHeight, myImageWidth, CV_8UC1);
-    
-    if ((sockfd = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
-    {
-        std::cerr << "Socket creation failed" << std::endl;
-        return -1;
+    // Blocked before any thread is started, the writers and rigs included, so every thread
+    // inherits the mask and only the signal thread receives them
+    sigset_t signals;
+    sigemptyset(&signals);
+    if (headless)
+    {
+        sigaddset(&signals, SIGINT);
+        sigaddset(&signals, SIGTERM);
+        sigaddset(&signals, SIGUSR1);
+        sigaddset(&signals, SIGUSR2);
+        pthread_sigmask(SIG_BLOCK, &signals, nullptr);
     }
-    memset(&servaddr, 0, sizeof(servaddr));
-    memset(&cliaddr, 0, sizeof(cliaddr));
-    servaddr.sin_family = AF_INET;
-    servaddr.sin_port = htons(port);
-    servaddr.sin_addr.s_addr = INADDR_ANY;
-    if (bind(sockfd, (const struct sockaddr *)&servaddr, sizeof(servaddr)) < 0)
+
+    // Headless, no GL context or window is created and nothing is drawn
+    std::unique_ptr<window> app;
+    std::unique_ptr<state> app_state;
+    if (!headless)
+    {
+        app.reset(new window(1280, 720, "RealSense PCL Pointcloud Example"));
+        app_state.reset(new state);
+        register_glfw_callbacks(*app, *app_state);
+    }
+
+    if (snapshotViews.empty())
+    {
+        snapshotViews.push_back(snapshot_view{0.0, 0.0, 0.0f});
+    }
+
+    std::vector<std::unique_ptr<rig>> rigs;
+    if (rigsFile.empty())
+    {
+        std::unique_ptr<rig> r(new rig);
+        r->id = 0;
+        r->port = port;
+        r->receive = receiveOptions;
+        r->depth = depthOptions;
+        r->world = Eigen::Affine3f::Identity();
+        if (!load_thermal_calibration(r->calibration, "../calibration.xml", "../extrinsic.xml"))
+        {
+            return -1;
+        }
+        rigs.push_back(std::move(r));
+    }
+    else if (!load_rigs(rigsFile, receiveOptions, depthOptions, rigs))
     {
-        std::cerr << "Bind failed" << std::endl;
-        close(sockfd);
         return -1;
     }
-    socklen_t len = sizeof(cliaddr);
 
-    cv::FileStorage fs("../calibration.xml", cv::FileStorage::READ);
-    if (!fs.isOpened())
+    // Every rig runs in its own thread, the main loop only aligns, merges and renders
+    // The fused cloud only holds points with depth, see rig_to_world
+    cloud_writer<pcl::PointXYZRGBL> writer(saveFormat, false);
+    sequence_writer<pcl::PointXYZRGBL> recorder;
+    if (!recordFile.empty() && !recorder.start(recordFile))
     {
-        std::cerr << "Failed to open calibration.xml" << std::endl;
         return -1;
     }
-    cv::Mat cameraMatrixThermal, distCoeffsThermal;
-    fs["cameraMatrix"] >> cameraMatrixThermal;
-    fs["distCoeffs"] >> distCoeffsThermal;
-    fs.release();
-    cv::FileStorage fs2("../extrinsic.xml", cv::FileStorage::READ);
-    if (!fs2.isOpened())
+    thermal_depth_writer thermalDepthWriter;
+    if (!thermalDepthDirectory.empty() && !thermalDepthWriter.start(thermalDepthDirectory))
     {
-        std::cerr << "Failed to open extrinsic.xml" << std::endl;
         return -1;
     }
-    cv::Mat R_rgb_thermal, T_rgb_thermal, E, F, R_thermal_rgb, T_thermal_rgb;
-    fs2["R"] >> R_rgb_thermal;
-    fs2["T"] >> T_rgb_thermal;
-    fs2["E"] >> E;
-    fs2["F"] >> F;
-    fs2.release();
-    R_thermal_rgb = R_rgb_thermal.inv();
-    T_thermal_rgb = -R_thermal_rgb * T_rgb_thermal;
-
-    rs2::pointcloud pc;
-    rs2::points points;
-    rs2::pipeline pipe;
-    rs2::config cfg;
-    cfg.enable_stream(RS2_STREAM_DEPTH, 1280, 720, RS2_FORMAT_Z16);
-    cfg.enable_stream(RS2_STREAM_COLOR, 1280, 720, RS2_FORMAT_RGB8);
-    pipe.start(cfg);
-    rs2::align align_to_color(RS2_STREAM_COLOR);
-
-    while (app)
-    {
-        auto frames = pipe.wait_for_frames();
-        frames = align_to_color.process(frames);
-        auto depth = frames.get_depth_frame();
-        for (int i = 0; i < 4; ++i)
+    rig_sync sync;
+    sync.thermal_depth = thermalDepthDirectory.empty() ? nullptr : &thermalDepthWriter;
+    sync.upsample = upsample;
+    sync.distortion = distortion;
+    sync.print_timing = printTiming;
+    sync.check_crc = checkCrc;
+    sync.keep_thermal = !headless;
+    sync.decoder = decoder;
+
+    std::thread signalThread;
+    if (headless)
+    {
+        signalThread = std::thread(handle_signals, signals, std::ref(sync));
+        std::cout << "Running headless as pid " << getpid() << ", SIGUSR1 saves, SIGUSR2 toggles recording" << std::endl;
+    }
+    std::vector<std::thread> workers;
+    for (auto& r : rigs)
+    {
+        workers.emplace_back(run_rig, std::ref(*r), std::ref(sync), rangeMin, rangeMax);
+    }
+
+    uint64_t generation = 0;
+    double lastReference = -std::numeric_limits<double>::infinity();
+    std::vector<rig_frame> aligned;
+    pcl_rig_ptr merged(new pcl::PointCloud<pcl::PointXYZRGBL>);
+    std::vector<pcl_rig_ptr> layers;
+    layers.push_back(merged);
+
+    uint64_t fused = 0;
+    auto started = std::chrono::steady_clock::now();
+    point_rasterizer rasterizer;
+    cv::Mat snapshot;
+    auto lastSnapshot = started;
+    while (sync.running && (headless || *app))
+    {
+        int key = 0;
         {
-            ssize_t received_bytes = recvfrom(sockfd, shelf[i], sizeof(shelf[i]), 0, (struct sockaddr *)&cliaddr, &len);
-            if (received_bytes < 0)
+            std::unique_lock<std::mutex> lock(sync.mutex);
+            sync.cv.wait_for(lock, std::chrono::milliseconds(100), [&] {
+                return sync.generation != generation || !sync.running || sync.save_requested || sync.record_requested;
+            });
+            generation = sync.generation;
+            // A signal stands in for the key, one request per pass
+            if (sync.save_requested)
             {
-                std::cerr << "Receive failed" << std::endl;
-                close(sockfd);
-                return -1;
+                sync.save_requested = false;
+                key = 's';
             }
-            if (first && i == 1)
+            else if (sync.record_requested)
             {
-                break;
+                sync.record_requested = false;
+                key = 'r';
             }
         }
-        if (first)
+        if (align_rig_frames(rigs, syncTolerance, lastReference, aligned))
         {
-            first = false;
-            continue;
+            merged = merge_rig_frames(aligned);
+            layers[0] = merged;
+            fused++;
+            // Clouds dropped while the disk is busy are counted and reported when recording stops
+            recorder.write(merged);
+            // Thermal images are uploaded once per tick and drawn from their textures every frame
+            for (size_t i = 0; i < aligned.size() && !headless; i++)
+            {
+                const rig_frame& frame = aligned[i];
+                app_state->thermal.resize(rigs.size());
+                app_state->thermal[frame.rig_id].upload(frame.thermal.data, frame.thermal.cols, frame.thermal.rows, GL_BGR);
+            }
+        }
+
+        if (!headless)
+        {
+            // Keys arrive through the GLFW callbacks while the window polls its events
+            if (app_state->key)
+            {
+                key = app_state->key;
+                app_state->key = 0;
+            }
+            draw_pointcloud(*app, *app_state, layers);
+            draw_thermal_insets(*app, *app_state);
+        }
+
+        if (snapshotInterval > 0 && fused > 0 &&
+            std::chrono::duration<double>(std::chrono::steady_clock::now() - lastSnapshot).count() >= snapshotInterval)
+        {
+            lastSnapshot = std::chrono::steady_clock::now();
+            save_snapshots(rasterizer, snapshotViews, merged, snapshot);
         }
-        process_thermaldata(shelf, gray, color, myImageWidth, myImageHeight, rangeMin, rangeMax);
-        cv::undistort(gray, undistortedImage, cameraMatrixThermal, distCoeffsThermal);
-        cv::undistort(color, undistortedColor, cameraMatrixThermal, distCoeffsThermal);
-        points = pc.calculate(depth);
-        auto pcl_points = points_to_pcl(points, undistortedColor, cameraMatrixThermal, R_thermal_rgb, T_thermal_rgb);
-
-        // pcl_ptr cloud_filtered(new pcl::PointCloud<pcl::PointXYZRGB>);
-        // pcl::PassThrough<pcl::PointXYZRGB> pass;
-        // pass.setInputCloud(pcl_points);
-        // pass.setFilterFieldName("z");
-        // pass.setFilterLimits(0.0, 1.0);
-        // pass.filter(*cloud_filtered);
-
-        std::vector<pcl_ptr> layers;
-        layers.push_back(pcl_points);
-        // layers.push_back(cloud_filtered);
-
-        // cv::imshow("Thermal", undistortedImage);
-        cv::imshow("Thermal Color", undistortedColor);
-        int key = cv::waitKey(1);
-        draw_pointcloud(app, app_state, layers);
 
         if (key == 's')
         {
-            pcl::io::savePCDFileASCII ("thermal.pcd", *pcl_points);
-            std::cout << "Saved pointcloud" << std::endl;
+            // The writer keeps the merged cloud, which is replaced and never modified by the loop
+            if (!writer.save("thermal.pcd", merged))
+            {
+                std::cerr << "Still saving, pointcloud not saved" << std::endl;
+            }
+        }
+        else if (key == 'r')
+        {
+            if (recorder.recording())
+            {
+                recorder.stop();
+            }
+            else
+            {
+                char name[64];
+                time_t now = time(nullptr);
+                strftime(name, sizeof(name), "thermal_%Y%m%d_%H%M%S.pcs", localtime(&now));
+                recorder.start(name);
+            }
         }
     }
-    close(sockfd);
+    stop_rigs(sync);
+    for (auto& worker : workers)
+    {
+        worker.join();
+    }
+    if (headless)
+    {
+        // Wakes the signal thread if the rigs stopped on their own
+        pthread_kill(signalThread.native_handle(), SIGTERM);
+        signalThread.join();
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+        printf("Fused %llu pointclouds in %.1f s (%.1f per second)\n", static_cast<unsigned long long>(fused), elapsed,
+               elapsed > 0 ? fused / elapsed : 0.0);
+    }
     return EXIT_SUCCESS;
 }
 catch (const rs2::error & e)
@@ -354,6 +1168,11 @@ void register_glfw_callbacks(window& app, state& app_state)
             app_state.yaw = app_state.pitch = 0;
             app_state.offset_x = app_state.offset_y = 0.0;
         }
+        else
+        {
+            // GLFW reports letters by their upper case code
+            app_state.key = (key >= GLFW_KEY_A && key <= GLFW_KEY_Z) ? key - GLFW_KEY_A + 'a' : key;
+        }
     };
 }
 
@@ -362,7 +1181,7 @@ void register_glfw_callbacks(window& app, state& app_state)
 /// \param app_state State than contains the view transforms.
 /// \param points Point cloud vector to be rendered.
 /// \return None.
-void draw_pointcloud(window& app, state& app_state, const std::vector<pcl_ptr>& points)
+void draw_pointcloud(window& app, state& app_state, const std::vector<pcl_rig_ptr>& points)
 {
     glPopMatrix();
     glPushAttrib(GL_ALL_ATTRIB_BITS);
@@ -386,22 +1205,9 @@ void draw_pointcloud(window& app, state& app_state, const std::vector<pcl_ptr>&
     glTranslatef(0, 0, -0.5f);
 
     glPointSize(width / 640);
-    glEnable(GL_TEXTURE_2D);
 
-    for (auto&& pc : points)
-    {
-        glBegin(GL_POINTS);
-        for (int i = 0; i < pc->points.size(); i++)
-        {
-            auto&& p = pc->points[i];
-            if (p.z && p.z < 2.0)
-            {
-                glColor3ub(p.r, p.g, p.b);
-                glVertex3f(p.x, p.y, p.z);
-            }
-        }
-        glEnd();
-    }
+    // Uploads a new cloud once, unchanged ones are drawn from their buffers
+    app_state.renderer.draw(points);
 
     glPopMatrix();
     glMatrixMode(GL_PROJECTION);
@@ -410,73 +1216,49 @@ void draw_pointcloud(window& app, state& app_state, const std::vector<pcl_ptr>&
     glPushMatrix();
 }
 
-/// \brief Processes data from UDP to thermal image.
-/// \param shelf Raw temperature image data.
-/// \param gray Thermal image that is generated.
-/// \param myImageWidth Width of the image.
-/// \param myImageHeight Height of the image.
-/// \param rangeMin Minimum temperature to be scaled between 0 and 255.
-/// \param rangeMax Maximum temperature to be scaled between 0 and 255.
+/// \brief Draws the thermal image of every rig as an inset along the top of the window, from
+/// the textures uploaded when the images arrived.
+/// \param app Window that renders the point cloud.
+/// \param app_state State that holds the thermal textures.
 /// \return None.
-void process_thermaldata(uint8_t (*shelf)[PACKET_SIZE * PACKETS_PER_FRAME],
-                        cv::Mat& gray,
-                        cv::Mat& color,
-                        int& myImageWidth,
-                        int& myImageHeight,
-                        uint16_t& rangeMin,
-                        uint16_t& rangeMax)
+void draw_thermal_insets(window& app, state& app_state)
 {
-    float diff = rangeMax - rangeMin;
-    float scale = 255 / diff;
-    uint16_t n_zero_value_drop_frame = 0;
-    const int *selectedColormap = colormap_ironblack;
-	int selectedColormapSize = get_size_colormap_ironblack();
-
-    int row, column;
-    uint16_t value;
-    uint16_t valueFrameBuffer;
-    for (int iSegment = 1; iSegment <= 4; iSegment++)
-    {
-        int ofsRow = 30 * (iSegment - 1);
-        for (int i = 0; i < FRAME_SIZE_UINT16; i++)
+    // draw_pointcloud replaced the window's transform, map window coordinates with the origin
+    // at the top left here and restore the matrices afterwards
+    glMatrixMode(GL_PROJECTION);
+    glPushMatrix();
+    glLoadIdentity();
+    glOrtho(0, app.width(), app.height(), 0, -1, +1);
+    glMatrixMode(GL_MODELVIEW);
+    glPushMatrix();
+    glLoadIdentity();
+    float x = INSET_MARGIN;
+    float width = app.width() * INSET_FRACTION;
+    for (size_t i = 0; i < app_state.thermal.size(); i++)
+    {
+        texture& t = app_state.thermal[i];
+        if (!t.get_gl_handle())
         {
-            if (i % PACKET_SIZE_UINT16 < 2)
-            {
-                continue;
-            }
-            valueFrameBuffer = (shelf[iSegment - 1][i * 2] << 8) + shelf[iSegment - 1][i * 2 + 1];
-            if (valueFrameBuffer == 0)
-            {
-                n_zero_value_drop_frame++;
-                break;
-            }
-            if (valueFrameBuffer <= rangeMin)
-            {
-                value = 0;
-            }
-            else if (valueFrameBuffer > rangeMax)
-            {
-                value = 255;
-            }
-            else
-            {
-                value = ((valueFrameBuffer - rangeMin) * scale);
-            }
-            int ofs_r = 3 * value + 0; if (selectedColormapSize <= ofs_r) ofs_r = selectedColormapSize - 1;
-            int ofs_g = 3 * value + 1; if (selectedColormapSize <= ofs_g) ofs_g = selectedColormapSize - 1;
-            int ofs_b = 3 * value + 2; if (selectedColormapSize <= ofs_b) ofs_b = selectedColormapSize - 1;
-            cv::Vec3b rgbcolor(selectedColormap[ofs_b], selectedColormap[ofs_g], selectedColormap[ofs_r]);
-            column = (i % PACKET_SIZE_UINT16) - 2 + (myImageWidth / 2) * ((i % (PACKET_SIZE_UINT16 * 2)) / PACKET_SIZE_UINT16);
-            row = i / PACKET_SIZE_UINT16 / 2 + ofsRow;
-            if (row < myImageHeight && column < myImageWidth)
-            {
-                color.at<cv::Vec3b>(row, column) = rgbcolor;
-                gray.at<uint8_t>(row, column) = value;
-            }
+            continue;
         }
+        float height = width * t.height() / t.width();
+        glBindTexture(GL_TEXTURE_2D, t.get_gl_handle());
+        glColor3f(1.0f, 1.0f, 1.0f);
+        glEnable(GL_TEXTURE_2D);
+        glBegin(GL_QUADS);
+        glTexCoord2f(0, 0); glVertex2f(x, INSET_MARGIN);
+        glTexCoord2f(0, 1); glVertex2f(x, INSET_MARGIN + height);
+        glTexCoord2f(1, 1); glVertex2f(x + width, INSET_MARGIN + height);
+        glTexCoord2f(1, 0); glVertex2f(x + width, INSET_MARGIN);
+        glEnd();
+        glDisable(GL_TEXTURE_2D);
+        glBindTexture(GL_TEXTURE_2D, 0);
+        std::string label = app_state.thermal.size() == 1 ? "Thermal" : "Thermal " + std::to_string(i);
+        draw_text(static_cast<int>(x + 5), static_cast<int>(INSET_MARGIN + height + 12), label.c_str());
+        x += width + INSET_MARGIN;
     }
-    if (n_zero_value_drop_frame != 0)
-    {
-        n_zero_value_drop_frame = 0;
-    }
+    glPopMatrix();
+    glMatrixMode(GL_PROJECTION);
+    glPopMatrix();
+    glMatrixMode(GL_MODELVIEW);
 }
@@ -0,0 +1,319 @@
+#include <DepthSource.h>
+
+#include <cmath>
+#include <cstring>
+#include <time.h>
+
+/// \file DepthSource.cpp
+/// \brief Live, bag and synthetic depth sources.
+
+// Synthetic scene in the color camera frame (x right, y down, z forward), meters
+#define SYNTHETIC_FOCAL 0.71f       // Focal length relative to the image width, about a D435 color camera
+#define SYNTHETIC_WALL_Z 4.0f
+#define SYNTHETIC_FLOOR_Y 1.2f      // Camera height above the floor
+#define SYNTHETIC_PERSON_Z 2.0f
+#define SYNTHETIC_PERSON_RADIUS 0.25f
+#define SYNTHETIC_PERSON_HEIGHT 1.8f
+#define SYNTHETIC_PERSON_PERIOD 8.0 // Same walk as the person of lepton_sim
+#define SYNTHETIC_FRAMES_WAIT 4     // Framesets read before giving up on a complete one
+
+/// \brief Camera or bag played through an rs2::pipeline.
+class pipeline_depth_source : public depth_source
+{
+public:
+    explicit pipeline_depth_source(const depth_source_options& options);
+    bool wait_for_frames(rs2::frameset& frames, unsigned int timeout_ms) override;
+    rs2_intrinsics color_intrinsics() const override;
+    bool finished() const override;
+    void stop() override;
+    std::string name() const override { return _name; }
+
+private:
+    rs2::pipeline _pipe;
+    rs2::pipeline_profile _profile;
+    bool _bag;
+    bool _loop;
+    bool _stopped;
+    std::string _name;
+};
+
+/// \brief Walking person in front of a wall, rendered into a software device.
+class synthetic_depth_source : public depth_source
+{
+public:
+    explicit synthetic_depth_source(const depth_source_options& options);
+    ~synthetic_depth_source() override;
+    bool wait_for_frames(rs2::frameset& frames, unsigned int timeout_ms) override;
+    rs2_intrinsics color_intrinsics() const override { return _intrinsics; }
+    void stop() override;
+    std::string name() const override { return "synthetic scene"; }
+
+private:
+    void render(double t, uint16_t* depth, uint8_t* color) const;
+
+    rs2_intrinsics _intrinsics;
+    int _fps;
+    bool _realTime;
+    bool _stopped;
+    int _frameNumber;
+    int64_t _start_ns;
+    rs2::software_device _device;
+    rs2::software_sensor _depthSensor;
+    rs2::software_sensor _colorSensor;
+    rs2::stream_profile _depthStream;
+    rs2::stream_profile _colorStream;
+    rs2::syncer _syncer;
+};
+
+/// \brief Monotonic clock in nanoseconds, paces the synthetic frames.
+static int64_t monotonic_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<int64_t>(ts.tv_sec) * 1000000000LL + ts.tv_nsec;
+}
+
+/// \brief Opens a camera or a bag. A live camera stamps its frames with the host clock so
+/// frames of different cameras can be compared, a bag keeps its recorded timestamps.
+/// \param options Source and its settings.
+pipeline_depth_source::pipeline_depth_source(const depth_source_options& options)
+    : _bag(options.type == DEPTH_SOURCE_BAG), _loop(options.loop), _stopped(false)
+{
+    rs2::config cfg;
+    if (_bag)
+    {
+        // A bag plays the streams it holds, they cannot be chosen
+        cfg.enable_device_from_file(options.file, options.loop);
+        _name = options.file;
+    }
+    else
+    {
+        if (!options.serial.empty())
+        {
+            cfg.enable_device(options.serial);
+        }
+        cfg.enable_stream(RS2_STREAM_DEPTH, options.width, options.height, RS2_FORMAT_Z16, options.fps);
+        cfg.enable_stream(RS2_STREAM_COLOR, options.width, options.height, RS2_FORMAT_RGB8, options.fps);
+        _name = options.serial.empty() ? "RealSense" : "RealSense " + options.serial;
+    }
+    _profile = _pipe.start(cfg);
+    if (_bag)
+    {
+        // Without real time playback the pipeline waits for every frame to be read instead of dropping
+        _profile.get_device().as<rs2::playback>().set_real_time(options.real_time);
+    }
+    else
+    {
+        rs2::depth_sensor sensor = _profile.get_device().first<rs2::depth_sensor>();
+        if (sensor.supports(RS2_OPTION_GLOBAL_TIME_ENABLED))
+        {
+            sensor.set_option(RS2_OPTION_GLOBAL_TIME_ENABLED, 1.f);
+        }
+    }
+}
+
+bool pipeline_depth_source::wait_for_frames(rs2::frameset& frames, unsigned int timeout_ms)
+{
+    if (_stopped || !_pipe.try_wait_for_frames(&frames, timeout_ms))
+    {
+        return false;
+    }
+    return frames.get_depth_frame() && frames.get_color_frame();
+}
+
+rs2_intrinsics pipeline_depth_source::color_intrinsics() const
+{
+    return _profile.get_stream(RS2_STREAM_COLOR).as<rs2::video_stream_profile>().get_intrinsics();
+}
+
+bool pipeline_depth_source::finished() const
+{
+    return _stopped || (_bag && !_loop &&
+                        _profile.get_device().as<rs2::playback>().current_status() == RS2_PLAYBACK_STATUS_STOPPED);
+}
+
+void pipeline_depth_source::stop()
+{
+    if (!_stopped)
+    {
+        _stopped = true;
+        _pipe.stop();
+    }
+}
+
+/// \brief Creates a software device with a depth and a color sensor sharing the same
+/// intrinsics, so depth is already aligned to color.
+/// \param options Image size, frame rate and pacing.
+synthetic_depth_source::synthetic_depth_source(const depth_source_options& options)
+    : _fps(options.fps), _realTime(options.real_time), _stopped(false), _frameNumber(0), _start_ns(0),
+      _depthSensor(_device.add_sensor("Depth")), _colorSensor(_device.add_sensor("Color"))
+{
+    float focal = SYNTHETIC_FOCAL * options.width;
+    _intrinsics.width = options.width;
+    _intrinsics.height = options.height;
+    _intrinsics.ppx = options.width / 2.f;
+    _intrinsics.ppy = options.height / 2.f;
+    _intrinsics.fx = focal;
+    _intrinsics.fy = focal;
+    _intrinsics.model = RS2_DISTORTION_NONE;
+    memset(_intrinsics.coeffs, 0, sizeof(_intrinsics.coeffs));
+
+    _depthStream = _depthSensor.add_video_stream({RS2_STREAM_DEPTH, 0, 0, options.width, options.height, options.fps,
+                                                  2, RS2_FORMAT_Z16, _intrinsics});
+    _colorStream = _colorSensor.add_video_stream({RS2_STREAM_COLOR, 0, 1, options.width, options.height, options.fps,
+                                                  3, RS2_FORMAT_RGB8, _intrinsics});
+    _depthSensor.add_read_only_option(RS2_OPTION_DEPTH_UNITS, 0.001f);
+    _depthStream.register_extrinsics_to(_colorStream, {{1, 0, 0, 0, 1, 0, 0, 0, 1}, {0, 0, 0}});
+    _device.create_matcher(RS2_MATCHER_DLR_C);
+    _depthSensor.open(_depthStream);
+    _colorSensor.open(_colorStream);
+    _depthSensor.start(_syncer);
+    _colorSensor.start(_syncer);
+}
+
+synthetic_depth_source::~synthetic_depth_source()
+{
+    stop();
+}
+
+/// \brief Renders the next frame, injects it and reads back the matched frameset.
+/// Real time frames are stamped with the host clock, otherwise with the time of the frame in the scene.
+/// \param frames The frameset.
+/// \param timeout_ms Longest wait for the syncer.
+/// \return False once stopped or if no complete frameset came out of the syncer.
+bool synthetic_depth_source::wait_for_frames(rs2::frameset& frames, unsigned int timeout_ms)
+{
+    if (_stopped)
+    {
+        return false;
+    }
+    int64_t period_ns = 1000000000LL / _fps;
+    if (_frameNumber == 0)
+    {
+        _start_ns = monotonic_ns();
+    }
+    double timestamp_ms = _frameNumber * 1000.0 / _fps;
+    if (_realTime)
+    {
+        int64_t deadline_ns = _start_ns + _frameNumber * period_ns;
+        struct timespec ts;
+        ts.tv_sec = deadline_ns / 1000000000LL;
+        ts.tv_nsec = deadline_ns % 1000000000LL;
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr);
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        timestamp_ms = now.tv_sec * 1000.0 + now.tv_nsec / 1e6;
+    }
+
+    size_t pixels = static_cast<size_t>(_intrinsics.width) * _intrinsics.height;
+    uint8_t* depth = new uint8_t[pixels * 2];
+    uint8_t* color = new uint8_t[pixels * 3];
+    render(_frameNumber / static_cast<double>(_fps), reinterpret_cast<uint16_t*>(depth), color);
+
+    // The frames own their pixels, librealsense frees them once the last reference is gone
+    rs2_software_video_frame depthFrame = {};
+    depthFrame.pixels = depth;
+    depthFrame.deleter = [](void* p) { delete[] static_cast<uint8_t*>(p); };
+    depthFrame.stride = _intrinsics.width * 2;
+    depthFrame.bpp = 2;
+    depthFrame.timestamp = timestamp_ms;
+    depthFrame.domain = RS2_TIMESTAMP_DOMAIN_SYSTEM_TIME;
+    depthFrame.frame_number = _frameNumber;
+    depthFrame.profile = _depthStream.get();
+    depthFrame.depth_units = 0.001f;
+    rs2_software_video_frame colorFrame = depthFrame;
+    colorFrame.pixels = color;
+    colorFrame.stride = _intrinsics.width * 3;
+    colorFrame.bpp = 3;
+    colorFrame.profile = _colorStream.get();
+    _depthSensor.on_video_frame(depthFrame);
+    _colorSensor.on_video_frame(colorFrame);
+    _frameNumber++;
+
+    // The syncer may let a single frame through before its match arrives
+    for (int i = 0; i < SYNTHETIC_FRAMES_WAIT; i++)
+    {
+        if (!_syncer.try_wait_for_frames(&frames, timeout_ms))
+        {
+            return false;
+        }
+        if (frames.get_depth_frame() && frames.get_color_frame())
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+void synthetic_depth_source::stop()
+{
+    if (!_stopped)
+    {
+        _stopped = true;
+        _depthSensor.stop();
+        _colorSensor.stop();
+        _depthSensor.close();
+        _colorSensor.close();
+    }
+}
+
+/// \brief Ray casts the scene: a wall, the floor and a person (a vertical cylinder) walking
+/// left and right. Depth is in millimeters, 0 where nothing is hit.
+/// \param t Time of the frame in seconds.
+/// \param depth Destination of width * height depth values.
+/// \param color Destination of width * height RGB pixels.
+/// \return None.
+void synthetic_depth_source::render(double t, uint16_t* depth, uint8_t* color) const
+{
+    float personX = static_cast<float>(1.0 * sin(2.0 * M_PI * t / SYNTHETIC_PERSON_PERIOD));
+    const float r2 = SYNTHETIC_PERSON_RADIUS * SYNTHETIC_PERSON_RADIUS;
+    for (int v = 0; v < _intrinsics.height; v++)
+    {
+        float dy = (v - _intrinsics.ppy) / _intrinsics.fy;
+        for (int u = 0; u < _intrinsics.width; u++)
+        {
+            float dx = (u - _intrinsics.ppx) / _intrinsics.fx;
+            // Rays are (dx, dy, 1), so the distance along a ray is the depth
+            float z = SYNTHETIC_WALL_Z;
+            uint8_t rgb[3] = {200, 196, 188};
+            if (dy > 0.f && SYNTHETIC_FLOOR_Y / dy < z)
+            {
+                z = SYNTHETIC_FLOOR_Y / dy;
+                // Checkered floor, 0.5 m tiles
+                bool dark = (static_cast<int>(std::floor(z * dx * 2.f)) + static_cast<int>(std::floor(z * 2.f))) & 1;
+                rgb[0] = rgb[1] = rgb[2] = dark ? 90 : 150;
+            }
+            // Cylinder around (personX, SYNTHETIC_PERSON_Z): (z dx - x)^2 + (z - Z)^2 = r^2
+            float a = dx * dx + 1.f;
+            float b = -2.f * (dx * personX + SYNTHETIC_PERSON_Z);
+            float c = personX * personX + SYNTHETIC_PERSON_Z * SYNTHETIC_PERSON_Z - r2;
+            float discriminant = b * b - 4.f * a * c;
+            if (discriminant >= 0.f)
+            {
+                float hit = (-b - std::sqrt(discriminant)) / (2.f * a);
+                float y = hit * dy;
+                if (hit > 0.f && hit < z && y <= SYNTHETIC_FLOOR_Y && y >= SYNTHETIC_FLOOR_Y - SYNTHETIC_PERSON_HEIGHT)
+                {
+                    z = hit;
+                    rgb[0] = 60;
+                    rgb[1] = 80;
+                    rgb[2] = 160;
+                }
+            }
+            size_t i = static_cast<size_t>(v) * _intrinsics.width + u;
+            depth[i] = static_cast<uint16_t>(z * 1000.f + 0.5f);
+            color[3 * i] = rgb[0];
+            color[3 * i + 1] = rgb[1];
+            color[3 * i + 2] = rgb[2];
+        }
+    }
+}
+
+std::unique_ptr<depth_source> open_depth_source(const depth_source_options& options)
+{
+    if (options.type == DEPTH_SOURCE_SYNTHETIC)
+    {
+        return std::unique_ptr<depth_source>(new synthetic_depth_source(options));
+    }
+    return std::unique_ptr<depth_source>(new pipeline_depth_source(options));
+}
@@ -0,0 +1,273 @@
+#include <LeptonDecoder.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <sys/socket.h>
+
+/// \file LeptonDecoder.cpp
+/// \brief Registry of the decoder specializations and frame reception.
+
+#define MAX_SEGMENT_RESTARTS 8
+
+static const lepton_decoder leptonDecoders[] = {
+    make_lepton_decoder<lepton3_layout>("lepton3"),
+    make_lepton_decoder<lepton3_telemetry_header_layout>("lepton3-telemetry-header"),
+    make_lepton_decoder<lepton3_telemetry_footer_layout>("lepton3-telemetry-footer"),
+    make_lepton_decoder<lepton2_layout>("lepton2"),
+    make_lepton_decoder<lepton2_telemetry_header_layout>("lepton2-telemetry-header"),
+    make_lepton_decoder<lepton2_telemetry_footer_layout>("lepton2-telemetry-footer"),
+};
+
+const lepton_decoder* find_lepton_decoder(const char* name)
+{
+    for (const auto& decoder : leptonDecoders)
+    {
+        if (strcmp(decoder.name, name) == 0)
+        {
+            return &decoder;
+        }
+    }
+    return nullptr;
+}
+
+const lepton_decoder* detect_lepton_decoder(const uint8_t* datagram, ssize_t size)
+{
+    bool segmented = size > LEPTON_SEGMENT_PACKET * LEPTON_PACKET_SIZE &&
+                     lepton_segment_number(datagram, LEPTON_PACKET_SIZE) != 0;
+    for (const auto& decoder : leptonDecoders)
+    {
+        if (decoder.telemetry == TELEMETRY_FOOTER || decoder.segment_size != size)
+        {
+            continue;
+        }
+        // A Lepton 2 segment has the size of a Lepton 3 segment but no segment number
+        if ((decoder.segments > 1) == segmented)
+        {
+            return &decoder;
+        }
+    }
+    return nullptr;
+}
+
+const lepton_decoder* detect_lepton_stream(int sockfd)
+{
+    uint8_t datagram[LEPTON_MAX_PACKETS_PER_SEGMENT * LEPTON_PACKET_SIZE + 1];
+    while (true)
+    {
+        int64_t timestamp_ns;
+        ssize_t size = receive_segment(sockfd, datagram, sizeof(datagram), timestamp_ns);
+        if (size < 0)
+        {
+            return nullptr;
+        }
+        const lepton_decoder* decoder = detect_lepton_decoder(datagram, size);
+        if (decoder)
+        {
+            printf("Thermal stream: %s\n", decoder->name);
+            return decoder;
+        }
+    }
+}
+
+void print_lepton_decoders()
+{
+    for (const auto& decoder : leptonDecoders)
+    {
+        printf("  %-26s %dx%d, %d segment(s) of %d packets\n", decoder.name, decoder.width, decoder.height,
+               decoder.segments, decoder.packets_per_segment);
+    }
+}
+
+ssize_t receive_lepton_frame(int sockfd, const lepton_decoder& decoder, uint8_t* frame, ssize_t* received,
+                             thermal_timestamps& timestamps, uint32_t* kernel_drops)
+{
+    timestamps.segments = decoder.segments;
+    int restarts = 0;
+    int s = 0;
+    while (s < decoder.segments)
+    {
+        uint8_t* segment = frame + s * decoder.segment_size;
+        received[s] = receive_segment(sockfd, segment, decoder.segment_size, timestamps.segment_ns[s], kernel_drops);
+        if (received[s] < 0)
+        {
+            return received[s];
+        }
+        // Give up on locking after a few tries, validation then reports the bad segment numbers
+        if (decoder.segments > 1 && received[s] >= decoder.segment_size && restarts < MAX_SEGMENT_RESTARTS)
+        {
+            int number = lepton_segment_number(segment, LEPTON_PACKET_SIZE);
+            if (number != s + 1)
+            {
+                restarts++;
+                if (number == 1)
+                {
+                    memmove(frame, segment, decoder.segment_size);
+                    received[0] = received[s];
+                    timestamps.segment_ns[0] = timestamps.segment_ns[s];
+                    s = 1;
+                }
+                else
+                {
+                    s = 0;
+                }
+                continue;
+            }
+        }
+        s++;
+    }
+    timestamps.frame_ns = timestamps.segment_ns[0];
+    return received[decoder.segments - 1];
+}
+
+/// \brief Starts the receive thread.
+/// \param sockfd Socket from open_thermal_socket, closed by the caller after the receiver.
+/// \param decoder Layout of the stream.
+/// \param options CPU and priority of the receive thread.
+lepton_receiver::lepton_receiver(int sockfd, const lepton_decoder& decoder, const receive_options& options)
+    : _sockfd(sockfd), _decoder(decoder), _first(0), _count(0), _running(true), _failed(false), _overruns(0)
+{
+    for (auto& s : _slots)
+    {
+        s.frame.resize(decoder.frame_size());
+    }
+    _thread = std::thread(&lepton_receiver::run, this, options);
+}
+
+/// \brief Stops the receive thread.
+lepton_receiver::~lepton_receiver()
+{
+    stop();
+}
+
+/// \brief Stops the receive thread, has to be called before the socket is closed. A shutdown of
+/// the socket wakes a blocked receive.
+/// \return None.
+void lepton_receiver::stop()
+{
+    if (!_thread.joinable())
+    {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _running = false;
+    }
+    shutdown(_sockfd, SHUT_RD);
+    _thread.join();
+    if (_overruns)
+    {
+        printf("Thermal receive queue: %llu frames dropped\n", static_cast<unsigned long long>(_overruns));
+    }
+}
+
+/// \brief Receive thread: receives frames into the queue until stopped or the socket fails.
+/// When the queue is full the oldest frame is dropped, the newest one is worth more.
+/// \param options CPU and priority of the thread.
+/// \return None.
+void lepton_receiver::run(receive_options options)
+{
+    configure_receive_thread(options);
+    slot incoming;
+    incoming.frame.resize(_decoder.frame_size());
+    while (true)
+    {
+        incoming.kernel_drops = 0;
+        incoming.result = receive_lepton_frame(_sockfd, _decoder, incoming.frame.data(), incoming.received,
+                                               incoming.timestamps, &incoming.kernel_drops);
+        incoming.error = errno;
+        bool failed = incoming.result < 0 && incoming.error != EAGAIN && incoming.error != EWOULDBLOCK;
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            if (!_running)
+            {
+                return;
+            }
+            if (_count == LEPTON_RECEIVER_QUEUE)
+            {
+                _first = (_first + 1) % LEPTON_RECEIVER_QUEUE;
+                _count--;
+                _overruns++;
+            }
+            // Swap the buffers instead of copying the frame
+            std::swap(_slots[(_first + _count) % LEPTON_RECEIVER_QUEUE], incoming);
+            _count++;
+            _failed = failed;
+        }
+        _cv.notify_one();
+        if (failed)
+        {
+            return;
+        }
+    }
+}
+
+/// \brief Takes the oldest received frame, waits for one if the queue is empty. Same results
+/// as receive_lepton_frame on the socket. For recorders, which must keep every frame.
+/// \param frame Destination of frame_size() bytes.
+/// \param received Bytes received for each segment.
+/// \param timestamps Kernel receive time of each segment.
+/// \param kernel_drops Updated with the SO_RXQ_OVFL count, may be null.
+/// \return Bytes of the last datagram, -1 if the socket failed or timed out (errno is set).
+ssize_t lepton_receiver::receive(uint8_t* frame, ssize_t* received, thermal_timestamps& timestamps, uint32_t* kernel_drops)
+{
+    return take(false, frame, received, timestamps, kernel_drops);
+}
+
+/// \brief Takes the newest received frame and drops the older ones as overruns, waits for one if
+/// the queue is empty. For fusion with depth, which needs the thermal frame closest to now
+/// rather than every frame. The skipped frames also show as gaps in the frame counter.
+/// \param frame Destination of frame_size() bytes.
+/// \param received Bytes received for each segment.
+/// \param timestamps Kernel receive time of each segment.
+/// \param kernel_drops Updated with the SO_RXQ_OVFL count, may be null.
+/// \return Bytes of the last datagram, -1 if the socket failed or timed out (errno is set).
+ssize_t lepton_receiver::receive_latest(uint8_t* frame, ssize_t* received, thermal_timestamps& timestamps,
+                                        uint32_t* kernel_drops)
+{
+    return take(true, frame, received, timestamps, kernel_drops);
+}
+
+/// \brief Takes the oldest or the newest queued frame, see receive and receive_latest.
+ssize_t lepton_receiver::take(bool latest, uint8_t* frame, ssize_t* received, thermal_timestamps& timestamps,
+                              uint32_t* kernel_drops)
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    _cv.wait(lock, [this] { return _count > 0 || _failed; });
+    if (_count == 0)
+    {
+        // The receive thread has ended on a socket error
+        errno = EIO;
+        return -1;
+    }
+    while (latest && _count > 1)
+    {
+        _first = (_first + 1) % LEPTON_RECEIVER_QUEUE;
+        _count--;
+        _overruns++;
+    }
+    slot& s = _slots[_first];
+    _first = (_first + 1) % LEPTON_RECEIVER_QUEUE;
+    _count--;
+    if (kernel_drops && s.kernel_drops)
+    {
+        *kernel_drops = s.kernel_drops;
+    }
+    if (s.result < 0)
+    {
+        errno = s.error;
+        return s.result;
+    }
+    memcpy(frame, s.frame.data(), s.frame.size());
+    memcpy(received, s.received, sizeof(s.received));
+    timestamps = s.timestamps;
+    return s.result;
+}
+
+/// \brief Frames dropped so far because the processing fell behind the queue.
+/// \return Number of frames.
+uint64_t lepton_receiver::overruns()
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _overruns;
+}
@@ -0,0 +1,168 @@
+#include <LeptonPacket.h>
+
+#include <cstdio>
+
+/// \file LeptonPacket.cpp
+/// \brief Validation of VoSPI packets before a frame is decoded.
+
+#define CRC_POLYNOMIAL 0x1021
+
+/// \brief Slice-by-8 tables. crcTable[k][b] is the CRC of byte b followed by k zero bytes,
+/// so 8 bytes are folded in with 8 independent lookups instead of a chain of 8.
+struct crc_tables
+{
+    uint16_t table[8][256];
+
+    crc_tables()
+    {
+        for (int b = 0; b < 256; b++)
+        {
+            uint16_t crc = static_cast<uint16_t>(b << 8);
+            for (int bit = 0; bit < 8; bit++)
+            {
+                crc = (crc & 0x8000) ? static_cast<uint16_t>((crc << 1) ^ CRC_POLYNOMIAL) : static_cast<uint16_t>(crc << 1);
+            }
+            table[0][b] = crc;
+        }
+        for (int k = 1; k < 8; k++)
+        {
+            for (int b = 0; b < 256; b++)
+            {
+                uint16_t prev = table[k - 1][b];
+                table[k][b] = static_cast<uint16_t>((prev << 8) ^ table[0][prev >> 8]);
+            }
+        }
+    }
+};
+
+static const crc_tables crcTables;
+
+uint16_t lepton_crc16(const uint8_t* data, size_t size, uint16_t crc)
+{
+    const uint16_t (*t)[256] = crcTables.table;
+    while (size >= 8)
+    {
+        crc = t[7][(crc >> 8) ^ data[0]] ^ t[6][(crc & 0xFF) ^ data[1]] ^
+              t[5][data[2]] ^ t[4][data[3]] ^ t[3][data[4]] ^ t[2][data[5]] ^ t[1][data[6]] ^ t[0][data[7]];
+        data += 8;
+        size -= 8;
+    }
+    while (size--)
+    {
+        crc = static_cast<uint16_t>((crc << 8) ^ t[0][(crc >> 8) ^ *data++]);
+    }
+    return crc;
+}
+
+bool lepton_packet_crc_ok(const uint8_t* packet, size_t packetSize)
+{
+    const uint8_t header[4] = {static_cast<uint8_t>(packet[0] & 0x0F), packet[1], 0, 0};
+    uint16_t crc = lepton_crc16(header, sizeof(header));
+    crc = lepton_crc16(packet + 4, packetSize - 4, crc);
+    return crc == ((packet[2] << 8) | packet[3]);
+}
+
+drop_reason validate_segment(const uint8_t* segment, ssize_t received, int packets, int packetSize, int segmentNumber, bool checkCrc,
+                             int pixelBegin, int pixelEnd)
+{
+    if (received < static_cast<ssize_t>(packets) * packetSize)
+    {
+        return DROP_SHORT;
+    }
+    for (int p = 0; p < packets; p++)
+    {
+        const uint8_t* packet = segment + p * packetSize;
+        if (lepton_discard_packet(packet))
+        {
+            return DROP_DISCARD;
+        }
+        if ((((packet[0] & 0x0F) << 8) | packet[1]) != p)
+        {
+            return DROP_PACKET_ORDER;
+        }
+    }
+    if (segmentNumber > 0 && packets > LEPTON_SEGMENT_PACKET &&
+        lepton_segment_number(segment, packetSize) != segmentNumber)
+    {
+        return DROP_SEGMENT;
+    }
+    if (checkCrc)
+    {
+        for (int p = 0; p < packets; p++)
+        {
+            if (!lepton_packet_crc_ok(segment + p * packetSize, packetSize))
+            {
+                return DROP_CRC;
+            }
+        }
+    }
+    for (int p = pixelBegin; p < pixelEnd; p++)
+    {
+        const uint8_t* payload = segment + p * packetSize + 4;
+        for (int i = 0; i < packetSize - 4; i += 2)
+        {
+            if ((payload[i] | payload[i + 1]) == 0)
+            {
+                return DROP_ZERO;
+            }
+        }
+    }
+    return DROP_NONE;
+}
+
+const char* drop_reason_name(drop_reason reason)
+{
+    switch (reason)
+    {
+    case DROP_NONE: return "valid";
+    case DROP_SHORT: return "short datagram";
+    case DROP_DISCARD: return "discard packet";
+    case DROP_PACKET_ORDER: return "packet order";
+    case DROP_SEGMENT: return "segment number";
+    case DROP_CRC: return "crc";
+    case DROP_ZERO: return "zero pixel";
+    case DROP_DUPLICATE: return "duplicate frame";
+    case DROP_FFC: return "ffc in progress";
+    default: return "unknown";
+    }
+}
+
+/// \brief Counts a checked frame.
+/// \param reason Result of the check, DROP_NONE for a valid frame.
+/// \return None.
+void drop_stats::add(drop_reason reason)
+{
+    frames++;
+    dropped[reason]++;
+}
+
+/// \brief Prints how many frames were checked and why they were dropped.
+/// \return None.
+void drop_stats::print() const
+{
+    uint64_t total = frames - dropped[DROP_NONE];
+    printf("Thermal frames: %llu checked, %llu dropped\n", static_cast<unsigned long long>(frames), static_cast<unsigned long long>(total));
+    for (int r = DROP_NONE + 1; r < DROP_REASONS; r++)
+    {
+        if (dropped[r] != 0)
+        {
+            printf("  %-16s %llu\n", drop_reason_name(static_cast<drop_reason>(r)), static_cast<unsigned long long>(dropped[r]));
+        }
+    }
+    if (lost != 0)
+    {
+        printf("  %-16s %llu\n", "lost", static_cast<unsigned long long>(lost));
+    }
+}
+
+/// \brief Resets all counters.
+/// \return None.
+void drop_stats::clear()
+{
+    frames = 0;
+    lost = 0;
+    for (int r = 0; r < DROP_REASONS; r++)
+    {
+        dropped[r] = 0;
+    }
+}
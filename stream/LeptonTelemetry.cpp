@@ -0,0 +1,140 @@
+#include <LeptonTelemetry.h>
+
+/// \file LeptonTelemetry.cpp
+/// \brief Per frame metadata decoded from telemetry row A of the Lepton.
+
+#define TELEMETRY_ROW_WORDS 80
+#define TELEMETRY_REVISION 0
+#define TELEMETRY_UPTIME 1
+#define TELEMETRY_STATUS 3
+#define TELEMETRY_FRAME_COUNTER 20
+#define TELEMETRY_FRAME_MEAN 22
+#define TELEMETRY_FPA_TEMP 24
+#define TELEMETRY_HOUSING_TEMP 26
+#define TELEMETRY_FPA_TEMP_LAST_FFC 29
+#define TELEMETRY_LAST_FFC 30
+
+#define STATUS_FFC_DESIRED (1u << 3)
+#define STATUS_FFC_STATE_SHIFT 4
+#define STATUS_OVERTEMP (1u << 20)
+
+// A larger jump of the frame counter is a restart of the Lepton, not lost frames
+#define MAX_FRAME_COUNTER_GAP 10000
+
+/// \brief 32 bit value sent as two words, least significant word first.
+static uint32_t telemetry_uint32(const uint16_t* words, int index)
+{
+    return static_cast<uint32_t>(words[index]) | (static_cast<uint32_t>(words[index + 1]) << 16);
+}
+
+/// \brief Temperature in Kelvin x 100 to Celsius.
+static float telemetry_celsius(uint16_t kelvin100)
+{
+    return kelvin100 / 100.f - 273.15f;
+}
+
+/// \brief Writes a 32 bit value as two words, least significant word first.
+static void set_telemetry_uint32(uint16_t* words, int index, uint32_t value)
+{
+    words[index] = static_cast<uint16_t>(value);
+    words[index + 1] = static_cast<uint16_t>(value >> 16);
+}
+
+/// \brief Temperature in Celsius to Kelvin x 100.
+static uint16_t telemetry_kelvin100(float celsius)
+{
+    return static_cast<uint16_t>((celsius + 273.15f) * 100.f + 0.5f);
+}
+
+void set_lepton_status(uint32_t status, lepton_telemetry& telemetry)
+{
+    telemetry.status = status;
+    telemetry.ffc = static_cast<ffc_state>((status >> STATUS_FFC_STATE_SHIFT) & 0x3);
+    telemetry.ffc_desired = (status & STATUS_FFC_DESIRED) != 0;
+    telemetry.overtemp = (status & STATUS_OVERTEMP) != 0;
+}
+
+bool parse_lepton_telemetry(const uint16_t* words, int count, lepton_telemetry& telemetry)
+{
+    telemetry = lepton_telemetry();
+    if (!words || count < TELEMETRY_ROW_WORDS)
+    {
+        return false;
+    }
+    telemetry.valid = true;
+    telemetry.revision = words[TELEMETRY_REVISION];
+    telemetry.uptime_ms = telemetry_uint32(words, TELEMETRY_UPTIME);
+    set_lepton_status(telemetry_uint32(words, TELEMETRY_STATUS), telemetry);
+    telemetry.frame_counter = telemetry_uint32(words, TELEMETRY_FRAME_COUNTER);
+    telemetry.frame_mean = words[TELEMETRY_FRAME_MEAN];
+    telemetry.fpa_temp = telemetry_celsius(words[TELEMETRY_FPA_TEMP]);
+    telemetry.housing_temp = telemetry_celsius(words[TELEMETRY_HOUSING_TEMP]);
+    telemetry.fpa_temp_last_ffc = telemetry_celsius(words[TELEMETRY_FPA_TEMP_LAST_FFC]);
+    telemetry.last_ffc_ms = telemetry_uint32(words, TELEMETRY_LAST_FFC);
+    return true;
+}
+
+void format_lepton_telemetry(const lepton_telemetry& telemetry, uint16_t* words, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        words[i] = 0;
+    }
+    if (count < TELEMETRY_ROW_WORDS)
+    {
+        return;
+    }
+    words[TELEMETRY_REVISION] = telemetry.revision;
+    set_telemetry_uint32(words, TELEMETRY_UPTIME, telemetry.uptime_ms);
+    set_telemetry_uint32(words, TELEMETRY_STATUS, telemetry.status);
+    set_telemetry_uint32(words, TELEMETRY_FRAME_COUNTER, telemetry.frame_counter);
+    words[TELEMETRY_FRAME_MEAN] = telemetry.frame_mean;
+    words[TELEMETRY_FPA_TEMP] = telemetry_kelvin100(telemetry.fpa_temp);
+    words[TELEMETRY_HOUSING_TEMP] = telemetry_kelvin100(telemetry.housing_temp);
+    words[TELEMETRY_FPA_TEMP_LAST_FFC] = telemetry_kelvin100(telemetry.fpa_temp_last_ffc);
+    set_telemetry_uint32(words, TELEMETRY_LAST_FFC, telemetry.last_ffc_ms);
+}
+
+/// \brief Checks the metadata of a frame that passed validation.
+/// \param telemetry Metadata of the frame, nothing is checked when it is not valid.
+/// \param drops Gets the frames missing before this one added to its lost counter.
+/// \return DROP_DUPLICATE for a repeated frame, DROP_FFC while the shutter is closed, DROP_NONE otherwise.
+drop_reason frame_sequence::check(const lepton_telemetry& telemetry, drop_stats& drops)
+{
+    if (!telemetry.valid)
+    {
+        return DROP_NONE;
+    }
+    if (started)
+    {
+        uint32_t advance = telemetry.frame_counter - last;
+        if (advance == 0)
+        {
+            return DROP_DUPLICATE;
+        }
+        if (advance <= MAX_FRAME_COUNTER_GAP)
+        {
+            if (step == 0 || advance < step)
+            {
+                step = advance;
+            }
+            drops.lost += advance / step - 1;
+        }
+    }
+    started = true;
+    last = telemetry.frame_counter;
+    // Counted in the sequence above, the frame is only skipped
+    return telemetry.ffc == FFC_IN_PROGRESS ? DROP_FFC : DROP_NONE;
+}
+
+const char* ffc_state_name(ffc_state state)
+{
+    switch (state)
+    {
+    case FFC_NEVER: return "never";
+    case FFC_IMMINENT: return "imminent";
+    case FFC_IN_PROGRESS: return "in progress";
+    case FFC_DONE: return "done";
+    default: return "unknown";
+    }
+}
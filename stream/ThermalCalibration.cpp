@@ -0,0 +1,33 @@
+#include <ThermalCalibration.h>
+
+#include <iostream>
+#include <opencv2/core/persistence.hpp>
+
+/// \file ThermalCalibration.cpp
+/// \brief Loading of the thermal camera calibration.
+
+bool load_thermal_calibration(thermal_calibration& c, const std::string& calibration, const std::string& extrinsic)
+{
+    cv::FileStorage fs(calibration, cv::FileStorage::READ);
+    if (!fs.isOpened())
+    {
+        std::cerr << "Failed to open " << calibration << std::endl;
+        return false;
+    }
+    fs["cameraMatrix"] >> c.cameraMatrixThermal;
+    fs["distCoeffs"] >> c.distCoeffsThermal;
+    fs.release();
+    cv::FileStorage fs2(extrinsic, cv::FileStorage::READ);
+    if (!fs2.isOpened())
+    {
+        std::cerr << "Failed to open " << extrinsic << std::endl;
+        return false;
+    }
+    cv::Mat R_rgb_thermal, T_rgb_thermal;
+    fs2["R"] >> R_rgb_thermal;
+    fs2["T"] >> T_rgb_thermal;
+    fs2.release();
+    c.R_thermal_rgb = R_rgb_thermal.inv();
+    c.T_thermal_rgb = -c.R_thermal_rgb * T_rgb_thermal;
+    return true;
+}
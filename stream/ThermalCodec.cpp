@@ -0,0 +1,392 @@
+#include <ThermalCodec.h>
+
+#include <algorithm>
+#include <cstring>
+
+/// \file ThermalCodec.cpp
+/// \brief Lossless codec for raw 16-bit thermal frames.
+
+#define MODE_SPATIAL 0
+#define MODE_TEMPORAL 1
+#define MODE_TEMPORAL_GRADIENT 2
+#define MODES 3
+
+#define RICE_BLOCK 16
+#define RICE_PARAMETER_BITS 5
+#define RICE_MAX_PARAMETER 17
+#define RICE_LIMIT 24      // Longer unary codes are replaced by an escape and the raw value
+#define RESIDUAL_BITS 17   // Zigzag mapped difference of two 16-bit values
+
+/// \brief Maps signed residuals to unsigned values, small magnitudes to small values.
+static inline uint32_t zigzag(int32_t value)
+{
+    return (static_cast<uint32_t>(value) << 1) ^ static_cast<uint32_t>(value >> 31);
+}
+
+static inline int32_t unzigzag(uint32_t value)
+{
+    return static_cast<int32_t>(value >> 1) ^ -static_cast<int32_t>(value & 1);
+}
+
+/// \brief Median edge detector of LOCO-I, picks the left or upper pixel at an edge and the
+/// planar prediction otherwise.
+static inline int32_t med(int32_t left, int32_t up, int32_t upLeft)
+{
+    int32_t lo = std::min(left, up);
+    int32_t hi = std::max(left, up);
+    return upLeft >= hi ? lo : (upLeft <= lo ? hi : left + up - upLeft);
+}
+
+static inline int32_t clamp16(int32_t value)
+{
+    return std::min(std::max(value, 0), 65535);
+}
+
+/// \brief Spatial prediction of a row, the first row is predicted from the left only.
+static void spatial_residuals(const uint16_t* row, const uint16_t* up, int width, uint32_t* residuals)
+{
+    if (!up)
+    {
+        residuals[0] = zigzag(row[0] - (1 << 13));
+        for (int x = 1; x < width; x++)
+        {
+            residuals[x] = zigzag(row[x] - row[x - 1]);
+        }
+        return;
+    }
+    residuals[0] = zigzag(row[0] - up[0]);
+    for (int x = 1; x < width; x++)
+    {
+        residuals[x] = zigzag(row[x] - med(row[x - 1], up[x], up[x - 1]));
+    }
+}
+
+/// \brief Temporal prediction of a row, with the spatial correction the change of the pixel
+/// to the left since the previous frame is added.
+static void temporal_residuals(const uint16_t* row, const uint16_t* previous, int width,
+                               uint32_t* temporal, uint32_t* gradient)
+{
+    temporal[0] = gradient[0] = zigzag(row[0] - previous[0]);
+    for (int x = 1; x < width; x++)
+    {
+        temporal[x] = zigzag(row[x] - previous[x]);
+        gradient[x] = zigzag(row[x] - clamp16(previous[x] + row[x - 1] - previous[x - 1]));
+    }
+}
+
+static uint64_t residual_cost(const uint32_t* residuals, int width)
+{
+    uint64_t sum = 0;
+    for (int x = 0; x < width; x++)
+    {
+        sum += residuals[x];
+    }
+    return sum;
+}
+
+/// \brief Rice parameter for a block, the smallest k with count * 2^k >= sum.
+static inline int rice_parameter(const uint32_t* values, int count)
+{
+    uint64_t sum = 0;
+    for (int i = 0; i < count; i++)
+    {
+        sum += values[i];
+    }
+    int k = 0;
+    while (k < RICE_MAX_PARAMETER && (static_cast<uint64_t>(count) << k) < sum)
+    {
+        k++;
+    }
+    return k;
+}
+
+/// \brief MSB first bit writer, at most 32 bits per call.
+struct bit_writer
+{
+    uint8_t* out;
+    size_t pos = 0;
+    uint64_t acc = 0;
+    int bits = 0;
+
+    explicit bit_writer(uint8_t* data) : out(data) {}
+
+    inline void put(uint32_t value, int count)
+    {
+        acc = (acc << count) | value;
+        bits += count;
+        while (bits >= 8)
+        {
+            bits -= 8;
+            out[pos++] = static_cast<uint8_t>(acc >> bits);
+        }
+    }
+
+    void flush()
+    {
+        if (bits > 0)
+        {
+            out[pos++] = static_cast<uint8_t>(acc << (8 - bits));
+            bits = 0;
+        }
+    }
+};
+
+/// \brief MSB first bit reader, reads zeros past the end and remembers it.
+struct bit_reader
+{
+    const uint8_t* data;
+    size_t size;
+    size_t pos = 0;
+    uint64_t acc = 0;
+    int bits = 0;
+
+    bit_reader(const uint8_t* d, size_t s) : data(d), size(s) {}
+
+    inline void refill()
+    {
+        while (bits <= 56)
+        {
+            uint64_t byte = pos < size ? data[pos] : 0;
+            pos++;
+            acc |= byte << (56 - bits);
+            bits += 8;
+        }
+    }
+
+    inline uint32_t get(int count)
+    {
+        refill();
+        if (count == 0)
+        {
+            return 0;
+        }
+        uint32_t value = static_cast<uint32_t>(acc >> (64 - count));
+        acc <<= count;
+        bits -= count;
+        return value;
+    }
+
+    /// \brief Leading zero bits, at most limit, nothing is consumed.
+    inline int zeros(int limit)
+    {
+        refill();
+        int count = acc ? __builtin_clzll(acc) : 64;
+        return std::min(count, limit);
+    }
+
+    inline void skip(int count)
+    {
+        acc <<= count;
+        bits -= count;
+    }
+
+    bool overrun() const
+    {
+        return pos * 8 - bits > size * 8;
+    }
+};
+
+static void rice_encode(bit_writer& writer, const uint32_t* values, int count)
+{
+    for (int b = 0; b < count; b += RICE_BLOCK)
+    {
+        int n = std::min(RICE_BLOCK, count - b);
+        int k = rice_parameter(values + b, n);
+        writer.put(k, RICE_PARAMETER_BITS);
+        for (int i = b; i < b + n; i++)
+        {
+            uint32_t q = values[i] >> k;
+            if (q < RICE_LIMIT)
+            {
+                writer.put(1, q + 1);
+                if (k > 0)
+                {
+                    writer.put(values[i] & ((1u << k) - 1), k);
+                }
+            }
+            else
+            {
+                writer.put(0, RICE_LIMIT);
+                writer.put(values[i], RESIDUAL_BITS);
+            }
+        }
+    }
+}
+
+static bool rice_decode(bit_reader& reader, int32_t* residuals, int count)
+{
+    for (int b = 0; b < count; b += RICE_BLOCK)
+    {
+        int n = std::min(RICE_BLOCK, count - b);
+        int k = reader.get(RICE_PARAMETER_BITS);
+        if (k > RICE_MAX_PARAMETER)
+        {
+            return false;
+        }
+        for (int i = b; i < b + n; i++)
+        {
+            int q = reader.zeros(RICE_LIMIT);
+            uint32_t value;
+            if (q < RICE_LIMIT)
+            {
+                reader.skip(q + 1);
+                value = (static_cast<uint32_t>(q) << k) | reader.get(k);
+            }
+            else
+            {
+                reader.skip(RICE_LIMIT);
+                value = reader.get(RESIDUAL_BITS);
+            }
+            residuals[i] = unzigzag(value);
+        }
+    }
+    return !reader.overrun();
+}
+
+thermal_encoder::thermal_encoder(int width, int height)
+    : _width(width), _height(height), _hasPrevious(false), _previous(static_cast<size_t>(width) * height)
+{
+    for (auto& residuals : _residuals)
+    {
+        residuals.resize(width);
+    }
+}
+
+/// \brief Worst case size of an encoded frame, every residual escaped.
+/// \return Bytes to reserve for encode().
+size_t thermal_encoder::max_encoded_size() const
+{
+    size_t blocks = (_width + RICE_BLOCK - 1) / RICE_BLOCK * static_cast<size_t>(_height);
+    size_t pixels = static_cast<size_t>(_width) * _height;
+    return (_height + 3) / 4 + (blocks * RICE_PARAMETER_BITS + pixels * (RICE_LIMIT + RESIDUAL_BITS) + 7) / 8;
+}
+
+/// \brief Encodes a frame.
+/// \param pixels Raw pixel values, width * height in row major order.
+/// \param keyframe Encode without reference to the previous frame.
+/// \param out Destination of at least max_encoded_size() bytes.
+/// \return Bytes written.
+size_t thermal_encoder::encode(const uint16_t* pixels, bool keyframe, uint8_t* out)
+{
+    bool temporal = !keyframe && _hasPrevious;
+    size_t modeBytes = (_height + 3) / 4;
+    memset(out, 0, modeBytes);
+    bit_writer writer(out + modeBytes);
+    for (int y = 0; y < _height; y++)
+    {
+        const uint16_t* row = pixels + y * _width;
+        const uint16_t* up = y > 0 ? row - _width : nullptr;
+        spatial_residuals(row, up, _width, _residuals[MODE_SPATIAL].data());
+        int mode = MODE_SPATIAL;
+        if (temporal)
+        {
+            temporal_residuals(row, _previous.data() + y * _width, _width,
+                               _residuals[MODE_TEMPORAL].data(), _residuals[MODE_TEMPORAL_GRADIENT].data());
+            uint64_t best = residual_cost(_residuals[MODE_SPATIAL].data(), _width);
+            for (int m = MODE_TEMPORAL; m < MODES; m++)
+            {
+                uint64_t cost = residual_cost(_residuals[m].data(), _width);
+                if (cost < best)
+                {
+                    best = cost;
+                    mode = m;
+                }
+            }
+        }
+        out[y / 4] |= static_cast<uint8_t>(mode << (2 * (y % 4)));
+        rice_encode(writer, _residuals[mode].data(), _width);
+    }
+    writer.flush();
+    std::copy(pixels, pixels + _previous.size(), _previous.begin());
+    _hasPrevious = true;
+    return modeBytes + writer.pos;
+}
+
+thermal_decoder::thermal_decoder(int width, int height)
+    : _width(width), _height(height), _hasPrevious(false), _previous(static_cast<size_t>(width) * height),
+      _residuals(width)
+{
+}
+
+/// \brief Decodes a frame.
+/// \param data Encoded frame.
+/// \param size Bytes of the encoded frame.
+/// \param pixels Destination of width * height values.
+/// \return False if the data is corrupt or a non keyframe follows no decoded frame.
+bool thermal_decoder::decode(const uint8_t* data, size_t size, uint16_t* pixels)
+{
+    size_t modeBytes = (_height + 3) / 4;
+    if (size < modeBytes)
+    {
+        return false;
+    }
+    bit_reader reader(data + modeBytes, size - modeBytes);
+    for (int y = 0; y < _height; y++)
+    {
+        int mode = (data[y / 4] >> (2 * (y % 4))) & 0x3;
+        if (mode >= MODES || (mode != MODE_SPATIAL && !_hasPrevious))
+        {
+            return false;
+        }
+        if (!rice_decode(reader, _residuals.data(), _width))
+        {
+            return false;
+        }
+        uint16_t* row = pixels + y * _width;
+        const uint16_t* up = y > 0 ? row - _width : nullptr;
+        const uint16_t* previous = _previous.data() + y * _width;
+        const int32_t* r = _residuals.data();
+        // Bits above 16 are set by a value out of range, checked once per row
+        uint32_t outOfRange = 0;
+        int32_t value;
+        if (mode == MODE_TEMPORAL)
+        {
+            for (int x = 0; x < _width; x++)
+            {
+                value = previous[x] + r[x];
+                outOfRange |= static_cast<uint32_t>(value);
+                row[x] = static_cast<uint16_t>(value);
+            }
+        }
+        else if (mode == MODE_TEMPORAL_GRADIENT)
+        {
+            value = previous[0] + r[0];
+            outOfRange |= static_cast<uint32_t>(value);
+            row[0] = static_cast<uint16_t>(value);
+            for (int x = 1; x < _width; x++)
+            {
+                value = clamp16(previous[x] + row[x - 1] - previous[x - 1]) + r[x];
+                outOfRange |= static_cast<uint32_t>(value);
+                row[x] = static_cast<uint16_t>(value);
+            }
+        }
+        else
+        {
+            value = (up ? up[0] : (1 << 13)) + r[0];
+            outOfRange |= static_cast<uint32_t>(value);
+            row[0] = static_cast<uint16_t>(value);
+            for (int x = 1; x < _width; x++)
+            {
+                value = (up ? med(row[x - 1], up[x], up[x - 1]) : row[x - 1]) + r[x];
+                outOfRange |= static_cast<uint32_t>(value);
+                row[x] = static_cast<uint16_t>(value);
+            }
+        }
+        if (outOfRange >> 16)
+        {
+            return false;
+        }
+    }
+    std::copy(pixels, pixels + _previous.size(), _previous.begin());
+    _hasPrevious = true;
+    return true;
+}
+
+/// \brief Uses a frame that was not decoded here (stored raw) as the previous frame.
+/// \param pixels Raw pixel values, width * height in row major order.
+/// \return None.
+void thermal_decoder::set_reference(const uint16_t* pixels)
+{
+    std::copy(pixels, pixels + _previous.size(), _previous.begin());
+    _hasPrevious = true;
+}
@@ -0,0 +1,144 @@
+#include <ThermalDepth.h>
+
+#include <cerrno>
+#include <iostream>
+#include <limits>
+#include <sys/stat.h>
+#include <opencv2/imgcodecs.hpp>
+
+/// \file ThermalDepth.cpp
+/// \brief Organized temperature and depth images and their writer.
+
+/// \brief Builds a temperature and depth frame from the projection of a depth image.
+/// \param projection Projection, project() has been called with the same depth image.
+/// \param depth Depth aligned to the color image, in depth units.
+/// \param units Meters per depth unit.
+/// \param raw Raw thermal image after thermal_projection::undistort, CV_16UC1 in centikelvin.
+/// \param frame CV_16UC2 frame, reallocated if its size differs.
+/// \return None.
+void build_thermal_depth(const thermal_projection& projection, const uint16_t* depth, float units, const cv::Mat& raw,
+                         cv::Mat& frame)
+{
+    const int width = projection.width();
+    frame.create(projection.height(), width, CV_16UC2);
+    const uint16_t* temperature = raw.ptr<uint16_t>();
+    const float millimeters = units * 1000.0f;
+    projection.parallel_rows([&](int begin, int end)
+                             {
+                                 for (int y = begin; y < end; y++)
+                                 {
+                                     size_t row = static_cast<size_t>(y) * width;
+                                     const int32_t* index = projection.index() + row;
+                                     const uint16_t* d = depth + row;
+                                     uint16_t* out = frame.ptr<uint16_t>(y);
+                                     for (int x = 0; x < width; x++)
+                                     {
+                                         float mm = d[x] * millimeters + 0.5f;
+                                         out[2 * x] = static_cast<uint16_t>(mm < 65535.0f ? mm : 65535.0f);
+                                         out[2 * x + 1] = index[x] >= 0 ? temperature[index[x]] : 0;
+                                     }
+                                 }
+                             });
+}
+
+/// \brief Temperatures of a frame.
+/// \param frame CV_16UC2 temperature and depth frame.
+/// \param celsius CV_32F temperatures in degrees Celsius, NaN for pixels without temperature.
+/// \return None.
+void thermal_depth_celsius(const cv::Mat& frame, cv::Mat& celsius)
+{
+    celsius.create(frame.rows, frame.cols, CV_32FC1);
+    const float none = std::numeric_limits<float>::quiet_NaN();
+    for (int y = 0; y < frame.rows; y++)
+    {
+        const uint16_t* in = frame.ptr<uint16_t>(y);
+        float* out = celsius.ptr<float>(y);
+        for (int x = 0; x < frame.cols; x++)
+        {
+            uint16_t t = in[2 * x + 1];
+            out[x] = t ? t * TD_KELVIN_PER_UNIT - TD_ZERO_CELSIUS : none;
+        }
+    }
+}
+
+/// \brief Depths of a frame.
+/// \param frame CV_16UC2 temperature and depth frame.
+/// \param meters CV_32F depths in meters, 0 for pixels without depth.
+/// \return None.
+void thermal_depth_meters(const cv::Mat& frame, cv::Mat& meters)
+{
+    meters.create(frame.rows, frame.cols, CV_32FC1);
+    for (int y = 0; y < frame.rows; y++)
+    {
+        const uint16_t* in = frame.ptr<uint16_t>(y);
+        float* out = meters.ptr<float>(y);
+        for (int x = 0; x < frame.cols; x++)
+        {
+            out[x] = in[2 * x] * 0.001f;
+        }
+    }
+}
+
+thermal_depth_writer::thermal_depth_writer()
+    : _writer(TD_WRITER_QUEUE)
+{
+}
+
+/// \brief Writes the queued frames and stops the thread.
+thermal_depth_writer::~thermal_depth_writer()
+{
+    if (!_writer.running())
+    {
+        return;
+    }
+    _writer.stop();
+    std::cout << "Wrote " << _writer.written() << " temperature and depth frames to " << _directory << ", dropped "
+              << _writer.dropped() + _writer.failed() << std::endl;
+}
+
+/// \brief Creates the directory if needed and starts the writer thread.
+/// \param directory Directory of the frames.
+/// \return False if the directory cannot be created.
+bool thermal_depth_writer::start(const std::string& directory)
+{
+    if (mkdir(directory.c_str(), 0755) != 0 && errno != EEXIST)
+    {
+        std::cerr << "Failed to create " << directory << std::endl;
+        return false;
+    }
+    _directory = directory;
+    _writer.start(&thermal_depth_writer::write_frame);
+    return true;
+}
+
+/// \brief Queues a frame, never waits for the disk.
+/// \param rig Rig that produced the frame.
+/// \param timestamp_ns Thermal receive time of the frame.
+/// \param frame Frame, shared until it is written, so it must not be modified afterwards.
+/// \return False if too many frames are already waiting, the frame is dropped.
+bool thermal_depth_writer::write(int rig, int64_t timestamp_ns, const cv::Mat& frame)
+{
+    std::string name = _directory + "/td_" + std::to_string(rig) + "_" + std::to_string(timestamp_ns) + ".tiff";
+    return _writer.push(job(name, frame));
+}
+
+/// \brief Writes one frame on the writer thread.
+/// \param j File name and frame.
+/// \return False if the file could not be written.
+bool thermal_depth_writer::write_frame(const job& j)
+{
+    bool ok = false;
+    try
+    {
+        ok = cv::imwrite(j.first, j.second);
+    }
+    catch (const cv::Exception& e)
+    {
+        std::cerr << e.what() << std::endl;
+    }
+    if (!ok)
+    {
+        std::cerr << "Failed to write " << j.first << std::endl;
+    }
+    return ok;
+}
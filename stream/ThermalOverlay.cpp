@@ -0,0 +1,74 @@
+#include <ThermalOverlay.h>
+
+#include <algorithm>
+#include <cmath>
+
+/// \file ThermalOverlay.cpp
+/// \brief 2D thermal overlay of the color image through the aligned depth.
+
+/// \brief Creates the overlay, init() has to be called before blending.
+/// \param threads Blending threads, all cores if 0.
+thermal_overlay::thermal_overlay(unsigned int threads)
+    : _projection(threads)
+{
+}
+
+/// \brief Prepares the projection of the color pixels into the thermal image.
+/// \param calibration Thermal intrinsics and the color to thermal pose.
+/// \param color Intrinsics of the color stream, which the depth is aligned to.
+/// \param thermalWidth Width of the thermal image.
+/// \param thermalHeight Height of the thermal image.
+/// \param distortion Handling of the thermal lens distortion.
+/// \return None.
+void thermal_overlay::init(const thermal_calibration& calibration, const rs2_intrinsics& color, int thermalWidth, int thermalHeight,
+                           thermal_distortion distortion)
+{
+    _projection.init(calibration, color, thermalWidth, thermalHeight, distortion);
+}
+
+/// \brief Blends the thermal color onto every color pixel with depth that the thermal camera
+/// sees. Pixels without depth or outside the thermal image keep their color.
+/// \param depth Depth aligned to the color image, in depth units.
+/// \param units Meters per depth unit.
+/// \param thermal Colorized thermal image, BGR and as received.
+/// \param color BGR color image, blended in place.
+/// \param alpha Weight of the thermal color, 0 to 1.
+/// \return None.
+void thermal_overlay::blend(const uint16_t* depth, float units, const cv::Mat& thermal, cv::Mat& color, float alpha)
+{
+    _projection.undistort(thermal, _undistorted);
+    _projection.project(depth, units);
+    int weight = std::min(256, std::max(0, static_cast<int>(std::lrint(alpha * 256.0f))));
+    _projection.parallel_rows([this, &color, weight](int begin, int end)
+                              {
+                                  blend_rows(begin, end, color, weight);
+                              });
+}
+
+/// \brief Blends a band of rows.
+/// \param begin First row.
+/// \param end Row after the last one.
+/// \param color BGR color image.
+/// \param weight Weight of the thermal color, 0 to 256.
+/// \return None.
+void thermal_overlay::blend_rows(int begin, int end, cv::Mat& color, int weight) const
+{
+    const uint8_t* thermal = _undistorted.ptr<uint8_t>();
+    const int width = _projection.width();
+    for (int y = begin; y < end; y++)
+    {
+        const int32_t* index = _projection.index() + static_cast<size_t>(y) * width;
+        uint8_t* pixel = color.ptr<uint8_t>(y);
+        for (int x = 0; x < width; x++, pixel += 3)
+        {
+            if (index[x] < 0)
+            {
+                continue;
+            }
+            const uint8_t* t = thermal + index[x] * 3;
+            pixel[0] = static_cast<uint8_t>((pixel[0] * (256 - weight) + t[0] * weight) >> 8);
+            pixel[1] = static_cast<uint8_t>((pixel[1] * (256 - weight) + t[1] * weight) >> 8);
+            pixel[2] = static_cast<uint8_t>((pixel[2] * (256 - weight) + t[2] * weight) >> 8);
+        }
+    }
+}
@@ -0,0 +1,377 @@
+#include <ThermalProjection.h>
+
+#include <algorithm>
+#include <librealsense2/rsutil.h>
+#include <opencv2/imgproc.hpp>
+#include <opencv2/calib3d.hpp>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/// \file ThermalProjection.cpp
+/// \brief Projection of aligned depth pixels into the thermal image.
+
+/// \brief Creates the projection, init() has to be called before projecting.
+/// \param threads Projecting threads, all cores if 0.
+thermal_projection::thermal_projection(unsigned int threads)
+    : _pool(new worker_pool(threads)), _distortion(DISTORTION_REMAP),
+      _width(0), _height(0), _thermalWidth(0), _thermalHeight(0), _offsetU(0.0f), _offsetV(0.0f), _offsetW(0.0f),
+      _camera(), _coeffs(), _minX(0.0f), _maxX(0.0f), _minY(0.0f), _maxY(0.0f), _tableWidth(0), _tableHeight(0)
+{
+}
+
+/// \brief Computes the projection of every color pixel ray into the thermal image and, depending
+/// on the distortion mode, the undistortion maps or the distortion table of the thermal image.
+/// \param calibration Thermal intrinsics and the color to thermal pose.
+/// \param color Intrinsics of the color stream, which the depth is aligned to.
+/// \param thermalWidth Width of the thermal image.
+/// \param thermalHeight Height of the thermal image.
+/// \param distortion Handling of the lens distortion.
+/// \return None.
+void thermal_projection::init(const thermal_calibration& calibration, const rs2_intrinsics& color, int thermalWidth, int thermalHeight,
+                              thermal_distortion distortion)
+{
+    _distortion = distortion;
+    _width = color.width;
+    _height = color.height;
+    _thermalWidth = thermalWidth;
+    _thermalHeight = thermalHeight;
+
+    cv::Mat K, D;
+    calibration.cameraMatrixThermal.convertTo(K, CV_64F);
+    const double* k = K.ptr<double>();
+    _camera[0] = static_cast<float>(k[0]);
+    _camera[1] = static_cast<float>(k[1]);
+    _camera[2] = static_cast<float>(k[2]);
+    _camera[3] = static_cast<float>(k[4]);
+    _camera[4] = static_cast<float>(k[5]);
+    // The 5 coefficients calibrateCamera estimates by default, missing ones are 0
+    calibration.distCoeffsThermal.convertTo(D, CV_64F);
+    for (size_t i = 0; i < 5; i++)
+    {
+        _coeffs[i] = i < D.total() ? static_cast<float>(D.ptr<double>()[i]) : 0.0f;
+    }
+    _minX = (-PROJECTION_MARGIN - _camera[2]) / _camera[0];
+    _maxX = (thermalWidth + PROJECTION_MARGIN - _camera[2]) / _camera[0];
+    _minY = (-PROJECTION_MARGIN - _camera[4]) / _camera[3];
+    _maxY = (thermalHeight + PROJECTION_MARGIN - _camera[4]) / _camera[3];
+
+    // Pinhole projection K * (R * point + T), the point at depth d along a ray is d * ray. The
+    // model projects to normalized coordinates and applies K after the distortion.
+    cv::Mat KR, KT;
+    if (distortion == DISTORTION_MODEL)
+    {
+        calibration.R_thermal_rgb.convertTo(KR, CV_64F);
+        calibration.T_thermal_rgb.convertTo(KT, CV_64F);
+    }
+    else
+    {
+        cv::Mat(calibration.cameraMatrixThermal * calibration.R_thermal_rgb).convertTo(KR, CV_64F);
+        cv::Mat(calibration.cameraMatrixThermal * calibration.T_thermal_rgb).convertTo(KT, CV_64F);
+    }
+    const double* kr = KR.ptr<double>();
+    const double* kt = KT.ptr<double>();
+    _offsetU = static_cast<float>(kt[0]);
+    _offsetV = static_cast<float>(kt[1]);
+    _offsetW = static_cast<float>(kt[2]);
+
+    size_t pixels = static_cast<size_t>(_width) * _height;
+    _rayU.resize(pixels);
+    _rayV.resize(pixels);
+    _rayW.resize(pixels);
+    for (int y = 0; y < _height; y++)
+    {
+        for (int x = 0; x < _width; x++)
+        {
+            float pixel[2] = { static_cast<float>(x), static_cast<float>(y) };
+            float ray[3];
+            rs2_deproject_pixel_to_point(ray, &color, pixel, 1.0f);
+            size_t i = static_cast<size_t>(y) * _width + x;
+            _rayU[i] = static_cast<float>(kr[0] * ray[0] + kr[1] * ray[1] + kr[2] * ray[2]);
+            _rayV[i] = static_cast<float>(kr[3] * ray[0] + kr[4] * ray[1] + kr[5] * ray[2]);
+            _rayW[i] = static_cast<float>(kr[6] * ray[0] + kr[7] * ray[1] + kr[8] * ray[2]);
+        }
+    }
+    _index.resize(pixels);
+
+    if (distortion == DISTORTION_REMAP)
+    {
+        // The maps cv::undistort builds on every call, built once
+        cv::initUndistortRectifyMap(calibration.cameraMatrixThermal, calibration.distCoeffsThermal, cv::Mat(),
+                                    calibration.cameraMatrixThermal, cv::Size(thermalWidth, thermalHeight), CV_16SC2,
+                                    _mapX, _mapY);
+    }
+
+    // Distorted pixel at the center of every cell of the undistorted image and its margin
+    _tableWidth = distortion == DISTORTION_TABLE ? (thermalWidth + 2 * PROJECTION_MARGIN) * PROJECTION_SUBPIXELS : 0;
+    _tableHeight = distortion == DISTORTION_TABLE ? (thermalHeight + 2 * PROJECTION_MARGIN) * PROJECTION_SUBPIXELS : 0;
+    _table.resize(static_cast<size_t>(_tableWidth) * _tableHeight);
+    for (int y = 0; y < _tableHeight; y++)
+    {
+        float v = (y + 0.5f) / PROJECTION_SUBPIXELS - PROJECTION_MARGIN;
+        float normalizedY = (v - _camera[4]) / _camera[3];
+        for (int x = 0; x < _tableWidth; x++)
+        {
+            float u = (x + 0.5f) / PROJECTION_SUBPIXELS - PROJECTION_MARGIN;
+            _table[static_cast<size_t>(y) * _tableWidth + x] = distort((u - _camera[2] - _camera[1] * normalizedY) / _camera[0],
+                                                                       normalizedY);
+        }
+    }
+}
+
+/// \brief Applies the distortion model and the camera matrix to a point.
+/// \param x Normalized x coordinate, X / Z in the thermal camera frame.
+/// \param y Normalized y coordinate.
+/// \return Pixel of the thermal image as received, row * thermal width + column, -1 for none.
+int32_t thermal_projection::distort(float x, float y) const
+{
+    // Same operations in the same order as the SSE2 path of model_rows
+    float r2 = x * x + y * y;
+    float radial = 1.0f + r2 * (_coeffs[0] + r2 * (_coeffs[1] + r2 * _coeffs[4]));
+    float xy = 2.0f * x * y;
+    float distortedX = x * radial + _coeffs[2] * xy + _coeffs[3] * (r2 + 2.0f * x * x);
+    float distortedY = y * radial + _coeffs[2] * (r2 + 2.0f * y * y) + _coeffs[3] * xy;
+    float u = _camera[0] * distortedX + _camera[1] * distortedY + _camera[2];
+    float v = _camera[3] * distortedY + _camera[4];
+    bool valid = u > -1.0f && u < static_cast<float>(_thermalWidth) && v > -1.0f && v < static_cast<float>(_thermalHeight);
+    return valid ? static_cast<int>(v) * _thermalWidth + static_cast<int>(u) : -1;
+}
+
+/// \brief Undistorts a thermal image with the maps built by init(), like cv::undistort. With
+/// DISTORTION_MODEL and DISTORTION_TABLE the index already points into the image as received,
+/// which is passed on without a copy.
+/// \param thermal Thermal image as received, of any type remap takes.
+/// \param undistorted Undistorted image, pixels that map outside the image are 0.
+/// \param nearest Take the nearest pixel instead of interpolating, for raw temperatures that
+/// must not be blended with the 0 outside the image.
+/// \return None.
+void thermal_projection::undistort(const cv::Mat& thermal, cv::Mat& undistorted, bool nearest) const
+{
+    if (_distortion != DISTORTION_REMAP)
+    {
+        undistorted = thermal;
+        return;
+    }
+    cv::remap(thermal, undistorted, _mapX, _mapY, nearest ? cv::INTER_NEAREST : cv::INTER_LINEAR);
+}
+
+/// \brief Finds the thermal pixel of every depth pixel, see index().
+/// \param depth Depth aligned to the color image, in depth units.
+/// \param units Meters per depth unit.
+/// \return None.
+void thermal_projection::project(const uint16_t* depth, float units)
+{
+    parallel_rows([this, depth, units](int begin, int end)
+                  {
+                      if (_distortion == DISTORTION_MODEL)
+                      {
+                          model_rows(begin, end, depth, units);
+                      }
+                      else if (_distortion == DISTORTION_TABLE)
+                      {
+                          table_rows(begin, end, depth, units);
+                      }
+                      else
+                      {
+                          project_rows(begin, end, depth, units);
+                      }
+                  });
+}
+
+/// \brief Projects a band of rows into the undistorted image.
+/// \param begin First row.
+/// \param end Row after the last one.
+/// \param depth Depth aligned to the color image.
+/// \param units Meters per depth unit.
+/// \return None.
+void thermal_projection::project_rows(int begin, int end, const uint16_t* depth, float units)
+{
+    // Like an int cast, a coordinate above -1 truncates to pixel 0
+    const float maxU = static_cast<float>(_thermalWidth), maxV = static_cast<float>(_thermalHeight);
+    for (int y = begin; y < end; y++)
+    {
+        size_t row = static_cast<size_t>(y) * _width;
+        const uint16_t* d = depth + row;
+        const float* rayU = &_rayU[row];
+        const float* rayV = &_rayV[row];
+        const float* rayW = &_rayW[row];
+        int32_t* index = &_index[row];
+        int x = 0;
+#if defined(__SSE2__)
+        const __m128 scale = _mm_set1_ps(units);
+        const __m128 offsetU = _mm_set1_ps(_offsetU), offsetV = _mm_set1_ps(_offsetV), offsetW = _mm_set1_ps(_offsetW);
+        const __m128 zero = _mm_setzero_ps(), minusOne = _mm_set1_ps(-1.0f);
+        const __m128 width = _mm_set1_ps(maxU), height = _mm_set1_ps(maxV);
+        const __m128i none = _mm_set1_epi32(-1);
+        for (; x + 4 <= _width; x += 4)
+        {
+            __m128i raw = _mm_unpacklo_epi16(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(d + x)), _mm_setzero_si128());
+            __m128 z = _mm_mul_ps(_mm_cvtepi32_ps(raw), scale);
+            __m128 w = _mm_add_ps(_mm_mul_ps(z, _mm_loadu_ps(rayW + x)), offsetW);
+            __m128 u = _mm_div_ps(_mm_add_ps(_mm_mul_ps(z, _mm_loadu_ps(rayU + x)), offsetU), w);
+            __m128 v = _mm_div_ps(_mm_add_ps(_mm_mul_ps(z, _mm_loadu_ps(rayV + x)), offsetV), w);
+            __m128 valid = _mm_and_ps(_mm_cmpgt_ps(z, zero), _mm_cmpgt_ps(w, zero));
+            valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpgt_ps(u, minusOne), _mm_cmplt_ps(u, width)));
+            valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpgt_ps(v, minusOne), _mm_cmplt_ps(v, height)));
+            // Whole pixels first, the index is exact in float for any thermal image size
+            __m128 column = _mm_cvtepi32_ps(_mm_cvttps_epi32(_mm_and_ps(u, valid)));
+            __m128 line = _mm_cvtepi32_ps(_mm_cvttps_epi32(_mm_and_ps(v, valid)));
+            __m128i i = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(line, width), column));
+            __m128i mask = _mm_castps_si128(valid);
+            i = _mm_or_si128(_mm_and_si128(mask, i), _mm_andnot_si128(mask, none));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(index + x), i);
+        }
+#endif
+        for (; x < _width; x++)
+        {
+            float z = d[x] * units;
+            float w = z * rayW[x] + _offsetW;
+            float u = (z * rayU[x] + _offsetU) / w;
+            float v = (z * rayV[x] + _offsetV) / w;
+            bool valid = z > 0 && w > 0 && u > -1.0f && u < maxU && v > -1.0f && v < maxV;
+            index[x] = valid ? static_cast<int>(v) * _thermalWidth + static_cast<int>(u) : -1;
+        }
+    }
+}
+
+/// \brief Projects a band of rows into the distortion table.
+/// \param begin First row.
+/// \param end Row after the last one.
+/// \param depth Depth aligned to the color image.
+/// \param units Meters per depth unit.
+/// \return None.
+void thermal_projection::table_rows(int begin, int end, const uint16_t* depth, float units)
+{
+    const float margin = static_cast<float>(PROJECTION_MARGIN), subpixels = static_cast<float>(PROJECTION_SUBPIXELS);
+    const float maxU = _thermalWidth + margin, maxV = _thermalHeight + margin;
+    for (int y = begin; y < end; y++)
+    {
+        size_t row = static_cast<size_t>(y) * _width;
+        const uint16_t* d = depth + row;
+        const float* rayU = &_rayU[row];
+        const float* rayV = &_rayV[row];
+        const float* rayW = &_rayW[row];
+        int32_t* index = &_index[row];
+        int x = 0;
+#if defined(__SSE2__)
+        const __m128 scale = _mm_set1_ps(units);
+        const __m128 offsetU = _mm_set1_ps(_offsetU), offsetV = _mm_set1_ps(_offsetV), offsetW = _mm_set1_ps(_offsetW);
+        const __m128 zero = _mm_setzero_ps(), minusMargin = _mm_set1_ps(-margin), plusMargin = _mm_set1_ps(margin);
+        const __m128 width = _mm_set1_ps(maxU), height = _mm_set1_ps(maxV), cells = _mm_set1_ps(subpixels);
+        const __m128 lastColumn = _mm_set1_ps(static_cast<float>(_tableWidth - 1));
+        const __m128 lastLine = _mm_set1_ps(static_cast<float>(_tableHeight - 1));
+        const __m128 tableWidth = _mm_set1_ps(static_cast<float>(_tableWidth));
+        const __m128i none = _mm_set1_epi32(-1);
+        int32_t cell[4];
+        for (; x + 4 <= _width; x += 4)
+        {
+            __m128i raw = _mm_unpacklo_epi16(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(d + x)), _mm_setzero_si128());
+            __m128 z = _mm_mul_ps(_mm_cvtepi32_ps(raw), scale);
+            __m128 w = _mm_add_ps(_mm_mul_ps(z, _mm_loadu_ps(rayW + x)), offsetW);
+            __m128 u = _mm_div_ps(_mm_add_ps(_mm_mul_ps(z, _mm_loadu_ps(rayU + x)), offsetU), w);
+            __m128 v = _mm_div_ps(_mm_add_ps(_mm_mul_ps(z, _mm_loadu_ps(rayV + x)), offsetV), w);
+            __m128 valid = _mm_and_ps(_mm_cmpgt_ps(z, zero), _mm_cmpgt_ps(w, zero));
+            valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpgt_ps(u, minusMargin), _mm_cmplt_ps(u, width)));
+            valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpgt_ps(v, minusMargin), _mm_cmplt_ps(v, height)));
+            // Rounding may put a coordinate just below the end of the table onto it
+            __m128 column = _mm_min_ps(_mm_mul_ps(_mm_add_ps(u, plusMargin), cells), lastColumn);
+            __m128 line = _mm_min_ps(_mm_mul_ps(_mm_add_ps(v, plusMargin), cells), lastLine);
+            column = _mm_cvtepi32_ps(_mm_cvttps_epi32(_mm_and_ps(column, valid)));
+            line = _mm_cvtepi32_ps(_mm_cvttps_epi32(_mm_and_ps(line, valid)));
+            __m128i i = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(line, tableWidth), column));
+            __m128i mask = _mm_castps_si128(valid);
+            i = _mm_or_si128(_mm_and_si128(mask, i), _mm_andnot_si128(mask, none));
+            // No gather in SSE2, the table lookups are scalar
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(cell), i);
+            for (int j = 0; j < 4; j++)
+            {
+                index[x + j] = cell[j] >= 0 ? _table[cell[j]] : -1;
+            }
+        }
+#endif
+        for (; x < _width; x++)
+        {
+            float z = d[x] * units;
+            float w = z * rayW[x] + _offsetW;
+            float u = (z * rayU[x] + _offsetU) / w;
+            float v = (z * rayV[x] + _offsetV) / w;
+            index[x] = -1;
+            if (z > 0 && w > 0 && u > -margin && u < maxU && v > -margin && v < maxV)
+            {
+                int column = std::min(static_cast<int>((u + margin) * subpixels), _tableWidth - 1);
+                int line = std::min(static_cast<int>((v + margin) * subpixels), _tableHeight - 1);
+                index[x] = _table[static_cast<size_t>(line) * _tableWidth + column];
+            }
+        }
+    }
+}
+
+/// \brief Projects a band of rows to normalized coordinates and applies the distortion model.
+/// \param begin First row.
+/// \param end Row after the last one.
+/// \param depth Depth aligned to the color image.
+/// \param units Meters per depth unit.
+/// \return None.
+void thermal_projection::model_rows(int begin, int end, const uint16_t* depth, float units)
+{
+    for (int y = begin; y < end; y++)
+    {
+        size_t row = static_cast<size_t>(y) * _width;
+        const uint16_t* d = depth + row;
+        const float* rayX = &_rayU[row];
+        const float* rayY = &_rayV[row];
+        const float* rayZ = &_rayW[row];
+        int32_t* index = &_index[row];
+        int x = 0;
+#if defined(__SSE2__)
+        const __m128 scale = _mm_set1_ps(units);
+        const __m128 offsetX = _mm_set1_ps(_offsetU), offsetY = _mm_set1_ps(_offsetV), offsetZ = _mm_set1_ps(_offsetW);
+        const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f), two = _mm_set1_ps(2.0f), minusOne = _mm_set1_ps(-1.0f);
+        const __m128 minX = _mm_set1_ps(_minX), maxX = _mm_set1_ps(_maxX), minY = _mm_set1_ps(_minY), maxY = _mm_set1_ps(_maxY);
+        const __m128 k1 = _mm_set1_ps(_coeffs[0]), k2 = _mm_set1_ps(_coeffs[1]), p1 = _mm_set1_ps(_coeffs[2]);
+        const __m128 p2 = _mm_set1_ps(_coeffs[3]), k3 = _mm_set1_ps(_coeffs[4]);
+        const __m128 fx = _mm_set1_ps(_camera[0]), skew = _mm_set1_ps(_camera[1]), cx = _mm_set1_ps(_camera[2]);
+        const __m128 fy = _mm_set1_ps(_camera[3]), cy = _mm_set1_ps(_camera[4]);
+        const __m128 width = _mm_set1_ps(static_cast<float>(_thermalWidth)), height = _mm_set1_ps(static_cast<float>(_thermalHeight));
+        const __m128i none = _mm_set1_epi32(-1);
+        for (; x + 4 <= _width; x += 4)
+        {
+            __m128i raw = _mm_unpacklo_epi16(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(d + x)), _mm_setzero_si128());
+            __m128 z = _mm_mul_ps(_mm_cvtepi32_ps(raw), scale);
+            __m128 w = _mm_add_ps(_mm_mul_ps(z, _mm_loadu_ps(rayZ + x)), offsetZ);
+            __m128 nx = _mm_div_ps(_mm_add_ps(_mm_mul_ps(z, _mm_loadu_ps(rayX + x)), offsetX), w);
+            __m128 ny = _mm_div_ps(_mm_add_ps(_mm_mul_ps(z, _mm_loadu_ps(rayY + x)), offsetY), w);
+            // Far outside the image the polynomial can fold back into it, those points are dropped
+            __m128 valid = _mm_and_ps(_mm_cmpgt_ps(z, zero), _mm_cmpgt_ps(w, zero));
+            valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpgt_ps(nx, minX), _mm_cmplt_ps(nx, maxX)));
+            valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpgt_ps(ny, minY), _mm_cmplt_ps(ny, maxY)));
+            __m128 r2 = _mm_add_ps(_mm_mul_ps(nx, nx), _mm_mul_ps(ny, ny));
+            __m128 radial = _mm_add_ps(one, _mm_mul_ps(r2, _mm_add_ps(k1, _mm_mul_ps(r2, _mm_add_ps(k2, _mm_mul_ps(r2, k3))))));
+            __m128 xy = _mm_mul_ps(_mm_mul_ps(two, nx), ny);
+            __m128 dx = _mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, radial), _mm_mul_ps(p1, xy)),
+                                   _mm_mul_ps(p2, _mm_add_ps(r2, _mm_mul_ps(_mm_mul_ps(two, nx), nx))));
+            __m128 dy = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ny, radial), _mm_mul_ps(p1, _mm_add_ps(r2, _mm_mul_ps(_mm_mul_ps(two, ny), ny)))),
+                                   _mm_mul_ps(p2, xy));
+            __m128 u = _mm_add_ps(_mm_add_ps(_mm_mul_ps(fx, dx), _mm_mul_ps(skew, dy)), cx);
+            __m128 v = _mm_add_ps(_mm_mul_ps(fy, dy), cy);
+            valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpgt_ps(u, minusOne), _mm_cmplt_ps(u, width)));
+            valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpgt_ps(v, minusOne), _mm_cmplt_ps(v, height)));
+            __m128 column = _mm_cvtepi32_ps(_mm_cvttps_epi32(_mm_and_ps(u, valid)));
+            __m128 line = _mm_cvtepi32_ps(_mm_cvttps_epi32(_mm_and_ps(v, valid)));
+            __m128i i = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(line, width), column));
+            __m128i mask = _mm_castps_si128(valid);
+            i = _mm_or_si128(_mm_and_si128(mask, i), _mm_andnot_si128(mask, none));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(index + x), i);
+        }
+#endif
+        for (; x < _width; x++)
+        {
+            float z = d[x] * units;
+            float w = z * rayZ[x] + _offsetW;
+            float nx = (z * rayX[x] + _offsetU) / w;
+            float ny = (z * rayY[x] + _offsetV) / w;
+            bool valid = z > 0 && w > 0 && nx > _minX && nx < _maxX && ny > _minY && ny < _maxY;
+            index[x] = valid ? distort(nx, ny) : -1;
+        }
+    }
+}
@@ -0,0 +1,464 @@
+#include <ThermalRecording.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/// \file ThermalRecording.cpp
+/// \brief Append-only recording of raw thermal frames in a memory mapped, chunked file.
+
+#define THERMAL_RECORD_ALIGNMENT 64
+#define THERMAL_PAGE_SIZE 4096
+
+static uint64_t align_up(uint64_t size, uint64_t alignment)
+{
+    return (size + alignment - 1) / alignment * alignment;
+}
+
+/// \brief Bytes of one frame record, aligned so chunks stay a multiple of the page size.
+static uint64_t thermal_record_size(int width, int height)
+{
+    return align_up(THERMAL_RECORD_HEADER_SIZE + static_cast<uint64_t>(width) * height * sizeof(uint16_t), THERMAL_RECORD_ALIGNMENT);
+}
+
+void thermal_record_metadata(const thermal_record_header& header, thermal_timestamps& timestamps, lepton_telemetry& telemetry)
+{
+    timestamps.segments = header.segments;
+    timestamps.frame_ns = header.frame_ns;
+    for (int i = 0; i < MAX_SEGMENTS_PER_FRAME; i++)
+    {
+        timestamps.segment_ns[i] = header.segment_ns[i];
+    }
+    telemetry = lepton_telemetry();
+    telemetry.valid = header.telemetry_valid != 0;
+    telemetry.revision = header.revision;
+    telemetry.uptime_ms = header.uptime_ms;
+    set_lepton_status(header.status, telemetry);
+    telemetry.frame_counter = header.frame_counter;
+    telemetry.frame_mean = header.frame_mean;
+    telemetry.fpa_temp = header.fpa_temp;
+    telemetry.housing_temp = header.housing_temp;
+    telemetry.fpa_temp_last_ffc = header.fpa_temp_last_ffc;
+    telemetry.last_ffc_ms = header.last_ffc_ms;
+}
+
+thermal_recorder::thermal_recorder()
+    : _fd(-1), _header(nullptr), _chunk(nullptr), _chunkOffset(0), _nextOffset(0), _frames(0), _pixelBytes(0)
+{
+}
+
+thermal_recorder::~thermal_recorder()
+{
+    close();
+}
+
+/// \brief Creates a recording, an existing file is overwritten.
+/// \param filename Path of the recording.
+/// \param width Image width in pixels.
+/// \param height Image height in pixels.
+/// \param codec THERMAL_CODEC_NONE for raw frames, THERMAL_CODEC_PREDICTIVE to compress them.
+/// \return True if the file was created.
+bool thermal_recorder::open(const std::string& filename, int width, int height, int codec)
+{
+    close();
+    _fd = ::open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (_fd < 0)
+    {
+        std::cerr << "Failed to create " << filename << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+    void* header = MAP_FAILED;
+    if (ftruncate(_fd, THERMAL_HEADER_SIZE) == 0)
+    {
+        header = mmap(nullptr, THERMAL_HEADER_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+    }
+    if (header == MAP_FAILED)
+    {
+        std::cerr << "Failed to map " << filename << ": " << strerror(errno) << std::endl;
+        ::close(_fd);
+        _fd = -1;
+        return false;
+    }
+    _header = static_cast<thermal_file_header*>(header);
+    memcpy(_header->magic, THERMAL_RECORDING_MAGIC, sizeof(_header->magic));
+    _header->version = THERMAL_RECORDING_VERSION;
+    _header->width = width;
+    _header->height = height;
+    _header->chunk_frames = THERMAL_CHUNK_FRAMES;
+    _header->codec = codec;
+    _header->keyframe_interval = THERMAL_KEYFRAME_INTERVAL;
+    _header->record_size = thermal_record_size(width, height);
+    _header->chunk_size = THERMAL_CHUNK_HEADER_SIZE + _header->record_size * THERMAL_CHUNK_FRAMES;
+    _header->frames = 0;
+    _header->chunks = 0;
+    _header->created_ns = realtime_ns();
+    _nextOffset = THERMAL_HEADER_SIZE;
+    _frames = 0;
+    _pixelBytes = static_cast<size_t>(width) * height * sizeof(uint16_t);
+    _encoder.reset();
+    if (codec == THERMAL_CODEC_PREDICTIVE)
+    {
+        _encoder.reset(new thermal_encoder(width, height));
+        _encoded.resize(_encoder->max_encoded_size());
+    }
+    return true;
+}
+
+/// \brief Appends a frame, a new chunk is allocated when the current one is full. In a
+/// compressed recording the frame is stored raw if it does not get smaller.
+/// \param pixels Raw pixel values, width * height in row major order.
+/// \param timestamps Receive timestamps of the frame.
+/// \param telemetry Telemetry of the frame.
+/// \return False if the recording is not open or the disk is full.
+bool thermal_recorder::write(const uint16_t* pixels, const thermal_timestamps& timestamps, const lepton_telemetry& telemetry)
+{
+    if (_fd < 0)
+    {
+        return false;
+    }
+    thermal_chunk_header* chunk = reinterpret_cast<thermal_chunk_header*>(_chunk);
+    if (!chunk || chunk->frames == THERMAL_CHUNK_FRAMES)
+    {
+        if (chunk)
+        {
+            unmap_chunk(false);
+        }
+        if (!map_chunk())
+        {
+            close();
+            return false;
+        }
+        chunk = reinterpret_cast<thermal_chunk_header*>(_chunk);
+    }
+
+    uint32_t n = chunk->frames;
+    uint64_t offset = chunk->bytes;
+    uint8_t* record = _chunk + offset;
+    thermal_record_header* header = reinterpret_cast<thermal_record_header*>(record);
+    memset(header, 0, sizeof(*header));
+    header->frame = _frames;
+    header->frame_ns = timestamps.frame_ns;
+    header->segments = timestamps.segments;
+    for (int i = 0; i < MAX_SEGMENTS_PER_FRAME; i++)
+    {
+        header->segment_ns[i] = timestamps.segment_ns[i];
+    }
+    header->telemetry_valid = telemetry.valid;
+    header->frame_counter = telemetry.frame_counter;
+    header->uptime_ms = telemetry.uptime_ms;
+    header->status = telemetry.status;
+    header->last_ffc_ms = telemetry.last_ffc_ms;
+    header->revision = telemetry.revision;
+    header->frame_mean = telemetry.frame_mean;
+    header->fpa_temp = telemetry.fpa_temp;
+    header->housing_temp = telemetry.housing_temp;
+    header->fpa_temp_last_ffc = telemetry.fpa_temp_last_ffc;
+    size_t size = _encoder ? _encoder->encode(pixels, _frames % THERMAL_KEYFRAME_INTERVAL == 0, _encoded.data()) : _pixelBytes;
+    if (_encoder && size < _pixelBytes)
+    {
+        header->codec = THERMAL_CODEC_PREDICTIVE;
+        memcpy(record + THERMAL_RECORD_HEADER_SIZE, _encoded.data(), size);
+    }
+    else
+    {
+        header->codec = THERMAL_CODEC_NONE;
+        size = _pixelBytes;
+        memcpy(record + THERMAL_RECORD_HEADER_SIZE, pixels, size);
+    }
+    header->encoded_size = static_cast<uint32_t>(size);
+    chunk->timestamps[n] = timestamps.frame_ns;
+    chunk->offsets[n] = static_cast<uint32_t>(offset);
+
+    // The frame becomes visible to readers of the growing file only once it is complete
+    std::atomic_thread_fence(std::memory_order_release);
+    chunk->bytes = align_up(offset + THERMAL_RECORD_HEADER_SIZE + size, THERMAL_RECORD_ALIGNMENT);
+    chunk->frames = n + 1;
+    _header->frames = ++_frames;
+    return true;
+}
+
+/// \brief Allocates the next chunk on disk and maps it.
+/// \return False if the disk is full or the mapping failed.
+bool thermal_recorder::map_chunk()
+{
+    _chunkOffset = _nextOffset;
+    // Allocating the blocks up front keeps the chunk contiguous and turns a full disk into
+    // an error here instead of a SIGBUS when a mapped page is written back
+    int err = posix_fallocate(_fd, _chunkOffset, _header->chunk_size);
+    if (err != 0)
+    {
+        std::cerr << "Failed to allocate recording chunk: " << strerror(err) << std::endl;
+        return false;
+    }
+    void* chunk = mmap(nullptr, _header->chunk_size, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, _chunkOffset);
+    if (chunk == MAP_FAILED)
+    {
+        std::cerr << "Failed to map recording chunk: " << strerror(errno) << std::endl;
+        return false;
+    }
+    _chunk = static_cast<uint8_t*>(chunk);
+    thermal_chunk_header* header = reinterpret_cast<thermal_chunk_header*>(_chunk);
+    header->magic = THERMAL_CHUNK_MAGIC;
+    header->frames = 0;
+    header->chunk = _header->chunks;
+    header->first_frame = _frames;
+    header->bytes = THERMAL_CHUNK_HEADER_SIZE;
+    _header->chunks++;
+    return true;
+}
+
+/// \brief Unmaps the current chunk and starts writing it back without waiting for the disk.
+/// The next chunk reuses the allocated space the current one did not fill.
+/// \param truncate Cut the file after the last frame of the chunk, used when closing.
+/// \return None.
+void thermal_recorder::unmap_chunk(bool truncate)
+{
+    const thermal_chunk_header* chunk = reinterpret_cast<thermal_chunk_header*>(_chunk);
+    uint32_t frames = chunk->frames;
+    uint64_t bytes = chunk->bytes;
+    munmap(_chunk, _header->chunk_size);
+    _chunk = nullptr;
+    sync_file_range(_fd, _chunkOffset, bytes, SYNC_FILE_RANGE_WRITE);
+    _nextOffset = _chunkOffset + align_up(bytes, THERMAL_PAGE_SIZE);
+    if (truncate)
+    {
+        uint64_t end = _chunkOffset;
+        if (frames > 0)
+        {
+            end += bytes;
+        }
+        else
+        {
+            _header->chunks--;
+        }
+        if (ftruncate(_fd, end) != 0)
+        {
+            std::cerr << "Failed to truncate recording: " << strerror(errno) << std::endl;
+        }
+    }
+}
+
+/// \brief Writes the last chunk back and closes the file.
+/// \return None.
+void thermal_recorder::close()
+{
+    if (_fd < 0)
+    {
+        return;
+    }
+    if (_chunk)
+    {
+        unmap_chunk(true);
+    }
+    msync(_header, THERMAL_HEADER_SIZE, MS_SYNC);
+    munmap(_header, THERMAL_HEADER_SIZE);
+    _header = nullptr;
+    ::close(_fd);
+    _fd = -1;
+}
+
+thermal_recording::thermal_recording()
+    : _data(nullptr), _size(0), _width(0), _height(0), _codec(THERMAL_CODEC_NONE), _keyframeInterval(1), _frames(0),
+      _decoded(0)
+{
+}
+
+thermal_recording::~thermal_recording()
+{
+    close();
+}
+
+/// \brief Maps a recording and reads the chunk headers into the seek index.
+/// \param filename Path of the recording.
+/// \return False if the file is not a recording.
+bool thermal_recording::open(const std::string& filename)
+{
+    close();
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        std::cerr << "Failed to open " << filename << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < THERMAL_HEADER_SIZE)
+    {
+        std::cerr << filename << " is not a thermal recording" << std::endl;
+        ::close(fd);
+        return false;
+    }
+    void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (data == MAP_FAILED)
+    {
+        std::cerr << "Failed to map " << filename << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+    _data = static_cast<const uint8_t*>(data);
+    _size = st.st_size;
+
+    const thermal_file_header* header = reinterpret_cast<const thermal_file_header*>(_data);
+    if (memcmp(header->magic, THERMAL_RECORDING_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != THERMAL_RECORDING_VERSION || header->chunk_frames != THERMAL_CHUNK_FRAMES ||
+        header->record_size != thermal_record_size(header->width, header->height) ||
+        header->codec > THERMAL_CODEC_PREDICTIVE || header->keyframe_interval == 0)
+    {
+        std::cerr << filename << " is not a thermal recording" << std::endl;
+        close();
+        return false;
+    }
+    _width = header->width;
+    _height = header->height;
+    _codec = header->codec;
+    _keyframeInterval = header->keyframe_interval;
+    if (_codec != THERMAL_CODEC_NONE)
+    {
+        _decoder.reset(new thermal_decoder(_width, _height));
+    }
+
+    // Only complete frames of chunks that made it to disk are indexed
+    uint64_t offset = THERMAL_HEADER_SIZE;
+    while (offset + THERMAL_CHUNK_HEADER_SIZE <= _size)
+    {
+        const thermal_chunk_header* chunk = reinterpret_cast<const thermal_chunk_header*>(_data + offset);
+        if (chunk->magic != THERMAL_CHUNK_MAGIC || chunk->bytes < THERMAL_CHUNK_HEADER_SIZE)
+        {
+            break;
+        }
+        uint32_t frames = std::min<uint32_t>(chunk->frames, THERMAL_CHUNK_FRAMES);
+        uint32_t complete = 0;
+        while (complete < frames)
+        {
+            uint64_t record = offset + chunk->offsets[complete];
+            if (chunk->offsets[complete] < THERMAL_CHUNK_HEADER_SIZE || record + THERMAL_RECORD_HEADER_SIZE > _size)
+            {
+                break;
+            }
+            const thermal_record_header* r = reinterpret_cast<const thermal_record_header*>(_data + record);
+            if (r->encoded_size > header->record_size - THERMAL_RECORD_HEADER_SIZE ||
+                record + THERMAL_RECORD_HEADER_SIZE + r->encoded_size > _size)
+            {
+                break;
+            }
+            complete++;
+        }
+        if (complete == 0)
+        {
+            break;
+        }
+        _chunks.push_back(chunk_entry{chunk, _data + offset, _frames, complete});
+        _frames += complete;
+        if (complete < frames)
+        {
+            break;
+        }
+        offset += align_up(chunk->bytes, THERMAL_PAGE_SIZE);
+    }
+    _decoded = _frames;
+    return true;
+}
+
+/// \brief Unmaps the recording, views returned by frame() become invalid.
+/// \return None.
+void thermal_recording::close()
+{
+    if (_data)
+    {
+        munmap(const_cast<uint8_t*>(_data), _size);
+    }
+    _data = nullptr;
+    _size = 0;
+    _frames = 0;
+    _decoded = 0;
+    _chunks.clear();
+    _decoder.reset();
+}
+
+/// \brief Frame by number, pointing into the mapping.
+/// \param index Frame number, less than frames().
+/// \return View of the frame, null pointers if the index is out of range.
+thermal_frame_view thermal_recording::frame(uint64_t index) const
+{
+    if (index >= _frames)
+    {
+        return thermal_frame_view{nullptr, nullptr, nullptr};
+    }
+    auto chunk = std::upper_bound(_chunks.begin(), _chunks.end(), index,
+                                  [](uint64_t i, const chunk_entry& c) { return i < c.first_frame; }) - 1;
+    const uint8_t* record = chunk->data + chunk->header->offsets[index - chunk->first_frame];
+    const thermal_record_header* header = reinterpret_cast<const thermal_record_header*>(record);
+    const uint8_t* data = record + THERMAL_RECORD_HEADER_SIZE;
+    const uint16_t* pixels = header->codec == THERMAL_CODEC_NONE ? reinterpret_cast<const uint16_t*>(data) : nullptr;
+    return thermal_frame_view{header, pixels, data};
+}
+
+/// \brief Pixels of a frame. Raw frames are copied, encoded frames are decoded starting at
+/// the previously decoded frame or the last keyframe, so reading in order decodes every
+/// frame once.
+/// \param index Frame number, less than frames().
+/// \param pixels Destination of width * height values.
+/// \return False if the index is out of range or the frame is corrupt.
+bool thermal_recording::decode(uint64_t index, uint16_t* pixels)
+{
+    if (index >= _frames)
+    {
+        return false;
+    }
+    uint64_t start = index;
+    if (_decoder)
+    {
+        start = index - index % _keyframeInterval;
+        if (_decoded < index && _decoded >= start)
+        {
+            start = _decoded + 1;
+        }
+    }
+    for (uint64_t i = start; i <= index; i++)
+    {
+        thermal_frame_view view = frame(i);
+        if (view.pixels)
+        {
+            memcpy(pixels, view.pixels, static_cast<size_t>(_width) * _height * sizeof(uint16_t));
+            if (_decoder)
+            {
+                _decoder->set_reference(pixels);
+            }
+        }
+        else if (!_decoder || !_decoder->decode(view.data, view.header->encoded_size, pixels))
+        {
+            _decoded = _frames;
+            return false;
+        }
+        _decoded = i;
+    }
+    return true;
+}
+
+/// \brief First frame received at or after a time, from the chunk indices.
+/// \param timestamp_ns Receive time in ns (CLOCK_REALTIME).
+/// \return Frame number, frames() if all frames are older.
+uint64_t thermal_recording::seek(int64_t timestamp_ns) const
+{
+    auto chunk = std::upper_bound(_chunks.begin(), _chunks.end(), timestamp_ns,
+                                  [](int64_t t, const chunk_entry& c) { return t < c.header->timestamps[0]; });
+    if (chunk != _chunks.begin())
+    {
+        --chunk;
+    }
+    for (; chunk != _chunks.end(); ++chunk)
+    {
+        const int64_t* begin = chunk->header->timestamps;
+        const int64_t* found = std::lower_bound(begin, begin + chunk->frames, timestamp_ns);
+        if (found != begin + chunk->frames)
+        {
+            return chunk->first_frame + (found - begin);
+        }
+    }
+    return _frames;
+}
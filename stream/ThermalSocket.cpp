@@ -0,0 +1,292 @@
+#include <ThermalSocket.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <sstream>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+/// \file ThermalSocket.cpp
+/// \brief UDP ingest of the Lepton segments with kernel receive timestamps, timing and drop statistics.
+
+histogram::histogram(double binWidth, int bins)
+    : _binWidth(binWidth), _bins(bins, 0)
+{
+    clear();
+}
+
+/// \brief Adds a value, values past the last bin are counted in the last bin.
+/// \param value Value to add.
+/// \return None.
+void histogram::add(double value)
+{
+    int bin = static_cast<int>(value / _binWidth);
+    bin = std::max(0, std::min(bin, static_cast<int>(_bins.size()) - 1));
+    _bins[bin]++;
+    _count++;
+    double delta = value - _mean;
+    _mean += delta / _count;
+    _m2 += delta * (value - _mean);
+    _min = std::min(_min, value);
+    _max = std::max(_max, value);
+}
+
+/// \brief Resets all bins and statistics.
+/// \return None.
+void histogram::clear()
+{
+    std::fill(_bins.begin(), _bins.end(), 0);
+    _count = 0;
+    _mean = 0.0;
+    _m2 = 0.0;
+    _min = std::numeric_limits<double>::infinity();
+    _max = -std::numeric_limits<double>::infinity();
+}
+
+/// \brief Prints the statistics and the non-empty bins as a bar chart.
+/// \param name Title of the histogram.
+/// \param unit Unit of the values.
+/// \return None.
+void histogram::print(const std::string& name, const std::string& unit) const
+{
+    if (_count == 0)
+    {
+        std::cout << name << ": no samples" << std::endl;
+        return;
+    }
+    double stddev = _count > 1 ? std::sqrt(_m2 / (_count - 1)) : 0.0;
+    printf("%s: n=%llu mean=%.3f%s std=%.3f%s min=%.3f%s max=%.3f%s\n", name.c_str(),
+           static_cast<unsigned long long>(_count), _mean, unit.c_str(), stddev, unit.c_str(),
+           _min, unit.c_str(), _max, unit.c_str());
+    uint64_t peak = *std::max_element(_bins.begin(), _bins.end());
+    for (size_t i = 0; i < _bins.size(); i++)
+    {
+        if (_bins[i] == 0)
+        {
+            continue;
+        }
+        int bar = static_cast<int>(50 * _bins[i] / peak);
+        printf("  %8.2f%s%s %8llu %s\n", i * _binWidth, unit.c_str(), i + 1 == _bins.size() ? "+" : " ",
+               static_cast<unsigned long long>(_bins[i]), std::string(std::max(bar, 1), '#').c_str());
+    }
+}
+
+frame_timing::frame_timing()
+    : _last_frame_ns(0), _interval(1.0, 120), _latency(0.25, 200)
+{
+}
+
+/// \brief Adds one processed frame, frames with a missing segment are skipped.
+/// \param timestamps Kernel receive times of the frame.
+/// \param processed_ns Time the frame finished processing.
+/// \return None.
+void frame_timing::add(const thermal_timestamps& timestamps, int64_t processed_ns)
+{
+    if (timestamps.segments <= 0)
+    {
+        return;
+    }
+    for (int i = 0; i < timestamps.segments; i++)
+    {
+        if (timestamps.segment_ns[i] == 0)
+        {
+            return;
+        }
+    }
+    if (_last_frame_ns != 0)
+    {
+        _interval.add((timestamps.frame_ns - _last_frame_ns) / 1e6);
+    }
+    _last_frame_ns = timestamps.frame_ns;
+    _latency.add((processed_ns - timestamps.segment_ns[timestamps.segments - 1]) / 1e6);
+}
+
+/// \brief Prints the inter-frame interval and latency histograms.
+/// \return None.
+void frame_timing::print() const
+{
+    _interval.print("Thermal inter-frame interval", "ms");
+    _latency.print("Thermal receive-to-process latency", "ms");
+}
+
+/// \brief Resets both histograms.
+/// \return None.
+void frame_timing::clear()
+{
+    _interval.clear();
+    _latency.clear();
+}
+
+int64_t realtime_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return static_cast<int64_t>(ts.tv_sec) * 1000000000LL + ts.tv_nsec;
+}
+
+int open_thermal_socket(uint16_t port, int timeout_ms, const receive_options& options)
+{
+    int sockfd;
+    struct sockaddr_in servaddr;
+    if ((sockfd = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+    {
+        std::cerr << "Socket creation failed" << std::endl;
+        return -1;
+    }
+    memset(&servaddr, 0, sizeof(servaddr));
+    servaddr.sin_family = AF_INET;
+    servaddr.sin_port = htons(port);
+    servaddr.sin_addr.s_addr = INADDR_ANY;
+    if (bind(sockfd, (const struct sockaddr *)&servaddr, sizeof(servaddr)) < 0)
+    {
+        std::cerr << "Bind failed on port " << port << std::endl;
+        close(sockfd);
+        return -1;
+    }
+    int enable = 1;
+    if (setsockopt(sockfd, SOL_SOCKET, SO_TIMESTAMPNS, &enable, sizeof(enable)) < 0)
+    {
+        std::cerr << "SO_TIMESTAMPNS not supported, using receive time" << std::endl;
+    }
+    if (setsockopt(sockfd, SOL_SOCKET, SO_RXQ_OVFL, &enable, sizeof(enable)) < 0)
+    {
+        std::cerr << "SO_RXQ_OVFL not supported, drops only from /proc/net/udp" << std::endl;
+    }
+    if (options.rcvbuf > 0)
+    {
+        // SO_RCVBUFFORCE may exceed net.core.rmem_max but needs CAP_NET_ADMIN
+        if (setsockopt(sockfd, SOL_SOCKET, SO_RCVBUFFORCE, &options.rcvbuf, sizeof(options.rcvbuf)) < 0)
+        {
+            setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &options.rcvbuf, sizeof(options.rcvbuf));
+        }
+        int actual = 0;
+        socklen_t size = sizeof(actual);
+        getsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &actual, &size);
+        // The kernel reports twice the usable size to account for its bookkeeping
+        if (actual / 2 < options.rcvbuf)
+        {
+            std::cerr << "Receive buffer is " << actual / 2 << " bytes instead of " << options.rcvbuf
+                      << ", raise net.core.rmem_max or run with CAP_NET_ADMIN" << std::endl;
+        }
+    }
+    if (timeout_ms > 0)
+    {
+        struct timeval timeout;
+        timeout.tv_sec = timeout_ms / 1000;
+        timeout.tv_usec = (timeout_ms % 1000) * 1000;
+        setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    }
+    return sockfd;
+}
+
+bool configure_receive_thread(const receive_options& options)
+{
+    bool ok = true;
+    if (options.cpu >= 0)
+    {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(options.cpu, &cpus);
+        int err = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+        if (err != 0)
+        {
+            std::cerr << "Failed to pin the receive thread to CPU " << options.cpu << ": " << strerror(err) << std::endl;
+            ok = false;
+        }
+    }
+    if (options.priority > 0)
+    {
+        struct sched_param param;
+        memset(&param, 0, sizeof(param));
+        param.sched_priority = options.priority;
+        int err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+        if (err != 0)
+        {
+            std::cerr << "Failed to set SCHED_FIFO priority " << options.priority << ": " << strerror(err)
+                      << " (needs CAP_SYS_NICE or an rtprio limit)" << std::endl;
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+ssize_t receive_segment(int sockfd, uint8_t* buffer, size_t size, int64_t& timestamp_ns, uint32_t* kernel_drops)
+{
+    struct iovec iov;
+    iov.iov_base = buffer;
+    iov.iov_len = size;
+    char control[CMSG_SPACE(sizeof(struct timespec)) + CMSG_SPACE(sizeof(uint32_t))];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t received_bytes = recvmsg(sockfd, &msg, 0);
+    if (received_bytes < 0)
+    {
+        return received_bytes;
+    }
+    timestamp_ns = 0;
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS)
+        {
+            struct timespec ts;
+            memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+            timestamp_ns = static_cast<int64_t>(ts.tv_sec) * 1000000000LL + ts.tv_nsec;
+        }
+        else if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_RXQ_OVFL && kernel_drops)
+        {
+            memcpy(kernel_drops, CMSG_DATA(cmsg), sizeof(uint32_t));
+        }
+    }
+    if (timestamp_ns == 0)
+    {
+        timestamp_ns = realtime_ns();
+    }
+    return received_bytes;
+}
+
+int64_t proc_udp_drops(uint16_t port)
+{
+    std::ifstream file("/proc/net/udp");
+    std::string line;
+    std::getline(file, line); // Header
+    while (std::getline(file, line))
+    {
+        // sl local_address rem_address st tx_queue:rx_queue tr:tm->when retrnsmt uid timeout inode ref pointer drops
+        std::istringstream fields(line);
+        std::string slot, local, field;
+        fields >> slot >> local;
+        size_t colon = local.find(':');
+        if (colon == std::string::npos || std::strtoul(local.c_str() + colon + 1, nullptr, 16) != port)
+        {
+            continue;
+        }
+        std::string last;
+        while (fields >> field)
+        {
+            last = field;
+        }
+        return std::strtoll(last.c_str(), nullptr, 10);
+    }
+    return -1;
+}
+
+void print_socket_drops(uint16_t port, uint32_t kernel_drops)
+{
+    printf("Socket drops on port %u: SO_RXQ_OVFL=%u /proc/net/udp=%lld\n", port, kernel_drops,
+           static_cast<long long>(proc_udp_drops(port)));
+}
@@ -0,0 +1,223 @@
+#include <ThermalUpsample.h>
+
+#include <algorithm>
+
+/// \file ThermalUpsample.cpp
+/// \brief Depth guided upsampling of temperatures.
+
+/// \brief Creates the upsampler.
+/// \param radius Window radius in depth pixels, at most 80 so the depth sums fit in 32 bits.
+/// \param edge Depth change in meters that is kept as an edge, the regularization of the fits.
+guided_upsampler::guided_upsampler(int radius, float edge)
+    : _radius(radius), _edge(edge)
+{
+}
+
+/// \brief Builds a temperature and depth frame, see build_thermal_depth, with the temperatures
+/// upsampled to the depth resolution. Pixels with depth that the thermal camera sees get a
+/// temperature, the others 0.
+/// \param projection Projection, project() has been called with the same depth image. Its worker
+/// pool runs the filter.
+/// \param depth Depth aligned to the color image, in depth units.
+/// \param units Meters per depth unit.
+/// \param raw Raw thermal image after thermal_projection::undistort, CV_16UC1 in centikelvin.
+/// \param frame CV_16UC2 frame, reallocated if its size differs.
+/// \return None.
+void guided_upsampler::upsample(const thermal_projection& projection, const uint16_t* depth, float units,
+                                const cv::Mat& raw, cv::Mat& frame)
+{
+    const int width = projection.width();
+    frame.create(projection.height(), width, CV_16UC2);
+    worker_pool& pool = projection.pool();
+    _buffers.resize(pool.size());
+    const int32_t* index = projection.index();
+    const uint16_t* temperature = raw.ptr<uint16_t>();
+    const int tiles = (width + UPSAMPLE_TILE - 1) / UPSAMPLE_TILE;
+    pool.run([&](unsigned int k)
+             {
+                 for (int t = static_cast<int>(k); t < tiles; t += static_cast<int>(pool.size()))
+                 {
+                     filter_tile(_buffers[k], t * UPSAMPLE_TILE, std::min(width, (t + 1) * UPSAMPLE_TILE), index, depth,
+                                 temperature, units, frame);
+                 }
+             });
+}
+
+/// \brief Filters the columns of one tile from the top of the image to the bottom. Row y of the
+/// moments enters the ring, the fits of row y - radius are computed from the window sums and enter
+/// their ring, and row y - 2 * radius of the frame is written from the sums of the fits.
+/// \param buffers Buffers of the calling thread.
+/// \param x0 First column of the tile.
+/// \param x1 Column after the last one.
+/// \param index Thermal pixel of every depth pixel, see thermal_projection::index.
+/// \param depth Depth in depth units.
+/// \param temperature Raw thermal image.
+/// \param units Meters per depth unit.
+/// \param frame Frame whose columns x0 to x1 are written.
+/// \return None.
+void guided_upsampler::filter_tile(tile_buffers& buffers, int x0, int x1, const int32_t* index, const uint16_t* depth,
+                                   const uint16_t* temperature, float units, cv::Mat& frame) const
+{
+    const int width = frame.cols, height = frame.rows, r = _radius, ring = 2 * r + 1;
+    // The fits are needed radius columns around the tile, their moments radius columns further
+    const int fx0 = std::max(0, x0 - r), fx1 = std::min(width, x1 + r);
+    const int fw = fx1 - fx0, tw = x1 - x0;
+    const double eps = _edge / static_cast<double>(units), eps2 = eps * eps;
+    const double millimeters = units * 1000.0;
+
+    buffers.momentRing.resize(static_cast<size_t>(ring) * fw);
+    buffers.momentSum.assign(fw, moments());
+    buffers.fitRow.resize(fw);
+    buffers.fitRing.resize(static_cast<size_t>(ring) * tw);
+    buffers.fitSum.assign(static_cast<size_t>(tw) * 3, 0.0);
+    moments* momentSum = buffers.momentSum.data();
+    fit* fitRow = buffers.fitRow.data();
+    double* fitSum = buffers.fitSum.data();
+
+    // Adds sign times the moments of pixel i to m, pixels without depth or temperature add nothing
+    auto accumulate = [&](moments& m, size_t i, int sign)
+    {
+        int32_t d = depth[i];
+        int32_t t = d && index[i] >= 0 ? temperature[index[i]] : 0;
+        if (t > 0)
+        {
+            m.count += sign;
+            m.depth += sign * d;
+            m.temperature += sign * t;
+            m.depth2 += sign * static_cast<int64_t>(d) * d;
+            m.product += sign * static_cast<int64_t>(d) * t;
+        }
+    };
+
+    for (int y = 0; y < height + 2 * r; y++)
+    {
+        // Moments of row y, summed along the row, enter the window sums and row y - ring leaves
+        moments* slot = &buffers.momentRing[static_cast<size_t>(y % ring) * fw];
+        if (y >= ring)
+        {
+            for (int j = 0; j < fw; j++)
+            {
+                momentSum[j].count -= slot[j].count;
+                momentSum[j].depth -= slot[j].depth;
+                momentSum[j].temperature -= slot[j].temperature;
+                momentSum[j].depth2 -= slot[j].depth2;
+                momentSum[j].product -= slot[j].product;
+            }
+        }
+        if (y < height)
+        {
+            const size_t row = static_cast<size_t>(y) * width;
+            moments run = moments();
+            for (int x = std::max(0, fx0 - r); x < std::min(width, fx0 + r); x++)
+            {
+                accumulate(run, row + x, 1);
+            }
+            for (int x = fx0; x < fx1; x++)
+            {
+                if (x + r < width)
+                {
+                    accumulate(run, row + x + r, 1);
+                }
+                if (x > fx0 && x - r - 1 >= 0)
+                {
+                    accumulate(run, row + x - r - 1, -1);
+                }
+                const int j = x - fx0;
+                slot[j] = run;
+                momentSum[j].count += run.count;
+                momentSum[j].depth += run.depth;
+                momentSum[j].temperature += run.temperature;
+                momentSum[j].depth2 += run.depth2;
+                momentSum[j].product += run.product;
+            }
+        }
+
+        // Fits of row c, whose window is complete, summed along the row into their window sums
+        const int c = y - r;
+        if (c >= 0)
+        {
+            fit* fits = &buffers.fitRing[static_cast<size_t>(c % ring) * tw];
+            if (c >= ring)
+            {
+                for (int j = 0; j < tw; j++)
+                {
+                    fitSum[3 * j] -= fits[j].a;
+                    fitSum[3 * j + 1] -= fits[j].b;
+                    fitSum[3 * j + 2] -= fits[j].weight;
+                }
+            }
+            if (c < height)
+            {
+                // Exact integer variance and covariance scaled by count^2, so no cancellation
+                for (int j = 0; j < fw; j++)
+                {
+                    const moments& s = momentSum[j];
+                    if (s.count == 0)
+                    {
+                        fitRow[j].a = fitRow[j].b = fitRow[j].weight = 0.0f;
+                        continue;
+                    }
+                    const int64_t n = s.count;
+                    const int64_t var = n * s.depth2 - static_cast<int64_t>(s.depth) * s.depth;
+                    const int64_t cov = n * s.product - static_cast<int64_t>(s.depth) * s.temperature;
+                    const double a = cov / (static_cast<double>(var) + eps2 * static_cast<double>(n * n));
+                    fitRow[j].a = static_cast<float>(a);
+                    fitRow[j].b = static_cast<float>((s.temperature - a * s.depth) / n);
+                    fitRow[j].weight = 1.0f;
+                }
+                double a = 0.0, b = 0.0, weight = 0.0;
+                for (int j = 0; j < std::min(fx1, x0 + r) - fx0; j++)
+                {
+                    a += fitRow[j].a;
+                    b += fitRow[j].b;
+                    weight += fitRow[j].weight;
+                }
+                for (int x = x0; x < x1; x++)
+                {
+                    if (x + r < width)
+                    {
+                        const fit& f = fitRow[x + r - fx0];
+                        a += f.a;
+                        b += f.b;
+                        weight += f.weight;
+                    }
+                    if (x > x0 && x - r - 1 >= 0)
+                    {
+                        const fit& f = fitRow[x - r - 1 - fx0];
+                        a -= f.a;
+                        b -= f.b;
+                        weight -= f.weight;
+                    }
+                    const int j = x - x0;
+                    fits[j].a = static_cast<float>(a);
+                    fits[j].b = static_cast<float>(b);
+                    fits[j].weight = static_cast<float>(weight);
+                    fitSum[3 * j] += fits[j].a;
+                    fitSum[3 * j + 1] += fits[j].b;
+                    fitSum[3 * j + 2] += fits[j].weight;
+                }
+            }
+        }
+
+        // Row o of the frame from the averaged fits of the windows that contain its pixels
+        const int o = y - 2 * r;
+        if (o >= 0)
+        {
+            uint16_t* out = frame.ptr<uint16_t>(o);
+            const size_t row = static_cast<size_t>(o) * width;
+            for (int x = x0; x < x1; x++)
+            {
+                const size_t i = row + x;
+                const double* s = &fitSum[3 * (x - x0)];
+                double mm = std::min(65535.0, depth[i] * millimeters + 0.5);
+                double t = 0.0;
+                if (depth[i] && index[i] >= 0 && s[2] > 0.5)
+                {
+                    t = std::min(65535.0, std::max(1.0, (s[0] * depth[i] + s[1]) / s[2] + 0.5));
+                }
+                out[2 * x] = static_cast<uint16_t>(mm);
+                out[2 * x + 1] = static_cast<uint16_t>(t);
+            }
+        }
+    }
+}
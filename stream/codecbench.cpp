@@ -0,0 +1,209 @@
+#include <iostream>
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <libgen.h>
+#include <ThermalCodec.h>
+#include <ThermalRecording.h>
+
+#define LEPTON_FPS 27
+#define BENCH_BATCH_FRAMES THERMAL_CHUNK_FRAMES
+
+/// \file codecbench.cpp
+/// \brief Benchmark of the lossless thermal codec over a corpus of recordings.
+
+/// \brief Function to describe how to use the command line arguments
+/// \param cmd Argument of the command line, here it is the program
+void printUsage(char *cmd)
+{
+	char *cmdname = basename(cmd);
+	printf(" Usage: %s [OPTION]... RECORDING...\n"
+		   " -h			display this help and exit.\n"
+		   " -keyframe x		frames between keyframes (default: 32).\n"
+		   " -repeat x		encode and decode every recording x times (default: 3).\n"
+		   " Recordings are made with -record in lepton or depth_saver, raw or compressed.\n"
+		   "", cmdname);
+	return;
+}
+
+/// \brief Totals over the frames of one or more recordings.
+struct codec_result
+{
+	uint64_t frames = 0;
+	uint64_t raw_bytes = 0;
+	uint64_t encoded_bytes = 0;
+	double encode_s = 0.0;
+	double decode_s = 0.0;
+	uint64_t mismatches = 0;
+
+	void add(const codec_result& other)
+	{
+		frames += other.frames;
+		raw_bytes += other.raw_bytes;
+		encoded_bytes += other.encoded_bytes;
+		encode_s += other.encode_s;
+		decode_s += other.decode_s;
+		mismatches += other.mismatches;
+	}
+
+	void print(const std::string& name) const
+	{
+		double ratio = encoded_bytes ? static_cast<double>(raw_bytes) / encoded_bytes : 0.0;
+		double encodeFps = encode_s > 0 ? frames / encode_s : 0.0;
+		double decodeFps = decode_s > 0 ? frames / decode_s : 0.0;
+		printf("%s\n", name.c_str());
+		printf("  frames %llu, %.1f MB raw, %.1f MB encoded, ratio %.2f, %.2f bits/pixel\n",
+			   static_cast<unsigned long long>(frames), raw_bytes / 1e6, encoded_bytes / 1e6, ratio,
+			   raw_bytes ? 16.0 / ratio : 0.0);
+		printf("  encode %.0f frames/s (%.1f MB/s, %.0fx real time at %d Hz)\n",
+			   encodeFps, encode_s > 0 ? raw_bytes / encode_s / 1e6 : 0.0, encodeFps / LEPTON_FPS, LEPTON_FPS);
+		printf("  decode %.0f frames/s (%.1f MB/s, %.0fx real time at %d Hz)\n",
+			   decodeFps, decode_s > 0 ? raw_bytes / decode_s / 1e6 : 0.0, decodeFps / LEPTON_FPS, LEPTON_FPS);
+		if (mismatches)
+		{
+			printf("  %llu frames did not decode to the original\n", static_cast<unsigned long long>(mismatches));
+		}
+	}
+};
+
+/// \brief Encodes and decodes every frame of a recording on one core and checks the result.
+/// Frames are processed in batches of a chunk so long recordings do not have to fit in memory,
+/// only encoding and decoding are timed.
+/// \param recording Recording to use as corpus.
+/// \param keyframeInterval Frames between keyframes.
+/// \param repeat Number of passes, the timings are summed.
+/// \return Totals of all passes.
+codec_result run_codec(thermal_recording& recording, int keyframeInterval, int repeat)
+{
+	codec_result result;
+	size_t pixels = static_cast<size_t>(recording.width()) * recording.height();
+	std::vector<uint16_t> frames(pixels * BENCH_BATCH_FRAMES);
+	std::vector<uint16_t> decoded(pixels);
+	std::vector<size_t> sizes(BENCH_BATCH_FRAMES);
+	std::vector<uint8_t> encoded;
+	for (int pass = 0; pass < repeat; pass++)
+	{
+		thermal_encoder encoder(recording.width(), recording.height());
+		thermal_decoder decoder(recording.width(), recording.height());
+		size_t maxSize = encoder.max_encoded_size();
+		encoded.resize(maxSize * BENCH_BATCH_FRAMES);
+		for (uint64_t first = 0; first < recording.frames(); first += BENCH_BATCH_FRAMES)
+		{
+			uint64_t count = std::min<uint64_t>(BENCH_BATCH_FRAMES, recording.frames() - first);
+			for (uint64_t i = 0; i < count; i++)
+			{
+				if (!recording.decode(first + i, frames.data() + i * pixels))
+				{
+					std::cerr << "Frame " << first + i << " is corrupt" << std::endl;
+					result.mismatches++;
+					return result;
+				}
+			}
+
+			auto start = std::chrono::steady_clock::now();
+			for (uint64_t i = 0; i < count; i++)
+			{
+				sizes[i] = encoder.encode(frames.data() + i * pixels, (first + i) % keyframeInterval == 0,
+										  encoded.data() + i * maxSize);
+			}
+			auto encodeEnd = std::chrono::steady_clock::now();
+			for (uint64_t i = 0; i < count; i++)
+			{
+				if (!decoder.decode(encoded.data() + i * maxSize, sizes[i], decoded.data()) ||
+					memcmp(decoded.data(), frames.data() + i * pixels, pixels * sizeof(uint16_t)) != 0)
+				{
+					result.mismatches++;
+				}
+			}
+			auto decodeEnd = std::chrono::steady_clock::now();
+
+			result.frames += count;
+			result.raw_bytes += count * pixels * sizeof(uint16_t);
+			for (uint64_t i = 0; i < count; i++)
+			{
+				result.encoded_bytes += sizes[i];
+			}
+			result.encode_s += std::chrono::duration<double>(encodeEnd - start).count();
+			result.decode_s += std::chrono::duration<double>(decodeEnd - encodeEnd).count();
+		}
+	}
+	return result;
+}
+
+/// \brief Reports compression ratio and single core throughput of the codec.
+/// \param argc Number of command-line arguments.
+/// \param argv Array of command-line arguments.
+/// \param keyframe Frames between keyframes.
+/// \param repeat Passes over every recording.
+/// \return 0 if every frame decoded to the original, -1 otherwise.
+int main(int argc, char **argv)
+{
+	int keyframeInterval = THERMAL_KEYFRAME_INTERVAL;
+	int repeat = 3;
+	std::vector<std::string> files;
+
+	for(int i=1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "-h") == 0)
+		{
+			printUsage(argv[0]);
+			exit(0);
+		}
+		else if (strcmp(argv[i], "-keyframe") == 0)
+		{
+			if (i + 1 != argc && (keyframeInterval = std::strtol(argv[i + 1], nullptr, 10)) > 0)
+			{
+				i++;
+			}
+			else
+			{
+				std::cerr << "Error: Enter a keyframe interval above 0." << std::endl;
+				exit(1);
+			}
+		}
+		else if (strcmp(argv[i], "-repeat") == 0)
+		{
+			if (i + 1 != argc && (repeat = std::strtol(argv[i + 1], nullptr, 10)) > 0)
+			{
+				i++;
+			}
+			else
+			{
+				std::cerr << "Error: Enter a repeat count above 0." << std::endl;
+				exit(1);
+			}
+		}
+		else
+		{
+			files.push_back(argv[i]);
+		}
+	}
+	if (files.empty())
+	{
+		printUsage(argv[0]);
+		exit(1);
+	}
+
+	codec_result total;
+	for (const auto& file : files)
+	{
+		thermal_recording recording;
+		if (!recording.open(file))
+		{
+			return -1;
+		}
+		codec_result result = run_codec(recording, keyframeInterval, repeat);
+		result.print(file);
+		total.add(result);
+	}
+	if (files.size() > 1)
+	{
+		total.print("Corpus");
+	}
+	return total.mismatches == 0 ? 0 : -1;
+}
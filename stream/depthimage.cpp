@@ -7,19 +7,25 @@
 #include <chrono>
 #include <cstdint>
 #include <cstring>
+#include <vector>
 #include <arpa/inet.h>
+#include <sched.h>
 #include <unistd.h>
 #include <Palettes.h>
+#include <DepthSource.h>
+#include <LeptonDecoder.h>
+#include <LeptonTelemetry.h>
+#include <ThermalRecording.h>
+#include <ThermalSocket.h>
+#include <ThermalCalibration.h>
+#include <ThermalOverlay.h>
 
-#define PACKET_SIZE 164
-#define PACKET_SIZE_UINT16 (PACKET_SIZE/2)
-#define PACKETS_PER_FRAME 60
-#define FRAME_SIZE_UINT16 (PACKET_SIZE_UINT16*PACKETS_PER_FRAME)
 #define FPS 27;
 
 /// \file depthimage.cpp
 /// \brief Program that streams images from the thermal and rgb cameras.
 /// \brief Saves thermal images to thermal_images and rgb images to images.
+/// \brief With -overlay the thermal image is blended onto the color image through the aligned depth.
 
 /// \brief Function to describe how to use the command line arguments
 /// \param cmd Argument of the command line, here it is the program
@@ -32,6 +38,26 @@ void printUsage(char *cmd)
 		   " -mintemp x		sets a minimum value for scaling (suggestion: 27300).\n"
 		   " -maxtemp x		sets a maximum value for scaling (suggestion: 30800).\n"
 		   "			Temperature values for min and max are in hectoKelvin.\n"
+		   " -rcvbuf x		socket receive buffer in bytes (suggestion: 4194304).\n"
+		   " -cpu x		pin the thermal receive thread to cpu x.\n"
+		   " -rtprio x		run the thermal receive thread under SCHED_FIFO with priority x (1 to 99).\n"
+		   " -lepton x		thermal stream layout, detected when not given.\n"
+		   "			lepton3, lepton2 and their -telemetry-header/-footer variants.\n"
+		   " -nocrc		skip the CRC check of the thermal packets.\n"
+		   " -timing		print frame jitter, latency and drop statistics every 10 s.\n"
+		   " -record x		append every valid raw 16-bit frame with its timestamps\n"
+		   "			and telemetry to the recording file x.\n"
+		   " -compress		losslessly compress the recorded frames.\n"
+		   " -bag x		play depth and color from the RealSense recording x instead of a camera.\n"
+		   " -syndepth		use a synthetic depth and color scene instead of a camera.\n"
+		   " -fast		play the bag or the synthetic scene as fast as possible\n"
+		   "			instead of at its frame rate.\n"
+		   " -overlay [a]		blend the thermal image onto the color image, with weight a\n"
+		   "			between 0 and 1 (default: 0.5). Needs the calibration.\n"
+		   " -calibration x	thermal intrinsics (default: ../../pointcloud/calibration.xml).\n"
+		   " -extrinsic x		thermal to rgb extrinsics (default: ../../pointcloud/extrinsic.xml).\n"
+		   " -distortion x		thermal lens distortion of the overlay: remap, model or table\n"
+		   "			(default: remap), see ThermalProjection.h.\n"
 		   " Capture:		To capture images press c on the image window.\n"
 		   "			Saves raw grayscale and custom colormap images\n"
 		   "			to the thermal_images directory.\n"
@@ -46,12 +72,26 @@ void printUsage(char *cmd)
 /// \param port Port of the IP address.
 /// \param mintemp Minimum temperature to be scaled between 0 and 255.
 /// \param maxtemp Maximum temperature to be scaled between 0 and 255.
+/// \param lepton Layout of the thermal stream.
+/// \param nocrc Skip the CRC check of the thermal packets.
+/// \param timing Print the timing histograms and drop counters periodically.
+/// \param rcvbuf Socket receive buffer size.
+/// \param cpu Cpu the thermal receive thread is pinned to.
+/// \param rtprio SCHED_FIFO priority of the thermal receive thread.
+/// \param record Recording file for the raw frames.
+/// \param compress Compress the recorded frames.
+/// \param bag RealSense recording to play instead of a camera.
+/// \param syndepth Synthetic depth scene instead of a camera.
+/// \param fast Play the bag or the synthetic scene as fast as possible.
+/// \param overlay Blend the thermal image onto the color image, with an optional weight.
+/// \param calibration Thermal intrinsics for the overlay.
+/// \param extrinsic Thermal to rgb extrinsics for the overlay.
+/// \param distortion Handling of the thermal lens distortion in the overlay.
 /// \return 0 if successful, -1 if failure.
 int main(int argc, char * argv[])
 try
 {
     int sockfd;
-    struct sockaddr_in servaddr, cliaddr;
 
     const int *selectedColormap = colormap_ironblack;
 	int selectedColormapSize = get_size_colormap_ironblack();
@@ -62,8 +102,19 @@ try
 	int myImageWidth = 160;
 	int myImageHeight = 120;
 	int img_cnt = 0;
-	bool first = true;
 	uint16_t port = 8080;
+	bool printTiming = false;
+	bool checkCrc = true;
+	const lepton_decoder *decoder = nullptr;
+	receive_options receiveOptions;
+	std::string recordFile;
+	int recordCodec = THERMAL_CODEC_NONE;
+	depth_source_options depthOptions;
+	bool overlay = false;
+	float overlayAlpha = OVERLAY_ALPHA;
+	std::string calibrationFile = "../../pointcloud/calibration.xml";
+	std::string extrinsicFile = "../../pointcloud/extrinsic.xml";
+	thermal_distortion distortion = DISTORTION_REMAP;
 
 	for(int i=1; i < argc; i++)
 	{
@@ -125,129 +176,282 @@ try
 				exit(1);
 			}
 		}
+		else if (strcmp(argv[i], "-timing") == 0)
+		{
+			printTiming = true;
+		}
+		else if (strcmp(argv[i], "-rcvbuf") == 0)
+		{
+			if (i + 1 != argc)
+			{
+				long int temp = std::strtol(argv[++i], nullptr, 10);
+				if (temp <= 0 || temp > 1073741824){
+					std::cerr << "Error: Enter a receive buffer size in bytes." << std::endl;
+					exit(1);
+				}
+				receiveOptions.rcvbuf = static_cast<int>(temp);
+			}
+			else
+			{
+				std::cerr << "Error: Enter a receive buffer size in bytes." << std::endl;
+				exit(1);
+			}
+		}
+		else if (strcmp(argv[i], "-cpu") == 0)
+		{
+			if (i + 1 != argc)
+			{
+				long int temp = std::strtol(argv[++i], nullptr, 10);
+				if (temp < 0 || temp >= CPU_SETSIZE){
+					std::cerr << "Error: Enter a valid cpu." << std::endl;
+					exit(1);
+				}
+				receiveOptions.cpu = static_cast<int>(temp);
+			}
+			else
+			{
+				std::cerr << "Error: Enter a valid cpu." << std::endl;
+				exit(1);
+			}
+		}
+		else if (strcmp(argv[i], "-rtprio") == 0)
+		{
+			if (i + 1 != argc)
+			{
+				long int temp = std::strtol(argv[++i], nullptr, 10);
+				if (temp < 1 || temp > 99){
+					std::cerr << "Error: Enter a priority between 1 and 99." << std::endl;
+					exit(1);
+				}
+				receiveOptions.priority = static_cast<int>(temp);
+			}
+			else
+			{
+				std::cerr << "Error: Enter a priority between 1 and 99." << std::endl;
+				exit(1);
+			}
+		}
+		else if (strcmp(argv[i], "-nocrc") == 0)
+		{
+			checkCrc = false;
+		}
+		else if (strcmp(argv[i], "-record") == 0)
+		{
+			if (i + 1 != argc)
+			{
+				recordFile = argv[++i];
+			}
+			else
+			{
+				std::cerr << "Error: Enter a recording file." << std::endl;
+				exit(1);
+			}
+		}
+		else if (strcmp(argv[i], "-compress") == 0)
+		{
+			recordCodec = THERMAL_CODEC_PREDICTIVE;
+		}
+		else if (strcmp(argv[i], "-lepton") == 0)
+		{
+			if (i + 1 != argc && (decoder = find_lepton_decoder(argv[i + 1])) != nullptr)
+			{
+				i++;
+			}
+			else
+			{
+				std::cerr << "Error: Enter one of the thermal decoders:" << std::endl;
+				print_lepton_decoders();
+				exit(1);
+			}
+		}
+		else if (strcmp(argv[i], "-bag") == 0)
+		{
+			if (i + 1 != argc)
+			{
+				depthOptions.type = DEPTH_SOURCE_BAG;
+				depthOptions.file = argv[++i];
+			}
+			else
+			{
+				std::cerr << "Error: Enter a bag file." << std::endl;
+				exit(1);
+			}
+		}
+		else if (strcmp(argv[i], "-syndepth") == 0)
+		{
+			depthOptions.type = DEPTH_SOURCE_SYNTHETIC;
+		}
+		else if (strcmp(argv[i], "-fast") == 0)
+		{
+			depthOptions.real_time = false;
+		}
+		else if (strcmp(argv[i], "-overlay") == 0)
+		{
+			overlay = true;
+			// The weight is optional, a following option starts with a dash
+			if (i + 1 != argc && argv[i + 1][0] != '-')
+			{
+				double temp = std::strtod(argv[++i], nullptr);
+				if (temp < 0 || temp > 1){
+					std::cerr << "Error: Enter an overlay weight between 0 and 1." << std::endl;
+					exit(1);
+				}
+				overlayAlpha = static_cast<float>(temp);
+			}
+		}
+		else if (strcmp(argv[i], "-calibration") == 0 || strcmp(argv[i], "-extrinsic") == 0)
+		{
+			std::string& file = strcmp(argv[i], "-calibration") == 0 ? calibrationFile : extrinsicFile;
+			if (i + 1 != argc)
+			{
+				file = argv[++i];
+			}
+			else
+			{
+				std::cerr << "Error: Enter a path after " << argv[i] << "." << std::endl;
+				exit(1);
+			}
+		}
+		else if (strcmp(argv[i], "-distortion") == 0)
+		{
+			if (i + 1 != argc && parse_thermal_distortion(argv[i + 1], distortion))
+			{
+				i++;
+			}
+			else
+			{
+				std::cerr << "Error: Enter a distortion mode: remap, model or table." << std::endl;
+				exit(1);
+			}
+		}
 	}
 
-	uint8_t shelf[4][PACKET_SIZE*PACKETS_PER_FRAME];
+	thermal_calibration calibration;
+	if (overlay && !load_thermal_calibration(calibration, calibrationFile, extrinsicFile))
+	{
+		return -1;
+	}
 
 	uint16_t minValue = rangeMin;
 	uint16_t maxValue = rangeMax;
 	float diff = maxValue - minValue;
 	float scale = 255/diff;
-	uint16_t n_zero_value_drop_frame = 0;
 
-    cv::Mat image(myImageHeight, myImageWidth, CV_8UC3);
-	cv::Mat gray(myImageHeight, myImageWidth, CV_8UC1);
-    cv::namedWindow("Thermal Image", cv::WINDOW_AUTOSIZE);
-
-    if ((sockfd = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+    if ((sockfd = open_thermal_socket(port, 0, receiveOptions)) < 0)
 	{
-        std::cerr << "Socket creation failed" << std::endl;
         return -1;
     }
-
-    memset(&servaddr, 0, sizeof(servaddr));
-    memset(&cliaddr, 0, sizeof(cliaddr));
-    
-    servaddr.sin_family = AF_INET;
-    servaddr.sin_port = htons(port);
-    servaddr.sin_addr.s_addr = INADDR_ANY;
-
-    if (bind(sockfd, (const struct sockaddr *)&servaddr, sizeof(servaddr)) < 0)
+    if (!decoder && (decoder = detect_lepton_stream(sockfd)) == nullptr)
 	{
-        std::cerr << "Bind failed" << std::endl;
+        std::cerr << "Receive failed" << std::endl;
         close(sockfd);
         return -1;
     }
+	myImageWidth = decoder->width;
+	myImageHeight = decoder->height;
+    std::vector<uint8_t> frame(decoder->frame_size());
+    std::vector<uint16_t> telemetryWords(decoder->telemetry_words());
+    cv::Mat raw(myImageHeight, myImageWidth, CV_16UC1);
+    cv::Mat image(myImageHeight, myImageWidth, CV_8UC3);
+	cv::Mat gray(myImageHeight, myImageWidth, CV_8UC1);
+    cv::namedWindow("Thermal Image", cv::WINDOW_AUTOSIZE);
 
-    socklen_t len = sizeof(cliaddr);
+    uint32_t kernelDrops = 0;
+    ssize_t receivedBytes[MAX_SEGMENTS_PER_FRAME] = {};
+    drop_stats drops;
+    thermal_timestamps timestamps = {};
+    lepton_telemetry telemetry;
+    frame_sequence sequence;
+    thermal_recorder recorder;
+    if (!recordFile.empty() && !recorder.open(recordFile, myImageWidth, myImageHeight, recordCodec))
+	{
+        close(sockfd);
+        return -1;
+    }
+    frame_timing timing;
+    FILE *timestampFile = nullptr;
 
-    // Declare RealSense pipeline
-    rs2::pipeline pipe;
-    rs2::config cfg;
-    cfg.enable_stream(RS2_STREAM_DEPTH, 1280, 720, RS2_FORMAT_Z16);
-    cfg.enable_stream(RS2_STREAM_COLOR, 1280, 720, RS2_FORMAT_RGB8);
-    pipe.start(cfg);
+    // RealSense camera, bag or synthetic scene
+    std::unique_ptr<depth_source> source = open_depth_source(depthOptions);
+    std::cout << "Depth from " << source->name() << std::endl;
     rs2::align align_to_color(RS2_STREAM_COLOR);
 
     int frame_counter = 0;
+    thermal_overlay fusion;
+    bool fusionReady = false;
+    cv::Mat overlayImage;
+    // Only the receive thread is pinned and prioritized, not the processing and its threads
+    lepton_receiver receiver(sockfd, *decoder, receiveOptions);
 
     while (true)
     {
-		rs2::frameset frames = pipe.wait_for_frames();
-		frames = align_to_color.process(frames);
-		rs2::frame color_frame = frames.get_color_frame();
-
-        for (int i = 0; i < 4; ++i)
+		rs2::frameset frames;
+		if (!source->wait_for_frames(frames, 15000))
 		{
-            ssize_t received_bytes = recvfrom(sockfd, shelf[i], sizeof(shelf[i]), 0, (struct sockaddr *)&cliaddr, &len);
-            if (received_bytes < 0)
+			if (source->finished())
 			{
-                std::cerr << "Receive failed" << std::endl;
-                close(sockfd);
-                return -1;
-            }
-			if (first && i == 1)
-			{
-				first = false;
 				break;
 			}
+			continue;
+		}
+		frames = align_to_color.process(frames);
+		rs2::video_frame color_frame = frames.get_color_frame();
+		rs2::depth_frame depth_frame = frames.get_depth_frame();
+
+        // A recording keeps every thermal frame, otherwise the newest one goes with the depth frame
+        ssize_t result = recorder.is_open() ? receiver.receive(frame.data(), receivedBytes, timestamps, &kernelDrops)
+                                            : receiver.receive_latest(frame.data(), receivedBytes, timestamps, &kernelDrops);
+        if (result < 0)
+		{
+            std::cerr << "Receive failed" << std::endl;
+            receiver.stop();
+            close(sockfd);
+            return -1;
         }
+
+		// Reject corrupted frames before any decoding
+		drop_reason reason = decoder->validate(frame.data(), receivedBytes, checkCrc);
+		if (reason == DROP_NONE)
+		{
+			// Telemetry first, repeated frames and frames frozen by the shutter are not decoded
+			decoder->decode(frame.data(), nullptr, telemetryWords.data());
+			parse_lepton_telemetry(telemetryWords.data(), decoder->telemetry_words(), telemetry);
+			reason = sequence.check(telemetry, drops);
+		}
+		drops.add(reason);
+		if (reason != DROP_NONE)
+		{
+			continue;
+		}
+		decoder->decode(frame.data(), raw.ptr<uint16_t>(), nullptr);
+		if (recorder.is_open())
+		{
+			recorder.write(raw.ptr<uint16_t>(), timestamps, telemetry);
+		}
+
         if (autoRangeMin || autoRangeMax)
 		{
+			double frameMin, frameMax;
+			cv::minMaxLoc(raw, &frameMin, &frameMax);
 			if (autoRangeMin)
 			{
-				maxValue = 65535;
+				minValue = static_cast<uint16_t>(frameMin);
 			}
 			if (autoRangeMax)
 			{
-				maxValue = 0;
-			}
-			for (int iSegment = 1; iSegment <= 4; iSegment++)
-			{
-				for (int i=0;i<FRAME_SIZE_UINT16;i++)
-				{
-					if (i % PACKET_SIZE_UINT16 < 2)
-					{
-						continue;
-					}
-
-					uint16_t value = (shelf[iSegment - 1][i*2] << 8) + shelf[iSegment - 1][i*2+1];
-					if (value == 0)
-					{
-						continue;
-					}
-					if (autoRangeMax && (value > maxValue))
-					{
-						maxValue = value;
-					}
-					if (autoRangeMin && (value < minValue))
-					{
-						minValue = value;
-					}
-				}
+				maxValue = static_cast<uint16_t>(frameMax);
 			}
 			diff = maxValue - minValue;
 			scale = 255/diff;
 		}
-		int row, column;
 		uint16_t value;
 		uint16_t valueFrameBuffer;
-		for (int iSegment = 1; iSegment <= 4; iSegment++)
+		for (int row = 0; row < myImageHeight; row++)
 		{
-			int ofsRow = 30 * (iSegment - 1);
-			for (int i=0;i<FRAME_SIZE_UINT16;i++)
+			const uint16_t *rawRow = raw.ptr<uint16_t>(row);
+			for (int column = 0; column < myImageWidth; column++)
 			{
-				if (i % PACKET_SIZE_UINT16 < 2)
-				{
-					continue;
-				}
-
-				valueFrameBuffer = (shelf[iSegment - 1][i*2] << 8) + shelf[iSegment - 1][i*2+1];
-				if (valueFrameBuffer == 0)
-				{
-					n_zero_value_drop_frame++;
-					break;
-				}
+				valueFrameBuffer = rawRow[column];
 
 				if (!autoRangeMin && (valueFrameBuffer <= minValue))
 				{
@@ -265,28 +469,39 @@ try
 				int ofs_g = 3 * value + 1; if (selectedColormapSize <= ofs_g) ofs_g = selectedColormapSize - 1;
 				int ofs_b = 3 * value + 2; if (selectedColormapSize <= ofs_b) ofs_b = selectedColormapSize - 1;
 				cv::Vec3b color(selectedColormap[ofs_b], selectedColormap[ofs_g], selectedColormap[ofs_r]);
-                column = (i % PACKET_SIZE_UINT16) - 2 + (myImageWidth / 2) * ((i % (PACKET_SIZE_UINT16 * 2)) / PACKET_SIZE_UINT16);
-                row = i / PACKET_SIZE_UINT16 / 2 + ofsRow;
-                if (row < myImageHeight && column < myImageWidth)
-				{
-                    image.at<cv::Vec3b>(row, column) = color;
-					gray.at<uint8_t>(row, column) = value;
-                }
-                if ((column == 80) && (row == 60))
-				{
-                    double temp = (valueFrameBuffer / 100) - 273;
-                    std::cout << "Temp at center " << temp << std::endl;
-                }
+				image.at<cv::Vec3b>(row, column) = color;
+				gray.at<uint8_t>(row, column) = value;
 			}
 		}
-		if (n_zero_value_drop_frame != 0)
+		double temp = (raw.at<uint16_t>(myImageHeight / 2, myImageWidth / 2) / 100) - 273;
+		std::cout << "Temp at center " << temp << std::endl;
+		timing.add(timestamps, realtime_ns());
+		if (printTiming && timing.frames() >= TIMING_REPORT_FRAMES)
 		{
-			n_zero_value_drop_frame = 0;
+			timing.print();
+			print_socket_drops(port, kernelDrops);
+			drops.print();
+			timing.clear();
+			drops.clear();
 		}
 
-        cv::Mat color_image(cv::Size(1280, 720), CV_8UC3, (void*)color_frame.get_data(), cv::Mat::AUTO_STEP);
+        cv::Mat color_image(cv::Size(color_frame.get_width(), color_frame.get_height()), CV_8UC3, (void*)color_frame.get_data(), cv::Mat::AUTO_STEP);
 		cv::cvtColor(color_image, color_image, cv::COLOR_RGB2BGR);
 		cv::imshow("Color Image", color_image);
+		if (overlay)
+		{
+			// The ray tables follow the color stream, which the depth is aligned to
+			if (!fusionReady)
+			{
+				rs2_intrinsics intrinsics = color_frame.get_profile().as<rs2::video_stream_profile>().get_intrinsics();
+				fusion.init(calibration, intrinsics, myImageWidth, myImageHeight, distortion);
+				fusionReady = true;
+			}
+			color_image.copyTo(overlayImage);
+			fusion.blend(static_cast<const uint16_t*>(depth_frame.get_data()), depth_frame.get_units(), image, overlayImage,
+						 overlayAlpha);
+			cv::imshow("Thermal Overlay", overlayImage);
+		}
 		char key = cv::waitKey(1);
 		cv::imshow("Thermal Image", image);
 
@@ -301,6 +516,25 @@ try
 			cv::imwrite(filename, image);
 			filename = "thermal_images/thermal_grayimage_" + std::to_string(img_cnt) + ".png";
 			cv::imwrite(filename, gray);
+			if (overlay)
+			{
+				filename = "images/overlay_image_" + std::to_string(img_cnt) + ".png";
+				cv::imwrite(filename, overlayImage);
+			}
+			if (!timestampFile && (timestampFile = fopen("thermal_images/timestamps.csv", "a")) == nullptr)
+			{
+				std::cerr << "Failed to open thermal_images/timestamps.csv" << std::endl;
+			}
+			else
+			{
+				// image, frame and segment kernel receive times in ns, color frame time in ms,
+				// telemetry frame counter and FPA temperature
+				fprintf(timestampFile, "%d,%lld,%lld,%lld,%lld,%lld,%.3f,%u,%.2f\n", img_cnt, (long long)timestamps.frame_ns,
+						(long long)timestamps.segment_ns[0], (long long)timestamps.segment_ns[1],
+						(long long)timestamps.segment_ns[2], (long long)timestamps.segment_ns[3],
+						color_frame.get_timestamp(), telemetry.frame_counter, telemetry.fpa_temp);
+				fflush(timestampFile);
+			}
 			std::cout << "Image saved" << std::endl;
         }
         else if (key == 'q' || key == 'Q')
@@ -309,6 +543,22 @@ try
             break;
         }
     }
+    if (timestampFile)
+	{
+		fclose(timestampFile);
+	}
+	if (recorder.is_open())
+	{
+		std::cout << "Recorded " << recorder.frames() << " frames to " << recordFile << std::endl;
+		recorder.close();
+	}
+	if (printTiming)
+	{
+		timing.print();
+		print_socket_drops(port, kernelDrops);
+		drops.print();
+	}
+    receiver.stop();
     close(sockfd);
     return 0;
 }
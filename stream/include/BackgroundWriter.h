@@ -0,0 +1,185 @@
+#ifndef BACKGROUNDWRITER_H
+#define BACKGROUNDWRITER_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+/// \file BackgroundWriter.h
+/// \brief Bounded queue drained by one writer thread, so saving never makes a capture or
+/// render loop wait for the disk.
+
+/// \brief Queue of jobs written in order on a background thread. A job that does not fit in the
+/// queue is dropped and counted instead of waiting.
+/// \tparam Job Queued item, moved into the queue and out of it.
+template <class Job>
+class background_writer
+{
+public:
+    /// \brief Writes one job, returns false if it failed.
+    using write_function = std::function<bool(Job&)>;
+
+    /// \brief Creates the queue, start() starts the thread.
+    /// \param capacity Jobs waiting for the disk before new ones are dropped.
+    explicit background_writer(size_t capacity)
+        : _capacity(capacity), _running(false), _stop(false), _busy(false), _stopOnFailure(false), _written(0),
+          _dropped(0), _failed(0)
+    {
+    }
+
+    /// \brief Writes the queued jobs and stops the thread.
+    ~background_writer()
+    {
+        stop();
+    }
+
+    background_writer(const background_writer&) = delete;
+    background_writer& operator=(const background_writer&) = delete;
+
+    /// \brief Starts the writer thread, the counters restart from 0.
+    /// \param write Function writing one job.
+    /// \param stopOnFailure After a failed write discard the queued jobs and refuse new ones.
+    /// \return None.
+    void start(write_function write, bool stopOnFailure = false)
+    {
+        stop();
+        std::lock_guard<std::mutex> lock(_mutex);
+        _write = std::move(write);
+        _stopOnFailure = stopOnFailure;
+        _stop = false;
+        _written = _dropped = _failed = 0;
+        _running = true;
+        _thread = std::thread(&background_writer::run, this);
+    }
+
+    /// \brief Writes the queued jobs and stops the thread.
+    /// \return None.
+    void stop()
+    {
+        if (!_thread.joinable())
+        {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _stop = true;
+        }
+        _cv.notify_all();
+        _thread.join();
+        std::lock_guard<std::mutex> lock(_mutex);
+        _running = false;
+    }
+
+    /// \brief True between start() and stop().
+    bool running()
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _running;
+    }
+
+    /// \brief Queues a job, never waits for the disk.
+    /// \param job Job to write.
+    /// \return False if the writer is not running, has stopped after a failure or the queue is
+    /// full, in which case the job is dropped.
+    bool push(Job job)
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            if (!_running || _stop)
+            {
+                return false;
+            }
+            if (_queue.size() >= _capacity)
+            {
+                _dropped++;
+                return false;
+            }
+            _queue.push_back(std::move(job));
+        }
+        _cv.notify_all();
+        return true;
+    }
+
+    /// \brief Jobs queued or being written.
+    size_t pending()
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _queue.size() + (_busy ? 1 : 0);
+    }
+
+    /// \brief Jobs written successfully.
+    uint64_t written()
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _written;
+    }
+
+    /// \brief Jobs dropped because the queue was full or discarded after a failure.
+    uint64_t dropped()
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _dropped;
+    }
+
+    /// \brief Jobs whose write failed.
+    uint64_t failed()
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _failed;
+    }
+
+private:
+    void run()
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        while (true)
+        {
+            _cv.wait(lock, [&] { return _stop || !_queue.empty(); });
+            if (_queue.empty())
+            {
+                return;
+            }
+            Job job = std::move(_queue.front());
+            _queue.pop_front();
+            _busy = true;
+            lock.unlock();
+            bool ok = _write(job);
+            lock.lock();
+            _busy = false;
+            if (ok)
+            {
+                _written++;
+                continue;
+            }
+            _failed++;
+            if (_stopOnFailure)
+            {
+                _stop = true;
+                _dropped += _queue.size();
+                _queue.clear();
+                return;
+            }
+        }
+    }
+
+    size_t _capacity;
+    bool _running;
+    bool _stop;
+    bool _busy;
+    bool _stopOnFailure;
+    uint64_t _written;
+    uint64_t _dropped;
+    uint64_t _failed;
+    write_function _write;
+    std::mutex _mutex;
+    std::condition_variable _cv;
+    std::deque<Job> _queue;
+    std::thread _thread;
+};
+
+#endif
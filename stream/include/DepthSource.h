@@ -0,0 +1,71 @@
+#ifndef DEPTHSOURCE_H
+#define DEPTHSOURCE_H
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <librealsense2/rs.hpp>
+
+/// \file DepthSource.h
+/// \brief Depth and color framesets from a live RealSense, a .bag recording or a synthetic scene.
+///
+/// Every source returns librealsense framesets, the synthetic scene is injected through a
+/// software device, so rs2::align and rs2::pointcloud work the same on all of them and the
+/// fusion pipeline can run without a camera.
+
+#define DEPTH_WIDTH 1280
+#define DEPTH_HEIGHT 720
+#define DEPTH_FPS 30
+
+/// \brief Where the depth and color frames come from.
+enum depth_source_type
+{
+    DEPTH_SOURCE_LIVE,      // RealSense camera
+    DEPTH_SOURCE_BAG,       // Recording made with the RealSense viewer or rs-record
+    DEPTH_SOURCE_SYNTHETIC  // Generated scene, no camera needed
+};
+
+/// \brief Selection and settings of a depth source.
+struct depth_source_options
+{
+    depth_source_type type = DEPTH_SOURCE_LIVE;
+    std::string serial;      // Camera to open, the first one if empty
+    std::string file;        // Bag file to play
+    bool real_time = true;   // Bag and synthetic frames at their frame rate, as fast as possible otherwise
+    bool loop = false;       // Restart the bag when it ends
+    int width = DEPTH_WIDTH;
+    int height = DEPTH_HEIGHT;
+    int fps = DEPTH_FPS;
+};
+
+/// \brief Source of depth and color framesets.
+class depth_source
+{
+public:
+    virtual ~depth_source() {}
+
+    /// \brief Waits for the next frameset holding a depth and a color frame.
+    /// \param frames The frameset.
+    /// \param timeout_ms Longest wait.
+    /// \return False on timeout or at the end of a bag.
+    virtual bool wait_for_frames(rs2::frameset& frames, unsigned int timeout_ms) = 0;
+
+    /// \brief Intrinsics of the color stream, which depth is aligned to.
+    virtual rs2_intrinsics color_intrinsics() const = 0;
+
+    /// \brief True once a bag that does not loop has played to its end.
+    virtual bool finished() const { return false; }
+
+    /// \brief Stops streaming, no frames are returned afterwards.
+    virtual void stop() = 0;
+
+    /// \brief Name of the source for messages.
+    virtual std::string name() const = 0;
+};
+
+/// \brief Opens and starts a depth source.
+/// \param options Source and its settings.
+/// \return The started source, throws rs2::error if the camera or the bag cannot be opened.
+std::unique_ptr<depth_source> open_depth_source(const depth_source_options& options);
+
+#endif
@@ -0,0 +1,307 @@
+#ifndef LEPTONDECODER_H
+#define LEPTONDECODER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <sys/types.h>
+#include <LeptonPacket.h>
+#include <ThermalSocket.h>
+
+/// \file LeptonDecoder.h
+/// \brief Frame decoders specialized at compile time on the VoSPI layout of the Lepton model,
+/// and a registry that picks one for the stream being received.
+
+#define LEPTON_PACKET_SIZE 164
+#define LEPTON_HEADER_SIZE 4
+#define LEPTON_PACKET_PIXELS 80
+#define LEPTON_MAX_PACKETS_PER_SEGMENT 63
+#define LEPTON_RECEIVER_QUEUE 4   // Received frames waiting for processing before the oldest is dropped
+
+/// \brief Where the telemetry lines are placed in the frame.
+enum telemetry_location
+{
+    TELEMETRY_NONE,
+    TELEMETRY_HEADER,
+    TELEMETRY_FOOTER
+};
+
+/// \brief Packet layout of a frame, everything is a compile time constant.
+/// Packets are numbered over the whole frame, segment after segment. Image packets are in
+/// row major order with Width / 80 packets per row, telemetry packets come before (header)
+/// or after (footer) them.
+/// \tparam Width Image width in pixels, a multiple of 80.
+/// \tparam Height Image height in pixels.
+/// \tparam Segments Segments (datagrams) per frame.
+/// \tparam TelemetryPackets Packets holding telemetry when it is enabled.
+/// \tparam Location Position of the telemetry packets.
+template <int Width, int Height, int Segments, int TelemetryPackets, telemetry_location Location>
+struct lepton_layout
+{
+    static constexpr int width = Width;
+    static constexpr int height = Height;
+    static constexpr int segments = Segments;
+    static constexpr telemetry_location location = Location;
+    static constexpr int telemetry_packets = Location == TELEMETRY_NONE ? 0 : TelemetryPackets;
+    static constexpr int image_packets = Width / LEPTON_PACKET_PIXELS * Height;
+    static constexpr int total_packets = image_packets + telemetry_packets;
+    static constexpr int packets_per_segment = total_packets / Segments;
+    static constexpr int segment_size = packets_per_segment * LEPTON_PACKET_SIZE;
+    static constexpr int first_image_packet = Location == TELEMETRY_HEADER ? telemetry_packets : 0;
+    static constexpr int first_telemetry_packet = Location == TELEMETRY_HEADER ? 0 : image_packets;
+
+    static_assert(Width % LEPTON_PACKET_PIXELS == 0, "Rows must be made of whole packets");
+    static_assert(total_packets % Segments == 0, "Segments must hold the same number of packets");
+    static_assert(packets_per_segment <= LEPTON_MAX_PACKETS_PER_SEGMENT, "Segment larger than a VoSPI segment");
+};
+
+using lepton3_layout = lepton_layout<160, 120, 4, 4, TELEMETRY_NONE>;
+using lepton3_telemetry_header_layout = lepton_layout<160, 120, 4, 4, TELEMETRY_HEADER>;
+using lepton3_telemetry_footer_layout = lepton_layout<160, 120, 4, 4, TELEMETRY_FOOTER>;
+using lepton2_layout = lepton_layout<80, 60, 1, 3, TELEMETRY_NONE>;
+using lepton2_telemetry_header_layout = lepton_layout<80, 60, 1, 3, TELEMETRY_HEADER>;
+using lepton2_telemetry_footer_layout = lepton_layout<80, 60, 1, 3, TELEMETRY_FOOTER>;
+
+/// \brief Copies the big endian payload words of consecutive packets, skipping their headers.
+/// \tparam Packets Number of packets to copy.
+/// \param packet First packet.
+/// \param out Destination, 80 words per packet.
+/// \return None.
+template <int Packets>
+inline void decode_lepton_packets(const uint8_t* packet, uint16_t* out)
+{
+    for (int k = 0; k < Packets; k++)
+    {
+        const uint8_t* payload = packet + k * LEPTON_PACKET_SIZE + LEPTON_HEADER_SIZE;
+        uint16_t* words = out + k * LEPTON_PACKET_PIXELS;
+        for (int i = 0; i < LEPTON_PACKET_PIXELS; i++)
+        {
+            words[i] = static_cast<uint16_t>((payload[2 * i] << 8) | payload[2 * i + 1]);
+        }
+    }
+}
+
+/// \brief Decodes a received frame into raw 14-bit pixel values and telemetry words.
+/// Segments are contiguous in the frame buffer, so packet k starts at k * 164 and image
+/// packet q fills pixels q * 80 to q * 80 + 79 of the row major image.
+/// \tparam Layout A lepton_layout.
+/// \param frame Segments of the frame, one after the other.
+/// \param pixels Destination of width * height values, may be null to decode the telemetry only.
+/// \param telemetry Destination of telemetry_packets * 80 words, may be null.
+/// \return None.
+template <class Layout>
+void decode_lepton_frame(const uint8_t* frame, uint16_t* pixels, uint16_t* telemetry)
+{
+    if (pixels)
+    {
+        decode_lepton_packets<Layout::image_packets>(frame + Layout::first_image_packet * LEPTON_PACKET_SIZE, pixels);
+    }
+    if (Layout::telemetry_packets > 0 && telemetry)
+    {
+        decode_lepton_packets<Layout::telemetry_packets>(frame + Layout::first_telemetry_packet * LEPTON_PACKET_SIZE, telemetry);
+    }
+}
+
+/// \brief Writes the big endian payload words of consecutive packets, the inverse of decode_lepton_packets.
+/// \tparam Packets Number of packets to write.
+/// \param words Source, 80 words per packet.
+/// \param packet First packet.
+/// \return None.
+template <int Packets>
+inline void encode_lepton_packets(const uint16_t* words, uint8_t* packet)
+{
+    for (int k = 0; k < Packets; k++)
+    {
+        uint8_t* payload = packet + k * LEPTON_PACKET_SIZE + LEPTON_HEADER_SIZE;
+        const uint16_t* source = words + k * LEPTON_PACKET_PIXELS;
+        for (int i = 0; i < LEPTON_PACKET_PIXELS; i++)
+        {
+            payload[2 * i] = static_cast<uint8_t>(source[i] >> 8);
+            payload[2 * i + 1] = static_cast<uint8_t>(source[i]);
+        }
+    }
+}
+
+/// \brief Builds the VoSPI packets of a frame as the Lepton sends them: packet numbers, the
+/// segment number in packet 20 of segmented layouts and the CRC of every packet.
+/// \tparam Layout A lepton_layout.
+/// \param pixels Raw values, width * height in row major order.
+/// \param telemetry Telemetry words, telemetry_packets * 80, zeros if null.
+/// \param frame Destination of segments * segment_size bytes.
+/// \return None.
+template <class Layout>
+void encode_lepton_frame(const uint16_t* pixels, const uint16_t* telemetry, uint8_t* frame)
+{
+    encode_lepton_packets<Layout::image_packets>(pixels, frame + Layout::first_image_packet * LEPTON_PACKET_SIZE);
+    if (Layout::telemetry_packets > 0)
+    {
+        uint8_t* first = frame + Layout::first_telemetry_packet * LEPTON_PACKET_SIZE;
+        if (telemetry)
+        {
+            encode_lepton_packets<Layout::telemetry_packets>(telemetry, first);
+        }
+        else
+        {
+            for (int k = 0; k < Layout::telemetry_packets; k++)
+            {
+                memset(first + k * LEPTON_PACKET_SIZE + LEPTON_HEADER_SIZE, 0, LEPTON_PACKET_SIZE - LEPTON_HEADER_SIZE);
+            }
+        }
+    }
+    for (int s = 0; s < Layout::segments; s++)
+    {
+        for (int p = 0; p < Layout::packets_per_segment; p++)
+        {
+            uint8_t* packet = frame + s * Layout::segment_size + p * LEPTON_PACKET_SIZE;
+            int id = p;
+            if (Layout::segments > 1 && p == LEPTON_SEGMENT_PACKET)
+            {
+                id |= (s + 1) << 12;
+            }
+            packet[0] = static_cast<uint8_t>(id >> 8);
+            packet[1] = static_cast<uint8_t>(id);
+            // The CRC is computed with the upper nibble of the ID cleared
+            const uint8_t header[4] = {static_cast<uint8_t>(packet[0] & 0x0F), packet[1], 0, 0};
+            uint16_t crc = lepton_crc16(header, sizeof(header));
+            crc = lepton_crc16(packet + LEPTON_HEADER_SIZE, LEPTON_PACKET_SIZE - LEPTON_HEADER_SIZE, crc);
+            packet[2] = static_cast<uint8_t>(crc >> 8);
+            packet[3] = static_cast<uint8_t>(crc);
+        }
+    }
+}
+
+/// \brief Validates every segment of a received frame, see validate_segment.
+/// Only the Lepton 3 numbers its segments in packet 20.
+/// \tparam Layout A lepton_layout.
+/// \param frame Segments of the frame, one after the other.
+/// \param received Bytes received for each segment.
+/// \param checkCrc Verify the CRC of every packet.
+/// \return DROP_NONE if the frame is valid, the first failed check otherwise.
+template <class Layout>
+drop_reason validate_lepton_frame(const uint8_t* frame, const ssize_t* received, bool checkCrc)
+{
+    for (int s = 0; s < Layout::segments; s++)
+    {
+        // Image packets of this segment, relative to its first packet
+        int first = s * Layout::packets_per_segment;
+        int pixelBegin = Layout::first_image_packet - first;
+        int pixelEnd = Layout::first_image_packet + Layout::image_packets - first;
+        pixelBegin = pixelBegin < 0 ? 0 : pixelBegin;
+        pixelEnd = pixelEnd > Layout::packets_per_segment ? Layout::packets_per_segment : pixelEnd;
+        drop_reason reason = validate_segment(frame + s * Layout::segment_size, received[s], Layout::packets_per_segment,
+                                              LEPTON_PACKET_SIZE, Layout::segments > 1 ? s + 1 : 0, checkCrc,
+                                              pixelBegin, pixelEnd);
+        if (reason != DROP_NONE)
+        {
+            return reason;
+        }
+    }
+    return DROP_NONE;
+}
+
+/// \brief Runtime handle on one decoder specialization.
+struct lepton_decoder
+{
+    const char* name;
+    int width;
+    int height;
+    int segments;
+    int packets_per_segment;
+    int segment_size;
+    int telemetry_packets;
+    telemetry_location telemetry;
+    drop_reason (*validate)(const uint8_t* frame, const ssize_t* received, bool checkCrc);
+    void (*decode)(const uint8_t* frame, uint16_t* pixels, uint16_t* telemetry);
+    void (*encode)(const uint16_t* pixels, const uint16_t* telemetry, uint8_t* frame);
+
+    int frame_size() const { return segments * segment_size; }
+    int telemetry_words() const { return telemetry_packets * LEPTON_PACKET_PIXELS; }
+};
+
+/// \brief Builds the registry entry of a layout.
+template <class Layout>
+lepton_decoder make_lepton_decoder(const char* name)
+{
+    return lepton_decoder{name, Layout::width, Layout::height, Layout::segments, Layout::packets_per_segment,
+                          Layout::segment_size, Layout::telemetry_packets, Layout::location,
+                          &validate_lepton_frame<Layout>, &decode_lepton_frame<Layout>, &encode_lepton_frame<Layout>};
+}
+
+/// \brief Looks up a decoder by name (lepton3, lepton3-telemetry-header, lepton2, ...).
+/// \param name Name of the decoder.
+/// \return The decoder, null if there is none with that name.
+const lepton_decoder* find_lepton_decoder(const char* name);
+
+/// \brief Picks the decoder matching a received datagram from its size and the segment number of packet 20.
+/// Telemetry is assumed to be a header, a footer layout has to be asked for by name.
+/// \param datagram Received datagram.
+/// \param size Bytes received.
+/// \return The decoder, null if no layout matches.
+const lepton_decoder* detect_lepton_decoder(const uint8_t* datagram, ssize_t size);
+
+/// \brief Receives datagrams until one matches a registered decoder.
+/// \param sockfd Socket from open_thermal_socket.
+/// \return The decoder, null if the socket failed or timed out (errno is set).
+const lepton_decoder* detect_lepton_stream(int sockfd);
+
+/// \brief Prints the names of all registered decoders.
+/// \return None.
+void print_lepton_decoders();
+
+/// \brief Receives the segments of one frame. For segmented streams a segment with the wrong
+/// segment number restarts the frame, so the receiver locks onto the sender's frame boundary.
+/// \param sockfd Socket from open_thermal_socket.
+/// \param decoder Layout of the stream.
+/// \param frame Destination of frame_size() bytes.
+/// \param received Bytes received for each segment.
+/// \param timestamps Kernel receive time of each segment.
+/// \param kernel_drops Updated with the SO_RXQ_OVFL count, may be null.
+/// \return Bytes of the last datagram, -1 if the socket failed or timed out (errno is set).
+ssize_t receive_lepton_frame(int sockfd, const lepton_decoder& decoder, uint8_t* frame, ssize_t* received,
+                             thermal_timestamps& timestamps, uint32_t* kernel_drops);
+
+/// \brief Receives frames on a thread of its own and queues them for the processing thread.
+/// Only the receive thread is pinned and raised to SCHED_FIFO by the receive options, threads
+/// that the processing starts inherit the normal scheduler and all CPUs.
+class lepton_receiver
+{
+public:
+    lepton_receiver(int sockfd, const lepton_decoder& decoder, const receive_options& options);
+    ~lepton_receiver();
+
+    void stop();
+    ssize_t receive(uint8_t* frame, ssize_t* received, thermal_timestamps& timestamps, uint32_t* kernel_drops);
+    ssize_t receive_latest(uint8_t* frame, ssize_t* received, thermal_timestamps& timestamps, uint32_t* kernel_drops);
+    uint64_t overruns();
+
+private:
+    /// \brief Result of one receive_lepton_frame call.
+    struct slot
+    {
+        std::vector<uint8_t> frame;
+        ssize_t received[MAX_SEGMENTS_PER_FRAME];
+        thermal_timestamps timestamps;
+        uint32_t kernel_drops;
+        ssize_t result;
+        int error;     // errno of a failed receive
+    };
+
+    void run(receive_options options);
+    ssize_t take(bool latest, uint8_t* frame, ssize_t* received, thermal_timestamps& timestamps, uint32_t* kernel_drops);
+
+    int _sockfd;
+    const lepton_decoder& _decoder;
+    std::mutex _mutex;
+    std::condition_variable _cv;
+    slot _slots[LEPTON_RECEIVER_QUEUE];
+    int _first, _count;
+    bool _running, _failed;
+    uint64_t _overruns;   // Frames dropped because the queue was full or skipped by receive_latest
+    std::thread _thread;
+};
+
+#endif
@@ -0,0 +1,87 @@
+#ifndef LEPTONPACKET_H
+#define LEPTONPACKET_H
+
+#include <cstddef>
+#include <cstdint>
+#include <sys/types.h>
+
+/// \file LeptonPacket.h
+/// \brief Validation of VoSPI packets before a frame is decoded.
+
+#define LEPTON_SEGMENT_PACKET 20
+
+/// \brief Why a thermal frame was rejected.
+enum drop_reason
+{
+    DROP_NONE = 0,
+    DROP_SHORT,        // Datagram smaller than a full segment
+    DROP_DISCARD,      // Discard packet (ID xFxx) inside a segment
+    DROP_PACKET_ORDER, // Packet number does not match its position
+    DROP_SEGMENT,      // Segment number of packet 20 does not match its position
+    DROP_CRC,          // CRC16 mismatch
+    DROP_ZERO,         // Pixel value of 0, the sender filled in missing data
+    DROP_DUPLICATE,    // Telemetry frame counter did not advance, the Lepton repeated a frame
+    DROP_FFC,          // Flat field correction in progress, the image is frozen
+    DROP_REASONS
+};
+
+/// \brief Per reason counters of rejected frames.
+struct drop_stats
+{
+    uint64_t frames = 0;
+    uint64_t dropped[DROP_REASONS] = {};
+    uint64_t lost = 0; // Frames never received, from gaps in the telemetry frame counter
+
+    void add(drop_reason reason);
+    void print() const;
+    void clear();
+};
+
+/// \brief Name of a drop reason for printing.
+const char* drop_reason_name(drop_reason reason);
+
+/// \brief CRC16 of the Lepton (CCITT polynomial x^16 + x^12 + x^5 + 1, initial value 0).
+/// \param data Bytes to check.
+/// \param size Number of bytes.
+/// \param crc CRC of the preceding bytes, 0 to start.
+/// \return CRC of the bytes.
+uint16_t lepton_crc16(const uint8_t* data, size_t size, uint16_t crc = 0);
+
+/// \brief Checks the CRC of one VoSPI packet. The CRC covers the whole packet with the
+/// four most significant bits of the ID and the CRC field set to zero.
+/// \param packet Packet including its 4 byte header.
+/// \param packetSize Size of the packet.
+/// \return True if the CRC matches.
+bool lepton_packet_crc_ok(const uint8_t* packet, size_t packetSize);
+
+/// \brief Discard packets are sent while the Lepton has no new data, their ID reads xFxx.
+/// \param packet Packet including its 4 byte header.
+/// \return True for a discard packet.
+inline bool lepton_discard_packet(const uint8_t* packet)
+{
+    return (packet[0] & 0x0F) == 0x0F;
+}
+
+/// \brief Segment number a Lepton 3 writes into the ID of packet 20, 0 for an invalid segment.
+/// \param segment First packet of the segment.
+/// \param packetSize Bytes per packet.
+/// \return Segment number (1 to 4 for a valid Lepton 3 segment).
+inline int lepton_segment_number(const uint8_t* segment, int packetSize)
+{
+    return (segment[LEPTON_SEGMENT_PACKET * packetSize] >> 4) & 0x07;
+}
+
+/// \brief Checks every packet of a received segment, nothing is decoded.
+/// \param segment Received datagram.
+/// \param received Bytes received for the datagram.
+/// \param packets Packets per segment.
+/// \param packetSize Bytes per packet.
+/// \param segmentNumber Expected segment number (1 to 4) in packet 20, 0 to skip the check.
+/// \param checkCrc Verify the CRC of every packet.
+/// \param pixelBegin First packet holding pixels, telemetry packets are not checked for zero values.
+/// \param pixelEnd One past the last packet holding pixels.
+/// \return DROP_NONE if the segment is valid, the first failed check otherwise.
+drop_reason validate_segment(const uint8_t* segment, ssize_t received, int packets, int packetSize, int segmentNumber, bool checkCrc,
+                             int pixelBegin, int pixelEnd);
+
+#endif
@@ -0,0 +1,74 @@
+#ifndef LEPTONTELEMETRY_H
+#define LEPTONTELEMETRY_H
+
+#include <cstdint>
+#include <LeptonPacket.h>
+
+/// \file LeptonTelemetry.h
+/// \brief Per frame metadata decoded from telemetry row A of the Lepton.
+
+/// \brief Flat field correction state, status bits 5:4.
+enum ffc_state
+{
+    FFC_NEVER = 0,       // Never commanded
+    FFC_IMMINENT = 1,    // Shutter about to close (Lepton 3)
+    FFC_IN_PROGRESS = 2, // Shutter closed, the image is frozen
+    FFC_DONE = 3
+};
+
+/// \brief Metadata of one thermal frame, valid is false when the stream carries no telemetry.
+/// 32 bit values are sent least significant word first, temperatures are converted to Celsius.
+struct lepton_telemetry
+{
+    bool valid = false;
+    uint16_t revision = 0;
+    uint32_t uptime_ms = 0;       // Time since power on
+    uint32_t status = 0;
+    ffc_state ffc = FFC_NEVER;
+    bool ffc_desired = false;     // The Lepton asks for a flat field correction
+    bool overtemp = false;        // Shutdown imminent
+    uint32_t frame_counter = 0;   // Frames produced by the core since power on
+    uint16_t frame_mean = 0;
+    float fpa_temp = 0.f;         // Focal plane array
+    float housing_temp = 0.f;
+    float fpa_temp_last_ffc = 0.f;
+    uint32_t last_ffc_ms = 0;     // Uptime at the last flat field correction
+};
+
+/// \brief Decodes telemetry row A.
+/// \param words Telemetry words in host order as written by lepton_decoder::decode.
+/// \param count Number of words, 0 for a stream without telemetry.
+/// \param telemetry Decoded metadata, valid stays false if there is no row A.
+/// \return True if row A was decoded.
+bool parse_lepton_telemetry(const uint16_t* words, int count, lepton_telemetry& telemetry);
+
+/// \brief Encodes telemetry row A, the inverse of parse_lepton_telemetry. Words that are not
+/// decoded are set to zero.
+/// \param telemetry Metadata of the frame.
+/// \param words Destination of count words.
+/// \param count Number of words, at least 80 to hold row A.
+/// \return None.
+void format_lepton_telemetry(const lepton_telemetry& telemetry, uint16_t* words, int count);
+
+/// \brief Sets the status word and the flags decoded from it.
+/// \param status Status bits, words 3 and 4 of row A.
+/// \param telemetry Metadata to update.
+/// \return None.
+void set_lepton_status(uint32_t status, lepton_telemetry& telemetry);
+
+/// \brief Follows the frame counter of a stream to find repeated and missing frames.
+/// The counter advances by a fixed step per exported frame (the core may produce frames
+/// it does not export), the smallest advance seen is taken as that step.
+struct frame_sequence
+{
+    bool started = false;
+    uint32_t last = 0;
+    uint32_t step = 0;
+
+    drop_reason check(const lepton_telemetry& telemetry, drop_stats& drops);
+};
+
+/// \brief Name of a flat field correction state for printing.
+const char* ffc_state_name(ffc_state state);
+
+#endif
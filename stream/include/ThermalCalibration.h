@@ -0,0 +1,25 @@
+#ifndef THERMALCALIBRATION_H
+#define THERMALCALIBRATION_H
+
+#include <string>
+#include <opencv2/core.hpp>
+
+/// \file ThermalCalibration.h
+/// \brief Intrinsics of the thermal camera and its pose relative to the RealSense color camera,
+/// as written by the programs in calibration.
+
+/// \brief Thermal intrinsics and the pose of the thermal camera relative to the color camera.
+struct thermal_calibration
+{
+    cv::Mat cameraMatrixThermal, distCoeffsThermal;
+    cv::Mat R_thermal_rgb, T_thermal_rgb; // Color camera frame to thermal camera frame
+};
+
+/// \brief Loads the thermal intrinsics and the thermal to rgb extrinsics.
+/// \param c Calibration to fill.
+/// \param calibration Path to the calibration.xml of the thermal camera.
+/// \param extrinsic Path to the extrinsic.xml between the thermal and rgb camera.
+/// \return True if both files were read.
+bool load_thermal_calibration(thermal_calibration& c, const std::string& calibration, const std::string& extrinsic);
+
+#endif
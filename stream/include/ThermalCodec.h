@@ -0,0 +1,53 @@
+#ifndef THERMALCODEC_H
+#define THERMALCODEC_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/// \file ThermalCodec.h
+/// \brief Lossless codec for raw 16-bit thermal frames.
+///
+/// Every row is predicted with the cheapest of three predictors: spatial (median edge detector
+/// on the row above and the pixel to the left), temporal (same pixel of the previous frame) or
+/// temporal with a spatial correction (previous frame plus the change of the pixel to the left).
+/// The residuals are zigzag mapped and Rice coded in blocks of 16 with a parameter per block.
+/// An encoded frame is the predictor of every row (2 bits each) followed by the bitstream.
+/// Keyframes only use the spatial predictor and decode without the previous frame.
+
+#define THERMAL_CODEC_NONE 0
+#define THERMAL_CODEC_PREDICTIVE 1
+
+/// \brief Encodes a sequence of frames, the previous frame is kept for temporal prediction.
+class thermal_encoder
+{
+public:
+    thermal_encoder(int width, int height);
+    size_t max_encoded_size() const;
+    size_t encode(const uint16_t* pixels, bool keyframe, uint8_t* out);
+
+private:
+    int _width;
+    int _height;
+    bool _hasPrevious;
+    std::vector<uint16_t> _previous;
+    std::vector<uint32_t> _residuals[3];
+};
+
+/// \brief Decodes a sequence of frames, non keyframes need the previous frame to have been decoded.
+class thermal_decoder
+{
+public:
+    thermal_decoder(int width, int height);
+    bool decode(const uint8_t* data, size_t size, uint16_t* pixels);
+    void set_reference(const uint16_t* pixels);
+
+private:
+    int _width;
+    int _height;
+    bool _hasPrevious;
+    std::vector<uint16_t> _previous;
+    std::vector<int32_t> _residuals;
+};
+
+#endif
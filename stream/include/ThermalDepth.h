@@ -0,0 +1,52 @@
+#ifndef THERMALDEPTH_H
+#define THERMALDEPTH_H
+
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <opencv2/core.hpp>
+#include <BackgroundWriter.h>
+#include <ThermalProjection.h>
+
+/// \file ThermalDepth.h
+/// \brief Organized temperature and depth images, an alternative to thermal point clouds for
+/// consumers that work on images.
+///
+/// A frame is a CV_16UC2 image on the grid of the depth image aligned to the color camera:
+/// channel 0 is the depth in millimeters, channel 1 the raw radiometric value of the thermal
+/// pixel that sees the same point, in centikelvin. 0 marks a pixel without depth or without
+/// temperature. At 4 bytes per pixel a frame is an eighth of an organized PointXYZRGB cloud and
+/// keeps the temperature instead of a palette color. thermal_depth_celsius and
+/// thermal_depth_meters turn a frame into CV_32F images for analysis.
+
+#define TD_KELVIN_PER_UNIT 0.01f    // Raw radiometric Lepton values are centikelvin
+#define TD_ZERO_CELSIUS 273.15f
+#define TD_WRITER_QUEUE 8           // Frames waiting for the disk before new ones are dropped
+
+void build_thermal_depth(const thermal_projection& projection, const uint16_t* depth, float units, const cv::Mat& raw,
+                         cv::Mat& frame);
+void thermal_depth_celsius(const cv::Mat& frame, cv::Mat& celsius);
+void thermal_depth_meters(const cv::Mat& frame, cv::Mat& meters);
+
+/// \brief Writes temperature and depth frames as 2 channel 16-bit TIFF files on a background
+/// thread, named td_<rig>_<thermal receive time in ns>.tiff. Several rig threads may write.
+class thermal_depth_writer
+{
+public:
+    thermal_depth_writer();
+    ~thermal_depth_writer();
+
+    bool start(const std::string& directory);
+    bool write(int rig, int64_t timestamp_ns, const cv::Mat& frame);
+
+private:
+    using job = std::pair<std::string, cv::Mat>;
+
+    static bool write_frame(const job& j);
+
+    std::string _directory;
+    // Last member, its thread is stopped before the directory is destroyed
+    background_writer<job> _writer;
+};
+
+#endif
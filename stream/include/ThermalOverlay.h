@@ -0,0 +1,34 @@
+#ifndef THERMALOVERLAY_H
+#define THERMALOVERLAY_H
+
+#include <cstdint>
+#include <librealsense2/rs.hpp>
+#include <opencv2/core.hpp>
+#include <ThermalCalibration.h>
+#include <ThermalProjection.h>
+
+/// \file ThermalOverlay.h
+/// \brief Blends the thermal image onto the color image in 2D, using the depth aligned to the
+/// color image to find the thermal pixel that sees the same point as each color pixel, see
+/// thermal_projection.
+
+#define OVERLAY_ALPHA 0.5f    // Weight of the thermal color
+
+/// \brief Per pixel thermal overlay of a color image.
+class thermal_overlay
+{
+public:
+    explicit thermal_overlay(unsigned int threads = 0);
+
+    void init(const thermal_calibration& calibration, const rs2_intrinsics& color, int thermalWidth, int thermalHeight,
+              thermal_distortion distortion = DISTORTION_REMAP);
+    void blend(const uint16_t* depth, float units, const cv::Mat& thermal, cv::Mat& color, float alpha = OVERLAY_ALPHA);
+
+private:
+    void blend_rows(int begin, int end, cv::Mat& color, int weight) const;
+
+    thermal_projection _projection;
+    cv::Mat _undistorted;
+};
+
+#endif
@@ -0,0 +1,122 @@
+#ifndef THERMALPROJECTION_H
+#define THERMALPROJECTION_H
+
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <vector>
+#include <librealsense2/rs.hpp>
+#include <opencv2/core.hpp>
+#include <ThermalCalibration.h>
+#include <WorkerPool.h>
+
+/// \file ThermalProjection.h
+/// \brief Finds for every pixel of a depth image aligned to the color camera the thermal pixel
+/// that sees the same point.
+///
+/// The ray of every color pixel, already multiplied by the thermal projection K * R, is computed
+/// once. A frame then costs per pixel a multiply-add per coordinate of the projection and one
+/// division, with no point cloud in between. Rows are split between the threads of a worker
+/// pool, which the upsampling of the same frames shares, and the projection runs 4 pixels at a
+/// time with SSE2.
+///
+/// The lens distortion of the thermal camera is handled in one of three ways, see
+/// thermal_distortion. The default undistorts the thermal image every frame like cv::undistort
+/// and projects into it with the pinhole camera matrix. The other two find the pixel of the image
+/// as received, so no image is remapped per frame: DISTORTION_MODEL evaluates the 5 coefficient
+/// distortion model (k1, k2, p1, p2, k3) for every depth pixel, DISTORTION_TABLE projects with
+/// the pinhole camera matrix into a table built once that holds the distorted pixel of every
+/// quarter undistorted pixel. Both also sample the edges of the lens that undistorting crops.
+
+#define PROJECTION_SUBPIXELS 4    // Cells of the distortion table per thermal pixel and axis
+#define PROJECTION_MARGIN 8       // Thermal pixels around the undistorted image that the distorted modes sample
+
+/// \brief Handling of the thermal lens distortion.
+enum thermal_distortion
+{
+    DISTORTION_REMAP,   // Undistort the thermal image every frame and project into it
+    DISTORTION_MODEL,   // Distortion model evaluated per depth pixel, into the image as received
+    DISTORTION_TABLE    // Pinhole projection into a distortion table, into the image as received
+};
+
+/// \brief Parses a distortion mode name.
+/// \param name remap, model or table.
+/// \param distortion The mode.
+/// \return True if the name is known.
+inline bool parse_thermal_distortion(const char* name, thermal_distortion& distortion)
+{
+    if (strcmp(name, "remap") == 0)
+    {
+        distortion = DISTORTION_REMAP;
+    }
+    else if (strcmp(name, "model") == 0)
+    {
+        distortion = DISTORTION_MODEL;
+    }
+    else if (strcmp(name, "table") == 0)
+    {
+        distortion = DISTORTION_TABLE;
+    }
+    else
+    {
+        return false;
+    }
+    return true;
+}
+
+/// \brief Per pixel projection of aligned depth into the thermal image.
+class thermal_projection
+{
+public:
+    explicit thermal_projection(unsigned int threads = 0);
+
+    void init(const thermal_calibration& calibration, const rs2_intrinsics& color, int thermalWidth, int thermalHeight,
+              thermal_distortion distortion = DISTORTION_REMAP);
+    bool ready() const { return _width > 0; }
+    void undistort(const cv::Mat& thermal, cv::Mat& undistorted, bool nearest = false) const;
+    void project(const uint16_t* depth, float units);
+
+    int width() const { return _width; }
+    int height() const { return _height; }
+    /// \brief Thermal pixel of every depth pixel after project(), row * thermal width + column,
+    /// -1 for none.
+    const int32_t* index() const { return _index.data(); }
+    /// \brief Threads of the projection, for the other per frame passes over its image.
+    worker_pool& pool() const { return *_pool; }
+
+    /// \brief Runs f(begin, end) on bands of image rows, one band per thread of the pool, the
+    /// calling thread takes the first band.
+    /// \param f Function of the first row and the row after the last one.
+    /// \return None.
+    template <class F>
+    void parallel_rows(F f) const
+    {
+        const long height = _height, threads = _pool->size();
+        _pool->run([&](unsigned int k)
+                   {
+                       f(static_cast<int>(height * k / threads), static_cast<int>(height * (k + 1) / threads));
+                   });
+    }
+
+private:
+    void project_rows(int begin, int end, const uint16_t* depth, float units);
+    void table_rows(int begin, int end, const uint16_t* depth, float units);
+    void model_rows(int begin, int end, const uint16_t* depth, float units);
+    int32_t distort(float x, float y) const;
+
+    std::unique_ptr<worker_pool> _pool;
+    thermal_distortion _distortion;
+    int _width, _height;
+    int _thermalWidth, _thermalHeight;
+    std::vector<float> _rayU, _rayV, _rayW;   // K * R * ray of every color pixel, R * ray with DISTORTION_MODEL
+    float _offsetU, _offsetV, _offsetW;       // K * T, T with DISTORTION_MODEL
+    float _camera[5];                         // fx, skew, cx, fy, cy
+    float _coeffs[5];                         // k1, k2, p1, p2, k3
+    float _minX, _maxX, _minY, _maxY;         // Normalized coordinates that DISTORTION_MODEL samples
+    cv::Mat _mapX, _mapY;                     // Undistortion of the thermal image
+    std::vector<int32_t> _table;              // Distorted pixel of every cell, DISTORTION_TABLE
+    int _tableWidth, _tableHeight;
+    std::vector<int32_t> _index;
+};
+
+#endif
@@ -0,0 +1,173 @@
+#ifndef THERMALRECORDING_H
+#define THERMALRECORDING_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include <LeptonTelemetry.h>
+#include <ThermalCodec.h>
+#include <ThermalSocket.h>
+
+/// \file ThermalRecording.h
+/// \brief Append-only recording of raw thermal frames in a memory mapped, chunked file.
+///
+/// The file starts with a 4096 byte header followed by chunks. A chunk is preallocated for
+/// THERMAL_CHUNK_FRAMES frames and starts with a 4096 byte chunk header holding the number of
+/// frames written to it, the bytes used and the receive time and offset of each frame, which
+/// is the seek index. The next chunk starts at the first page after the used bytes. Every frame
+/// is a 128 byte record header (timestamps and telemetry) followed by the raw 14-bit pixels in
+/// host order or, in a compressed recording, the frame encoded by thermal_encoder. A frame that
+/// does not compress is stored raw. Compressed recordings have a keyframe every
+/// THERMAL_KEYFRAME_INTERVAL frames, chunks start with one. Counters are only advanced after a
+/// frame is complete, so a recording cut short by a crash is readable up to its last frame.
+
+#define THERMAL_RECORDING_MAGIC "LEPTNREC"
+#define THERMAL_RECORDING_VERSION 2
+#define THERMAL_CHUNK_MAGIC 0x4B4E4843 // "CHNK"
+#define THERMAL_CHUNK_FRAMES 256
+#define THERMAL_KEYFRAME_INTERVAL 32
+#define THERMAL_HEADER_SIZE 4096
+#define THERMAL_CHUNK_HEADER_SIZE 4096
+#define THERMAL_RECORD_HEADER_SIZE 128
+
+/// \brief First page of a recording.
+struct thermal_file_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t width;
+    uint32_t height;
+    uint32_t chunk_frames;
+    uint32_t codec;         // THERMAL_CODEC_NONE or THERMAL_CODEC_PREDICTIVE
+    uint32_t keyframe_interval;
+    uint64_t record_size;   // Largest record, header and raw pixels
+    uint64_t chunk_size;    // Space allocated for a chunk
+    uint64_t frames;        // Complete frames in the file
+    uint64_t chunks;
+    int64_t created_ns;
+};
+
+/// \brief First page of a chunk, timestamps is the index used to seek by time.
+struct thermal_chunk_header
+{
+    uint32_t magic;
+    uint32_t frames;        // Complete frames in the chunk
+    uint64_t chunk;
+    uint64_t first_frame;   // Frame number of the first record
+    uint64_t bytes;         // Used bytes including this header
+    int64_t timestamps[THERMAL_CHUNK_FRAMES]; // Frame receive time in ns
+    uint32_t offsets[THERMAL_CHUNK_FRAMES];   // Record offset from the chunk start
+};
+
+/// \brief Metadata stored in front of the pixels of every frame.
+struct thermal_record_header
+{
+    uint64_t frame;         // Frame number in the recording
+    int64_t frame_ns;
+    int64_t segment_ns[MAX_SEGMENTS_PER_FRAME];
+    int32_t segments;
+    uint32_t telemetry_valid;
+    uint32_t frame_counter;
+    uint32_t uptime_ms;
+    uint32_t status;
+    uint32_t last_ffc_ms;
+    uint16_t revision;
+    uint16_t frame_mean;
+    float fpa_temp;
+    float housing_temp;
+    float fpa_temp_last_ffc;
+    uint32_t codec;         // How the pixels of this record are stored
+    uint32_t encoded_size;  // Bytes following the record header
+    uint8_t reserved[32];
+};
+
+static_assert(sizeof(thermal_file_header) <= THERMAL_HEADER_SIZE, "File header larger than its page");
+static_assert(sizeof(thermal_chunk_header) <= THERMAL_CHUNK_HEADER_SIZE, "Chunk header larger than its page");
+static_assert(sizeof(thermal_record_header) == THERMAL_RECORD_HEADER_SIZE, "Record header size changed");
+
+/// \brief Zero-copy view of a recorded frame, valid while the recording is open.
+struct thermal_frame_view
+{
+    const thermal_record_header* header;
+    const uint16_t* pixels; // Null for an encoded frame, see thermal_recording::decode
+    const uint8_t* data;
+};
+
+/// \brief Appends frames to a recording. A chunk is allocated on disk and mapped when the
+/// previous one is full, frames are copied or encoded into the mapping and the kernel writes
+/// them back.
+class thermal_recorder
+{
+public:
+    thermal_recorder();
+    ~thermal_recorder();
+    bool open(const std::string& filename, int width, int height, int codec = THERMAL_CODEC_NONE);
+    bool write(const uint16_t* pixels, const thermal_timestamps& timestamps, const lepton_telemetry& telemetry);
+    void close();
+    bool is_open() const { return _fd >= 0; }
+    uint64_t frames() const { return _frames; }
+
+private:
+    bool map_chunk();
+    void unmap_chunk(bool truncate);
+
+    int _fd;
+    thermal_file_header* _header;
+    uint8_t* _chunk;
+    uint64_t _chunkOffset;
+    uint64_t _nextOffset;
+    uint64_t _frames;
+    size_t _pixelBytes;
+    std::unique_ptr<thermal_encoder> _encoder;
+    std::vector<uint8_t> _encoded;
+};
+
+/// \brief Read-only access to a recording. The whole file is mapped once and frames are
+/// returned as pointers into the mapping.
+class thermal_recording
+{
+public:
+    thermal_recording();
+    ~thermal_recording();
+    bool open(const std::string& filename);
+    void close();
+    uint64_t frames() const { return _frames; }
+    int width() const { return _width; }
+    int height() const { return _height; }
+    int codec() const { return _codec; }
+    thermal_frame_view frame(uint64_t index) const;
+    bool decode(uint64_t index, uint16_t* pixels);
+    uint64_t seek(int64_t timestamp_ns) const;
+
+private:
+    /// \brief Location of a chunk in the mapping.
+    struct chunk_entry
+    {
+        const thermal_chunk_header* header;
+        const uint8_t* data;
+        uint64_t first_frame;
+        uint32_t frames;
+    };
+
+    const uint8_t* _data;
+    size_t _size;
+    int _width;
+    int _height;
+    int _codec;
+    uint32_t _keyframeInterval;
+    uint64_t _frames;
+    std::vector<chunk_entry> _chunks;
+    std::unique_ptr<thermal_decoder> _decoder;
+    uint64_t _decoded; // Frame held by the decoder as its reference, frames() if none
+};
+
+/// \brief Converts the metadata of a recorded frame back to the in-memory structs.
+/// \param header Record header.
+/// \param timestamps Receive timestamps of the frame.
+/// \param telemetry Telemetry of the frame.
+/// \return None.
+void thermal_record_metadata(const thermal_record_header& header, thermal_timestamps& timestamps, lepton_telemetry& telemetry);
+
+#endif
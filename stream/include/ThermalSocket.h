@@ -0,0 +1,102 @@
+#ifndef THERMALSOCKET_H
+#define THERMALSOCKET_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <sys/types.h>
+
+/// \file ThermalSocket.h
+/// \brief UDP ingest of the Lepton segments with kernel receive timestamps, timing and drop statistics.
+
+#define MAX_SEGMENTS_PER_FRAME 4
+#define TIMING_REPORT_FRAMES 270     // Frames between timing reports, 10 s at 27 Hz
+
+/// \brief Kernel receive times of the segments of one thermal frame, CLOCK_REALTIME in nanoseconds.
+struct thermal_timestamps
+{
+    int segments; // Segments per frame of the stream, 4 for a Lepton 3 and 1 for a Lepton 2
+    int64_t segment_ns[MAX_SEGMENTS_PER_FRAME];
+    int64_t frame_ns; // Arrival of the first segment
+};
+
+/// \brief Tuning of the receive path against segment drops.
+struct receive_options
+{
+    int rcvbuf = 0;   // SO_RCVBUF in bytes, 0 keeps the system default
+    int cpu = -1;     // CPU the receive thread is pinned to, -1 for no pinning
+    int priority = 0; // SCHED_FIFO priority (1 to 99), 0 keeps the normal scheduler
+};
+
+/// \brief Fixed bin histogram with running mean and standard deviation.
+class histogram
+{
+public:
+    histogram(double binWidth, int bins);
+    void add(double value);
+    void clear();
+    void print(const std::string& name, const std::string& unit) const;
+    uint64_t count() const { return _count; }
+
+private:
+    double _binWidth;
+    std::vector<uint64_t> _bins;
+    uint64_t _count;
+    double _mean, _m2, _min, _max;
+};
+
+/// \brief Collects inter-frame jitter and receive-to-process latency of the thermal stream.
+class frame_timing
+{
+public:
+    frame_timing();
+    void add(const thermal_timestamps& timestamps, int64_t processed_ns);
+    void print() const;
+    void clear();
+    uint64_t frames() const { return _latency.count(); }
+
+private:
+    int64_t _last_frame_ns;
+    histogram _interval;
+    histogram _latency;
+};
+
+/// \brief Current CLOCK_REALTIME in nanoseconds, the clock used by SO_TIMESTAMPNS.
+int64_t realtime_ns();
+
+/// \brief Creates and binds the UDP socket for thermal data with kernel receive timestamps
+/// and SO_RXQ_OVFL drop counting enabled.
+/// \param port Port of the IP address.
+/// \param timeout_ms Receive timeout in ms, 0 blocks forever.
+/// \param options Receive buffer size to request.
+/// \return Socket descriptor, -1 if failure.
+int open_thermal_socket(uint16_t port, int timeout_ms, const receive_options& options = receive_options());
+
+/// \brief Pins the calling thread to a CPU and switches it to SCHED_FIFO as requested.
+/// \param options CPU and priority to apply.
+/// \return True if every requested setting was applied.
+bool configure_receive_thread(const receive_options& options);
+
+/// \brief Receives one segment datagram with its kernel receive timestamp.
+/// \param sockfd Socket from open_thermal_socket.
+/// \param buffer Destination of the segment.
+/// \param size Size of the destination.
+/// \param timestamp_ns Kernel receive time of the datagram.
+/// \param kernel_drops If given, updated with the socket's SO_RXQ_OVFL count of datagrams
+/// dropped because the receive buffer was full.
+/// \return Received bytes, -1 if failure (errno is set).
+ssize_t receive_segment(int sockfd, uint8_t* buffer, size_t size, int64_t& timestamp_ns, uint32_t* kernel_drops = nullptr);
+
+/// \brief Reads the drop counter of the UDP socket bound to a port from /proc/net/udp.
+/// \param port Local port of the socket.
+/// \return Drops counted by the kernel, -1 if the socket was not found.
+int64_t proc_udp_drops(uint16_t port);
+
+/// \brief Prints the drop counters of a thermal socket from both SO_RXQ_OVFL and /proc/net/udp.
+/// \param port Local port of the socket.
+/// \param kernel_drops Last SO_RXQ_OVFL count from receive_segment.
+/// \return None.
+void print_socket_drops(uint16_t port, uint32_t kernel_drops);
+
+#endif
@@ -0,0 +1,69 @@
+#ifndef THERMALUPSAMPLE_H
+#define THERMALUPSAMPLE_H
+
+#include <cstdint>
+#include <vector>
+#include <opencv2/core.hpp>
+#include <ThermalProjection.h>
+
+/// \file ThermalUpsample.h
+/// \brief Upsamples thermal temperatures to the depth resolution with a guided filter that takes
+/// the depth image as its guide.
+///
+/// Looked up per depth pixel, the 160x120 thermal image shows as blocks of several depth pixels
+/// each. The guided filter fits temperature = a * depth + b in a window around every pixel and
+/// averages the fits, so the temperature varies smoothly over a surface and keeps the step where
+/// the depth jumps from one object to the next. Pixels without depth or temperature are left out
+/// of the fits. Every step is a box filter computed with running sums, so the cost per pixel does
+/// not depend on the radius.
+///
+/// The image is filtered in tiles of columns, each streamed from top to bottom: the rows of
+/// moments and of fits that a window still needs are kept in rings of 2 * radius + 1 rows, so
+/// every thread works in buffers of a few tens of KB instead of whole images. The moments are
+/// integer sums of depth units and centikelvin and stay exact. The tiles are split between the
+/// threads of the projection's worker pool.
+
+#define UPSAMPLE_RADIUS 8           // Window of 17x17 depth pixels, about two thermal pixels
+#define UPSAMPLE_EDGE 0.05f         // Depth change in meters that is kept as an edge
+#define UPSAMPLE_TILE 128           // Columns of a tile, the fit window adds 2 * radius on each side
+
+/// \brief Depth guided upsampling of temperatures.
+class guided_upsampler
+{
+public:
+    explicit guided_upsampler(int radius = UPSAMPLE_RADIUS, float edge = UPSAMPLE_EDGE);
+
+    void upsample(const thermal_projection& projection, const uint16_t* depth, float units, const cv::Mat& raw,
+                  cv::Mat& frame);
+
+private:
+    /// \brief Window sums of the pixels with depth and temperature, in depth units and centikelvin.
+    struct moments
+    {
+        int32_t count, depth, temperature;
+        int64_t depth2, product;    // depth^2 and depth * temperature
+    };
+
+    /// \brief Fit of a window, temperature = a * depth + b, weight 0 for a window without samples.
+    struct fit
+    {
+        float a, b, weight;
+    };
+
+    /// \brief Buffers of one thread. The rings hold the row sums of the last 2 * radius + 1 rows.
+    struct tile_buffers
+    {
+        std::vector<moments> momentRing, momentSum;
+        std::vector<fit> fitRow, fitRing;
+        std::vector<double> fitSum;     // a, b and weight per column
+    };
+
+    void filter_tile(tile_buffers& buffers, int x0, int x1, const int32_t* index, const uint16_t* depth,
+                     const uint16_t* temperature, float units, cv::Mat& frame) const;
+
+    int _radius;
+    float _edge;
+    std::vector<tile_buffers> _buffers;
+};
+
+#endif
@@ -0,0 +1,129 @@
+#ifndef WORKERPOOL_H
+#define WORKERPOOL_H
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/// \file WorkerPool.h
+/// \brief Threads started once and reused by every parallel pass of a frame, so a pass costs a
+/// wake up instead of creating and joining threads.
+
+/// \brief Fixed set of threads running one function at a time on all of them.
+class worker_pool
+{
+public:
+    /// \brief Starts the threads.
+    /// \param threads Threads including the caller of run(), all cores if 0.
+    explicit worker_pool(unsigned int threads = 0)
+        : _size(threads ? threads : std::max(1u, std::thread::hardware_concurrency())), _generation(0), _busy(0),
+          _stop(false)
+    {
+        for (unsigned int k = 1; k < _size; k++)
+        {
+            _workers.emplace_back(&worker_pool::work, this, k);
+        }
+    }
+
+    /// \brief Stops and joins the threads.
+    ~worker_pool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _stop = true;
+        }
+        _start.notify_all();
+        for (auto& w : _workers)
+        {
+            w.join();
+        }
+    }
+
+    worker_pool(const worker_pool&) = delete;
+    worker_pool& operator=(const worker_pool&) = delete;
+
+    /// \brief Threads that run a function, the caller of run() included.
+    unsigned int size() const
+    {
+        return _size;
+    }
+
+    /// \brief Runs f(thread) on every thread, the calling thread being thread 0, and returns when
+    /// all have finished. Calls from several threads run one after the other.
+    /// \param f Function of the thread number.
+    /// \return None.
+    template <class F>
+    void run(F f)
+    {
+        if (_size == 1)
+        {
+            f(0u);
+            return;
+        }
+        std::lock_guard<std::mutex> serial(_run);
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _job = std::ref(f);
+            _busy = _size - 1;
+            _generation++;
+        }
+        _start.notify_all();
+        try
+        {
+            f(0u);
+        }
+        catch (...)
+        {
+            wait();
+            throw;
+        }
+        wait();
+    }
+
+private:
+    void wait()
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _done.wait(lock, [this] { return _busy == 0; });
+        _job = nullptr;
+    }
+
+    void work(unsigned int k)
+    {
+        uint64_t seen = 0;
+        std::unique_lock<std::mutex> lock(_mutex);
+        while (true)
+        {
+            _start.wait(lock, [&] { return _stop || _generation != seen; });
+            if (_stop)
+            {
+                return;
+            }
+            seen = _generation;
+            lock.unlock();
+            _job(k);
+            lock.lock();
+            if (--_busy == 0)
+            {
+                _done.notify_all();
+            }
+        }
+    }
+
+    unsigned int _size;
+    uint64_t _generation;
+    unsigned int _busy;
+    bool _stop;
+    std::function<void(unsigned int)> _job;
+    std::mutex _run;
+    std::mutex _mutex;
+    std::condition_variable _start;
+    std::condition_variable _done;
+    std::vector<std::thread> _workers;
+};
+
+#endif
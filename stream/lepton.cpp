@@ -5,15 +5,17 @@
 #include <chrono>
 #include <cstdint>
 #include <cstring>
+#include <vector>
 #include <arpa/inet.h>
+#include <sched.h>
 #include <unistd.h>
 #include <opencv2/opencv.hpp>
 #include <Palettes.h>
+#include <LeptonDecoder.h>
+#include <LeptonTelemetry.h>
+#include <ThermalRecording.h>
+#include <ThermalSocket.h>
 
-#define PACKET_SIZE 164
-#define PACKET_SIZE_UINT16 (PACKET_SIZE / 2)
-#define PACKETS_PER_FRAME 60
-#define FRAME_SIZE_UINT16 (PACKET_SIZE_UINT16 * PACKETS_PER_FRAME)
 #define FPS 27;
 
 /// \file depthimage.cpp
@@ -30,6 +32,16 @@ void printUsage(char *cmd)
 		   " -mintemp x		sets a minimum value for scaling (suggestion: 27300).\n"
 		   " -maxtemp x		sets a maximum value for scaling (suggestion: 33500).\n"
 		   "			Temperature values for min and max are in hectoKelvin.\n"
+		   " -rcvbuf x		socket receive buffer in bytes (suggestion: 4194304).\n"
+		   " -cpu x		pin the thermal receive thread to cpu x.\n"
+		   " -rtprio x		run the thermal receive thread under SCHED_FIFO with priority x (1 to 99).\n"
+		   " -lepton x		thermal stream layout, detected when not given.\n"
+		   "			lepton3, lepton2 and their -telemetry-header/-footer variants.\n"
+		   " -nocrc		skip the CRC check of the thermal packets.\n"
+		   " -timing		print frame jitter, latency and drop statistics every 10 s.\n"
+		   " -record x		append every valid raw 16-bit frame with its timestamps\n"
+		   "			and telemetry to the recording file x.\n"
+		   " -compress		losslessly compress the recorded frames.\n"
 		   " Capture:		To capture images press c on the image window.\n"
 		   "			Saves raw grayscale and custom colormap images\n"
 		   "			to the thermal_images directory.\n"
@@ -43,12 +55,19 @@ void printUsage(char *cmd)
 /// \param port Port of the IP address.
 /// \param mintemp Minimum temperature to be scaled between 0 and 255.
 /// \param maxtemp Maximum temperature to be scaled between 0 and 255.
+/// \param lepton Layout of the thermal stream.
+/// \param nocrc Skip the CRC check of the thermal packets.
+/// \param timing Print the timing histograms and drop counters periodically.
+/// \param rcvbuf Socket receive buffer size.
+/// \param cpu Cpu the thermal receive thread is pinned to.
+/// \param rtprio SCHED_FIFO priority of the thermal receive thread.
+/// \param record Recording file for the raw frames.
+/// \param compress Compress the recorded frames.
 /// \return 0 if successful, -1 if failure.
 int main(int argc, char **argv)
 {
 	// Socket initialization
     int sockfd;
-    struct sockaddr_in servaddr, cliaddr;
 
 	// Lepton image setting
     const int *selectedColormap = colormap_ironblack;
@@ -62,6 +81,12 @@ int main(int argc, char **argv)
 	int img_cnt = 0;
 
 	uint16_t port = 8080;
+	bool printTiming = false;
+	bool checkCrc = true;
+	const lepton_decoder *decoder = nullptr;
+	receive_options receiveOptions;
+	std::string recordFile;
+	int recordCodec = THERMAL_CODEC_NONE;
 
 	for(int i=1; i < argc; i++)
 	{
@@ -123,113 +148,191 @@ int main(int argc, char **argv)
 				exit(1);
 			}
 		}
+		else if (strcmp(argv[i], "-timing") == 0)
+		{
+			printTiming = true;
+		}
+		else if (strcmp(argv[i], "-rcvbuf") == 0)
+		{
+			if (i + 1 != argc)
+			{
+				long int temp = std::strtol(argv[++i], nullptr, 10);
+				if (temp <= 0 || temp > 1073741824){
+					std::cerr << "Error: Enter a receive buffer size in bytes." << std::endl;
+					exit(1);
+				}
+				receiveOptions.rcvbuf = static_cast<int>(temp);
+			}
+			else
+			{
+				std::cerr << "Error: Enter a receive buffer size in bytes." << std::endl;
+				exit(1);
+			}
+		}
+		else if (strcmp(argv[i], "-cpu") == 0)
+		{
+			if (i + 1 != argc)
+			{
+				long int temp = std::strtol(argv[++i], nullptr, 10);
+				if (temp < 0 || temp >= CPU_SETSIZE){
+					std::cerr << "Error: Enter a valid cpu." << std::endl;
+					exit(1);
+				}
+				receiveOptions.cpu = static_cast<int>(temp);
+			}
+			else
+			{
+				std::cerr << "Error: Enter a valid cpu." << std::endl;
+				exit(1);
+			}
+		}
+		else if (strcmp(argv[i], "-rtprio") == 0)
+		{
+			if (i + 1 != argc)
+			{
+				long int temp = std::strtol(argv[++i], nullptr, 10);
+				if (temp < 1 || temp > 99){
+					std::cerr << "Error: Enter a priority between 1 and 99." << std::endl;
+					exit(1);
+				}
+				receiveOptions.priority = static_cast<int>(temp);
+			}
+			else
+			{
+				std::cerr << "Error: Enter a priority between 1 and 99." << std::endl;
+				exit(1);
+			}
+		}
+		else if (strcmp(argv[i], "-nocrc") == 0)
+		{
+			checkCrc = false;
+		}
+		else if (strcmp(argv[i], "-record") == 0)
+		{
+			if (i + 1 != argc)
+			{
+				recordFile = argv[++i];
+			}
+			else
+			{
+				std::cerr << "Error: Enter a recording file." << std::endl;
+				exit(1);
+			}
+		}
+		else if (strcmp(argv[i], "-compress") == 0)
+		{
+			recordCodec = THERMAL_CODEC_PREDICTIVE;
+		}
+		else if (strcmp(argv[i], "-lepton") == 0)
+		{
+			if (i + 1 != argc && (decoder = find_lepton_decoder(argv[i + 1])) != nullptr)
+			{
+				i++;
+			}
+			else
+			{
+				std::cerr << "Error: Enter one of the thermal decoders:" << std::endl;
+				print_lepton_decoders();
+				exit(1);
+			}
+		}
 	}
 
-	uint8_t result[PACKET_SIZE * PACKETS_PER_FRAME];
-	uint8_t shelf[4][PACKET_SIZE * PACKETS_PER_FRAME];
 	uint16_t minValue = rangeMin;
 	uint16_t maxValue = rangeMax;
 	float diff = maxValue - minValue;
 	float scale = 255 / diff;
-	uint16_t n_zero_value_drop_frame = 0;
-
-    cv::Mat image(myImageHeight, myImageWidth, CV_8UC3);
-	cv::Mat gray(myImageHeight, myImageWidth, CV_8UC1);
 
-    // Create socket
-    if ((sockfd = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+    // Create socket with kernel receive timestamps
+    if ((sockfd = open_thermal_socket(port, 0, receiveOptions)) < 0)
 	{
-        std::cerr << "Socket creation failed" << std::endl;
         return -1;
     }
+    if (!decoder && (decoder = detect_lepton_stream(sockfd)) == nullptr)
+	{
+        std::cerr << "Receive failed" << std::endl;
+        close(sockfd);
+        return -1;
+    }
+	myImageWidth = decoder->width;
+	myImageHeight = decoder->height;
+    std::vector<uint8_t> frame(decoder->frame_size());
+    std::vector<uint16_t> telemetryWords(decoder->telemetry_words());
+    cv::Mat raw(myImageHeight, myImageWidth, CV_16UC1);
+    cv::Mat image(myImageHeight, myImageWidth, CV_8UC3);
+	cv::Mat gray(myImageHeight, myImageWidth, CV_8UC1);
 
-    memset(&servaddr, 0, sizeof(servaddr));
-    memset(&cliaddr, 0, sizeof(cliaddr));
-    
-    // Set up server address
-    servaddr.sin_family = AF_INET;
-    servaddr.sin_port = htons(port);
-    servaddr.sin_addr.s_addr = INADDR_ANY;
-
-    // Bind the socket
-    if (bind(sockfd, (const struct sockaddr *)&servaddr, sizeof(servaddr)) < 0)
+    uint32_t kernelDrops = 0;
+    ssize_t receivedBytes[MAX_SEGMENTS_PER_FRAME] = {};
+    drop_stats drops;
+    thermal_timestamps timestamps = {};
+    lepton_telemetry telemetry;
+    frame_sequence sequence;
+    thermal_recorder recorder;
+    if (!recordFile.empty() && !recorder.open(recordFile, myImageWidth, myImageHeight, recordCodec))
 	{
-        std::cerr << "Bind failed" << std::endl;
         close(sockfd);
         return -1;
     }
-    socklen_t len = sizeof(cliaddr);
+    frame_timing timing;
+    FILE *timestampFile = nullptr;
+    // Only the receive thread is pinned and prioritized, not the processing and its threads
+    lepton_receiver receiver(sockfd, *decoder, receiveOptions);
 
     while (true)
 	{
-        for (int i = 0; i < 4; ++i)
+        if (receiver.receive(frame.data(), receivedBytes, timestamps, &kernelDrops) < 0)
 		{
-            ssize_t received_bytes = recvfrom(sockfd, shelf[i], sizeof(shelf[i]), 0, (struct sockaddr *)&cliaddr, &len);
-            if (received_bytes < 0)
-			{
-                std::cerr << "Receive failed" << std::endl;
-                close(sockfd);
-                return -1;
-            }
+            std::cerr << "Receive failed" << std::endl;
+            receiver.stop();
+            close(sockfd);
+            return -1;
         }
 
+		// Reject corrupted frames before any decoding
+		drop_reason reason = decoder->validate(frame.data(), receivedBytes, checkCrc);
+		if (reason == DROP_NONE)
+		{
+			// Telemetry first, repeated frames and frames frozen by the shutter are not decoded
+			decoder->decode(frame.data(), nullptr, telemetryWords.data());
+			parse_lepton_telemetry(telemetryWords.data(), decoder->telemetry_words(), telemetry);
+			reason = sequence.check(telemetry, drops);
+		}
+		drops.add(reason);
+		if (reason != DROP_NONE)
+		{
+			continue;
+		}
+		decoder->decode(frame.data(), raw.ptr<uint16_t>(), nullptr);
+		if (recorder.is_open())
+		{
+			recorder.write(raw.ptr<uint16_t>(), timestamps, telemetry);
+		}
+
         if (autoRangeMin || autoRangeMax)
 		{
+			double frameMin, frameMax;
+			cv::minMaxLoc(raw, &frameMin, &frameMax);
 			if (autoRangeMin)
 			{
-				maxValue = 65535;
+				minValue = static_cast<uint16_t>(frameMin);
 			}
 			if (autoRangeMax)
 			{
-				maxValue = 0;
-			}
-			for (int iSegment = 1; iSegment <= 4; iSegment++)
-			{
-				for (int i = 0;i < FRAME_SIZE_UINT16; i++)
-				{
-					if (i % PACKET_SIZE_UINT16 < 2)
-					{
-						continue;
-					}
-
-					uint16_t value = (shelf[iSegment - 1][i * 2] << 8) + shelf[iSegment - 1][i * 2+1];
-					if (value == 0)
-					{
-						continue;
-					}
-					if (autoRangeMax && (value > maxValue))
-					{
-						maxValue = value;
-					}
-					if (autoRangeMin && (value < minValue))
-					{
-						minValue = value;
-					}
-				}
+				maxValue = static_cast<uint16_t>(frameMax);
 			}
 			diff = maxValue - minValue;
 			scale = 255 / diff;
 		}
 
-		int row, column;
 		uint16_t value;
 		uint16_t valueFrameBuffer;
-		for (int iSegment = 1; iSegment <= 4; iSegment++)
+		for (int row = 0; row < myImageHeight; row++)
 		{
-			int ofsRow = 30 * (iSegment - 1);
-			for (int i = 0;i < FRAME_SIZE_UINT16; i++)
+			const uint16_t *rawRow = raw.ptr<uint16_t>(row);
+			for (int column = 0; column < myImageWidth; column++)
 			{
-				if (i % PACKET_SIZE_UINT16 < 2)
-				{
-					continue;
-				}
-
-				valueFrameBuffer = (shelf[iSegment - 1][i * 2] << 8) + shelf[iSegment - 1][i * 2+1];
-				if (valueFrameBuffer == 0)
-				{
-					n_zero_value_drop_frame++;
-					break;
-				}
+				valueFrameBuffer = rawRow[column];
 
 				if (!autoRangeMin && (valueFrameBuffer <= minValue))
 				{
@@ -247,24 +350,21 @@ int main(int argc, char **argv)
 				int ofs_g = 3 * value + 1; if (selectedColormapSize <= ofs_g) ofs_g = selectedColormapSize - 1;
 				int ofs_b = 3 * value + 2; if (selectedColormapSize <= ofs_b) ofs_b = selectedColormapSize - 1;
 				cv::Vec3b color(selectedColormap[ofs_b], selectedColormap[ofs_g], selectedColormap[ofs_r]);
-                column = (i % PACKET_SIZE_UINT16) - 2 + (myImageWidth / 2) * ((i % (PACKET_SIZE_UINT16 * 2)) / PACKET_SIZE_UINT16);
-                row = i / PACKET_SIZE_UINT16 / 2 + ofsRow;
-                if (row < myImageHeight && column < myImageWidth)
-				{
-                    image.at<cv::Vec3b>(row, column) = color;
-					gray.at<uint8_t>(row, column) = value;
-                }
-                if ((column == 80) && (row == 60))
-				{
-                    double temp = (valueFrameBuffer / 100) - 273;
-                    std::cout << "Temp at center " << temp << std::endl;
-                }
+				image.at<cv::Vec3b>(row, column) = color;
+				gray.at<uint8_t>(row, column) = value;
 			}
 		}
+		double temp = (raw.at<uint16_t>(myImageHeight / 2, myImageWidth / 2) / 100) - 273;
+		std::cout << "Temp at center " << temp << std::endl;
 
-		if (n_zero_value_drop_frame != 0)
+		timing.add(timestamps, realtime_ns());
+		if (printTiming && timing.frames() >= TIMING_REPORT_FRAMES)
 		{
-			n_zero_value_drop_frame = 0;
+			timing.print();
+			print_socket_drops(port, kernelDrops);
+			drops.print();
+			timing.clear();
+			drops.clear();
 		}
 		cv::imshow("Thermal Image", image);
 		int k = cv::waitKey(1);
@@ -276,6 +376,19 @@ int main(int argc, char **argv)
 			cv::imwrite(filename, image);
 			filename = "thermal_images/thermal_grayimage_" + std::to_string(img_cnt) + ".png";
 			cv::imwrite(filename, gray);
+			if (!timestampFile && (timestampFile = fopen("thermal_images/timestamps.csv", "a")) == nullptr)
+			{
+				std::cerr << "Failed to open thermal_images/timestamps.csv" << std::endl;
+			}
+			else
+			{
+				// image, frame and segment kernel receive times in ns, telemetry frame counter and FPA temperature
+				fprintf(timestampFile, "%d,%lld,%lld,%lld,%lld,%lld,%u,%.2f\n", img_cnt, (long long)timestamps.frame_ns,
+						(long long)timestamps.segment_ns[0], (long long)timestamps.segment_ns[1],
+						(long long)timestamps.segment_ns[2], (long long)timestamps.segment_ns[3],
+						telemetry.frame_counter, telemetry.fpa_temp);
+				fflush(timestampFile);
+			}
 			std::cout << "Image saved" << std::endl;
         }
 		else if (k >= 0)
@@ -284,7 +397,24 @@ int main(int argc, char **argv)
 		}
     }
 
+    if (timestampFile)
+	{
+		fclose(timestampFile);
+	}
+	if (recorder.is_open())
+	{
+		std::cout << "Recorded " << recorder.frames() << " frames to " << recordFile << std::endl;
+		recorder.close();
+	}
+	if (printTiming)
+	{
+		timing.print();
+		print_socket_drops(port, kernelDrops);
+		drops.print();
+	}
+
     // Close the socket
+    receiver.stop();
     close(sockfd);
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,597 @@
+#include <iostream>
+#include <cerrno>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+#include <arpa/inet.h>
+#include <libgen.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include <LeptonDecoder.h>
+#include <LeptonTelemetry.h>
+#include <ThermalRecording.h>
+
+#define LEPTON_FPS 27
+#define LEPTON_UNIQUE_FPS 9
+#define LEPTON_FRAME_REPEAT 3       // Exported frames per unique frame at 27 Hz
+#define LEPTON_FFC_INTERVAL_S 180   // Automatic flat field correction period
+#define LEPTON_FFC_FRAMES 5         // Unique frames the shutter stays closed
+#define SIM_REPORT_S 10
+
+/// \file leptonsim.cpp
+/// \brief Stand-in for the Raspberry Pi sender: sends recorded or synthetic thermal frames to a
+/// UDP port in the VoSPI packet format, with optional loss, reordering and jitter.
+
+/// \brief Function to describe how to use the command line arguments
+/// \param cmd Argument of the command line, here it is the program
+void printUsage(char *cmd)
+{
+	char *cmdname = basename(cmd);
+	printf(" Usage: %s [OPTION]...\n"
+		   " -h			display this help and exit.\n"
+		   " -host x		destination ip address (default: 127.0.0.1).\n"
+		   " -port x		destination ip port (default: 8080).\n"
+		   " -lepton x		stream layout (default: lepton3, or the size of the recording).\n"
+		   " -replay x		send the frames of the recording file x instead of a synthetic scene.\n"
+		   " -loop		restart the recording when it ends.\n"
+		   " -frames x		stop after x unique frames.\n"
+		   " -rate x		27: 27 Hz, every frame sent 3 times as by the Lepton (default).\n"
+		   "			9: unique frames at 9 Hz. max: as fast as possible.\n"
+		   "			Any other number: unique frames at x Hz.\n"
+		   " -repeat x		times every frame is sent, overrides the default of -rate.\n"
+		   " -loss x		probability of dropping a segment (0 to 1).\n"
+		   " -reorder x		probability of sending a segment after the next one (0 to 1).\n"
+		   " -jitter x		delay every segment by a random 0 to x ms.\n"
+		   " -seed x		seed of the scene noise and the impairments.\n"
+		   " Layouts:\n"
+		   "", cmdname);
+	print_lepton_decoders();
+	return;
+}
+
+/// \brief Monotonic clock in nanoseconds, used for pacing.
+static int64_t monotonic_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return static_cast<int64_t>(ts.tv_sec) * 1000000000LL + ts.tv_nsec;
+}
+
+/// \brief Sleeps until an absolute time of the monotonic clock.
+static void sleep_until_ns(int64_t deadline_ns)
+{
+	struct timespec ts;
+	ts.tv_sec = deadline_ns / 1000000000LL;
+	ts.tv_nsec = deadline_ns % 1000000000LL;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr) == EINTR)
+	{
+	}
+}
+
+/// \brief Synthetic radiometric scene: a room with a vertical temperature gradient, a person
+/// walking across it and a hot mug moving in a circle, with sensor noise. Values are in
+/// Kelvin x 100 like a Lepton in radiometric mode. The image freezes while the shutter is closed
+/// for the periodic flat field correction.
+class synthetic_scene
+{
+public:
+	synthetic_scene(int width, int height, uint32_t seed)
+		: _width(width), _height(height), _image(static_cast<size_t>(width) * height), _random(seed), _noise(-6, 6)
+	{
+	}
+
+	/// \brief Renders unique frame n, shown at n / 9 s.
+	/// \param n Unique frame number.
+	/// \param shutterClosed The image stays the previous one.
+	/// \return The frame, valid until the next call.
+	const uint16_t* render(uint64_t n, bool shutterClosed)
+	{
+		if (shutterClosed && n > 0)
+		{
+			return _image.data();
+		}
+		double t = static_cast<double>(n) / LEPTON_UNIQUE_FPS;
+		// Person: an ellipse walking left and right, mug: a disc on a circle
+		double personX = _width * (0.5 + 0.35 * sin(2.0 * M_PI * t / 8.0));
+		double personY = _height * 0.55;
+		double personRx = _width * 0.09;
+		double personRy = _height * 0.38;
+		double mugX = _width * (0.3 + 0.12 * cos(2.0 * M_PI * t / 5.0));
+		double mugY = _height * (0.4 + 0.15 * sin(2.0 * M_PI * t / 5.0));
+		double mugR = _width * 0.035;
+		for (int y = 0; y < _height; y++)
+		{
+			uint16_t* row = _image.data() + static_cast<size_t>(y) * _width;
+			int background = 29315 + 150 * y / _height; // 20 to 21.5 degrees Celsius
+			for (int x = 0; x < _width; x++)
+			{
+				int value = background;
+				double px = (x - personX) / personRx;
+				double py = (y - personY) / personRy;
+				double person = px * px + py * py;
+				if (person < 1.0)
+				{
+					value = 30650 - static_cast<int>(250 * person); // 33.4 degrees at the center
+				}
+				double mx = x - mugX;
+				double my = y - mugY;
+				if (mx * mx + my * my < mugR * mugR)
+				{
+					value = 33800;
+				}
+				row[x] = static_cast<uint16_t>(value + _noise(_random));
+			}
+		}
+		return _image.data();
+	}
+
+private:
+	int _width;
+	int _height;
+	std::vector<uint16_t> _image;
+	std::mt19937 _random;
+	std::uniform_int_distribution<int> _noise;
+};
+
+/// \brief The shutter closes for a few frames every LEPTON_FFC_INTERVAL_S.
+/// \param n Unique frame number.
+/// \return True while the flat field correction is in progress.
+static bool synthetic_shutter_closed(uint64_t n)
+{
+	return n % (static_cast<uint64_t>(LEPTON_FFC_INTERVAL_S) * LEPTON_UNIQUE_FPS) < LEPTON_FFC_FRAMES;
+}
+
+/// \brief Telemetry of a synthetic frame, the counter advances by 3 per unique frame like the
+/// core running at 27 Hz.
+/// \param n Unique frame number.
+/// \param pixels Frame, for the mean.
+/// \param count Number of pixels.
+/// \param telemetry Metadata of the frame.
+/// \return None.
+static void synthetic_telemetry(uint64_t n, const uint16_t* pixels, size_t count, lepton_telemetry& telemetry)
+{
+	uint64_t ffcPeriod = static_cast<uint64_t>(LEPTON_FFC_INTERVAL_S) * LEPTON_UNIQUE_FPS;
+	uint64_t sinceFfc = n % ffcPeriod;
+	uint64_t total = 0;
+	for (size_t i = 0; i < count; i++)
+	{
+		total += pixels[i];
+	}
+	telemetry = lepton_telemetry();
+	telemetry.valid = true;
+	telemetry.revision = 14;
+	telemetry.uptime_ms = static_cast<uint32_t>(n * 1000 / LEPTON_UNIQUE_FPS);
+	telemetry.frame_counter = static_cast<uint32_t>(n * LEPTON_FRAME_REPEAT);
+	telemetry.frame_mean = static_cast<uint16_t>(count ? total / count : 0);
+	telemetry.fpa_temp = 30.f + 0.5f * static_cast<float>(sin(n / 2000.0));
+	telemetry.housing_temp = telemetry.fpa_temp - 1.5f;
+	telemetry.fpa_temp_last_ffc = telemetry.fpa_temp;
+	telemetry.last_ffc_ms = static_cast<uint32_t>((n - sinceFfc) * 1000 / LEPTON_UNIQUE_FPS);
+	ffc_state ffc = synthetic_shutter_closed(n) ? FFC_IN_PROGRESS : FFC_DONE;
+	set_lepton_status(static_cast<uint32_t>(ffc) << 4, telemetry);
+}
+
+/// \brief Sends datagrams with loss, reordering and jitter and counts what was done to them.
+class impaired_sender
+{
+public:
+	impaired_sender(int sockfd, const struct sockaddr_in& destination, double loss, double reorder,
+					int64_t jitter_ns, uint32_t seed)
+		: _sockfd(sockfd), _destination(destination), _loss(loss), _reorder(reorder), _jitter_ns(jitter_ns),
+		  _random(seed), _uniform(0.0, 1.0), _holding(false), sent(0), lost(0), reordered(0), errors(0)
+	{
+	}
+
+	/// \brief Sends a datagram at a time of the monotonic clock plus the jitter.
+	/// \param data Datagram.
+	/// \param size Bytes of the datagram.
+	/// \param deadline_ns Send time, 0 to send immediately.
+	/// \return None.
+	void send(const uint8_t* data, size_t size, int64_t deadline_ns)
+	{
+		if (_jitter_ns > 0)
+		{
+			deadline_ns = (deadline_ns ? deadline_ns : monotonic_ns()) +
+						  static_cast<int64_t>(_uniform(_random) * _jitter_ns);
+		}
+		if (deadline_ns)
+		{
+			sleep_until_ns(deadline_ns);
+		}
+		if (_uniform(_random) < _loss)
+		{
+			lost++;
+			return;
+		}
+		if (!_holding && _uniform(_random) < _reorder)
+		{
+			_held.assign(data, data + size);
+			_holding = true;
+			reordered++;
+			return;
+		}
+		transmit(data, size);
+		flush();
+	}
+
+	/// \brief Sends a held datagram.
+	/// \return None.
+	void flush()
+	{
+		if (_holding)
+		{
+			_holding = false;
+			transmit(_held.data(), _held.size());
+		}
+	}
+
+private:
+	void transmit(const uint8_t* data, size_t size)
+	{
+		if (sendto(_sockfd, data, size, 0, reinterpret_cast<const struct sockaddr*>(&_destination),
+				   sizeof(_destination)) < 0)
+		{
+			errors++;
+			return;
+		}
+		sent++;
+	}
+
+	int _sockfd;
+	struct sockaddr_in _destination;
+	double _loss;
+	double _reorder;
+	int64_t _jitter_ns;
+	std::mt19937 _random;
+	std::uniform_real_distribution<double> _uniform;
+	std::vector<uint8_t> _held;
+	bool _holding;
+
+public:
+	uint64_t sent;
+	uint64_t lost;
+	uint64_t reordered;
+	uint64_t errors;
+};
+
+/// \brief Parses a probability argument.
+/// \param value Argument.
+/// \param probability Parsed value.
+/// \return True if it is between 0 and 1.
+static bool parse_probability(const char* value, double& probability)
+{
+	char* end;
+	probability = strtod(value, &end);
+	return end != value && probability >= 0.0 && probability <= 1.0;
+}
+
+/// \brief Sends a recording or a synthetic scene as a Lepton stream.
+/// \param argc Number of command-line arguments.
+/// \param argv Array of command-line arguments.
+/// \param host Destination address.
+/// \param port Destination port.
+/// \param lepton Layout of the stream.
+/// \param replay Recording to send.
+/// \param loop Restart the recording when it ends.
+/// \param frames Unique frames to send.
+/// \param rate Frames per second, 0 for as fast as possible.
+/// \param repeat Times every frame is sent.
+/// \param loss Probability of dropping a segment.
+/// \param reorder Probability of swapping a segment with the next one.
+/// \param jitter Maximum extra delay of a segment.
+/// \param seed Seed of the random generators.
+/// \return 0 if successful, -1 if failure.
+int main(int argc, char **argv)
+{
+	std::string host = "127.0.0.1";
+	uint16_t port = 8080;
+	const lepton_decoder *layout = nullptr;
+	std::string replayFile;
+	bool loop = false;
+	uint64_t maxFrames = 0;
+	double rate = LEPTON_FPS;
+	int repeat = 0;
+	double loss = 0.0;
+	double reorder = 0.0;
+	double jitterMs = 0.0;
+	uint32_t seed = 1;
+
+	for(int i=1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "-h") == 0)
+		{
+			printUsage(argv[0]);
+			exit(0);
+		}
+		else if (strcmp(argv[i], "-host") == 0)
+		{
+			if (i + 1 != argc)
+			{
+				host = argv[++i];
+			}
+			else
+			{
+				std::cerr << "Error: Enter a destination address." << std::endl;
+				exit(1);
+			}
+		}
+		else if (strcmp(argv[i], "-port") == 0)
+		{
+			if (i + 1 != argc)
+			{
+				long int temp = std::strtol(argv[++i], nullptr, 10);
+				if (temp < 0 || temp > 65535){
+					std::cerr << "Error: Enter a valid Port." << std::endl;
+					exit(1);
+				}
+				port = static_cast<uint16_t>(temp);
+			}
+			else
+			{
+				std::cerr << "Error: Enter a valid Port." << std::endl;
+				exit(1);
+			}
+		}
+		else if (strcmp(argv[i], "-lepton") == 0)
+		{
+			if (i + 1 != argc && (layout = find_lepton_decoder(argv[i + 1])) != nullptr)
+			{
+				i++;
+			}
+			else
+			{
+				std::cerr << "Error: Enter a stream layout:" << std::endl;
+				print_lepton_decoders();
+				exit(1);
+			}
+		}
+		else if (strcmp(argv[i], "-replay") == 0)
+		{
+			if (i + 1 != argc)
+			{
+				replayFile = argv[++i];
+			}
+			else
+			{
+				std::cerr << "Error: Enter a recording file." << std::endl;
+				exit(1);
+			}
+		}
+		else if (strcmp(argv[i], "-loop") == 0)
+		{
+			loop = true;
+		}
+		else if (strcmp(argv[i], "-frames") == 0)
+		{
+			long long temp;
+			if (i + 1 != argc && (temp = std::strtoll(argv[i + 1], nullptr, 10)) > 0)
+			{
+				maxFrames = static_cast<uint64_t>(temp);
+				i++;
+			}
+			else
+			{
+				std::cerr << "Error: Enter a number of frames above 0." << std::endl;
+				exit(1);
+			}
+		}
+		else if (strcmp(argv[i], "-rate") == 0)
+		{
+			if (i + 1 != argc && strcmp(argv[i + 1], "max") == 0)
+			{
+				rate = 0.0;
+				i++;
+			}
+			else if (i + 1 != argc && (rate = std::strtod(argv[i + 1], nullptr)) > 0.0)
+			{
+				i++;
+			}
+			else
+			{
+				std::cerr << "Error: Enter a rate above 0 Hz or max." << std::endl;
+				exit(1);
+			}
+		}
+		else if (strcmp(argv[i], "-repeat") == 0)
+		{
+			if (i + 1 != argc && (repeat = std::strtol(argv[i + 1], nullptr, 10)) > 0)
+			{
+				i++;
+			}
+			else
+			{
+				std::cerr << "Error: Enter a repeat count above 0." << std::endl;
+				exit(1);
+			}
+		}
+		else if (strcmp(argv[i], "-loss") == 0 || strcmp(argv[i], "-reorder") == 0)
+		{
+			double& probability = strcmp(argv[i], "-loss") == 0 ? loss : reorder;
+			if (i + 1 != argc && parse_probability(argv[i + 1], probability))
+			{
+				i++;
+			}
+			else
+			{
+				std::cerr << "Error: Enter a probability between 0 and 1." << std::endl;
+				exit(1);
+			}
+		}
+		else if (strcmp(argv[i], "-jitter") == 0)
+		{
+			if (i + 1 != argc && (jitterMs = std::strtod(argv[i + 1], nullptr)) >= 0.0)
+			{
+				i++;
+			}
+			else
+			{
+				std::cerr << "Error: Enter a jitter of 0 ms or more." << std::endl;
+				exit(1);
+			}
+		}
+		else if (strcmp(argv[i], "-seed") == 0)
+		{
+			if (i + 1 != argc)
+			{
+				seed = static_cast<uint32_t>(std::strtoul(argv[++i], nullptr, 10));
+			}
+			else
+			{
+				std::cerr << "Error: Enter a seed." << std::endl;
+				exit(1);
+			}
+		}
+		else
+		{
+			printUsage(argv[0]);
+			exit(1);
+		}
+	}
+	if (repeat == 0)
+	{
+		repeat = rate == LEPTON_FPS ? LEPTON_FRAME_REPEAT : 1;
+	}
+
+	thermal_recording recording;
+	if (!replayFile.empty())
+	{
+		if (!recording.open(replayFile))
+		{
+			return -1;
+		}
+		if (recording.frames() == 0)
+		{
+			std::cerr << "Error: " << replayFile << " has no frames." << std::endl;
+			return -1;
+		}
+		if (!layout)
+		{
+			layout = find_lepton_decoder(recording.width() == 80 ? "lepton2" : "lepton3");
+		}
+		if (recording.width() != layout->width || recording.height() != layout->height)
+		{
+			std::cerr << "Error: the recording is " << recording.width() << "x" << recording.height()
+					  << ", " << layout->name << " is " << layout->width << "x" << layout->height << "." << std::endl;
+			return -1;
+		}
+	}
+	else if (!layout)
+	{
+		layout = find_lepton_decoder("lepton3");
+	}
+
+	struct sockaddr_in destination;
+	memset(&destination, 0, sizeof(destination));
+	destination.sin_family = AF_INET;
+	destination.sin_port = htons(port);
+	if (inet_pton(AF_INET, host.c_str(), &destination.sin_addr) != 1)
+	{
+		std::cerr << "Error: " << host << " is not an IPv4 address." << std::endl;
+		return -1;
+	}
+	int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (sockfd < 0)
+	{
+		perror("socket creation failed");
+		return -1;
+	}
+
+	size_t pixelCount = static_cast<size_t>(layout->width) * layout->height;
+	std::vector<uint16_t> pixels(pixelCount);
+	std::vector<uint16_t> telemetryWords(layout->telemetry_words());
+	std::vector<uint8_t> frame(layout->frame_size());
+	synthetic_scene scene(layout->width, layout->height, seed);
+	impaired_sender sender(sockfd, destination, loss, reorder, static_cast<int64_t>(jitterMs * 1e6), seed + 1);
+
+	printf("Sending %s %s to %s:%u, ", replayFile.empty() ? "a synthetic scene" : replayFile.c_str(),
+		   layout->name, host.c_str(), port);
+	if (rate > 0.0)
+	{
+		printf("%.1f Hz, every frame %d time(s)\n", rate, repeat);
+	}
+	else
+	{
+		printf("as fast as possible, every frame %d time(s)\n", repeat);
+	}
+
+	int64_t period_ns = rate > 0.0 ? static_cast<int64_t>(1e9 / rate) : 0;
+	int64_t start_ns = monotonic_ns();
+	int64_t report_ns = start_ns + SIM_REPORT_S * 1000000000LL;
+	uint64_t exported = 0;
+	uint64_t unique = 0;
+	uint64_t replayed = 0;
+	while (maxFrames == 0 || unique < maxFrames)
+	{
+		lepton_telemetry telemetry;
+		if (!replayFile.empty())
+		{
+			if (replayed == recording.frames())
+			{
+				if (!loop)
+				{
+					break;
+				}
+				replayed = 0;
+			}
+			if (!recording.decode(replayed, pixels.data()))
+			{
+				std::cerr << "Frame " << replayed << " of the recording is corrupt" << std::endl;
+				break;
+			}
+			thermal_timestamps timestamps;
+			thermal_record_metadata(*recording.frame(replayed).header, timestamps, telemetry);
+			if (!telemetry.valid)
+			{
+				synthetic_telemetry(unique, pixels.data(), pixelCount, telemetry);
+			}
+			replayed++;
+		}
+		else
+		{
+			const uint16_t* image = scene.render(unique, synthetic_shutter_closed(unique));
+			memcpy(pixels.data(), image, pixelCount * sizeof(uint16_t));
+			synthetic_telemetry(unique, pixels.data(), pixelCount, telemetry);
+		}
+		format_lepton_telemetry(telemetry, telemetryWords.data(), layout->telemetry_words());
+		layout->encode(pixels.data(), telemetryWords.empty() ? nullptr : telemetryWords.data(), frame.data());
+
+		for (int r = 0; r < repeat; r++)
+		{
+			// Segments are spread over the frame period like the VoSPI segments of the Lepton
+			for (int s = 0; s < layout->segments; s++)
+			{
+				int64_t deadline_ns = period_ns ? start_ns + static_cast<int64_t>(exported) * period_ns +
+												  s * period_ns / layout->segments : 0;
+				sender.send(frame.data() + s * layout->segment_size, layout->segment_size, deadline_ns);
+			}
+			exported++;
+		}
+		unique++;
+
+		int64_t now_ns = monotonic_ns();
+		if (now_ns >= report_ns)
+		{
+			printf("%llu frames (%llu unique), %.1f Hz, %llu segments sent, %llu lost, %llu reordered\n",
+				   static_cast<unsigned long long>(exported), static_cast<unsigned long long>(unique),
+				   exported / ((now_ns - start_ns) / 1e9), static_cast<unsigned long long>(sender.sent),
+				   static_cast<unsigned long long>(sender.lost), static_cast<unsigned long long>(sender.reordered));
+			report_ns = now_ns + SIM_REPORT_S * 1000000000LL;
+		}
+	}
+	sender.flush();
+
+	double elapsed = (monotonic_ns() - start_ns) / 1e9;
+	printf("Sent %llu frames (%llu unique) in %.1f s: %llu segments, %llu lost, %llu reordered, %llu send errors\n",
+		   static_cast<unsigned long long>(exported), static_cast<unsigned long long>(unique), elapsed,
+		   static_cast<unsigned long long>(sender.sent), static_cast<unsigned long long>(sender.lost),
+		   static_cast<unsigned long long>(sender.reordered), static_cast<unsigned long long>(sender.errors));
+	close(sockfd);
+	return 0;
+}